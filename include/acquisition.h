@@ -18,6 +18,7 @@
 #include <driver/spi_master.h>
 #include <driver/timer.h>
 #include <esp_err.h>
+#include <esp_heap_caps.h>
 #include <esp_log.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
@@ -27,6 +28,8 @@
 #include "driver/adc.h"
 #include "driver/dac_cosine.h"
 #include "esp_adc/adc_continuous.h"
+#include "frame_pool.h"
+#include "globals.h"
 
 /**
  * @brief Structure defining a voltage scale setting
@@ -68,6 +71,27 @@ int get_voltage_scales_count(void);
  */
 void spi_master_init(void);
 
+#ifdef USE_EXTERNAL_ADC
+/**
+ * @brief Move capture to the selected divider
+ *
+ * Applies a rate change requested through spi_reconfig_requested and clears
+ * the request. The caller holds spi_mutex and nothing is queued on the
+ * current device; spi_pipeline_fill() calls it at a frame boundary.
+ */
+void spi_switch_timing(void);
+
+/**
+ * @brief Get the divider capture currently runs at, see spi_timing.h
+ *
+ * Equals the selected divider except between a rate change request and its
+ * switch, so frames are labelled with the rate they were captured at.
+ *
+ * @return SPI_TIMING_BASE_HZ cycles per SPI clock
+ */
+uint32_t spi_active_divider(void);
+#endif
+
 /**
  * @brief Initialize the MCPWM trigger for external ADC sampling
  *
@@ -89,20 +113,32 @@ void init_mcpwm_trigger(void);
  */
 esp_err_t init_pulse_counter(void);
 
+/**
+ * @brief Create the internal ADC driver handle
+ *
+ * Allocates the continuous-mode driver and its DMA pool once at boot, while
+ * the heap is still unfragmented. The handle is kept for the lifetime of the
+ * firmware; starting, stopping and rate changes reuse it. Only available
+ * when USE_EXTERNAL_ADC is not defined.
+ *
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t adc_sampling_init(void);
+
 /**
  * @brief Start continuous sampling with internal ADC
  *
- * Configures and starts the ESP32's internal ADC in continuous mode.
- * Sets up sampling pattern, frequency, and buffer configuration.
- * Only available when USE_EXTERNAL_ADC is not defined.
+ * Configures the driver for the rate of adc_divider and starts it. Creates
+ * the handle first if adc_sampling_init() did not. Only available when
+ * USE_EXTERNAL_ADC is not defined.
  */
 void start_adc_sampling(void);
 
 /**
  * @brief Stop continuous sampling with internal ADC
  *
- * Stops active ADC sampling and releases ADC resources.
- * Only available when USE_EXTERNAL_ADC is not defined.
+ * Stops active ADC sampling and discards the conversions still in the
+ * pool. The handle stays allocated. Only available when USE_EXTERNAL_ADC is not defined.
  */
 void stop_adc_sampling(void);
 
@@ -110,11 +146,28 @@ void stop_adc_sampling(void);
  * @brief Update ADC sampling frequency
  *
  * Reconfigures internal ADC with a new sampling frequency based on the
- * current adc_divider value. Stops and reinitializes the ADC with new settings.
- * Updates wait_convertion_time accordingly. Only available with internal ADC.
+ * current adc_divider value. Stops, configures and restarts the same handle,
+ * which takes milliseconds. Only available with internal ADC.
  */
 void config_adc_sampling(void);
 
+/**
+ * @brief Read a frame of internal ADC conversions as soon as they are available
+ *
+ * The driver's conversion-done callback counts the bytes entering its pool
+ * and notifies the calling task, so the read happens when the pool holds
+ * len bytes instead of after a fixed delay. Conversion frames the driver
+ * drops because its pool is full are counted in adc_pool_overflows. Only
+ * available with internal ADC.
+ *
+ * @param buffer Receives the conversions
+ * @param len Bytes to read, at most the pool size of BUF_SIZE * 2
+ * @param bytes_read Receives the number of bytes read
+ * @param timeout Ticks to wait for the conversions at most
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if fewer than len bytes arrived in time, or a driver error
+ */
+esp_err_t adc_read_frame(uint8_t *buffer, uint32_t len, uint32_t *bytes_read, TickType_t timeout);
+
 /**
  * @brief Configure GPIO input for trigger detection
  *
@@ -128,7 +181,7 @@ void configure_gpio(void);
  *
  * Configures Timer Group 0, Timer 0 for precise wait intervals.
  * Calculates appropriate wait_time_us based on sampling frequency
- * and buffer size. Used for timing in continuous acquisition mode.
+ * and the selected frame length. Used for timing in continuous acquisition mode.
  */
 void my_timer_init(void);
 
@@ -192,6 +245,58 @@ esp_err_t set_trigger_level(int percentage);
  */
 double get_sampling_frequency(void);
 
+/**
+ * @brief Get the exact sample rate selected for the ADC
+ *
+ * Rate of the selected divider for the external ADC, which is generally not
+ * a whole number of Hz, or of the current adc_divider for the internal ADC.
+ * On-device decimation is not included.
+ *
+ * @return Sample rate in Hz
+ */
+double get_exact_sample_rate(void);
+
+/**
+ * @brief Get the sample rate selected for the ADC, rounded to whole Hz
+ *
+ * @return Sample rate in Hz
+ */
+uint32_t get_current_sample_rate(void);
+
+/**
+ * @brief Get the index of the current sample rate setting
+ *
+ * @return spi_matrix row nearest to the selected rate for the external ADC, adc_divider for the internal ADC
+ */
+int get_rate_index(void);
+
+/**
+ * @brief Move to the next faster or slower sample rate setting
+ *
+ * The external ADC steps to the next spi_matrix row faster or slower than
+ * the selected rate. Stops at the fastest and slowest setting. The external
+ * ADC is retimed at the next frame boundary, the internal ADC picks up the
+ * new divider before its next frame.
+ *
+ * @param step Positive for a faster rate, negative for a slower one
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if already at the limit
+ */
+esp_err_t sample_rate_step(int step);
+
+/**
+ * @brief Select the achievable sample rate nearest to a requested one
+ *
+ * The external ADC timing is computed by spi_timing_divider_for_rate() and
+ * applied at the next frame boundary. Rates beyond the hardware limits give
+ * the fastest or slowest rate.
+ *
+ * @param rate_hz Requested sample rate
+ * @param achieved_hz Receives the exact rate selected, may be NULL
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if rate_hz is not positive,
+ *         ESP_ERR_NOT_SUPPORTED for the internal ADC
+ */
+esp_err_t sample_rate_set(double rate_hz, double *achieved_hz);
+
 /**
  * @brief Get hardware-specific dividing factor
  *
@@ -256,13 +361,48 @@ int get_discard_trailer(void);
 /**
  * @brief Calculate effective number of samples per acquisition
  *
- * Returns BUF_SIZE minus any discarded samples from head and trailer.
- * Since neither discard value is non-zero, this effectively returns BUF_SIZE.
+ * Returns the payload bytes of a frame of the selected length, i.e. the
+ * capture length minus the discarded head and trailer. With the default
+ * frame length this is BUF_SIZE minus the discarded bytes.
  *
- * @return Number of valid samples per acquisition
+ * @return Number of valid bytes per acquisition
  */
 int get_samples_per_packet(void);
 
+/**
+ * @brief Select the frame length for the next data connection
+ *
+ * Shorter frames lower the latency, longer frames the per-frame overhead.
+ * The frame pool is re-carved when the next connection starts.
+ *
+ * @param samples Samples per frame between FRAME_MIN_SAMPLES and
+ *        get_max_frame_samples(), 0 for the longest frame
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if out of range
+ */
+esp_err_t set_frame_samples(int samples);
+
+/**
+ * @brief Get the selected frame length
+ *
+ * @return Samples per frame
+ */
+int get_frame_samples(void);
+
+/**
+ * @brief Get the longest frame a single BUF_SIZE capture can hold
+ *
+ * @return Samples per frame
+ */
+int get_max_frame_samples(void);
+
+/**
+ * @brief Get the bytes captured for a frame of the given length
+ *
+ * @param samples Samples per frame
+ * @return Capture length including the discarded head and trailer
+ */
+size_t get_frame_capture_len(int samples);
+
 /**
  * @brief Get the maximum possible ADC reading value
  *
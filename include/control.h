@@ -0,0 +1,139 @@
+/**
+ * @file control.h
+ * @brief Binary control protocol on the data socket
+ *
+ * Settings that a UI changes interactively (trigger, mode, sample rate) can
+ * be sent as small binary requests on the TCP data connection instead of an
+ * HTTP request each, which saves the connection setup and the JSON
+ * round-trip. The HTTP endpoints remain for provisioning and for clients
+ * that do not speak this protocol.
+ *
+ * Every message is a control_header_t followed by payload_len bytes. The
+ * client starts with CONTROL_HELLO to negotiate the protocol version and
+ * learn the supported opcodes; from then on every frame it receives carries a
+ * frame_header_t, so replies can be told apart from frames by their magic.
+ * A request is applied as soon as it is read. Its reply, with the same
+ * request_id, is sent between two frames, never inside one.
+ *
+ * All fields are little-endian.
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONTROL_MAGIC 0x4343 /* "CC" once written little-endian, frames start with "SF" */
+#define CONTROL_VERSION 1
+#define CONTROL_MAX_PAYLOAD 32 /* Longest request or reply payload */
+#define CONTROL_KEEP 0xFF /* In a field of CONTROL_SET_TRIGGER: leave the setting unchanged */
+
+/**
+ * @brief Request types, each reply carries the opcode of its request
+ */
+typedef enum {
+    CONTROL_HELLO = 1, /**< control_hello_t, replied with control_hello_reply_t */
+    CONTROL_PING, /**< Any payload, echoed back, for round-trip measurements */
+    CONTROL_SET_TRIGGER, /**< control_trigger_t, replied with control_trigger_reply_t */
+    CONTROL_SET_MODE, /**< One byte, 0 for continuous and 1 for single, echoed back */
+    CONTROL_SET_RATE, /**< One signed byte, +1 for the next faster rate and -1 for the next slower one,
+                           replied with control_rate_reply_t */
+    CONTROL_SET_RATE_HZ, /**< control_rate_hz_t, the achievable rate nearest to it like /freq's "sample_rate",
+                              replied with control_rate_reply_t. External ADC only */
+    CONTROL_OPCODE_COUNT /**< Number of opcodes plus one, not a valid opcode */
+} control_opcode_t;
+
+/**
+ * @brief Outcome of a request
+ */
+typedef enum {
+    CONTROL_OK = 0, /**< Applied */
+    CONTROL_ERR_OPCODE, /**< Unknown opcode */
+    CONTROL_ERR_LENGTH, /**< Payload too short for the opcode */
+    CONTROL_ERR_ARG, /**< A value is out of range, nothing was changed */
+    CONTROL_ERR_LIMIT, /**< Already at the fastest or slowest rate */
+    CONTROL_ERR_FAILED, /**< The setting could not be applied */
+} control_status_t;
+
+/**
+ * @brief Header of every request and reply
+ */
+typedef struct __attribute__((packed)) {
+    uint16_t magic; /**< CONTROL_MAGIC */
+    uint8_t opcode; /**< control_opcode_t */
+    uint8_t status; /**< control_status_t in replies, 0 in requests */
+    uint16_t request_id; /**< Chosen by the client, copied into the reply */
+    uint16_t payload_len; /**< Payload bytes following the header, at most CONTROL_MAX_PAYLOAD */
+} control_header_t;
+
+_Static_assert(sizeof(control_header_t) == 8, "control_header_t layout is part of the wire protocol");
+
+#define CONTROL_MAX_MESSAGE (sizeof(control_header_t) + CONTROL_MAX_PAYLOAD)
+
+/**
+ * @brief Payload of CONTROL_HELLO
+ */
+typedef struct __attribute__((packed)) {
+    uint16_t version; /**< Highest protocol version the client speaks */
+} control_hello_t;
+
+/**
+ * @brief Reply payload of CONTROL_HELLO
+ */
+typedef struct __attribute__((packed)) {
+    uint16_t version; /**< Protocol version used from now on */
+    uint16_t max_payload; /**< CONTROL_MAX_PAYLOAD */
+    uint32_t opcodes; /**< Bit n set if opcode n is supported */
+} control_hello_reply_t;
+
+/**
+ * @brief Payload of CONTROL_SET_TRIGGER, CONTROL_KEEP leaves a field unchanged
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t edge; /**< 1 for positive, 0 for negative */
+    uint8_t type; /**< trigger_type_t */
+    uint8_t level; /**< Trigger level in percent of full scale */
+    uint8_t hysteresis; /**< Hysteresis in percent of full scale */
+    uint8_t position; /**< Share of the window before the trigger, in percent */
+} control_trigger_t;
+
+/**
+ * @brief Reply payload of CONTROL_SET_TRIGGER, the settings now in effect
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t edge; /**< 1 for positive, 0 for negative */
+    uint8_t type; /**< trigger_type_t */
+    uint8_t position; /**< Share of the window before the trigger, in percent */
+    uint8_t reserved; /**< Zero */
+    int32_t level; /**< Trigger level in ADC codes */
+    int32_t hysteresis; /**< Hysteresis in ADC codes */
+} control_trigger_reply_t;
+
+/**
+ * @brief Payload of CONTROL_SET_RATE_HZ
+ */
+typedef struct __attribute__((packed)) {
+    double sample_rate_hz; /**< Requested hardware sample rate, IEEE 754 binary64 */
+} control_rate_hz_t;
+
+/**
+ * @brief Reply payload of CONTROL_SET_RATE and CONTROL_SET_RATE_HZ
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t sample_rate_hz; /**< Hardware sample rate now in effect */
+    uint8_t rate_index; /**< Nearest spi_matrix row for the external ADC, adc_divider for the internal ADC */
+    uint8_t reserved[3]; /**< Zero */
+} control_rate_reply_t;
+
+/**
+ * @brief Apply a complete request and build its reply
+ *
+ * @param request Request header, payload_len already checked against CONTROL_MAX_PAYLOAD
+ * @param payload Request payload
+ * @param reply Receives the reply, at least CONTROL_MAX_MESSAGE bytes
+ * @return Length of the reply
+ */
+size_t control_execute(const control_header_t *request, const uint8_t *payload, uint8_t *reply);
+
+#endif /* CONTROL_H */
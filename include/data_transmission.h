@@ -13,15 +13,22 @@
 #include <errno.h>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <lwip/api.h>
+#include <lwip/priv/sockets_priv.h>
+#include <lwip/priv/tcpip_priv.h>
 #include <lwip/sockets.h>
+#include <lwip/tcp.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "globals.h"
+#include "sample_format.h"
 
 /**
  * @brief Initialize data transmission subsystem
@@ -32,42 +39,183 @@
  */
 esp_err_t data_transmission_init(void);
 
+/**
+ * @brief What a data client drops once it holds its share of the frame buffers
+ */
+typedef enum {
+    DROP_OLDEST = 0, /**< Drop the oldest frame not yet being written, the client stays close to live */
+    DROP_NEWEST, /**< Drop the new frame, the client keeps the frames it already has queued */
+    DROP_POLICY_COUNT
+} drop_policy_t;
+
+/**
+ * @brief How frames are sent to a data client
+ */
+typedef enum {
+    TRANSPORT_TCP = 0, /**< Connection to the TCP data socket */
+    TRANSPORT_UDP, /**< Subscription on the UDP socket, see udp_stream.h */
+    TRANSPORT_WS, /**< WebSocket session of one of the HTTP servers */
+} data_transport_t;
+
+/**
+ * @brief Snapshot of a connected data client
+ */
+typedef struct {
+    char addr[16]; /**< Peer address */
+    uint16_t port; /**< Peer port */
+    data_transport_t transport; /**< How frames are sent to the client */
+    drop_policy_t policy; /**< Drop policy latched when the client connected */
+    bool header; /**< Whether the client receives frame headers */
+    sample_format_t format; /**< Wire format of the frames the client receives */
+    int frame_samples; /**< Samples per frame or roll chunk the client receives */
+    int queued; /**< Frames held, written or waiting to be written */
+    uint32_t frames_sent; /**< Frames completely written */
+    uint32_t frames_dropped; /**< Frames skipped by the drop policy */
+    uint32_t retransmits; /**< UDP fragments sent again in answer to NACKs */
+} data_client_info_t;
+
 /**
  * @brief Task to handle socket communication and data streaming
  *
- * This task accepts connections from clients, acquires data from ADC or SPI,
- * and streams the data to connected clients. It supports both continuous
- * and trigger-based acquisition modes. In external ADC mode, it also responds
- * to socket reset requests to safely close connections when needed.
+ * This task accepts up to MAX_DATA_CLIENTS connections, TCP connections, UDP
+ * subscriptions and WebSocket sessions together, and streams the frames
+ * produced by acquisition_task to all of them. Frames arrive through a
+ * lock-free ring and are shared by reference: every client keeps its own
+ * write cursor and queue, and a frame is handed back once the last client
+ * has finished with it. Writes never block, so a slow client only loses its
+ * own frames and never blocks the others or the capture. Acquisition runs
+ * while at least one client is connected. In external ADC mode, it also
+ * responds to socket reset requests to safely close connections when needed.
  *
  * @param pvParameters Parameters for the task (unused)
  */
 void socket_task(void *pvParameters);
 
 /**
- * @brief Send data packet to connected client
+ * @brief Select the drop policy for clients connecting from now on
  *
- * Transmits a buffer of data to the currently connected client over TCP.
+ * @param policy Policy to select
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for an unknown policy
+ */
+esp_err_t drop_policy_select(drop_policy_t policy);
+
+/**
+ * @brief Get the drop policy given to the next client
  *
- * @param client_sock Socket descriptor for the connected client
- * @param buffer Data buffer to send
- * @param sample_size Size of each sample in bytes
- * @param discard_head Number of samples to discard from the start
- * @param samples_per_packet Number of samples to send
- * @return ESP_OK on success, ESP_FAIL on error
+ * @return Selected policy
+ */
+drop_policy_t drop_policy_selected(void);
+
+/**
+ * @brief Get the name used for a drop policy in the HTTP API
+ *
+ * @param policy Policy to name
+ * @return "oldest" or "newest"
+ */
+const char *drop_policy_name(drop_policy_t policy);
+
+/**
+ * @brief Look up a drop policy by its HTTP API name
+ *
+ * @param name Name to look up
+ * @param policy Receives the policy
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND for an unknown name
+ */
+esp_err_t drop_policy_from_name(const char *name, drop_policy_t *policy);
+
+/**
+ * @brief Get a snapshot of the connected data clients
+ *
+ * @param info Receives one entry per client
+ * @param max Capacity of info
+ * @return Number of entries filled in
+ */
+int data_clients_get(data_client_info_t *info, int max);
+
+/**
+ * @brief Get the name used for a transport in the HTTP API
+ *
+ * @param transport Transport to name
+ * @return "tcp", "udp" or "ws"
+ */
+const char *data_transport_name(data_transport_t transport);
+
+#define WS_MAX_CONTROL_PAYLOAD 125 /* Largest WebSocket control frame payload (RFC 6455) */
+
+/**
+ * @brief Hand a WebSocket session over to socket_task for streaming
+ *
+ * Called by the HTTP server once the handshake is done. From then on
+ * socket_task writes every frame as one binary message straight to the
+ * session socket, without blocking and without the server task, so a slow
+ * browser never holds up the server.
+ *
+ * @param server Server owning the session
+ * @param fd Session socket
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if MAX_DATA_CLIENTS sessions are already handed over
  */
-esp_err_t send_data_packet(int client_sock, uint8_t *buffer, size_t sample_size, int discard_head,
-                           int samples_per_packet);
+esp_err_t ws_client_open(httpd_handle_t server, int fd);
+
+/**
+ * @brief Let go of a session the HTTP server is about to close
+ *
+ * Called from the server's close callback for every session before its
+ * socket is closed. If the session is being streamed to, waits until
+ * socket_task has stopped writing to the socket.
+ *
+ * @param fd Session socket
+ */
+void ws_client_closed(int fd);
+
+/**
+ * @brief Answer a PING the browser sent on a WebSocket session
+ *
+ * Only socket_task writes to a streaming session, so the PONG is queued for
+ * it and goes out between two frames. A PING arriving while the previous
+ * PONG is still queued is answered by that one.
+ *
+ * @param fd Session socket
+ * @param payload Application data of the PING, echoed in the PONG
+ * @param len Bytes in payload
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if len exceeds WS_MAX_CONTROL_PAYLOAD,
+ *         ESP_ERR_NOT_FOUND if the session is not streaming
+ */
+esp_err_t ws_client_pong(int fd, const uint8_t *payload, size_t len);
+
+/**
+ * @brief High-priority task that captures frames from the ADC or SPI
+ *
+ * Runs while socket_task has at least one client connected. Captures into the shared
+ * frame buffers, applies the single trigger mode filter and publishes each
+ * frame to socket_task without copying. Counts an overrun whenever no buffer
+ * is free because the sender is behind.
+ *
+ * @param pvParameters Parameters for the task (unused)
+ */
+void acquisition_task(void *pvParameters);
 
 /**
  * @brief Switch to single trigger acquisition mode
  *
  * Configures the system to wait for and capture a single trigger event.
+ * From then on only captured frames that hold a trigger (see trigger.h) are
+ * streamed, each cut to the window around its trigger point.
  *
  * @return ESP_OK on success, ESP_FAIL on error
  */
 esp_err_t set_single_trigger_mode(void);
 
+/**
+ * @brief Select the trigger edge
+ *
+ * In single mode the pulse counter of the external ADC is switched to the
+ * new edge right away.
+ *
+ * @param rising true for the positive edge, false for the negative one
+ * @return ESP_OK on success
+ */
+esp_err_t set_trigger_edge(bool rising);
+
 #ifdef USE_EXTERNAL_ADC
 /**
  * @brief Request a reset of all socket connections
@@ -94,51 +242,54 @@ void force_socket_cleanup(void);
 #endif
 
 /**
- * @brief Switch to continuous acquisition mode
+ * @brief Select roll mode for the next data connection
  *
- * Configures the system for continuous data acquisition.
+ * In roll mode the capture length shrinks to a chunk of the given number of
+ * samples, and every chunk is sent with a frame header as soon as it is
+ * captured, so the latency at slow rates is one chunk instead of one
+ * frame. The frame pool is carved into chunks, so more of them are in
+ * flight. Chunks are never trigger-aligned.
  *
- * @return ESP_OK on success, ESP_FAIL on error
+ * @param samples ROLL_MIN_CHUNK_SAMPLES to ROLL_MAX_CHUNK_SAMPLES, 0 for full frames
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if out of range
  */
-esp_err_t set_continuous_mode(void);
+esp_err_t roll_set_chunk_samples(int samples);
 
 /**
- * @brief Check if a trigger event has occurred
- *
- * Monitors input signal for a trigger event based on current
- * trigger settings (edge type and level).
+ * @brief Get the roll chunk selected for the next data connection
  *
- * @param current Current signal value or edge state
- * @param last Previous signal value or edge state
- * @return true if a trigger event occurred, false otherwise
+ * @return Samples per chunk, 0 when roll mode is off
  */
-bool is_triggered(int current, int last);
+int roll_chunk_samples(void);
 
 /**
- * @brief Send data packet to connected client in a non-blocking manner
+ * @brief Settings latched by the first client and shared by every client of the session
+ */
+typedef struct {
+    sample_format_t format; /**< Wire format */
+    int roll_chunk_samples; /**< Samples per roll chunk, 0 for full frames */
+    int frame_samples; /**< Samples per full frame */
+} data_session_t;
+
+/**
+ * @brief Get the settings of the running streaming session
  *
- * Transmits a buffer of data to the currently connected client over TCP in a non-blocking way.
- * In external ADC mode, also monitors for socket changes and reset requests during sending.
+ * Frames are encoded once for every client, so a client joining a running
+ * session receives the session's format, roll chunk and frame length
+ * whatever it selected. Only the frame header is chosen per client.
  *
- * @param client_sock Socket descriptor for the connected client
- * @param buffer Data buffer to send
- * @param len Length of the data to send
- * @param flags Flags for the send operation
- * @return ESP_OK on success, ESP_FAIL on error, ESP_ERR_TIMEOUT if a WiFi operation is requested
+ * @param session Receives the settings while a session runs
+ * @return true while at least one data client is connected
  */
-esp_err_t non_blocking_send(int client_sock, void *buffer, size_t len, int flags);
+bool data_session_get(data_session_t *session);
+
 /**
- * @brief Acquire data from the configured ADC
+ * @brief Switch to continuous acquisition mode
  *
- * Reads data from either the internal ADC (via adc_continuous_read) or
- * external ADC (via SPI) based on the current configuration. When using
- * external ADC, this function manages SPI mutex access.
+ * Configures the system for continuous data acquisition.
  *
- * @param buffer Buffer to store the acquired data
- * @param buffer_size Size of the buffer in bytes
- * @param bytes_read Pointer to variable that will hold number of bytes read
- * @return ESP_OK on success, ESP_FAIL or error code on failure
+ * @return ESP_OK on success, ESP_FAIL on error
  */
-esp_err_t acquire_data(uint8_t *buffer, size_t buffer_size, uint32_t *bytes_read);
+esp_err_t set_continuous_mode(void);
 
 #endif /* DATA_TRANSMISSION_H */
\ No newline at end of file
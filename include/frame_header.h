@@ -0,0 +1,62 @@
+/**
+ * @file frame_header.h
+ * @brief Self-describing header sent in front of every frame
+ *
+ * Lets the client detect lost captures and rate or format changes without
+ * out-of-band queries, and measure latency from the capture timestamp. The
+ * header is filled by acquisition_task next to the frame descriptor and sent
+ * as a separate small write, so the payload itself is never copied. All
+ * fields are little-endian.
+ */
+
+#ifndef FRAME_HEADER_H
+#define FRAME_HEADER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FRAME_HEADER_MAGIC 0x4653 /* "SF" once written little-endian */
+#define FRAME_HEADER_VERSION 1
+
+#define FRAME_FLAG_TRIGGERED 0x01 /* The window is aligned to a trigger point */
+#define FRAME_FLAG_AVERAGED 0x02 /* The payload is the average of several windows */
+#define FRAME_FLAG_SEGMENTED 0x04 /* The payload is a segment batch (segments.h) */
+
+/**
+ * @brief Header of a frame on the data socket
+ */
+typedef struct __attribute__((packed)) {
+    uint16_t magic; /**< FRAME_HEADER_MAGIC */
+    uint8_t version; /**< FRAME_HEADER_VERSION */
+    uint8_t header_len; /**< Size of this header in bytes */
+    uint32_t sequence; /**< Frame counter, skips one for every capture lost to a stall */
+    int64_t timestamp_us; /**< esp_timer time at which the capture completed */
+    uint32_t sample_rate_hz; /**< Hardware sample rate rounded to whole Hz, before decimation */
+    uint16_t decimation; /**< Decimation factor applied to the payload */
+    uint8_t rate_index; /**< Nearest spi_matrix row for the external ADC, adc_divider for the internal ADC */
+    uint8_t format; /**< sample_format_t of the payload */
+    uint8_t decimation_mode; /**< decimation_mode_t of the payload */
+    uint8_t flags; /**< FRAME_FLAG_* bits */
+    uint16_t averages; /**< Number of frames averaged into the payload, 1 if not averaged */
+    int32_t trigger_offset; /**< Payload sample index of the trigger point, -1 if not triggered */
+    uint32_t sample_count; /**< Number of samples in the payload */
+    uint32_t payload_len; /**< Number of payload bytes following the header */
+} frame_header_t;
+
+_Static_assert(sizeof(frame_header_t) == 40, "frame_header_t layout is part of the wire protocol");
+
+/**
+ * @brief Enable or disable frame headers for the next data connection
+ *
+ * @param enabled true to send a frame_header_t in front of every frame
+ */
+void frame_header_set_enabled(bool enabled);
+
+/**
+ * @brief Check whether frame headers are selected for the next data connection
+ *
+ * @return true if headers are enabled, false (the default) otherwise
+ */
+bool frame_header_enabled(void);
+
+#endif /* FRAME_HEADER_H */
@@ -0,0 +1,146 @@
+/**
+ * @file frame_pool.h
+ * @brief Preallocated frame buffer pool with one owner per buffer
+ *
+ * FRAME_BUFFERS chunks of FRAME_POOL_CHUNK_SIZE bytes are allocated once at
+ * boot, each on its own so no single block larger than one capture is
+ * needed. The chunks are cut into as many equally sized frame buffers as
+ * fit, up to FRAME_POOL_MAX_SLOTS, and a buffer never straddles two chunks.
+ * Changing the frame length only re-carves the chunks, so short frames get
+ * more buffers in flight and the heap is never touched again after the first
+ * allocation. If only some chunks can be allocated the pool runs with fewer
+ * buffers.
+ *
+ * acquisition_task takes a buffer with frame_pool_acquire() and passes its
+ * ownership on with the frame descriptor. The buffer is captured into again
+ * once its owner hands it back with frame_pool_release(). Sharing a frame
+ * between several clients is counted by the sender, which releases the
+ * buffer after the last client is done with it. The recorder copies the
+ * samples, as its history outlives the handful of pool buffers.
+ *
+ * Buffers are only ever acquired and the chunks only carved by
+ * acquisition_task; a buffer can be released from any task.
+ */
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <esp_err.h>
+#include <esp_heap_caps.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "globals.h"
+#include "sdkconfig.h"
+
+#define FRAME_POOL_CHUNK_SIZE (BUF_SIZE) /* One allocation, the longest frame */
+#define FRAME_POOL_SIZE (FRAME_BUFFERS * FRAME_POOL_CHUNK_SIZE) /* Same memory as the former fixed buffers */
+#define FRAME_POOL_MAX_SLOTS 7 /* Frame ring and SPI queue hold 8 entries, one is kept for the segment store */
+#define FRAME_POOL_ALIGN 4 /* DMA transfers and buffers must be word aligned */
+
+#ifdef CONFIG_SPIRAM
+#define FRAME_POOL_PSRAM_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) /* Allowed for buffers only the CPU writes */
+#else
+#define FRAME_POOL_PSRAM_CAPS 0
+#endif
+
+/**
+ * @brief Allocate the chunks
+ *
+ * Every chunk tries caps first and falls back to fallback_caps, e.g. PSRAM
+ * for buffers that are only filled by the CPU. Chunks that could not be
+ * allocated are tried again by the next call.
+ *
+ * @param caps heap_caps flags of the preferred placement, e.g. MALLOC_CAP_DMA for SPI capture
+ * @param fallback_caps heap_caps flags to try if caps fails, 0 for none
+ * @return ESP_OK if at least one chunk is allocated, ESP_ERR_NO_MEM otherwise
+ */
+esp_err_t frame_pool_init(uint32_t caps, uint32_t fallback_caps);
+
+/**
+ * @brief Get the memory the chunks were placed in
+ *
+ * @return "dma", "internal", "psram", "mixed" if the chunks differ, or "none" before frame_pool_init()
+ */
+const char *frame_pool_memory(void);
+
+/**
+ * @brief Get the number of chunks allocated
+ *
+ * @return Chunks, FRAME_BUFFERS unless memory was short
+ */
+int frame_pool_chunks(void);
+
+/**
+ * @brief Get the number of buffers the chunks would be carved into
+ *
+ * Before frame_pool_init() every chunk is assumed to be allocated.
+ *
+ * @param frame_len Bytes per frame
+ * @return Number of buffers, 0 if frame_len is 0 or larger than a chunk
+ */
+int frame_pool_slots_for(size_t frame_len);
+
+/**
+ * @brief Cut the chunks into buffers of at least frame_len bytes
+ *
+ * Every buffer handed out before is invalid afterwards, so carving is
+ * refused while any buffer is still owned.
+ *
+ * @param frame_len Bytes per frame, rounded up to FRAME_POOL_ALIGN
+ * @return Number of buffers, 0 if frame_len does not fit or a buffer is still owned
+ */
+int frame_pool_carve(size_t frame_len);
+
+/**
+ * @brief Take ownership of a free buffer
+ *
+ * @return Buffer index, -1 if every buffer is owned
+ */
+int frame_pool_acquire(void);
+
+/**
+ * @brief Hand an owned buffer back to the pool
+ *
+ * @param index Buffer index
+ * @return true if the buffer is free again, false if it already was
+ */
+bool frame_pool_release(int index);
+
+/**
+ * @brief Get a buffer of the current carving
+ *
+ * @param index Buffer index, below frame_pool_count()
+ * @return Start of the buffer
+ */
+uint8_t *frame_pool_slot(int index);
+
+/**
+ * @brief Get the number of buffers of the current carving
+ *
+ * @return Number of buffers, 0 before the first carve
+ */
+int frame_pool_count(void);
+
+/**
+ * @brief Get the length of each buffer of the current carving
+ *
+ * @return Bytes per buffer, a multiple of FRAME_POOL_ALIGN
+ */
+size_t frame_pool_slot_len(void);
+
+/**
+ * @brief Get the number of buffers currently owned
+ *
+ * @return Owned buffers
+ */
+int frame_pool_in_use(void);
+
+/**
+ * @brief Get the largest number of buffers owned at once since the last carve
+ *
+ * @return Owned buffers
+ */
+int frame_pool_peak_in_use(void);
+
+#endif /* FRAME_POOL_H */
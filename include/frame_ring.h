@@ -0,0 +1,78 @@
+/**
+ * @file frame_ring.h
+ * @brief Lock-free single-producer/single-consumer ring of frame descriptors
+ *
+ * Connects the acquisition task (producer) with the sender task (consumer).
+ * Only descriptors travel through the ring; the sample data stays in the
+ * frame buffer it was captured into. Each side only ever writes its own
+ * index, so no mutex is needed.
+ */
+
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "frame_header.h"
+
+#define FRAME_RING_CAPACITY 8 /* Must be a power of two */
+
+/**
+ * @brief Descriptor of a captured frame
+ */
+typedef struct {
+    uint8_t *data; /**< Start of the encoded payload inside the frame buffer */
+    size_t len; /**< Length of the encoded payload in bytes */
+    int index; /**< Buffer index, used to hand the buffer back to its owner */
+    frame_header_t header; /**< Header describing the payload */
+} frame_desc_t;
+
+/**
+ * @brief Single-producer/single-consumer ring of frame descriptors
+ */
+typedef struct {
+    frame_desc_t slots[FRAME_RING_CAPACITY]; /**< Descriptor storage */
+    atomic_uint head; /**< Next slot to write, only modified by the producer */
+    atomic_uint tail; /**< Next slot to read, only modified by the consumer */
+} frame_ring_t;
+
+/**
+ * @brief Reset a ring to the empty state
+ *
+ * Must not be called while either side is using the ring.
+ *
+ * @param ring Ring to initialize
+ */
+void frame_ring_init(frame_ring_t *ring);
+
+/**
+ * @brief Append a descriptor (producer side)
+ *
+ * @param ring Ring to write to
+ * @param desc Descriptor to copy into the ring
+ * @return true on success, false if the ring is full
+ */
+bool frame_ring_push(frame_ring_t *ring, const frame_desc_t *desc);
+
+/**
+ * @brief Remove the oldest descriptor (consumer side)
+ *
+ * @param ring Ring to read from
+ * @param desc Receives the descriptor
+ * @return true on success, false if the ring is empty
+ */
+bool frame_ring_pop(frame_ring_t *ring, frame_desc_t *desc);
+
+/**
+ * @brief Get the number of descriptors currently queued
+ *
+ * The value is a snapshot and may change as soon as it is returned.
+ *
+ * @param ring Ring to inspect
+ * @return Number of queued descriptors
+ */
+unsigned frame_ring_count(frame_ring_t *ring);
+
+#endif /* FRAME_RING_H */
@@ -44,7 +44,8 @@
 #define ADC_CHANNEL ADC_CHANNEL_6
 #define ADC_BITWIDTH ADC_WIDTH_BIT_10
 #define SAMPLE_RATE_HZ 600000 /* 600 kHz */
-#define WAIT_ADC_CONV_TIME 15
+#define ADC_CONV_FRAME_SIZE 128 /* Bytes the driver moves into its pool per DMA interrupt */
+#define ADC_READ_TIMEOUT_MS 1000 /* Longest wait for the conversions of one frame */
 
 /* GPIO Definitions */
 #define GPIO_INPUT_PIN GPIO_NUM_11
@@ -64,7 +65,6 @@
 #define SPI_FREQ 40000000
 #define PERIOD_TICKS 32
 #define COMPARE_VALUE 26
-#define SPI_FREQ_SCALE_FACTOR 1000 / 16
 #define MATRIX_SPI_ROWS 7
 #define MATRIX_SPI_COLS 5
 
@@ -85,10 +85,17 @@
 
 /* Buffer Configuration */
 #ifdef USE_EXTERNAL_ADC
-#define BUF_SIZE 17280 * 4
+#define BUF_SIZE (17280 * 4) /* Largest capture, frame lengths are selected at runtime up to this */
 #else
-#define BUF_SIZE 1440 * 30
+#define BUF_SIZE (1440 * 30)
 #endif
+#define FRAME_BUFFERS 2 /* Frame buffers of BUF_SIZE that make up the frame pool */
+#define FRAME_MIN_SAMPLES 1024 /* Shortest selectable frame, shorter streams use roll mode */
+#define MAX_DATA_CLIENTS MAX_STA_CONN /* Data connections fed from the same captured frames */
+#define ACCEPT_POLL_MS 200 /* Longest idle wait of socket_task before it rechecks its state */
+#define ROLL_MIN_CHUNK_SAMPLES 64 /* Smallest roll mode chunk, keeps the per-chunk overhead bounded */
+#define ROLL_MAX_CHUNK_SAMPLES 4096
+#define MIN_FREE_INTERNAL_HEAP (40 * 1024) /* Warn at boot below this, WiFi and lwIP allocate at runtime */
 
 /* Heap Tracing */
 #ifdef CONFIG_HEAP_TRACING
@@ -100,14 +107,12 @@ extern adc_continuous_handle_t adc_handle;
 extern atomic_int adc_modify_freq;
 extern atomic_int adc_divider;
 extern int read_miss_count;
-extern int wait_convertion_time;
 extern spi_device_handle_t spi;
 extern mcpwm_timer_handle_t timer;
 extern mcpwm_oper_handle_t oper;
 extern mcpwm_cmpr_handle_t comparator;
 extern mcpwm_gen_handle_t generator;
 extern const uint32_t spi_matrix[MATRIX_SPI_ROWS][MATRIX_SPI_COLS];
-extern int spi_index;
 extern ledc_channel_config_t ledc_channel;
 extern atomic_int mode;
 extern atomic_int last_state;
@@ -118,6 +123,9 @@ extern pcnt_channel_handle_t pcnt_chan;
 extern int new_sock;
 extern httpd_handle_t second_server;
 extern TaskHandle_t socket_task_handle;
+extern TaskHandle_t acquisition_task_handle;
+extern atomic_uint frame_overruns;
+extern atomic_uint frame_underruns;
 extern unsigned char public_key[KEYSIZE];
 extern unsigned char private_key[KEYSIZE];
 extern SemaphoreHandle_t key_gen_semaphore;
@@ -131,7 +139,7 @@ extern atomic_bool adc_initializing; // Add this line
 #else
 extern SemaphoreHandle_t spi_mutex;
 extern atomic_int socket_reset_requested;
-extern SemaphoreHandle_t spi_mutex;
+extern atomic_int spi_reconfig_requested;
 #endif
 
 /* Define SPI matrix content */
@@ -11,6 +11,7 @@
 
 #include <esp_err.h>
 #include <esp_event.h>
+#include <esp_heap_caps.h>
 #include <esp_log.h>
 #include <esp_netif.h>
 #include <esp_task_wdt.h>
@@ -0,0 +1,170 @@
+/**
+ * @file record.h
+ * @brief Deep record into PSRAM
+ *
+ * On boards with PSRAM (CONFIG_SPIRAM) a record of a runtime-selected number
+ * of samples is allocated in external RAM. The SPI driver keeps capturing
+ * into the internal DMA frame buffers, which serve as staging only, and
+ * acquisition_task appends each captured frame to the record until it is
+ * full. While a record is filling, acquisition runs even without a data
+ * client, and frames are captured back to back instead of waiting for a
+ * slow sender. The finished record is read back over HTTP, either at full
+ * resolution or as a min/max overview. Consecutive frames are separated by
+ * the short gap between two captures; the start and completion time of
+ * every frame is kept in a table that is read back as well.
+ *
+ * Without PSRAM record_arm() fails with ESP_ERR_NOT_SUPPORTED and the record
+ * stays idle.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "globals.h"
+
+#define RECORD_MIN_SAMPLES 1024
+#define RECORD_READ_CHUNK_SAMPLES 512 /* Samples staged in internal RAM per read callback */
+#define RECORD_FRAME_MIN_SAMPLES ROLL_MIN_CHUNK_SAMPLES /* Shortest frame appended, sizes the frame table */
+
+/**
+ * @brief Progress of the record
+ */
+typedef enum {
+    RECORD_IDLE = 0, /**< No record allocated */
+    RECORD_ARMED, /**< Waiting for frames, or partly filled */
+    RECORD_BUSY, /**< A frame is being appended or the record is being replaced */
+    RECORD_DONE, /**< Full, ready to be read */
+    RECORD_READING, /**< A reader is copying samples out */
+} record_state_t;
+
+/**
+ * @brief Snapshot of the record
+ */
+typedef struct {
+    record_state_t state; /**< Current state */
+    size_t samples; /**< Length of the record in samples */
+    size_t filled; /**< Samples captured so far */
+    uint32_t frames; /**< Frames the record was assembled from */
+    int64_t first_us; /**< esp_timer completion time of the first frame */
+    int64_t last_us; /**< esp_timer completion time of the last frame */
+    uint32_t sample_rate_hz; /**< Hardware sample rate when the record was armed */
+} record_status_t;
+
+/**
+ * @brief Position and capture time of one frame of the record, as read by record_read_frames()
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t first_sample; /**< Index of the frame's first sample in the record */
+    uint32_t samples; /**< Samples of the frame in the record */
+    int64_t end_us; /**< esp_timer time at which the capture of the frame completed */
+} record_frame_entry_t;
+
+_Static_assert(sizeof(record_frame_entry_t) == 16, "record_frame_entry_t layout is part of the HTTP API");
+
+/**
+ * @brief Receives the samples of record_read() chunk by chunk
+ *
+ * @param ctx Context passed to record_read()
+ * @param data ADC words in the byte order of the configured ADC
+ * @param len Length of data in bytes
+ * @return ESP_OK to continue, any other value stops the read
+ */
+typedef esp_err_t (*record_sink_t)(void *ctx, const uint8_t *data, size_t len);
+
+/**
+ * @brief Allocate a record and start filling it with the next frames
+ *
+ * Drops any previous record. Waits for a frame copy or read in progress to
+ * finish first.
+ *
+ * @param samples Record length, at least RECORD_MIN_SAMPLES
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if too short, ESP_ERR_NO_MEM if
+ *         PSRAM cannot hold it, ESP_ERR_NOT_SUPPORTED without PSRAM
+ */
+esp_err_t record_arm(size_t samples);
+
+/**
+ * @brief Stop recording and free the record
+ */
+void record_free(void);
+
+/**
+ * @brief Check whether an armed record still waits for frames
+ *
+ * socket_task keeps acquisition running while this is true, with or
+ * without data clients.
+ *
+ * @return true from record_arm() until the record is full or freed
+ */
+bool record_filling(void);
+
+/**
+ * @brief Get a snapshot of the record state
+ *
+ * @param status Receives the state
+ */
+void record_get_status(record_status_t *status);
+
+/**
+ * @brief Get the longest record PSRAM can currently hold
+ *
+ * @return Samples, 0 without PSRAM
+ */
+size_t record_max_samples(void);
+
+/**
+ * @brief Append a captured frame to an armed record
+ *
+ * Only called from acquisition_task, with the raw frame before any processing.
+ *
+ * @param data ADC words in the byte order of the configured ADC
+ * @param len Length of data in bytes
+ * @param timestamp_us esp_timer time at which the capture completed
+ */
+void record_frame(const uint8_t *data, size_t len, int64_t timestamp_us);
+
+/**
+ * @brief Read part of a finished record
+ *
+ * With step 1 the samples are passed on unchanged. With a larger step every
+ * bucket of step samples is reduced to its minimum and maximum word, which
+ * gives an overview of a long record in a few points.
+ *
+ * @param start First sample to read
+ * @param count Number of samples to read, clipped to the end of the record
+ * @param step 1 for full resolution, otherwise samples per min/max bucket
+ * @param sink Receives the output in chunks of at most RECORD_READ_CHUNK_SAMPLES words
+ * @param ctx Passed to sink
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if no finished record exists,
+ *         ESP_ERR_INVALID_ARG for a start past the end or a step below 1,
+ *         the sink's error if it stopped the read
+ */
+esp_err_t record_read(size_t start, size_t count, int step, record_sink_t sink, void *ctx);
+
+/**
+ * @brief Read the frame table of a finished record
+ *
+ * One record_frame_entry_t per frame the record was assembled from, in
+ * capture order. The gap between two captures is the difference of their
+ * end_us less the duration of the later frame.
+ *
+ * @param sink Receives the entries in chunks
+ * @param ctx Passed to sink
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if no finished record exists,
+ *         the sink's error if it stopped the read
+ */
+esp_err_t record_read_frames(record_sink_t sink, void *ctx);
+
+/**
+ * @brief Get the name used for a record state in the HTTP API
+ *
+ * @param state State to name
+ * @return "idle", "armed", "busy", "done" or "reading"
+ */
+const char *record_state_name(record_state_t state);
+
+#endif /* RECORD_H */
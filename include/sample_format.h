@@ -0,0 +1,101 @@
+/**
+ * @file sample_format.h
+ * @brief Wire formats for the samples streamed to the client
+ *
+ * The ADC words carry fewer useful bits than the 16 bits they occupy
+ * (get_data_mask()). Frames can be re-encoded in place before they are sent,
+ * either as a dense bit stream holding only the data bits or as one byte per
+ * sample for display-only clients. The format is chosen by the client through
+ * the HTTP API and applies from the next data connection on.
+ *
+ * SAMPLE_FORMAT_DELTA splits a frame into blocks of DELTA_BLOCK_SAMPLES
+ * samples (the last one may be shorter), each starting on a byte boundary.
+ * With w the number of data bits, a block is an MSB-first bit stream of:
+ * - header byte b
+ * - if b is DELTA_BLOCK_RAW: every sample in w bits
+ * - otherwise: the first sample in w bits, the reference r in w + 1 bits and
+ *   every following sample as zigzag(sample - previous) - r in b bits
+ * The number of samples per frame is fixed, so the client knows where a
+ * frame ends.
+ */
+
+#ifndef SAMPLE_FORMAT_H
+#define SAMPLE_FORMAT_H
+
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_BLOCK_SAMPLES 64 /* Samples per block of SAMPLE_FORMAT_DELTA */
+#define DELTA_BLOCK_RAW 0xFF /* Block header marking plain packed samples */
+
+/**
+ * @brief Encoding of the samples on the data socket
+ */
+typedef enum {
+    SAMPLE_FORMAT_RAW16 = 0, /**< Raw 16-bit ADC words, as captured */
+    SAMPLE_FORMAT_PACKED, /**< Data bits only, packed MSB first into a continuous bit stream */
+    SAMPLE_FORMAT_DISPLAY8, /**< Eight most significant data bits, one byte per sample */
+    SAMPLE_FORMAT_DELTA, /**< Lossless blocks of zigzag deltas with frame-of-reference packing */
+    SAMPLE_FORMAT_COUNT /**< Number of formats, not a valid format */
+} sample_format_t;
+
+/**
+ * @brief Get the name used for a format in the HTTP API
+ *
+ * @param format Format to name
+ * @return "raw16", "packed", "display8" or "delta"
+ */
+const char *sample_format_name(sample_format_t format);
+
+/**
+ * @brief Look up a format by its HTTP API name
+ *
+ * @param name Name as returned by sample_format_name()
+ * @param format Receives the matching format
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND for an unknown name
+ */
+esp_err_t sample_format_from_name(const char *name, sample_format_t *format);
+
+/**
+ * @brief Get the number of bits one sample occupies on the wire
+ *
+ * For SAMPLE_FORMAT_PACKED this is the number of bits set in get_data_mask():
+ * 10 for the external ADC, 12 for the internal ADC.
+ *
+ * @param format Format to query
+ * @return Bits per sample, 0 for the variable-length SAMPLE_FORMAT_DELTA
+ */
+int sample_format_bits(sample_format_t format);
+
+/**
+ * @brief Re-encode a frame of raw ADC words in place
+ *
+ * Words are read big-endian for the external ADC and little-endian for the
+ * internal ADC, masked with mask and shifted down to bit 0. The output never
+ * grows, so it is written over the input as it is read. A trailing partial
+ * byte of a packed stream is padded with zero bits.
+ *
+ * @param format Target format
+ * @param mask Sample bits of the words: get_data_mask(), or a wider mask of up to 15 bits for hi-res frames
+ * @param data Raw ADC words, overwritten with the encoded samples
+ * @param len Length of data in bytes, an odd trailing byte is dropped
+ * @return Length of the encoded data in bytes
+ */
+size_t sample_format_encode(sample_format_t format, uint16_t mask, uint8_t *data, size_t len);
+
+/**
+ * @brief Select the format used for the next data connection
+ *
+ * @param format Format to select
+ */
+void sample_format_select(sample_format_t format);
+
+/**
+ * @brief Get the format selected for the next data connection
+ *
+ * @return Selected format, SAMPLE_FORMAT_RAW16 unless changed
+ */
+sample_format_t sample_format_selected(void);
+
+#endif /* SAMPLE_FORMAT_H */
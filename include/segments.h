@@ -0,0 +1,134 @@
+/**
+ * @file segments.h
+ * @brief Segmented capture for single mode
+ *
+ * Collects several short trigger-aligned segments into a preallocated store
+ * and hands them to the sender as one batch, so bursts of events that come
+ * faster than full frames can be sent are still caught. A captured frame is
+ * scanned for as many triggers as it holds; the engine re-arms right after
+ * each segment, so the only time no trigger can be seen is between captures.
+ * That blind time is measured from the capture timestamps and reported with
+ * every segment.
+ *
+ * The batch payload starts with a segment_batch_t, followed by count
+ * segment_entry_t and then the samples of all segments back to back in the
+ * session's sample format. All fields are little-endian.
+ */
+
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sample_format.h"
+#include "trigger.h"
+
+#define SEGMENT_MAX_COUNT 64
+#define SEGMENT_MIN_SAMPLES 16
+#define SEGMENT_MAX_STORE_SAMPLES 32768 /* Limits the store to 64 KB of samples */
+#define SEGMENT_STORE_INDEX (-1) /* frame_desc_t index of a batch, which lives in the store */
+
+/**
+ * @brief Start of a batch payload
+ */
+typedef struct __attribute__((packed)) {
+    uint16_t count; /**< Number of segments in the batch */
+    uint16_t trigger_index; /**< Sample index of the trigger point inside each segment */
+    uint32_t samples; /**< Samples per segment */
+} segment_batch_t;
+
+/**
+ * @brief Per-segment record following the segment_batch_t
+ */
+typedef struct __attribute__((packed)) {
+    int64_t timestamp_us; /**< esp_timer time of the trigger sample */
+    uint32_t dead_time_us; /**< Time since the previous segment during which no trigger could be seen */
+} segment_entry_t;
+
+_Static_assert(sizeof(segment_batch_t) == 8, "segment_batch_t layout is part of the wire protocol");
+_Static_assert(sizeof(segment_entry_t) == 12, "segment_entry_t layout is part of the wire protocol");
+
+/**
+ * @brief Request a new segmented capture setting
+ *
+ * Applied by segments_update() at the next frame boundary once no batch is
+ * being sent. Any partly filled batch is dropped.
+ *
+ * @param count Segments per batch, 0 turns segmented capture off
+ * @param samples Samples per segment
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the store would not fit the limits
+ */
+esp_err_t segments_configure(int count, int samples);
+
+/**
+ * @brief Get the segments per batch currently in effect
+ *
+ * @return Segments per batch, 0 when segmented capture is off
+ */
+int segments_get_count(void);
+
+/**
+ * @brief Get the samples per segment currently in effect
+ *
+ * @return Samples per segment, 0 when segmented capture is off
+ */
+int segments_get_samples(void);
+
+/**
+ * @brief Apply a pending setting and check whether segmented capture is on
+ *
+ * Allocates the store when segmented capture is turned on and frees it when
+ * it is turned off. If the allocation fails, segmented capture stays off.
+ * While the segments are longer than the frames it is off as well, and the
+ * request applies again once the frames are long enough. Only called from
+ * acquisition_task.
+ *
+ * @param frame_samples Samples per captured frame of the session
+ * @return true if frames go to segments_capture()
+ */
+bool segments_update(size_t frame_samples);
+
+/**
+ * @brief Copy the trigger-aligned segments of a captured frame into the store
+ *
+ * Frames that arrive while a batch is being sent are skipped and count as
+ * dead time, as does the rest of a frame after the batch filled up.
+ *
+ * @param data ADC words in the byte order of the configured ADC
+ * @param len Length of data in bytes
+ * @param end_us esp_timer time at which the capture completed
+ * @param config Trigger settings
+ * @return Number of segments stored from this frame
+ */
+int segments_capture(const uint8_t *data, size_t len, int64_t end_us, const trigger_config_t *config);
+
+/**
+ * @brief Encode a full batch and hand it out for sending
+ *
+ * The store stays owned by the sender until segments_release().
+ *
+ * @param format Wire format of the samples
+ * @param payload Receives the start of the batch payload
+ * @return Length of the payload in bytes, 0 if the batch is not full yet
+ */
+size_t segments_take_batch(sample_format_t format, uint8_t **payload);
+
+/**
+ * @brief Give the store back once the sender is done with a batch
+ *
+ * Only called once every client has acknowledged the batch or been aborted,
+ * since lwIP sends the store without copying it. The store may be refilled,
+ * or freed by segments_update(), right after this call.
+ */
+void segments_release(void);
+
+/**
+ * @brief Drop a partly filled batch and the dead time measurement
+ *
+ * Called when acquisition stops, so a new session starts with an empty batch.
+ */
+void segments_discard(void);
+
+#endif /* SEGMENTS_H */
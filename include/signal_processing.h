@@ -0,0 +1,272 @@
+/**
+ * @file signal_processing.h
+ * @brief On-device processing of captured frames
+ *
+ * Operates in place on the frame buffers between capture and wire encoding.
+ * Input and output are ADC words in the byte order of the configured ADC with
+ * the sample in the get_data_mask() bits, so the result can be encoded like
+ * any captured frame.
+ */
+
+#ifndef SIGNAL_PROCESSING_H
+#define SIGNAL_PROCESSING_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "globals.h"
+
+#define DECIMATION_MAX_FACTOR 64 /* Keeps the CIC registers within 32 bits for 12-bit samples */
+#define DECIMATION_CIC_ORDER 3
+#define DECIMATION_WARMUP 4 /* Leading outputs dropped while the CIC and FIR fill up */
+
+#define AVERAGING_MAX_FRAMES 256 /* Keeps block sums of 12-bit samples within 32 bits */
+#define AVERAGING_FRACTION_BITS 8 /* Fixed-point fraction bits of the exponential average */
+
+/**
+ * @brief How frames are reduced by the decimation factor
+ */
+typedef enum {
+    DECIMATION_FILTER = 0, /**< CIC + FIR low-pass, one sample per bucket */
+    DECIMATION_PEAK, /**< Minimum and maximum of every bucket, two samples per bucket */
+    DECIMATION_HIRES, /**< Boxcar mean of every bucket with extra resolution bits, one wider sample per bucket */
+    DECIMATION_MODE_COUNT /**< Number of modes, not a valid mode */
+} decimation_mode_t;
+
+/**
+ * @brief How trigger-aligned frames are averaged
+ */
+typedef enum {
+    AVERAGING_OFF = 0, /**< Every frame is sent */
+    AVERAGING_BLOCK, /**< Mean of each run of N frames */
+    AVERAGING_EXPONENTIAL, /**< Exponential moving average with weight 1/N, sent every N frames */
+    AVERAGING_MODE_COUNT /**< Number of modes, not a valid mode */
+} averaging_mode_t;
+
+/**
+ * @brief Read one ADC word in the byte order of the configured ADC
+ *
+ * @param p First byte of the word
+ * @return Raw 16-bit word
+ */
+static inline uint16_t adc_word_read(const uint8_t *p)
+{
+#ifdef USE_EXTERNAL_ADC
+    return (uint16_t)((p[0] << 8) | p[1]);
+#else
+    return (uint16_t)(p[0] | (p[1] << 8));
+#endif
+}
+
+/**
+ * @brief Write one ADC word in the byte order of the configured ADC
+ *
+ * @param p First byte of the word
+ * @param word Raw 16-bit word
+ */
+static inline void adc_word_write(uint8_t *p, uint16_t word)
+{
+#ifdef USE_EXTERNAL_ADC
+    p[0] = (uint8_t)(word >> 8);
+    p[1] = (uint8_t)word;
+#else
+    p[0] = (uint8_t)word;
+    p[1] = (uint8_t)(word >> 8);
+#endif
+}
+
+/**
+ * @brief Set the decimation factor applied to the following frames
+ *
+ * The ADC keeps sampling at its hardware rate; the effective rate becomes
+ * the hardware rate divided by factor. Takes effect at the next frame.
+ *
+ * @param factor 1 (no decimation) to DECIMATION_MAX_FACTOR
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if factor is out of range
+ */
+esp_err_t decimation_set_factor(int factor);
+
+/**
+ * @brief Get the current decimation factor
+ *
+ * @return Decimation factor, 1 when decimation is off
+ */
+int decimation_get_factor(void);
+
+/**
+ * @brief Set how the following frames are decimated
+ *
+ * @param mode Decimation mode
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for an unknown mode
+ */
+esp_err_t decimation_set_mode(decimation_mode_t mode);
+
+/**
+ * @brief Get the current decimation mode
+ *
+ * @return Decimation mode, DECIMATION_FILTER unless changed
+ */
+decimation_mode_t decimation_get_mode(void);
+
+/**
+ * @brief Get the name used for a decimation mode in the HTTP API
+ *
+ * @param mode Mode to name
+ * @return "filter", "peak" or "hires"
+ */
+const char *decimation_mode_name(decimation_mode_t mode);
+
+/**
+ * @brief Look up a decimation mode by its HTTP API name
+ *
+ * @param name Name as returned by decimation_mode_name()
+ * @param mode Receives the matching mode
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND for an unknown name
+ */
+esp_err_t decimation_mode_from_name(const char *name, decimation_mode_t *mode);
+
+/**
+ * @brief Number of samples a frame holds after decimation
+ *
+ * @param samples Samples captured per frame
+ * @param factor Decimation factor
+ * @param mode Decimation mode
+ * @return Samples left after decimation
+ */
+size_t decimated_samples(size_t samples, int factor, decimation_mode_t mode);
+
+/**
+ * @brief Decimate a frame in place
+ *
+ * Runs a DECIMATION_CIC_ORDER-stage CIC decimator followed by a 3-tap FIR
+ * ([-1, 10, -1] / 8) that compensates the CIC passband droop. The filter
+ * state starts from zero for every frame since frames are not contiguous in
+ * time, so the first DECIMATION_WARMUP outputs are dropped.
+ *
+ * @param data ADC words, overwritten with the decimated words
+ * @param len Length of data in bytes
+ * @param factor Decimation factor, 1 leaves the frame untouched
+ * @return Length of the decimated data in bytes
+ */
+size_t decimate_frame(uint8_t *data, size_t len, int factor);
+
+/**
+ * @brief Reduce a frame in place to its min/max envelope
+ *
+ * Splits the frame into buckets of factor samples and replaces each bucket
+ * with its minimum followed by its maximum, so short glitches stay visible
+ * at long timebases. A trailing partial bucket is dropped.
+ *
+ * @param data ADC words, overwritten with min/max word pairs
+ * @param len Length of data in bytes
+ * @param factor Samples per bucket, below 2 leaves the frame untouched
+ * @return Length of the envelope in bytes
+ */
+size_t peak_detect_frame(uint8_t *data, size_t len, int factor);
+
+/**
+ * @brief Resolution bits gained by hi-res averaging
+ *
+ * Averaging factor samples of uncorrelated noise gains half a bit per
+ * doubling, so the gain is floor(log2(factor) / 2): 1 bit from 4 samples,
+ * 2 from 16, 3 from 64.
+ *
+ * @param factor Samples per bucket
+ * @return Extra bits carried by hi-res samples
+ */
+int hires_extra_bits(int factor);
+
+/**
+ * @brief Sample bits of the words written by hires_frame()
+ *
+ * The sample keeps its most significant bit where get_data_mask() has it and
+ * extends into the unused low bits, so masking with get_data_mask() still
+ * yields the plain sample. Without room below (internal ADC) the wider
+ * sample is right-aligned instead.
+ *
+ * @param factor Samples per bucket
+ * @return Mask of the hi-res sample bits, get_data_mask() when nothing is gained
+ */
+uint16_t hires_data_mask(int factor);
+
+/**
+ * @brief Reduce a frame in place to hi-res boxcar means
+ *
+ * Sums each bucket of factor samples and scales the sum with a fixed-point
+ * reciprocal to a mean with hires_extra_bits() fraction bits. A trailing
+ * partial bucket is dropped.
+ *
+ * @param data ADC words, overwritten with words holding hires_data_mask() bits
+ * @param len Length of data in bytes
+ * @param factor Samples per bucket, below 2 leaves the frame untouched
+ * @return Length of the hi-res data in bytes
+ */
+size_t hires_frame(uint8_t *data, size_t len, int factor);
+
+/**
+ * @brief Request a new averaging setting
+ *
+ * Applied by average_frame() at the next frame boundary, which also restarts
+ * the average.
+ *
+ * @param mode Averaging mode
+ * @param frames Frames per average, 2 to AVERAGING_MAX_FRAMES (ignored when off)
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for an invalid mode or count
+ */
+esp_err_t averaging_configure(averaging_mode_t mode, int frames);
+
+/**
+ * @brief Get the averaging mode currently in effect
+ *
+ * @return Averaging mode, AVERAGING_OFF unless changed
+ */
+averaging_mode_t averaging_get_mode(void);
+
+/**
+ * @brief Get the number of frames per average currently in effect
+ *
+ * @return Frames per average, 1 when averaging is off
+ */
+int averaging_get_frames(void);
+
+/**
+ * @brief Get the name used for an averaging mode in the HTTP API
+ *
+ * @param mode Mode to name
+ * @return "off", "block" or "exponential"
+ */
+const char *averaging_mode_name(averaging_mode_t mode);
+
+/**
+ * @brief Look up an averaging mode by its HTTP API name
+ *
+ * @param name Name as returned by averaging_mode_name()
+ * @param mode Receives the matching mode
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND for an unknown name
+ */
+esp_err_t averaging_mode_from_name(const char *name, averaging_mode_t *mode);
+
+/**
+ * @brief Add a trigger-aligned frame to the running average
+ *
+ * Accumulates the samples into a 32-bit buffer, allocated in PSRAM when
+ * available and only while averaging is on. Every N-th frame the average
+ * is written back over the frame as ADC words. Frames of a different length
+ * than the running average restart it. Only called from acquisition_task.
+ *
+ * @param data ADC words, overwritten with the average when one is due
+ * @param len Length of data in bytes
+ * @return true if data now holds an average to send, false if the frame was only accumulated
+ */
+bool average_frame(uint8_t *data, size_t len);
+
+/**
+ * @brief Free the averaging accumulator and drop the running average
+ *
+ * Called by acquisition_task when acquisition stops and for every frame that
+ * is not averaged, so the buffer only exists while frames are being averaged.
+ */
+void averaging_release(void);
+
+#endif /* SIGNAL_PROCESSING_H */
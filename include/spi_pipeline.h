@@ -0,0 +1,119 @@
+/**
+ * @file spi_pipeline.h
+ * @brief Queued-transaction capture pipeline for the external ADC
+ *
+ * Frame buffers come from the frame pool and are kept queued in the SPI
+ * driver, so the next frames are captured by DMA while the previous ones are
+ * consumed. Only acquisition_task uses a pipeline.
+ */
+
+#ifndef SPI_PIPELINE_H
+#define SPI_PIPELINE_H
+
+#include <driver/spi_master.h>
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "frame_pool.h"
+
+/**
+ * @brief State of a frame buffer in the SPI capture pipeline
+ */
+typedef enum {
+    SPI_FRAME_FREE, /**< Idle, can be queued for the next capture */
+    SPI_FRAME_QUEUED, /**< Owned by the SPI driver until its transaction completes */
+    SPI_FRAME_HELD, /**< Holds a completed capture that is being consumed */
+} spi_frame_state_t;
+
+/**
+ * @brief Queued-transaction capture pipeline for the external ADC
+ *
+ * Every free frame buffer is kept queued in the SPI driver, so frame N+1 is
+ * captured by DMA while frame N is consumed (e.g. sent to the client).
+ * spi_mutex is held for as long as any transaction is in flight, which keeps
+ * the SPI device from being removed under the driver.
+ */
+typedef struct {
+    uint8_t *buffers[FRAME_POOL_MAX_SLOTS]; /**< DMA-capable frame buffers carved from the frame pool */
+    spi_transaction_t trans[FRAME_POOL_MAX_SLOTS]; /**< One transaction descriptor per buffer */
+    spi_frame_state_t state[FRAME_POOL_MAX_SLOTS]; /**< Ownership state of each buffer */
+    int order[FRAME_POOL_MAX_SLOTS]; /**< Queued buffer indices in completion order */
+    int count; /**< Number of buffers of the current carving */
+    int in_flight; /**< Number of transactions queued in the driver */
+    size_t capture_len; /**< Bytes captured by each transaction, a whole number of words */
+    bool holds_mutex; /**< Whether the pipeline currently owns spi_mutex */
+} spi_pipeline_t;
+
+/**
+ * @brief Allocate the frame pool of a capture pipeline
+ *
+ * The pool is allocated once from DMA-capable internal memory and carved
+ * into full BUF_SIZE frames.
+ *
+ * @param pipeline Pipeline to initialize
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the pool cannot be allocated
+ */
+esp_err_t spi_pipeline_init(spi_pipeline_t *pipeline);
+
+/**
+ * @brief Re-carve the frame pool for a new capture length
+ *
+ * Every buffer becomes free, so nothing may be queued in the driver or held
+ * by the sender.
+ *
+ * @param pipeline Pipeline to re-carve
+ * @param frame_len Bytes per capture, rounded up to whole words
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE while captures are in flight,
+ *         ESP_ERR_INVALID_SIZE if frame_len does not fit the pool
+ */
+esp_err_t spi_pipeline_carve(spi_pipeline_t *pipeline, size_t frame_len);
+
+/**
+ * @brief Queue every free pool buffer for capture
+ *
+ * Each queued buffer is taken from the frame pool, and its ownership
+ * travels with the captured frame.
+ *
+ * Takes spi_mutex before the first transaction is queued. When a rate change
+ * has been requested through spi_reconfig_requested no new capture is queued
+ * until the pipeline is empty; the device is then switched and capture
+ * continues at the new rate.
+ *
+ * @param pipeline Pipeline to fill
+ * @return ESP_OK on success, error code from spi_device_queue_trans otherwise
+ */
+esp_err_t spi_pipeline_fill(spi_pipeline_t *pipeline);
+
+/**
+ * @brief Wait for the oldest queued capture to complete
+ *
+ * The completed buffer is marked as held and stays out of the pipeline until
+ * it is handed back with spi_pipeline_release().
+ *
+ * @param pipeline Pipeline to wait on
+ * @param index Receives the index of the completed buffer
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if nothing is in flight
+ */
+esp_err_t spi_pipeline_wait(spi_pipeline_t *pipeline, int *index);
+
+/**
+ * @brief Hand a held buffer back to the frame pool
+ *
+ * The buffer goes back to the frame pool and can be captured into again.
+ *
+ * @param pipeline Pipeline owning the buffer
+ * @param index Index previously returned by spi_pipeline_wait()
+ */
+void spi_pipeline_release(spi_pipeline_t *pipeline, int index);
+
+/**
+ * @brief Complete all in-flight captures and release spi_mutex
+ *
+ * Must be called before the pipeline is left idle (e.g. on client disconnect).
+ *
+ * @param pipeline Pipeline to drain
+ */
+void spi_pipeline_drain(spi_pipeline_t *pipeline);
+
+#endif /* SPI_PIPELINE_H */
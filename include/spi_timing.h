@@ -0,0 +1,93 @@
+/**
+ * @file spi_timing.h
+ * @brief Timing solver for the external ADC sample rate
+ *
+ * The external ADC delivers one sample every SPI_TIMING_CLOCKS_PER_SAMPLE
+ * SPI clocks, and the MCPWM trigger must run at the same period. Both are
+ * divided down from SPI_TIMING_BASE_HZ, so every achievable rate is
+ * SPI_TIMING_BASE_HZ / (SPI_TIMING_CLOCKS_PER_SAMPLE * divider) for an
+ * integer divider the SPI clock divider can represent, from 2.5 MS/s down
+ * to about 1.2 kS/s.
+ *
+ * The rows of spi_matrix are the calibration points. A divider takes the
+ * CS setup and input delay of the row nearest to it on a log scale, and the
+ * MCPWM period and compare value are scaled from the divider, so the
+ * dividers of the rows reproduce the rows exactly.
+ */
+
+#ifndef SPI_TIMING_H
+#define SPI_TIMING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SPI_TIMING_BASE_HZ 80000000 /* APB clock, divided for the SPI clock, equal to the MCPWM resolution */
+#define SPI_TIMING_CLOCKS_PER_SAMPLE 16 /* SPI clocks per ADC word */
+#define SPI_TIMING_MIN_DIVIDER 2 /* 40 MHz SPI clock, the fastest the ADC interface runs */
+#define SPI_TIMING_MAX_DIVIDER 4095 /* The MCPWM period of 16 ticks per divider step must fit the 16-bit timer */
+#define SPI_TIMING_MAX_CLOCK_N 64 /* SPI clock: the divider is a prescaler of at most 8192 times N of 2 to 64 */
+
+/**
+ * @brief SPI device and MCPWM settings of one sample rate
+ */
+typedef struct {
+    uint32_t divider; /**< SPI_TIMING_BASE_HZ cycles per SPI clock */
+    uint32_t spi_clock_hz; /**< clock_speed_hz of the SPI device, the driver picks the divider exactly */
+    uint32_t cs_ena_pretrans; /**< CS setup in SPI clocks, from the calibration row */
+    uint32_t input_delay_ns; /**< MISO input delay, from the calibration row */
+    uint32_t period_ticks; /**< MCPWM period */
+    uint32_t compare_ticks; /**< MCPWM compare value, the same share of the period as in spi_matrix */
+    int row; /**< spi_matrix row the CS setup and input delay are taken from */
+} spi_timing_t;
+
+/**
+ * @brief Check whether the SPI clock divider can represent a divider
+ *
+ * @param divider SPI_TIMING_BASE_HZ cycles per SPI clock
+ * @return true if the divider is in range and has a factor N of 2 to SPI_TIMING_MAX_CLOCK_N
+ */
+bool spi_timing_divider_valid(uint32_t divider);
+
+/**
+ * @brief Find the achievable divider whose sample rate is nearest to a requested one
+ *
+ * Rates beyond the limits give the fastest or slowest divider.
+ *
+ * @param rate_hz Requested sample rate
+ * @return Valid divider
+ */
+uint32_t spi_timing_divider_for_rate(double rate_hz);
+
+/**
+ * @brief Get the exact sample rate of a divider
+ *
+ * @param divider SPI_TIMING_BASE_HZ cycles per SPI clock
+ * @return Samples per second
+ */
+double spi_timing_rate(uint32_t divider);
+
+/**
+ * @brief Get the divider of a spi_matrix row
+ *
+ * @param row spi_matrix row
+ * @return SPI_TIMING_BASE_HZ cycles per SPI clock
+ */
+uint32_t spi_timing_row_divider(int row);
+
+/**
+ * @brief Get the spi_matrix row nearest to a divider on a log scale
+ *
+ * @param divider SPI_TIMING_BASE_HZ cycles per SPI clock
+ * @return spi_matrix row
+ */
+int spi_timing_row(uint32_t divider);
+
+/**
+ * @brief Compute the SPI device and MCPWM settings of a divider
+ *
+ * @param divider Valid divider
+ * @param timing Receives the settings
+ */
+void spi_timing_for_divider(uint32_t divider, spi_timing_t *timing);
+
+#endif /* SPI_TIMING_H */
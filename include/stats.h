@@ -0,0 +1,75 @@
+/**
+ * @file stats.h
+ * @brief Runtime acquisition and transmission statistics
+ *
+ * Counters only ever increase and are updated with relaxed atomic adds, once
+ * per frame or per send retry, never per sample. A 1 s esp_timer turns the
+ * totals into current rates, so readers of /stats do not disturb each other.
+ *
+ * Every counter is 32 bits wide, because 64-bit atomics are not lock-free on
+ * the 32-bit cores. The byte and time counters wrap within hours, so the
+ * timer also folds their last second into 64-bit totals, read with
+ * stats_get_totals().
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <esp_err.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * @brief Monotonic counters and current rates
+ */
+typedef struct {
+    atomic_uint frames_captured; /**< Frames delivered by the SPI driver or the ADC */
+    atomic_uint frames_sent; /**< Frames completely handed to the network stack */
+    atomic_uint bytes_sent; /**< Header and payload bytes handed to the network stack, wraps */
+    atomic_uint capture_failures; /**< Failed SPI transactions or ADC reads */
+    atomic_uint client_drops; /**< Frames a client skipped because it already held its share of the buffers */
+    atomic_uint send_retries; /**< Times a client's send buffer was found full */
+    atomic_uint send_stall_us; /**< Time spent waiting for room in the send buffer, wraps */
+    atomic_uint udp_retransmits; /**< UDP fragments sent again in answer to NACKs */
+    atomic_uint udp_nacks_expired; /**< NACKs for frames already past the retransmit window */
+    atomic_uint segments_captured; /**< Trigger-aligned segments stored by segmented capture */
+    atomic_uint rearm_dead_time_us; /**< Last measured gap between two captures, in which no trigger can be seen */
+    atomic_uint pool_exhausted_us; /**< Time acquisition waited with every frame pool buffer referenced, wraps */
+    atomic_uint rate_switches; /**< Sample rate changes applied */
+    atomic_uint rate_switch_us; /**< Time from the last rate change request until capture ran at the new rate */
+    atomic_uint adc_pool_overflows; /**< Internal ADC conversion frames dropped because the driver pool was full */
+    atomic_uint frames_per_second; /**< Frames sent during the last second */
+    atomic_uint bytes_per_second; /**< Bytes sent during the last second */
+} acquisition_stats_t;
+
+extern acquisition_stats_t acquisition_stats;
+
+/**
+ * @brief 64-bit totals of the wrapping counters
+ */
+typedef struct {
+    uint64_t bytes_sent; /**< Total of acquisition_stats.bytes_sent */
+    uint64_t send_stall_us; /**< Total of acquisition_stats.send_stall_us */
+    uint64_t pool_exhausted_us; /**< Total of acquisition_stats.pool_exhausted_us */
+} stats_totals_t;
+
+/**
+ * @brief Add to a counter from the hot path
+ */
+#define STATS_ADD(counter, value) atomic_fetch_add_explicit(&acquisition_stats.counter, (value), memory_order_relaxed)
+
+/**
+ * @brief Start the timer that computes the current rates
+ *
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t stats_init(void);
+
+/**
+ * @brief Read the 64-bit totals of the wrapping counters, up to date to the last add
+ *
+ * @param totals Receives the totals
+ */
+void stats_get_totals(stats_totals_t *totals);
+
+#endif /* STATS_H */
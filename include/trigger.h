@@ -0,0 +1,135 @@
+/**
+ * @file trigger.h
+ * @brief Sample-domain trigger engine for single mode
+ *
+ * Scans captured frames for a trigger condition and cuts out a window that is
+ * aligned to the trigger point. A capture holds contiguous samples, so the
+ * frame buffer itself serves as the pre-trigger history: the window starts
+ * trigger_position percent of its length before the trigger sample. Frames
+ * are not contiguous with each other, so no history is carried across them.
+ */
+
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define TRIGGER_WINDOW_DIVISOR 2 /* Trigger window is this fraction of the captured frame */
+
+/**
+ * @brief Condition that fires the trigger
+ */
+typedef enum {
+    TRIGGER_TYPE_EDGE = 0, /**< Crossing of the level after leaving the hysteresis band */
+    TRIGGER_TYPE_LEVEL, /**< First sample at or beyond the level */
+    TRIGGER_TYPE_COUNT /**< Number of types, not a valid type */
+} trigger_type_t;
+
+/**
+ * @brief Snapshot of the trigger settings, in ADC codes
+ */
+typedef struct {
+    trigger_type_t type; /**< Trigger condition */
+    bool rising; /**< Positive edge (or above level) if true, negative otherwise */
+    int32_t level; /**< Trigger level */
+    int32_t hysteresis; /**< Distance from the level the signal must reach to re-arm an edge trigger */
+    int position; /**< Share of the window before the trigger point, in percent */
+} trigger_config_t;
+
+/**
+ * @brief Get a snapshot of the current trigger settings
+ *
+ * The edge direction is taken from trigger_edge.
+ *
+ * @param config Receives the settings
+ */
+void trigger_get_config(trigger_config_t *config);
+
+/**
+ * @brief Set the trigger condition
+ *
+ * @param type Trigger type
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for an unknown type
+ */
+esp_err_t trigger_set_type(trigger_type_t type);
+
+/**
+ * @brief Set the trigger level
+ *
+ * @param percentage Level as a percentage (0-100) of get_max_bits()
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if out of range
+ */
+esp_err_t trigger_set_level(int percentage);
+
+/**
+ * @brief Set the edge trigger hysteresis
+ *
+ * @param percentage Hysteresis as a percentage (0-100) of get_max_bits()
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if out of range
+ */
+esp_err_t trigger_set_hysteresis(int percentage);
+
+/**
+ * @brief Set where the trigger point lies inside the window
+ *
+ * @param percentage Share of the window before the trigger (0-100)
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if out of range
+ */
+esp_err_t trigger_set_position(int percentage);
+
+/**
+ * @brief Get the name used for a trigger type in the HTTP API
+ *
+ * @param type Type to name
+ * @return "edge" or "level"
+ */
+const char *trigger_type_name(trigger_type_t type);
+
+/**
+ * @brief Look up a trigger type by its HTTP API name
+ *
+ * @param name Name as returned by trigger_type_name()
+ * @param type Receives the matching type
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND for an unknown name
+ */
+esp_err_t trigger_type_from_name(const char *name, trigger_type_t *type);
+
+/**
+ * @brief Number of samples in the trigger window
+ *
+ * @param samples Samples captured per frame
+ * @return Samples sent per triggered frame
+ */
+size_t trigger_window_samples(size_t samples);
+
+/**
+ * @brief Find the first trigger point in a run of ADC words
+ *
+ * Samples before from only arm the edge trigger, they never fire it.
+ *
+ * @param data ADC words in the byte order of the configured ADC
+ * @param from First sample index that may fire
+ * @param to Sample index at which the scan stops (exclusive)
+ * @param config Trigger settings
+ * @return Index of the trigger sample, -1 if there is none
+ */
+ssize_t trigger_scan(const uint8_t *data, size_t from, size_t to, const trigger_config_t *config);
+
+/**
+ * @brief Align a captured frame to its first trigger point
+ *
+ * Moves the trigger window to the start of the frame in place.
+ *
+ * @param data ADC words in the byte order of the configured ADC
+ * @param len Length of data in bytes
+ * @param config Trigger settings
+ * @param trigger_index Receives the sample index of the trigger point inside the window
+ * @return Length of the window in bytes, 0 if the frame holds no trigger
+ */
+size_t trigger_align_frame(uint8_t *data, size_t len, const trigger_config_t *config, size_t *trigger_index);
+
+#endif /* TRIGGER_H */
@@ -0,0 +1,122 @@
+/**
+ * @file udp_stream.h
+ * @brief UDP transport for the data stream
+ *
+ * A TCP stream stalls every later frame behind one lost segment, which on a
+ * congested WiFi link means hundreds of milliseconds. As an alternative a
+ * client can subscribe over UDP on the same port number as the TCP data
+ * socket. Every frame, frame_header_t included, is then split into
+ * datagrams that fit one Ethernet MTU, each starting with a
+ * udp_fragment_header_t.
+ *
+ * The client reports missing fragments with a NACK. A frame stays held for
+ * retransmission for UDP_RETRANSMIT_WINDOW_MS after its last fragment was
+ * sent; later NACKs are ignored, so a lost frame is dropped instead of
+ * arriving late. A client that sends nothing for UDP_CLIENT_TIMEOUT_MS is
+ * dropped, so clients repeat their subscription as a keepalive.
+ *
+ * All fields are little-endian.
+ */
+
+#ifndef UDP_STREAM_H
+#define UDP_STREAM_H
+
+#include <lwip/sockets.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "frame_header.h"
+
+#define UDP_STREAM_MAGIC 0x5544 /* "DU" once written little-endian */
+#define UDP_MAX_DATAGRAM 1472 /* Ethernet MTU minus the IPv4 and UDP headers, never fragmented by IP */
+#define UDP_RETRANSMIT_WINDOW_MS 60 /* How long a sent frame can still be NACKed */
+#define UDP_CLIENT_TIMEOUT_MS 3000 /* Silence after which a UDP client is dropped */
+
+#define UDP_FRAGMENT_RETRANSMIT 0x01 /* The fragment is sent again in answer to a NACK */
+
+/**
+ * @brief Datagram types
+ */
+typedef enum {
+    UDP_MSG_FRAGMENT = 0, /**< Device to client: part of a frame */
+    UDP_MSG_SUBSCRIBE, /**< Client to device: start streaming, or keep streaming */
+    UDP_MSG_NACK, /**< Client to device: resend the fragments in mask */
+    UDP_MSG_BYE, /**< Client to device: stop streaming */
+} udp_msg_type_t;
+
+/**
+ * @brief Header of every datagram from the device
+ */
+typedef struct __attribute__((packed)) {
+    uint16_t magic; /**< UDP_STREAM_MAGIC */
+    uint8_t type; /**< UDP_MSG_FRAGMENT */
+    uint8_t flags; /**< UDP_FRAGMENT_* bits */
+    uint32_t frame_seq; /**< frame_header_t sequence of the frame */
+    uint16_t fragment; /**< Index of this fragment */
+    uint16_t fragment_count; /**< Fragments the frame is split into */
+    uint32_t frame_len; /**< Header and payload bytes of the whole frame */
+} udp_fragment_header_t;
+
+_Static_assert(sizeof(udp_fragment_header_t) == 16, "udp_fragment_header_t layout is part of the wire protocol");
+
+#define UDP_FRAGMENT_PAYLOAD (UDP_MAX_DATAGRAM - sizeof(udp_fragment_header_t)) /* Frame bytes per datagram */
+
+/**
+ * @brief Datagram from the client
+ */
+typedef struct __attribute__((packed)) {
+    uint16_t magic; /**< UDP_STREAM_MAGIC */
+    uint8_t type; /**< UDP_MSG_SUBSCRIBE, UDP_MSG_NACK or UDP_MSG_BYE */
+    uint8_t reserved; /**< Zero */
+    uint32_t frame_seq; /**< NACK: frame the fragments belong to */
+    uint16_t first_fragment; /**< NACK: fragment of bit 0 of mask */
+    uint16_t reserved2; /**< Zero */
+    uint64_t mask; /**< NACK: bit i set if fragment first_fragment + i is missing */
+} udp_control_t;
+
+_Static_assert(sizeof(udp_control_t) == 20, "udp_control_t layout is part of the wire protocol");
+
+/**
+ * @brief Get the number of datagrams a frame is split into
+ *
+ * @param payload_len Payload bytes, the frame header is added
+ * @return Fragments
+ */
+int udp_fragment_count(size_t payload_len);
+
+/**
+ * @brief Describe one fragment of a frame for sendmsg()
+ *
+ * Nothing is copied: the I/O vector points into the header and the payload.
+ *
+ * @param header Frame header, sent in front of the payload
+ * @param payload Frame payload
+ * @param payload_len Payload bytes
+ * @param fragment Fragment to describe
+ * @param flags UDP_FRAGMENT_* bits
+ * @param frag Receives the datagram header, referenced by iov[0]
+ * @param iov Receives up to three entries
+ * @return Entries filled in, 0 if fragment is past the end of the frame
+ */
+int udp_fragment_iov(const frame_header_t *header, const uint8_t *payload, size_t payload_len, int fragment,
+                     uint8_t flags, udp_fragment_header_t *frag, struct iovec iov[3]);
+
+/**
+ * @brief Select the fragments a NACK asks for that can be sent again
+ *
+ * Only fragments already sent are resent: for a frame still being written
+ * that is sent_len / UDP_FRAGMENT_PAYLOAD of them. A completely sent frame
+ * can be NACKed for UDP_RETRANSMIT_WINDOW_MS after its last fragment.
+ *
+ * @param nack NACK for the frame, frame_seq already matched
+ * @param payload_len Payload bytes of the frame, the frame header is added
+ * @param sent_len Frame bytes sent so far, header included
+ * @param sent_us When the last fragment was sent, used once the whole frame is sent
+ * @param now_us Current time
+ * @param resend Receives bit i set if fragment nack->first_fragment + i is to be sent again
+ * @return false if the frame is past its retransmit window, true otherwise
+ */
+bool udp_nack_select(const udp_control_t *nack, size_t payload_len, size_t sent_len, int64_t sent_us, int64_t now_us,
+                     uint64_t *resend);
+
+#endif /* UDP_STREAM_H */
@@ -52,6 +52,18 @@ httpd_handle_t start_second_webserver(void);
  */
 esp_err_t config_handler(httpd_req_t *req);
 
+/**
+ * @brief Handler for runtime statistics requests
+ *
+ * Returns JSON with the monotonic acquisition and transmission counters
+ * (frames captured and sent, bytes sent, capture failures, send retries and
+ * stall time, overruns and underruns) and the current frame and data rates.
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t stats_handler(httpd_req_t *req);
+
 /**
  * @brief Handler for WiFi network scanning
  *
@@ -104,6 +116,162 @@ esp_err_t single_handler(httpd_req_t *req);
  */
 esp_err_t freq_handler(httpd_req_t *req);
 
+/**
+ * @brief Handler to select the wire sample format
+ *
+ * Accepts {"format": "raw16" | "packed" | "display8" | "delta"} and an
+ * optional "frame_header" boolean that puts a frame_header_t in front of every
+ * frame. Both apply from the next data connection on.
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t format_handler(httpd_req_t *req);
+
+/**
+ * @brief Handler to select roll mode for the next data connection
+ *
+ * Accepts {"chunk_samples": n}, with n from ROLL_MIN_CHUNK_SAMPLES to
+ * ROLL_MAX_CHUNK_SAMPLES, or 0 to go back to full frames. The response
+ * reports the resulting chunk duration at the current rate.
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t roll_handler(httpd_req_t *req);
+
+/**
+ * @brief Handler to select the frame length for the next data connection
+ *
+ * Accepts {"samples": n}, with n from FRAME_MIN_SAMPLES to the longest frame
+ * reported by /config, or 0 for the longest frame. The response reports the
+ * frame duration at the current rate and how many frames the pool holds.
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t frame_length_handler(httpd_req_t *req);
+
+/**
+ * @brief Handler to list the connected data clients
+ *
+ * Reports every client with its address, drop policy, frames held and its
+ * sent and dropped frame counts, plus the policy new clients will get.
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t clients_handler(httpd_req_t *req);
+
+/**
+ * @brief WebSocket handler streaming frames to a browser
+ *
+ * After the handshake the session is handed to socket_task, which sends
+ * every frame as one binary message, with its frame header when headers are
+ * enabled. The handler only sees frames from the browser: a close frame, or
+ * anything larger than a control frame, ends the session, and a PING is
+ * answered through socket_task with ws_client_pong().
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t stream_ws_handler(httpd_req_t *req);
+
+/**
+ * @brief Close callback of both HTTP servers
+ *
+ * Lets socket_task stop writing to a WebSocket session before its socket is
+ * closed and the descriptor can be reused.
+ *
+ * @param hd Server handle
+ * @param sockfd Session socket
+ */
+void session_close_handler(httpd_handle_t hd, int sockfd);
+
+/**
+ * @brief Handler to select the drop policy for new data clients
+ *
+ * Accepts {"drop_policy": "oldest"} or {"drop_policy": "newest"}. Clients
+ * already connected keep their policy. Responds like clients_handler().
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t drop_policy_handler(httpd_req_t *req);
+
+/**
+ * @brief Handler to set the on-device decimation
+ *
+ * Accepts {"factor": n, "mode": "filter" | "peak" | "hires"}, both optional,
+ * with n from 1 to DECIMATION_MAX_FACTOR. The ADC keeps sampling at its
+ * hardware rate and the next frames carry one filtered sample ("filter"), a
+ * min/max pair ("peak") or a wider boxcar mean ("hires") per n samples, so
+ * the timebase changes without reconfiguring the SPI device. Selecting
+ * "hires" switches the ADC to its fastest rate first.
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t decimation_handler(httpd_req_t *req);
+
+/**
+ * @brief Handler to set waveform averaging for single mode
+ *
+ * Accepts {"mode": "off" | "block" | "exponential", "frames": n}, with n from
+ * 2 to AVERAGING_MAX_FRAMES. Trigger-aligned windows are accumulated on the
+ * device and only every n-th window sends the average.
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t averaging_handler(httpd_req_t *req);
+
+/**
+ * @brief Handler to set up segmented capture for single mode
+ *
+ * Accepts {"count": k, "samples": n}. Each batch collects k trigger-aligned
+ * segments of n samples and is sent as one frame; {"count": 0} turns
+ * segmented capture off. k * n is limited to SEGMENT_MAX_STORE_SAMPLES.
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t segments_handler(httpd_req_t *req);
+
+/**
+ * @brief Handler to arm or free the PSRAM deep record
+ *
+ * Accepts {"samples": n}. A non-zero n allocates a record of n samples in
+ * PSRAM that fills with the next captured frames; 0 frees it. Responds with
+ * the record status like record_status_handler().
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t record_handler(httpd_req_t *req);
+
+/**
+ * @brief Handler to report the state and fill level of the deep record
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t record_status_handler(httpd_req_t *req);
+
+/**
+ * @brief Handler to read samples from a finished deep record
+ *
+ * Accepts {"start": s, "count": n, "step": k}, all optional. Responds with
+ * raw ADC words in the byte order of the data socket's raw16 format: n
+ * samples from s for k = 1, or a min/max word pair per k samples for an
+ * overview. {"frames": true} responds with the record_frame_entry_t of
+ * every frame instead.
+ *
+ * @param req HTTP request structure
+ * @return ESP_OK on success, error code otherwise
+ */
+esp_err_t record_data_handler(httpd_req_t *req);
+
 /**
  * @brief Handler to reset data socket
  *
@@ -4,7 +4,16 @@
  */
 
 #include "acquisition.h"
+#include <esp_timer.h>
+#include <math.h>
 #include "globals.h"
+#include "spi_timing.h"
+#include "stats.h"
+#ifdef USE_EXTERNAL_ADC
+#include <esp_rom_gpio.h>
+#include <soc/soc_caps.h>
+#include <soc/spi_periph.h>
+#endif
 
 static const char *TAG = "ACQUISITION";
 
@@ -13,14 +22,12 @@ adc_continuous_handle_t adc_handle;
 atomic_int adc_modify_freq = 0;
 atomic_int adc_divider = 1;
 int read_miss_count = 0;
-int wait_convertion_time = WAIT_ADC_CONV_TIME;
 spi_device_handle_t spi;
 mcpwm_timer_handle_t timer = NULL;
 mcpwm_oper_handle_t oper = NULL;
 mcpwm_cmpr_handle_t comparator = NULL;
 mcpwm_gen_handle_t generator = NULL;
 const uint32_t spi_matrix[MATRIX_SPI_ROWS][MATRIX_SPI_COLS] = MATRIX_SPI_FREQ;
-int spi_index = 0;
 ledc_channel_config_t ledc_channel;
 uint64_t wait_time_us;
 pcnt_unit_handle_t pcnt_unit;
@@ -30,6 +37,11 @@ pcnt_channel_handle_t pcnt_chan;
 atomic_bool adc_is_running = ATOMIC_VAR_INIT(false);
 #endif
 
+/**
+ * @brief Frame length selected for the next data connection, 0 for the longest frame
+ */
+static atomic_int frame_samples = ATOMIC_VAR_INIT(0);
+
 static const voltage_scale_t voltage_scales[] = {
     {400.0, "200V, -200V"}, {120.0, "60V, -60V"}, {24.0, "12V, -12V"}, {6.0, "3V, -3V"}, {1.0, "500mV, -500mV"}};
 
@@ -45,6 +57,151 @@ const voltage_scale_t *get_voltage_scales(void)
 
 #ifdef USE_EXTERNAL_ADC
 SemaphoreHandle_t spi_mutex = NULL;
+atomic_int spi_reconfig_requested = ATOMIC_VAR_INIT(0);
+
+#define SPI_DEVICE_SLOTS (SOC_SPI_MAX_CS_NUM < MATRIX_SPI_ROWS ? SOC_SPI_MAX_CS_NUM : MATRIX_SPI_ROWS)
+
+/**
+ * @brief Dividers registered as SPI devices, indexed by CS slot
+ *
+ * Switching between registered dividers only swaps the handle. The driver
+ * gives every device a CS signal of its own and the host has
+ * SOC_SPI_MAX_CS_NUM of them, so a divider that is not registered replaces
+ * the one farthest from it once it is selected.
+ */
+static spi_device_handle_t spi_devices[SPI_DEVICE_SLOTS];
+static uint32_t spi_device_dividers[SPI_DEVICE_SLOTS];
+
+/**
+ * @brief Divider selected for the external ADC, see spi_timing.h
+ */
+static atomic_uint selected_divider = ATOMIC_VAR_INIT(SPI_TIMING_MIN_DIVIDER);
+
+/**
+ * @brief Divider the SPI device and the MCPWM run at, lags selected_divider until a switch is applied
+ */
+static atomic_uint active_divider = ATOMIC_VAR_INIT(SPI_TIMING_MIN_DIVIDER);
+
+/**
+ * @brief When the pending rate change was requested
+ */
+static atomic_llong switch_requested_us = ATOMIC_VAR_INIT(0);
+
+/**
+ * @brief Register the device of a divider in a free slot
+ *
+ * The driver takes the lowest free CS signal, so slots must be filled in
+ * order for the slot index to match the CS signal.
+ */
+static esp_err_t spi_register_divider(int slot, uint32_t divider)
+{
+    spi_timing_t timing;
+    spi_timing_for_divider(divider, &timing);
+
+    spi_device_interface_config_t devcfg = {.clock_speed_hz = timing.spi_clock_hz,
+                                            .mode = 0, // SPI mode 0
+                                            .spics_io_num = PIN_NUM_CS, // CS pin
+                                            .queue_size = 7, // Transaction queue size
+                                            .pre_cb = NULL, // No pre-transaction callback
+                                            .post_cb = NULL, // No post-transaction callback
+                                            .flags = SPI_DEVICE_HALFDUPLEX | SPI_DEVICE_NO_DUMMY,
+                                            .cs_ena_pretrans = timing.cs_ena_pretrans,
+                                            .input_delay_ns = timing.input_delay_ns};
+
+    esp_err_t ret = spi_bus_add_device(HSPI_HOST, &devcfg, &spi_devices[slot]);
+    spi_device_dividers[slot] = ret == ESP_OK ? divider : 0;
+    return ret;
+}
+
+/**
+ * @brief Hand the CS pin to the device of a slot
+ *
+ * Every device drives the same pin and the one added last has taken it over.
+ */
+static void spi_route_cs(int slot)
+{
+    esp_rom_gpio_connect_out_signal(PIN_NUM_CS, spi_periph_signal[HSPI_HOST].spics_out[slot], false, false);
+}
+
+/**
+ * @brief Pick the slot of a divider, registering it if needed
+ *
+ * @return Slot, -1 if the divider could not be registered
+ */
+static int spi_slot_for_divider(uint32_t divider)
+{
+    uint32_t active = atomic_load(&active_divider);
+    int victim = -1;
+
+    for (int slot = 0; slot < SPI_DEVICE_SLOTS; slot++) {
+        if (spi_device_dividers[slot] == divider) {
+            return slot;
+        }
+        // Rate changes mostly step to a neighbouring rate, so the farthest one is needed last
+        if (spi_device_dividers[slot] != active &&
+            (victim < 0 || fabs(log((double)spi_device_dividers[slot] / divider)) >
+                               fabs(log((double)spi_device_dividers[victim] / divider)))) {
+            victim = slot;
+        }
+    }
+
+    if (victim < 0 || spi_bus_remove_device(spi_devices[victim]) != ESP_OK ||
+        spi_register_divider(victim, divider) != ESP_OK) {
+        ESP_LOGE(TAG, "No SPI device slot for divider %lu", divider);
+        return -1;
+    }
+    return victim;
+}
+
+void spi_switch_timing(void)
+{
+    // The MCPWM period and compare value both latch at the next timer zero, so no trigger pulse mixes the timings
+    atomic_store(&spi_reconfig_requested, 0); // A request arriving from here on switches again
+    uint32_t divider = atomic_load(&selected_divider);
+    if (divider == atomic_load(&active_divider)) {
+        return;
+    }
+
+    int slot = spi_slot_for_divider(divider);
+    if (slot < 0) {
+        return;
+    }
+
+    spi_timing_t timing;
+    spi_timing_for_divider(divider, &timing);
+    spi = spi_devices[slot];
+    spi_route_cs(slot);
+    ESP_ERROR_CHECK(mcpwm_timer_set_period(timer, timing.period_ticks));
+    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(comparator, timing.compare_ticks));
+    atomic_store(&active_divider, divider);
+
+    int64_t latency_us = esp_timer_get_time() - atomic_load(&switch_requested_us);
+    atomic_store_explicit(&acquisition_stats.rate_switch_us, (uint32_t)latency_us, memory_order_relaxed);
+    STATS_ADD(rate_switches, 1);
+    ESP_LOGI(TAG, "Sample rate switched to %.3f Hz in %lld us", spi_timing_rate(divider), latency_us);
+}
+
+/**
+ * @brief Request a switch of the SPI device and the MCPWM timing to selected_divider
+ *
+ * Never blocks. While nothing is capturing the switch is made right away.
+ * Otherwise the capture pipeline stops queueing, and switches at the frame
+ * boundary after the captures already queued, which still run at the old
+ * rate.
+ */
+static void request_spi_switch(void)
+{
+    atomic_store(&switch_requested_us, esp_timer_get_time());
+    atomic_store(&spi_reconfig_requested, 1);
+
+    // Nothing is capturing: switch right away, otherwise the pipeline switches once its queue has run empty
+    if (xSemaphoreTake(spi_mutex, 0) == pdTRUE) {
+        if (atomic_load(&spi_reconfig_requested)) {
+            spi_switch_timing();
+        }
+        xSemaphoreGive(spi_mutex);
+    }
+}
 
 void spi_master_init(void)
 {
@@ -74,26 +231,23 @@ void spi_master_init(void)
     ret = spi_bus_initialize(HSPI_HOST, &buscfg, 3);
     ESP_ERROR_CHECK(ret);
 
-    // Configure the SPI device
-    spi_device_interface_config_t devcfg = {.clock_speed_hz = spi_matrix[0][0], // Initial SPI clock speed
-                                            .mode = 0, // SPI mode 0
-                                            .spics_io_num = PIN_NUM_CS, // CS pin
-                                            .queue_size = 7, // Transaction queue size
-                                            .pre_cb = NULL, // No pre-transaction callback
-                                            .post_cb = NULL, // No post-transaction callback
-                                            .flags = SPI_DEVICE_HALFDUPLEX | SPI_DEVICE_NO_DUMMY,
-                                            .cs_ena_pretrans = spi_matrix[0][1],
-                                            .input_delay_ns = spi_matrix[0][2]};
-
-    // Add the SPI device to the bus
-    ret = spi_bus_add_device(HSPI_HOST, &devcfg, &spi);
-    ESP_ERROR_CHECK(ret);
+    // Register the fastest calibration rows up front, capture starts on the first one
+    for (int slot = 0; slot < SPI_DEVICE_SLOTS; slot++) {
+        ESP_ERROR_CHECK(spi_register_divider(slot, spi_timing_row_divider(slot)));
+    }
+    spi = spi_devices[0];
+    spi_route_cs(0);
 
     ESP_LOGI(TAG, "SPI Master initialized");
     spi_device_get_actual_freq(spi, &freq);
     ESP_LOGI(TAG, "Actual SPI frequency: %d Hz", freq);
 }
 
+uint32_t spi_active_divider(void)
+{
+    return atomic_load(&active_divider);
+}
+
 void init_mcpwm_trigger(void)
 {
     // Configure the sync pin as input
@@ -104,13 +258,17 @@ void init_mcpwm_trigger(void)
                              .intr_type = GPIO_INTR_DISABLE};
     ESP_ERROR_CHECK(gpio_config(&io_conf));
 
+    spi_timing_t timing;
+    spi_timing_for_divider(atomic_load(&active_divider), &timing);
+
     // Configure the MCPWM timer
     mcpwm_timer_config_t timer_config = {
         .group_id = 0,
         .clk_src = MCPWM_TIMER_CLK_SRC_DEFAULT,
-        .resolution_hz = MCPWM_FREQ_HZ * 32,
+        .resolution_hz = SPI_TIMING_BASE_HZ,
         .count_mode = MCPWM_TIMER_COUNT_MODE_UP,
-        .period_ticks = spi_matrix[0][3],
+        .period_ticks = timing.period_ticks,
+        .flags.update_period_on_empty = true, // Latches together with the compare value on a rate change
     };
     ESP_ERROR_CHECK(mcpwm_new_timer(&timer_config, &timer));
 
@@ -160,7 +318,7 @@ void init_mcpwm_trigger(void)
         generator, MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, comparator, MCPWM_GEN_ACTION_HIGH)));
 
     // Configure the compare value
-    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(comparator, (uint32_t)(spi_matrix[0][4])));
+    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(comparator, timing.compare_ticks));
     ESP_ERROR_CHECK(mcpwm_generator_set_force_level(generator, -1, true));
     ESP_ERROR_CHECK(mcpwm_timer_enable(timer));
     ESP_ERROR_CHECK(mcpwm_timer_start_stop(timer, MCPWM_TIMER_START_NO_STOP));
@@ -206,104 +364,121 @@ esp_err_t init_pulse_counter(void)
 
 atomic_bool adc_initializing = ATOMIC_VAR_INIT(false);
 
-void start_adc_sampling(void)
-{
-    ESP_LOGI(TAG, "Starting ADC sampling");
-
-    // Check if ADC is already running or initializing
-    if (atomic_load(&adc_is_running)) {
-        ESP_LOGW(TAG, "ADC already running, not starting again");
-        return;
-    }
+/**
+ * @brief Converted bytes in the driver pool that have not been read yet
+ */
+static atomic_uint adc_pool_bytes = ATOMIC_VAR_INIT(0);
 
-    if (atomic_exchange(&adc_initializing, true)) {
-        ESP_LOGW(TAG, "ADC initialization already in progress");
-        return;
-    }
+/**
+ * @brief Task notified whenever conversions arrive, the one last calling adc_read_frame()
+ */
+static TaskHandle_t adc_reader = NULL;
 
-    ESP_LOGI(TAG, "Initializing new ADC instance...");
+/**
+ * @brief Driver callback run from the DMA interrupt once a conversion frame is done
+ */
+static bool adc_conv_done(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *edata, void *user_data)
+{
+    BaseType_t woken = pdFALSE;
 
-    // Make sure we're working with a clean state
-    adc_handle = NULL;
+    atomic_fetch_add_explicit(&adc_pool_bytes, edata->size, memory_order_relaxed);
+    if (adc_reader != NULL) {
+        vTaskNotifyGiveFromISR(adc_reader, &woken);
+    }
+    return woken == pdTRUE;
+}
 
-    // Add memory cleanup delay
-    vTaskDelay(pdMS_TO_TICKS(100));
+/**
+ * @brief Driver callback run from the DMA interrupt when the frame just counted did not fit the pool
+ */
+static bool adc_pool_ovf(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *edata, void *user_data)
+{
+    atomic_fetch_sub_explicit(&adc_pool_bytes, ADC_CONV_FRAME_SIZE, memory_order_relaxed);
+    STATS_ADD(adc_pool_overflows, 1);
+    return false;
+}
 
-    // Configure ADC pattern
+/**
+ * @brief Apply the sample rate of adc_divider to the stopped driver
+ */
+static esp_err_t adc_apply_config(void)
+{
     adc_digi_pattern_config_t adc_pattern = {
         .atten = ADC_ATTEN_DB_12, .channel = ADC_CHANNEL, .bit_width = ADC_BITWIDTH};
 
-    // Configure continuous ADC
-    adc_continuous_handle_cfg_t adc_config = {
-        .max_store_buf_size = BUF_SIZE * 2,
-        .conv_frame_size = 128,
-        .flags.flush_pool = false, // Important: flush the pool to clear memory
-    };
+    adc_continuous_config_t continuous_config = {.pattern_num = 1,
+                                                 .adc_pattern = &adc_pattern,
+                                                 .sample_freq_hz = SAMPLE_RATE_HZ / adc_divider,
+                                                 .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+                                                 .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1};
 
-    // Try initialization with retries
-    esp_err_t ret = ESP_FAIL;
-    int retry_count = 0;
-    const int max_retries = 5;
+    esp_err_t ret = adc_continuous_config(adc_handle, &continuous_config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure ADC: %s", esp_err_to_name(ret));
+        return ret;
+    }
 
-    while (retry_count < max_retries) {
-        ret = adc_continuous_new_handle(&adc_config, &adc_handle);
+    return ESP_OK;
+}
 
-        if (ret == ESP_OK) {
-            ESP_LOGI(TAG, "ADC handle created successfully");
-            break;
-        }
+esp_err_t adc_sampling_init(void)
+{
+    if (adc_handle != NULL) {
+        return ESP_OK;
+    }
 
-        ESP_LOGW(TAG, "ADC initialization attempt %d failed: %s", retry_count + 1, esp_err_to_name(ret));
+    // The driver's DMA pool is allocated here once and kept, so rate changes never need the heap
+    adc_continuous_handle_cfg_t adc_config = {
+        .max_store_buf_size = BUF_SIZE * 2,
+        .conv_frame_size = ADC_CONV_FRAME_SIZE,
+        .flags.flush_pool = false,
+    };
 
-        // After failure, add longer delay and try again
-        vTaskDelay(pdMS_TO_TICKS(300));
-        retry_count++;
+    esp_err_t ret = adc_continuous_new_handle(&adc_config, &adc_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create ADC handle: %s", esp_err_to_name(ret));
+        adc_handle = NULL;
+        return ret;
     }
 
+    // Callbacks can only be registered while the driver is stopped, and the handle is never deleted
+    adc_continuous_evt_cbs_t callbacks = {
+        .on_conv_done = adc_conv_done,
+        .on_pool_ovf = adc_pool_ovf,
+    };
+    ret = adc_continuous_register_event_callbacks(adc_handle, &callbacks, NULL);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to create ADC handle after %d attempts", max_retries);
-        atomic_store(&adc_initializing, false);
-        return;
+        ESP_LOGE(TAG, "Failed to register ADC callbacks: %s", esp_err_to_name(ret));
+        return ret;
     }
 
-    // Delay after handle creation
-    vTaskDelay(pdMS_TO_TICKS(100));
+    ESP_LOGI(TAG, "ADC handle created with a %d-byte pool", BUF_SIZE * 2);
+    return ESP_OK;
+}
 
-    // Configure ADC
-    adc_continuous_config_t continuous_config = {.pattern_num = 1,
-                                                 .adc_pattern = &adc_pattern,
-                                                 .sample_freq_hz = SAMPLE_RATE_HZ / adc_divider,
-                                                 .conv_mode = ADC_CONV_SINGLE_UNIT_1,
-                                                 .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1};
+void start_adc_sampling(void)
+{
+    ESP_LOGI(TAG, "Starting ADC sampling");
 
-    ret = adc_continuous_config(adc_handle, &continuous_config);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to configure ADC: %s", esp_err_to_name(ret));
+    // Check if ADC is already running or initializing
+    if (atomic_load(&adc_is_running)) {
+        ESP_LOGW(TAG, "ADC already running, not starting again");
+        return;
+    }
 
-        // Safe cleanup on failure
-        if (adc_handle) {
-            adc_continuous_deinit(adc_handle);
-            adc_handle = NULL;
-        }
+    if (atomic_exchange(&adc_initializing, true)) {
+        ESP_LOGW(TAG, "ADC initialization already in progress");
+        return;
+    }
 
+    if (adc_sampling_init() != ESP_OK || adc_apply_config() != ESP_OK) {
         atomic_store(&adc_initializing, false);
         return;
     }
 
-    // Delay after configuration
-    vTaskDelay(pdMS_TO_TICKS(100));
-
-    // Start ADC
-    ret = adc_continuous_start(adc_handle);
+    esp_err_t ret = adc_continuous_start(adc_handle);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to start ADC: %s", esp_err_to_name(ret));
-
-        // Safe cleanup on failure
-        if (adc_handle) {
-            adc_continuous_deinit(adc_handle);
-            adc_handle = NULL;
-        }
-
         atomic_store(&adc_initializing, false);
         return;
     }
@@ -327,128 +502,66 @@ void stop_adc_sampling(void)
     // Set the running flag to false BEFORE we stop
     atomic_store(&adc_is_running, false);
 
-    // Add safety delay
-    vTaskDelay(pdMS_TO_TICKS(50));
-
-    // Check if we have a valid handle before proceeding
-    if (adc_handle == NULL) {
-        ESP_LOGW(TAG, "ADC handle is NULL, nothing to stop");
-        return;
-    }
-
-    // Stop ADC
-    ESP_LOGI(TAG, "Stopping ADC operation");
+    // The handle and its pool stay allocated for the next start
     esp_err_t ret = adc_continuous_stop(adc_handle);
     if (ret != ESP_OK) {
         ESP_LOGW(TAG, "Failed to stop ADC: %s", esp_err_to_name(ret));
     }
 
-    // Add significant delay before deinitializing
-    vTaskDelay(pdMS_TO_TICKS(200));
-
-    // Deinitialize ADC
-    ESP_LOGI(TAG, "Deinitializing ADC");
-    ret = adc_continuous_deinit(adc_handle);
-    if (ret != ESP_OK) {
-        ESP_LOGW(TAG, "Failed to deinitialize ADC: %s", esp_err_to_name(ret));
-    }
-
-    // Clear handle to ensure it's not reused
-    adc_handle = NULL;
-
-    // Add extra delay after deinitialization
-    vTaskDelay(pdMS_TO_TICKS(300));
+    // Conversions left in the pool belong to the stopped capture
+    adc_continuous_flush_pool(adc_handle);
+    atomic_store(&adc_pool_bytes, 0);
 
-    ESP_LOGI(TAG, "ADC stopped and deinitialized");
+    ESP_LOGI(TAG, "ADC stopped");
 }
+
 void config_adc_sampling(void)
 {
+    int64_t start_us = esp_timer_get_time();
     ESP_LOGI(TAG, "Reconfiguring ADC with new frequency: %d Hz", SAMPLE_RATE_HZ / adc_divider);
 
-    // First make sure ADC is fully stopped
+    // Only the rate changes: stop, configure and start the same handle
     if (atomic_load(&adc_is_running)) {
         stop_adc_sampling();
-        ESP_LOGI(TAG, "Stopped ADC");
     }
-
-    // Add significant delay to ensure memory is properly freed
-    vTaskDelay(pdMS_TO_TICKS(300));
-
-    // Make sure we're not in an initializing state
     atomic_store(&adc_initializing, false);
+    start_adc_sampling();
 
-    // Try multiple times to allocate memory for the ADC handle
-    esp_err_t ret = ESP_ERR_NO_MEM;
-    int retry_count = 0;
-    const int max_retries = 5;
-
-    while (ret == ESP_ERR_NO_MEM && retry_count < max_retries) {
-        // Add a delay between attempts
-        if (retry_count > 0) {
-            vTaskDelay(pdMS_TO_TICKS(200));
-        }
-
-        // Configuration of the continuous ADC handle
-        adc_continuous_handle_cfg_t adc_config = {
-            .max_store_buf_size = BUF_SIZE * 2,
-            .conv_frame_size = 128,
-            .flags.flush_pool = false,
-        };
-
-        ret = adc_continuous_new_handle(&adc_config, &adc_handle);
-
-        if (ret == ESP_ERR_NO_MEM) {
-            ESP_LOGW(TAG, "Memory allocation failed, retrying... (%d/%d)", retry_count + 1, max_retries);
-            retry_count++;
-        }
-    }
-
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to create ADC handle after %d attempts: %s", retry_count, esp_err_to_name(ret));
-        return;
+    if (atomic_load(&adc_is_running)) {
+        int64_t latency_us = esp_timer_get_time() - start_us;
+        atomic_store_explicit(&acquisition_stats.rate_switch_us, (uint32_t)latency_us, memory_order_relaxed);
+        STATS_ADD(rate_switches, 1);
+        ESP_LOGI(TAG, "ADC reconfigured in %lld us", latency_us);
     }
+}
 
-    // Short delay after handle creation
-    vTaskDelay(pdMS_TO_TICKS(20));
-
-    // Configure the ADC sampling pattern
-    adc_digi_pattern_config_t adc_pattern = {
-        .atten = ADC_ATTEN_DB_12, .channel = ADC_CHANNEL, .bit_width = ADC_BITWIDTH};
+esp_err_t adc_read_frame(uint8_t *buffer, uint32_t len, uint32_t *bytes_read, TickType_t timeout)
+{
+    TimeOut_t time_out;
 
-    // Continuous ADC configuration with adjusted frequency
-    adc_continuous_config_t continuous_config = {.pattern_num = 1,
-                                                 .adc_pattern = &adc_pattern,
-                                                 .sample_freq_hz = SAMPLE_RATE_HZ / adc_divider,
-                                                 .conv_mode = ADC_CONV_SINGLE_UNIT_1,
-                                                 .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1};
+    *bytes_read = 0;
+    adc_reader = xTaskGetCurrentTaskHandle();
+    vTaskSetTimeOutState(&time_out);
 
-    ret = adc_continuous_config(adc_handle, &continuous_config);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to configure ADC: %s", esp_err_to_name(ret));
-        adc_continuous_deinit(adc_handle);
-        return;
+    // The count is raised before the notification, so a notification taken for another reason only costs a recheck
+    while (atomic_load(&adc_pool_bytes) < len) {
+        if (xTaskCheckForTimeOut(&time_out, &timeout) == pdTRUE) {
+            return ESP_ERR_TIMEOUT;
+        }
+        ulTaskNotifyTake(pdTRUE, timeout);
     }
 
-    ESP_LOGI(TAG, "Configured ADC");
-
-    // Update the wait time for conversion
-    wait_convertion_time = WAIT_ADC_CONV_TIME * adc_divider;
-
-    // Short delay before starting
-    vTaskDelay(pdMS_TO_TICKS(20));
-
-    // Start the ADC again
-    ret = adc_continuous_start(adc_handle);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to start ADC: %s", esp_err_to_name(ret));
-        adc_continuous_deinit(adc_handle);
-        return;
+    // A read stops at the end of the pool's ring buffer, the rest of the frame is at its start
+    while (*bytes_read < len) {
+        uint32_t chunk = 0;
+        esp_err_t ret = adc_continuous_read(adc_handle, buffer + *bytes_read, len - *bytes_read, &chunk, 0);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        atomic_fetch_sub(&adc_pool_bytes, chunk);
+        *bytes_read += chunk;
     }
-
-    // Set ADC as running
-    atomic_store(&adc_is_running, true);
-
-    ESP_LOGI(TAG, "Started ADC");
+    return ESP_OK;
 }
 #endif
 
@@ -467,6 +580,15 @@ void configure_gpio(void)
     ESP_LOGI(TAG, "GPIO %d configured as input for trigger detection", SINGLE_INPUT_PIN);
 }
 
+/**
+ * @brief Time one frame of the selected length takes to capture, in microseconds
+ */
+static uint64_t frame_wait_time_us(void)
+{
+    double sampling_frequency = get_sampling_frequency();
+    return (get_frame_capture_len(get_frame_samples()) / sampling_frequency) * 1000000;
+}
+
 void my_timer_init(void)
 {
     // Timer configuration
@@ -479,9 +601,7 @@ void my_timer_init(void)
     };
     timer_init(TIMER_GROUP_0, TIMER_0, &config);
 
-    // Calculate the wait time in microseconds
-    double sampling_frequency = get_sampling_frequency();
-    wait_time_us = (BUF_SIZE / sampling_frequency) * 1000000;
+    wait_time_us = frame_wait_time_us();
 
     timer_set_counter_value(TIMER_GROUP_0, TIMER_0, wait_time_us);
 
@@ -620,6 +740,79 @@ double get_sampling_frequency(void)
 #endif
 }
 
+double get_exact_sample_rate(void)
+{
+#ifdef USE_EXTERNAL_ADC
+    return spi_timing_rate(atomic_load(&selected_divider));
+#else
+    return get_sampling_frequency() / adc_divider;
+#endif
+}
+
+uint32_t get_current_sample_rate(void)
+{
+    return lround(get_exact_sample_rate());
+}
+
+int get_rate_index(void)
+{
+#ifdef USE_EXTERNAL_ADC
+    return spi_timing_row(atomic_load(&selected_divider));
+#else
+    return adc_divider;
+#endif
+}
+
+esp_err_t sample_rate_step(int step)
+{
+#ifdef USE_EXTERNAL_ADC
+    // Step to the next calibration row faster or slower than the current rate, lower rows are faster
+    uint32_t divider = atomic_load(&selected_divider);
+    int row = step > 0 ? MATRIX_SPI_ROWS - 1 : 0;
+    while (row >= 0 && row < MATRIX_SPI_ROWS &&
+           !(step > 0 ? spi_timing_row_divider(row) < divider : spi_timing_row_divider(row) > divider)) {
+        row += step > 0 ? -1 : 1;
+    }
+    if (step == 0 || row < 0 || row >= MATRIX_SPI_ROWS) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    atomic_store(&selected_divider, spi_timing_row_divider(row));
+    ESP_LOGI(TAG, "spi row: %d", row);
+    request_spi_switch();
+#else
+    int divider = step > 0 ? adc_divider / 2 : adc_divider * 2;
+    if (step == 0 || divider < 1 || divider > 16) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    adc_divider = divider;
+    adc_modify_freq = 1;
+#endif
+    return ESP_OK;
+}
+
+esp_err_t sample_rate_set(double rate_hz, double *achieved_hz)
+{
+#ifdef USE_EXTERNAL_ADC
+    if (!(rate_hz > 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t divider = spi_timing_divider_for_rate(rate_hz);
+    atomic_store(&selected_divider, divider);
+    ESP_LOGI(TAG, "Sample rate %.3f Hz requested, divider %lu gives %.3f Hz", rate_hz, divider,
+             spi_timing_rate(divider));
+    request_spi_switch();
+    if (achieved_hz != NULL) {
+        *achieved_hz = spi_timing_rate(divider);
+    }
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
 int dividing_factor(void)
 {
 #ifdef USE_EXTERNAL_ADC
@@ -677,8 +870,34 @@ int get_discard_trailer(void)
 
 int get_samples_per_packet(void)
 {
-    int total_samples = BUF_SIZE; // Number of samples per send call
-    return total_samples - get_discard_head() - get_discard_trailer();
+    return get_frame_samples() * 2; // Payload bytes per send call
+}
+
+esp_err_t set_frame_samples(int samples)
+{
+    if (samples != 0 && (samples < FRAME_MIN_SAMPLES || samples > get_max_frame_samples())) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    atomic_store(&frame_samples, samples);
+    wait_time_us = frame_wait_time_us();
+    return ESP_OK;
+}
+
+int get_frame_samples(void)
+{
+    int samples = atomic_load(&frame_samples);
+    return samples > 0 ? samples : get_max_frame_samples();
+}
+
+int get_max_frame_samples(void)
+{
+    return (BUF_SIZE - get_discard_head() - get_discard_trailer()) / 2;
+}
+
+size_t get_frame_capture_len(int samples)
+{
+    return get_discard_head() + (size_t)samples * 2 + get_discard_trailer();
 }
 
 int get_max_bits(void)
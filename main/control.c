@@ -0,0 +1,177 @@
+/**
+ * @file control.c
+ * @brief Implementation of the binary control protocol requests
+ */
+
+#include "control.h"
+#include <esp_log.h>
+#include <string.h>
+#include "acquisition.h"
+#include "data_transmission.h"
+#include "globals.h"
+#include "trigger.h"
+
+static const char *TAG = "CONTROL";
+
+/**
+ * @brief Minimum payload length of every opcode
+ */
+static const uint16_t request_len[CONTROL_OPCODE_COUNT] = {
+    [CONTROL_HELLO] = sizeof(control_hello_t),
+    [CONTROL_PING] = 0,
+    [CONTROL_SET_TRIGGER] = sizeof(control_trigger_t),
+    [CONTROL_SET_MODE] = 1,
+    [CONTROL_SET_RATE] = 1,
+    [CONTROL_SET_RATE_HZ] = sizeof(control_rate_hz_t),
+};
+
+/**
+ * @brief Opcodes reported by CONTROL_HELLO, bit n for opcode n
+ */
+#ifdef USE_EXTERNAL_ADC
+#define SUPPORTED_OPCODES (((1u << CONTROL_OPCODE_COUNT) - 1) & ~1u)
+#else
+// The internal ADC only has its fixed divider steps
+#define SUPPORTED_OPCODES (((1u << CONTROL_OPCODE_COUNT) - 1) & ~1u & ~(1u << CONTROL_SET_RATE_HZ))
+#endif
+
+/**
+ * @brief Check that a CONTROL_KEEP-able percentage is in range
+ */
+static inline bool valid_percent(uint8_t value)
+{
+    return value == CONTROL_KEEP || value <= 100;
+}
+
+/**
+ * @brief Apply a CONTROL_SET_TRIGGER request and report the settings now in effect
+ */
+static control_status_t set_trigger(const control_trigger_t *request, control_trigger_reply_t *reply)
+{
+    // Validate everything first so a bad field leaves the trigger untouched
+    if ((request->edge != CONTROL_KEEP && request->edge > 1) ||
+        (request->type != CONTROL_KEEP && request->type >= TRIGGER_TYPE_COUNT) || !valid_percent(request->level) ||
+        !valid_percent(request->hysteresis) || !valid_percent(request->position)) {
+        return CONTROL_ERR_ARG;
+    }
+
+    if (request->edge != CONTROL_KEEP) {
+        set_trigger_edge(request->edge == 1);
+    }
+    if (request->type != CONTROL_KEEP) {
+        trigger_set_type((trigger_type_t)request->type);
+    }
+    if (request->hysteresis != CONTROL_KEEP) {
+        trigger_set_hysteresis(request->hysteresis);
+    }
+    if (request->position != CONTROL_KEEP) {
+        trigger_set_position(request->position);
+    }
+    if (request->level != CONTROL_KEEP) {
+        trigger_set_level(request->level);
+        if (mode == 1 && set_trigger_level(request->level) != ESP_OK) {
+            return CONTROL_ERR_FAILED;
+        }
+    }
+
+    trigger_config_t config;
+    trigger_get_config(&config);
+    reply->edge = config.rising;
+    reply->type = config.type;
+    reply->position = config.position;
+    reply->level = config.level;
+    reply->hysteresis = config.hysteresis;
+    return CONTROL_OK;
+}
+
+size_t control_execute(const control_header_t *request, const uint8_t *payload, uint8_t *reply)
+{
+    control_header_t *header = (control_header_t *)reply;
+    uint8_t *out = reply + sizeof(control_header_t);
+    size_t out_len = 0;
+    control_status_t status = CONTROL_OK;
+
+    if (request->opcode >= CONTROL_OPCODE_COUNT || !(SUPPORTED_OPCODES & (1u << request->opcode))) {
+        status = CONTROL_ERR_OPCODE;
+    } else if (request->payload_len < request_len[request->opcode]) {
+        status = CONTROL_ERR_LENGTH;
+    } else {
+        switch (request->opcode) {
+        case CONTROL_HELLO: {
+            control_hello_reply_t hello = {
+                .version = CONTROL_VERSION,
+                .max_payload = CONTROL_MAX_PAYLOAD,
+                .opcodes = SUPPORTED_OPCODES,
+            };
+            memcpy(out, &hello, sizeof(hello));
+            out_len = sizeof(hello);
+            break;
+        }
+        case CONTROL_PING:
+            memcpy(out, payload, request->payload_len);
+            out_len = request->payload_len;
+            break;
+        case CONTROL_SET_TRIGGER: {
+            control_trigger_t trigger;
+            control_trigger_reply_t applied = {0};
+            memcpy(&trigger, payload, sizeof(trigger));
+            status = set_trigger(&trigger, &applied);
+            if (status == CONTROL_OK) {
+                memcpy(out, &applied, sizeof(applied));
+                out_len = sizeof(applied);
+            }
+            break;
+        }
+        case CONTROL_SET_MODE:
+            if (payload[0] > 1) {
+                status = CONTROL_ERR_ARG;
+            } else if ((payload[0] == 1 ? set_single_trigger_mode() : set_continuous_mode()) != ESP_OK) {
+                status = CONTROL_ERR_FAILED;
+            } else {
+                out[0] = payload[0];
+                out_len = 1;
+            }
+            break;
+        case CONTROL_SET_RATE: {
+            int8_t step = (int8_t)payload[0];
+            if (step == 0) {
+                status = CONTROL_ERR_ARG;
+            } else if (sample_rate_step(step) != ESP_OK) {
+                status = CONTROL_ERR_LIMIT;
+            }
+            control_rate_reply_t rate = {
+                .sample_rate_hz = get_current_sample_rate(),
+                .rate_index = get_rate_index(),
+            };
+            memcpy(out, &rate, sizeof(rate));
+            out_len = sizeof(rate);
+            break;
+        }
+        case CONTROL_SET_RATE_HZ: {
+            control_rate_hz_t requested;
+            memcpy(&requested, payload, sizeof(requested));
+            if (sample_rate_set(requested.sample_rate_hz, NULL) != ESP_OK) {
+                status = CONTROL_ERR_ARG;
+            }
+            control_rate_reply_t rate = {
+                .sample_rate_hz = get_current_sample_rate(),
+                .rate_index = get_rate_index(),
+            };
+            memcpy(out, &rate, sizeof(rate));
+            out_len = sizeof(rate);
+            break;
+        }
+        }
+    }
+
+    if (status != CONTROL_OK) {
+        ESP_LOGW(TAG, "Request %u (opcode %u) failed with status %d", request->request_id, request->opcode, status);
+    }
+
+    header->magic = CONTROL_MAGIC;
+    header->opcode = request->opcode;
+    header->status = status;
+    header->request_id = request->request_id;
+    header->payload_len = out_len;
+    return sizeof(control_header_t) + out_len;
+}
@@ -4,17 +4,31 @@
  */
 
 #include "data_transmission.h"
+#include <esp_vfs_eventfd.h>
+#include <math.h>
 #include "acquisition.h"
+#include "control.h"
+#include "frame_header.h"
+#include "frame_pool.h"
+#include "frame_ring.h"
 #include "globals.h"
 #include "network.h"
+#include "record.h"
+#include "sample_format.h"
+#include "segments.h"
+#include "signal_processing.h"
+#include "spi_pipeline.h"
+#include "spi_timing.h"
+#include "stats.h"
+#include "trigger.h"
+#include "udp_stream.h"
+
+#ifndef CONFIG_LWIP_SO_LINGER
+#error "Data connections are aborted with SO_LINGER 0 before their frames are released, enable CONFIG_LWIP_SO_LINGER"
+#endif
 
 static const char *TAG = "DATA_TRANS";
 
-static uint8_t *pending_send_buffer = NULL;
-static size_t pending_send_size = 0;
-static size_t pending_send_offset = 0;
-static bool send_in_progress = false;
-
 /**
  * @brief Acquisition mode (0: continuous, 1: single trigger)
  */
@@ -42,323 +56,1829 @@ atomic_int wifi_operation_acknowledged = ATOMIC_VAR_INIT(0);
 
 #ifdef USE_EXTERNAL_ADC
 atomic_int socket_reset_requested = ATOMIC_VAR_INIT(0);
+
+/**
+ * @brief Capture pipeline owned by acquisition_task in external ADC mode
+ */
+static spi_pipeline_t capture_pipeline;
 #endif
+
+_Static_assert(FRAME_RING_CAPACITY >= FRAME_POOL_MAX_SLOTS + 1,
+               "frame ring must hold every frame buffer and the segment store");
+
+/**
+ * @brief Captured frames travelling from acquisition_task to socket_task
+ */
+static frame_ring_t ready_ring;
+
+/**
+ * @brief Sent frames travelling back from socket_task to acquisition_task
+ */
+static frame_ring_t free_ring;
+
+/**
+ * @brief Captured frame fanned out to the connected clients
+ *
+ * The frame goes back to acquisition_task once every client it was queued
+ * for has finished with it, so one capture feeds all clients without a copy.
+ */
+typedef struct {
+    frame_desc_t frame; /**< Frame as published by acquisition_task */
+    int refs; /**< Clients still writing the frame or waiting for its ACK, 0 when the slot is unused */
+} shared_frame_t;
+
+/**
+ * @brief Frames currently shared, at most one per frame buffer plus the segment store
+ */
+static shared_frame_t shared_frames[FRAME_RING_CAPACITY];
+
+#define CLIENT_QUEUE_DEPTH (FRAME_POOL_MAX_SLOTS + 1) /* Every frame buffer plus the segment store */
+#define WS_MAX_FRAME_HEADER 10 /* Unmasked WebSocket frame header with a 64-bit length */
+#define CONTROL_REPLY_QUEUE (4 * CONTROL_MAX_MESSAGE) /* Replies waiting for the end of the frame being written */
+
+_Static_assert(CONTROL_REPLY_QUEUE >= 2 + WS_MAX_CONTROL_PAYLOAD,
+               "the reply queue must hold the longest WebSocket PONG");
+
+/**
+ * @brief Data connection served by socket_task
+ *
+ * queue holds shared_frames indices, oldest first. The first `written`
+ * frames have been handed to lwIP with NETCONN_NOCOPY and wait for the
+ * client's ACK, or for a UDP client have been sent and are held for
+ * retransmission. The rest wait to be written. Each client writes at its own
+ * pace, so a slow client only ever delays its own frames.
+ */
+typedef struct {
+    int sock; /**< Connected socket, the shared UDP socket for UDP clients, -1 when the slot is unused */
+    httpd_handle_t server; /**< For WebSocket clients, the server owning the session socket */
+    data_transport_t transport; /**< How frames are sent to the client */
+    struct sockaddr_in peer; /**< Peer address, datagrams of UDP clients are sent to it */
+    char addr[16]; /**< Peer address */
+    uint16_t port; /**< Peer port */
+    drop_policy_t policy; /**< What to drop once the client holds its share of the frame buffers */
+    bool header; /**< Whether frames are sent with their frame_header_t */
+    uint8_t prefix[WS_MAX_FRAME_HEADER + sizeof(frame_header_t)]; /**< Copied bytes in front of queue[written] */
+    size_t prefix_len; /**< Bytes in prefix */
+    int queue[CLIENT_QUEUE_DEPTH]; /**< shared_frames indices, oldest first */
+    uint32_t end_seq[CLIENT_QUEUE_DEPTH]; /**< For written frames, TCP sequence number past their last byte */
+    int64_t sent_us[CLIENT_QUEUE_DEPTH]; /**< For written frames of a UDP client, when their last fragment was sent */
+    int count; /**< Frames in queue */
+    int written; /**< Leading frames in queue that are completely written */
+    size_t offset; /**< Bytes of queue[written] already written, header included */
+    int64_t last_heard_us; /**< When a UDP client last sent a datagram */
+    int64_t stall_start_us; /**< When the current write found the send buffer full, 0 if it did not */
+    bool blocked; /**< Whether the last write stopped short, socket_task then waits for the socket to drain */
+    uint32_t frames_sent; /**< Frames completely written to this client */
+    uint32_t frames_dropped; /**< Frames skipped for this client by its drop policy */
+    uint32_t retransmits; /**< Fragments sent again in answer to NACKs */
+    bool control; /**< Whether a TCP client negotiated the control protocol with CONTROL_HELLO */
+    uint8_t rx[CONTROL_MAX_MESSAGE]; /**< Control request being received */
+    size_t rx_len; /**< Bytes in rx */
+    uint8_t replies[CONTROL_REPLY_QUEUE]; /**< Control replies waiting for a frame boundary */
+    size_t replies_len; /**< Bytes in replies */
+    size_t replies_sent; /**< Leading bytes of replies already written */
+} data_client_t;
+
+static data_client_t clients[MAX_DATA_CLIENTS];
+static int client_count = 0;
+
+/**
+ * @brief UDP socket on the port number of the TCP data socket, -1 while there is none
+ */
+static int udp_sock = -1;
+
+/**
+ * @brief Event descriptor socket_task selects on together with its sockets, -1 before data_transmission_init()
+ */
+static int wake_fd = -1;
+
+#define WS_ADOPTED 0x40000000 /* socket_task streams to the session */
+#define WS_CLOSING 0x20000000 /* httpd is closing the session and waits for socket_task to let go */
+#define WS_RESERVED 0x10000000 /* The entry is being filled in by ws_client_open() */
+#define WS_FD_MASK 0x0FFFFFFF
+#define WS_CLOSE_TIMEOUT_MS 500 /* Longest time a closing session waits for socket_task */
+
+/**
+ * @brief WebSocket sessions handed over by the HTTP servers, -1 when unused
+ *
+ * Each entry holds the session socket plus WS_* state bits. httpd owns the
+ * socket and closes it, so its close callback waits until socket_task has
+ * let go of the session; otherwise the descriptor could be reused while
+ * frames are still being written to it.
+ */
+static atomic_int ws_sessions[MAX_DATA_CLIENTS] = {[0 ... MAX_DATA_CLIENTS - 1] = -1};
+static httpd_handle_t ws_servers[MAX_DATA_CLIENTS];
+
+/**
+ * @brief PONG owed to each entry of ws_sessions
+ *
+ * The server task fills in the payload and then sets pending; socket_task
+ * queues the PONG between two frames and clears pending, after which the
+ * server may fill in the next one.
+ */
+static struct {
+    atomic_bool pending;
+    uint8_t len;
+    uint8_t payload[WS_MAX_CONTROL_PAYLOAD];
+} ws_pongs[MAX_DATA_CLIENTS];
+
+/**
+ * @brief Drop policy given to the next accepted client
+ */
+static atomic_int drop_policy = ATOMIC_VAR_INIT(DROP_OLDEST);
+
+static const char *drop_policy_names[DROP_POLICY_COUNT] = {
+    [DROP_OLDEST] = "oldest",
+    [DROP_NEWEST] = "newest",
+};
+
+static const char *transport_names[] = {
+    [TRANSPORT_TCP] = "tcp",
+    [TRANSPORT_UDP] = "udp",
+    [TRANSPORT_WS] = "ws",
+};
+
+/**
+ * @brief Wire format shared by all clients, latched by socket_task when the first client connects
+ */
+static sample_format_t session_format = SAMPLE_FORMAT_RAW16;
+
+/**
+ * @brief Roll mode chunk selected for the next connection, 0 for full frames
+ */
+static atomic_int roll_chunk = ATOMIC_VAR_INIT(0);
+
+/**
+ * @brief Roll mode chunk of the current session, latched together with session_format
+ */
+static int session_roll = 0;
+
+/**
+ * @brief Frame length of the current session in samples, latched together with session_format
+ */
+static int session_frame_samples = 0;
+
+/**
+ * @brief Set by socket_task while it runs acquisition for a filling record without any client
+ */
+static bool record_capture = false;
+
+/**
+ * @brief Set by socket_task while the session settings above are latched for connected clients
+ */
+static atomic_bool session_active = ATOMIC_VAR_INIT(false);
+
+/**
+ * @brief Set by socket_task while at least one client is connected
+ */
+static atomic_bool acquisition_enabled = ATOMIC_VAR_INIT(false);
+
+/**
+ * @brief Cleared by acquisition_task once it has stopped and released its buffers
+ */
+static atomic_bool acquisition_running = ATOMIC_VAR_INIT(false);
+
+/**
+ * @brief Times the acquisition task found every pool buffer referenced, i.e. the pool ran dry
+ */
+atomic_uint frame_overruns = ATOMIC_VAR_INIT(0);
+
+/**
+ * @brief Times the sender found no captured frame waiting because acquisition was behind
+ */
+atomic_uint frame_underruns = ATOMIC_VAR_INIT(0);
+
+/**
+ * @brief Wake socket_task from its select()
+ *
+ * Safe from any task. Wakeups coalesce until socket_task reads the descriptor.
+ */
+static void wake_socket_task(void)
+{
+    uint64_t one = 1;
+    if (wake_fd >= 0) {
+        write(wake_fd, &one, sizeof(one));
+    }
+}
+
 esp_err_t data_transmission_init(void)
 {
     ESP_LOGI(TAG, "Initializing data transmission subsystem");
     read_miss_count = 0;
-    return ESP_OK;
+    ESP_ERROR_CHECK(stats_init());
+
+    // socket_task waits for its sockets and for new frames in one select()
+    esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_vfs_eventfd_register(&eventfd_config));
+    wake_fd = eventfd(0, 0);
+    if (wake_fd < 0) {
+        ESP_LOGE(TAG, "Unable to create the socket task event descriptor: errno %d", errno);
+        return ESP_FAIL;
+    }
+    frame_ring_init(&ready_ring);
+    frame_ring_init(&free_ring);
+#ifdef USE_EXTERNAL_ADC
+    return spi_pipeline_init(&capture_pipeline);
+#else
+    // The ADC driver copies its samples into the frame, so a board without enough internal RAM can use PSRAM
+    esp_err_t ret = frame_pool_init(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT, FRAME_POOL_PSRAM_CAPS);
+    if (ret == ESP_OK) {
+        frame_pool_carve(BUF_SIZE);
+    }
+    return ret;
+#endif
 }
 
-esp_err_t acquire_data(uint8_t *buffer, size_t buffer_size, uint32_t *bytes_read)
+/**
+ * @brief Drop a reference to a frame that was sent or will not be sent
+ *
+ * @param index Frame pool index, or SEGMENT_STORE_INDEX for a segment batch
+ */
+static void release_frame(int index)
 {
-    esp_err_t ret = ESP_OK;
-
+    if (index == SEGMENT_STORE_INDEX) {
+        segments_release();
+        return;
+    }
 #ifdef USE_EXTERNAL_ADC
-    // Configure SPI transaction
-    spi_transaction_t t;
-    memset(&t, 0, sizeof(t));
-    t.length = 0;
-    t.rxlength = buffer_size * 8; // in bitsº
-    t.rx_buffer = buffer;
-    t.flags = 0;
-
-    // Take semaphore for SPI access
-    if (xSemaphoreTake(spi_mutex, portMAX_DELAY) == pdTRUE) {
-        // Perform SPI transaction
-        ret = spi_device_polling_transmit(spi, &t);
-        xSemaphoreGive(spi_mutex);
-
-        if (ret == ESP_OK) {
-            *bytes_read = buffer_size;
+    spi_pipeline_release(&capture_pipeline, index);
+#else
+    frame_pool_release(index);
+#endif
+}
+
+/**
+ * @brief Count a failed ADC or SPI read and log it
+ */
+static void report_read_miss(void)
+{
+    read_miss_count++;
+    STATS_ADD(capture_failures, 1);
+    ESP_LOGW(TAG, "Missed ADC readings! Count: %d", read_miss_count);
+    if (read_miss_count >= 10) {
+        ESP_LOGE(TAG, "Critical ADC or SPI data loss detected.");
+        read_miss_count = 0;
+    }
+}
+
+/**
+ * @brief Sequence numbers of a TCP connection, read inside the lwIP thread
+ */
+typedef struct {
+    struct tcpip_api_call_data call; /**< Must be first, passed to tcpip_api_call */
+    struct netconn *conn; /**< Connection to inspect */
+    uint32_t lastack; /**< Highest sequence number acknowledged by the peer */
+    uint32_t snd_lbb; /**< Sequence number of the next byte to be buffered */
+} tcp_seq_query_t;
+
+/**
+ * @brief tcpip_api_call callback reading the sequence numbers of a connection
+ */
+static err_t read_tcp_seq(struct tcpip_api_call_data *call)
+{
+    tcp_seq_query_t *query = (tcp_seq_query_t *)call;
+    struct tcp_pcb *pcb = query->conn->pcb.tcp;
+
+    if (pcb == NULL) {
+        return ERR_CONN;
+    }
+
+    query->lastack = pcb->lastack;
+    query->snd_lbb = pcb->snd_lbb;
+    return ERR_OK;
+}
+
+/**
+ * @brief Get the lwIP connection behind a socket descriptor
+ */
+static struct netconn *socket_netconn(int sock)
+{
+    struct lwip_sock *lwip_sock = lwip_socket_dbg_get_socket(sock);
+    return lwip_sock != NULL ? lwip_sock->conn : NULL;
+}
+
+/**
+ * @brief Drop a client's reference to a shared frame
+ *
+ * The last reference returns the frame to acquisition_task.
+ *
+ * @param slot Index into shared_frames
+ */
+static void unref_shared_frame(int slot)
+{
+    if (--shared_frames[slot].refs == 0) {
+        frame_ring_push(&free_ring, &shared_frames[slot].frame);
+        xTaskNotifyGive(acquisition_task_handle);
+    }
+}
+
+/**
+ * @brief Give back a client's oldest written frames
+ *
+ * @param client Client to update
+ * @param released Number of leading written frames to give back
+ */
+static void release_written_frames(data_client_t *client, int released)
+{
+    if (released == 0) {
+        return;
+    }
+
+    for (int i = 0; i < released; i++) {
+        unref_shared_frame(client->queue[i]);
+    }
+    client->written -= released;
+    client->count -= released;
+    memmove(&client->queue[0], &client->queue[released], client->count * sizeof(client->queue[0]));
+    memmove(&client->end_seq[0], &client->end_seq[released], client->written * sizeof(client->end_seq[0]));
+    memmove(&client->sent_us[0], &client->sent_us[released], client->written * sizeof(client->sent_us[0]));
+}
+
+/**
+ * @brief Return every frame the client has acknowledged
+ *
+ * If the connection is gone lwIP has already dropped its references, so all
+ * written frames are returned. A UDP client's frames are returned once they
+ * are too old to be retransmitted.
+ *
+ * @param client Client to check
+ */
+static void release_acked_frames(data_client_t *client)
+{
+    if (client->written == 0) {
+        return;
+    }
+
+    int released = 0;
+    if (client->transport == TRANSPORT_UDP) {
+        int64_t expired_us = esp_timer_get_time() - UDP_RETRANSMIT_WINDOW_MS * 1000;
+        while (released < client->written && client->sent_us[released] < expired_us) {
+            released++;
+        }
+        release_written_frames(client, released);
+        return;
+    }
+
+    tcp_seq_query_t query = {.conn = socket_netconn(client->sock)};
+    bool connected = query.conn != NULL && tcpip_api_call(read_tcp_seq, &query.call) == ERR_OK;
+
+    while (released < client->written &&
+           (!connected || (int32_t)(query.lastack - client->end_seq[released]) >= 0)) {
+        released++;
+    }
+    release_written_frames(client, released);
+}
+
+/**
+ * @brief Send one fragment of a frame to a UDP client
+ *
+ * lwIP copies the datagram, so nothing stays referenced after the call.
+ *
+ * @param client UDP client
+ * @param frame Frame the fragment belongs to
+ * @param fragment Fragment index
+ * @param flags UDP_FRAGMENT_* bits
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if lwIP is out of buffers, ESP_ERR_INVALID_ARG
+ *         for a fragment past the end of the frame, ESP_FAIL on any other error
+ */
+static esp_err_t udp_send_fragment(data_client_t *client, const frame_desc_t *frame, int fragment, uint8_t flags)
+{
+    udp_fragment_header_t frag;
+    struct iovec iov[3];
+    int iovcnt = udp_fragment_iov(&frame->header, frame->data, frame->len, fragment, flags, &frag, iov);
+    if (iovcnt == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct msghdr msg = {
+        .msg_name = &client->peer,
+        .msg_namelen = sizeof(client->peer),
+        .msg_iov = iov,
+        .msg_iovlen = iovcnt,
+    };
+    if (sendmsg(client->sock, &msg, MSG_DONTWAIT) >= 0) {
+        return ESP_OK;
+    }
+    if (errno == ENOMEM || errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK) {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGE(TAG, "UDP send error to %s:%u: errno %d", client->addr, client->port, errno);
+    return ESP_FAIL;
+}
+
+/**
+ * @brief Send as many fragments of a UDP client's queued frames as lwIP takes
+ *
+ * Never blocks: once lwIP is out of buffers the call ends and the next one
+ * continues with the same fragment.
+ *
+ * @param client Client to write to
+ * @return ESP_OK on success, ESP_FAIL if sending failed
+ */
+static esp_err_t udp_client_write(data_client_t *client)
+{
+    client->blocked = false;
+    while (client->written < client->count) {
+        const frame_desc_t *frame = &shared_frames[client->queue[client->written]].frame;
+        size_t total = sizeof(frame->header) + frame->len;
+
+        while (client->offset < total) {
+            esp_err_t ret = udp_send_fragment(client, frame, client->offset / UDP_FRAGMENT_PAYLOAD, 0);
+            if (ret == ESP_ERR_NO_MEM) {
+                client->blocked = true;
+                if (client->stall_start_us == 0) {
+                    STATS_ADD(send_retries, 1);
+                    client->stall_start_us = esp_timer_get_time();
+                }
+                return ESP_OK;
+            }
+            if (ret != ESP_OK) {
+                return ESP_FAIL;
+            }
+            client->offset += total - client->offset < UDP_FRAGMENT_PAYLOAD ? total - client->offset
+                                                                             : UDP_FRAGMENT_PAYLOAD;
+        }
+
+        if (client->stall_start_us != 0) {
+            STATS_ADD(send_stall_us, esp_timer_get_time() - client->stall_start_us);
+            client->stall_start_us = 0;
+        }
+
+        client->sent_us[client->written++] = esp_timer_get_time();
+        client->offset = 0;
+        client->frames_sent++;
+        STATS_ADD(frames_sent, 1);
+        STATS_ADD(bytes_sent, total);
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Build the bytes a TCP or WebSocket client gets in front of a payload
+ *
+ * @param client Client the frame is written to
+ * @param frame Frame about to be written
+ * @return Bytes stored in client->prefix
+ */
+static size_t frame_prefix(data_client_t *client, const frame_desc_t *frame)
+{
+    size_t header_len = client->header ? sizeof(frame->header) : 0;
+    size_t len = 0;
+
+    if (client->transport == TRANSPORT_WS) {
+        // One binary message per frame, server frames are never masked
+        size_t message_len = header_len + frame->len;
+        client->prefix[len++] = 0x82; // FIN, binary
+        if (message_len < 126) {
+            client->prefix[len++] = message_len;
+        } else if (message_len <= UINT16_MAX) {
+            client->prefix[len++] = 126;
+            client->prefix[len++] = message_len >> 8;
+            client->prefix[len++] = message_len;
         } else {
-            ESP_LOGE(TAG, "SPI transaction failed: %s", esp_err_to_name(ret));
-            *bytes_read = 0;
+            client->prefix[len++] = 127;
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                client->prefix[len++] = (uint64_t)message_len >> shift;
+            }
         }
-    } else {
-        ESP_LOGE(TAG, "Failed to take SPI mutex");
-        ret = ESP_FAIL;
-        *bytes_read = 0;
     }
-#else
-    // Wait for ADC conversion
-    vTaskDelay(pdMS_TO_TICKS(wait_convertion_time));
 
-    // Read from ADC
-    ret = adc_continuous_read(adc_handle, buffer, buffer_size, bytes_read, 1000 / portTICK_PERIOD_MS);
-
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "ADC read failed: %s", esp_err_to_name(ret));
+    memcpy(&client->prefix[len], &frame->header, header_len);
+    return len + header_len;
+}
+
+/**
+ * @brief Write as much of the client's queued frames as its send buffer takes
+ *
+ * Never blocks: the small header is copied, the payload is only referenced,
+ * and a full send buffer just ends the call. The write continues from the
+ * same offset on the next call. UDP clients are handed to udp_client_write().
+ *
+ * @param client Client to write to
+ * @return ESP_OK on success, ESP_FAIL if the connection failed
+ */
+static esp_err_t client_write(data_client_t *client)
+{
+    if (client->transport == TRANSPORT_UDP) {
+        return udp_client_write(client);
+    }
+
+    struct netconn *conn = socket_netconn(client->sock);
+    if (conn == NULL) {
+        return ESP_FAIL;
+    }
+
+    client->blocked = false;
+    while (true) {
+        // Control replies go out between frames, never inside one
+        if (client->offset == 0 && client->replies_sent < client->replies_len) {
+            size_t written = 0;
+            size_t requested = client->replies_len - client->replies_sent;
+            err_t err = netconn_write_partly(conn, client->replies + client->replies_sent, requested,
+                                             NETCONN_COPY | NETCONN_DONTBLOCK, &written);
+            client->replies_sent += written;
+            if (err != ERR_OK && err != ERR_WOULDBLOCK && err != ERR_MEM) {
+                ESP_LOGE(TAG, "Send error to %s:%u: lwIP err %d", client->addr, client->port, err);
+                return ESP_FAIL;
+            }
+            if (written < requested) {
+                client->blocked = true;
+                return ESP_OK;
+            }
+            client->replies_len = 0;
+            client->replies_sent = 0;
+        }
+        if (client->written == client->count) {
+            break;
+        }
+
+        const frame_desc_t *frame = &shared_frames[client->queue[client->written]].frame;
+        if (client->offset == 0) {
+            client->prefix_len = frame_prefix(client, frame);
+        }
+        size_t header_len = client->prefix_len;
+        size_t total = header_len + frame->len;
+
+        while (client->offset < total) {
+            size_t written = 0;
+            size_t requested;
+            err_t err;
+            if (client->offset < header_len) {
+                requested = header_len - client->offset;
+                err = netconn_write_partly(conn, client->prefix + client->offset, requested,
+                                           NETCONN_COPY | NETCONN_MORE | NETCONN_DONTBLOCK, &written);
+            } else {
+                requested = total - client->offset;
+                err = netconn_write_partly(conn, frame->data + (client->offset - header_len), requested,
+                                           NETCONN_NOCOPY | NETCONN_MORE | NETCONN_DONTBLOCK, &written);
+            }
+            client->offset += written;
+
+            if (err != ERR_OK && err != ERR_WOULDBLOCK && err != ERR_MEM) {
+                ESP_LOGE(TAG, "Send error to %s:%u: lwIP err %d", client->addr, client->port, err);
+                return ESP_FAIL;
+            }
+
+            // The send buffer is full, come back once the client has acknowledged some data
+            if (written < requested) {
+                client->blocked = true;
+                if (client->stall_start_us == 0) {
+                    STATS_ADD(send_retries, 1);
+                    client->stall_start_us = esp_timer_get_time();
+                }
+                return ESP_OK;
+            }
+        }
+
+        if (client->stall_start_us != 0) {
+            STATS_ADD(send_stall_us, esp_timer_get_time() - client->stall_start_us);
+            client->stall_start_us = 0;
+        }
+
+        // lwIP references the payload until the client has acknowledged everything up to here
+        tcp_seq_query_t query = {.conn = conn};
+        if (tcpip_api_call(read_tcp_seq, &query.call) != ERR_OK) {
+            return ESP_FAIL;
+        }
+        client->end_seq[client->written++] = query.snd_lbb;
+        client->offset = 0;
+        client->frames_sent++;
+        STATS_ADD(frames_sent, 1);
+        STATS_ADD(bytes_sent, total);
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Read and apply the control requests a TCP client has sent
+ *
+ * Reads without blocking and only while the reply queue has room for one
+ * more reply, so a client that does not read its replies is held back
+ * instead of growing the queue. A malformed request, or any request other
+ * than CONTROL_HELLO before the protocol was negotiated, ends the
+ * connection since the byte stream can no longer be parsed.
+ *
+ * @param client TCP client
+ * @return ESP_OK on success, ESP_FAIL if the connection was closed or broke the protocol
+ */
+static esp_err_t poll_control(data_client_t *client)
+{
+    while (client->replies_len + CONTROL_MAX_MESSAGE <= sizeof(client->replies)) {
+        control_header_t request;
+        size_t needed = sizeof(request);
+        if (client->rx_len >= sizeof(request)) {
+            memcpy(&request, client->rx, sizeof(request));
+            if (request.magic != CONTROL_MAGIC || request.payload_len > CONTROL_MAX_PAYLOAD ||
+                (!client->control && request.opcode != CONTROL_HELLO)) {
+                ESP_LOGW(TAG, "Invalid control request from %s:%u", client->addr, client->port);
+                return ESP_FAIL;
+            }
+            needed += request.payload_len;
+        }
+
+        if (client->rx_len < needed) {
+            int len = recv(client->sock, client->rx + client->rx_len, needed - client->rx_len, MSG_DONTWAIT);
+            if (len == 0) {
+                return ESP_FAIL; // Closed by the client
+            }
+            if (len < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? ESP_OK : ESP_FAIL;
+            }
+            client->rx_len += len;
+            continue;
+        }
+
+        uint8_t *reply = client->replies + client->replies_len;
+        client->replies_len += control_execute(&request, client->rx + sizeof(request), reply);
+        client->rx_len = 0;
+
+        if (request.opcode == CONTROL_HELLO && ((control_header_t *)reply)->status == CONTROL_OK && !client->control) {
+            // Replies are told apart from frames by their magic, and small replies must not wait for Nagle
+            int nodelay = 1;
+            setsockopt(client->sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            client->control = true;
+            client->header = true;
+            ESP_LOGI(TAG, "Client %s:%u uses control protocol version %d", client->addr, client->port,
+                     CONTROL_VERSION);
+        }
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Make room in a client's queue by dropping its oldest frame not yet started
+ *
+ * @param client Client whose queue is full
+ * @return true if a frame was dropped
+ */
+static bool drop_oldest_frame(data_client_t *client)
+{
+    // A frame that is partly written cannot be dropped without corrupting the stream
+    int oldest = client->written + (client->offset > 0 ? 1 : 0);
+    if (oldest >= client->count) {
+        return false;
+    }
+
+    unref_shared_frame(client->queue[oldest]);
+    client->count--;
+    memmove(&client->queue[oldest], &client->queue[oldest + 1], (client->count - oldest) * sizeof(client->queue[0]));
+    return true;
+}
+
+/**
+ * @brief Queue a captured frame for every connected client
+ *
+ * Each client may hold an equal share of the frame buffers, queued and
+ * unacknowledged frames together. A client at its share drops a frame
+ * according to its policy, so a slow client never holds back the others or
+ * leaves acquisition without a buffer.
+ *
+ * @param frame Frame popped from ready_ring
+ */
+static void share_frame(const frame_desc_t *frame)
+{
+    int slot = 0;
+    while (shared_frames[slot].refs > 0) {
+        slot++; // Cannot run past the end: fewer frames exist than the array holds
+    }
+    shared_frames[slot].frame = *frame;
+
+    int share = frame_pool_count() / client_count;
+    if (share < 1) {
+        share = 1;
+    }
+
+    for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+        data_client_t *client = &clients[i];
+        if (client->sock < 0) {
+            continue;
+        }
+
+        // Frames a UDP client only holds for a possible retransmission are given up first
+        if (client->count >= share && client->transport == TRANSPORT_UDP && client->written > 0) {
+            release_written_frames(client, 1);
+        }
+        if (client->count >= share && client->policy == DROP_OLDEST && drop_oldest_frame(client)) {
+            client->frames_dropped++;
+            STATS_ADD(client_drops, 1);
+        }
+        if (client->count >= share) {
+            // Still at its share: the policy keeps the older frames, or the older ones are already being sent
+            client->frames_dropped++;
+            STATS_ADD(client_drops, 1);
+            continue;
+        }
+
+        client->queue[client->count++] = slot;
+        shared_frames[slot].refs++;
+    }
+
+    // Nobody took the frame, hand it straight back
+    if (shared_frames[slot].refs == 0) {
+        shared_frames[slot].refs = 1;
+        unref_shared_frame(slot);
+    }
+}
+
+/**
+ * @brief Let acquisition_task start producing frames
+ */
+static void start_acquisition(void)
+{
+    atomic_store(&acquisition_running, true);
+    atomic_store(&acquisition_enabled, true);
+    xTaskNotifyGive(acquisition_task_handle);
+}
+
+/**
+ * @brief Stop acquisition_task and reclaim every frame it handed over
+ *
+ * Blocks until the acquisition task has released the ADC, then returns
+ * frames that were captured but never sent to the free ring.
+ */
+static void stop_acquisition(void)
+{
+    frame_desc_t desc;
+
+    atomic_store(&acquisition_enabled, false);
+    xTaskNotifyGive(acquisition_task_handle);
+    while (atomic_load(&acquisition_running)) {
+        vTaskDelay(1);
+    }
+
+    while (frame_ring_pop(&ready_ring, &desc)) {
+        frame_ring_push(&free_ring, &desc);
+    }
+}
+
+#ifdef USE_EXTERNAL_ADC
+/**
+ * @brief Make the pulse counter count the edge selected by trigger_edge
+ */
+static void apply_pcnt_edge(void)
+{
+    if (trigger_edge == 1) {
+        // Configure for positive edge detection
+        ESP_ERROR_CHECK(
+            pcnt_channel_set_edge_action(pcnt_chan, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_HOLD));
+    } else {
+        // Configure for negative edge detection
+        ESP_ERROR_CHECK(
+            pcnt_channel_set_edge_action(pcnt_chan, PCNT_CHANNEL_EDGE_ACTION_HOLD, PCNT_CHANNEL_EDGE_ACTION_INCREASE));
+    }
+}
+#endif
+
+esp_err_t set_trigger_edge(bool rising)
+{
+    trigger_edge = rising ? 1 : 0;
+#ifdef USE_EXTERNAL_ADC
+    if (mode == 1) {
+        apply_pcnt_edge();
+    }
+#endif
+    return ESP_OK;
+}
+
+esp_err_t set_single_trigger_mode(void)
+{
+    ESP_LOGI(TAG, "Entering single trigger mode");
+
+    mode = 1; // Set to single trigger mode
+
+#ifdef USE_EXTERNAL_ADC
+    ESP_ERROR_CHECK(pcnt_unit_start(pcnt_unit));
+    apply_pcnt_edge();
+
+    // Get initial state
+    int temp_last_state;
+    pcnt_unit_get_count(pcnt_unit, &temp_last_state);
+    last_state = temp_last_state;
+#else
+    // Sample the current GPIO state
+    last_state = gpio_get_level(SINGLE_INPUT_PIN);
+#endif
+
+    return ESP_OK;
+}
+
+esp_err_t roll_set_chunk_samples(int samples)
+{
+    if (samples != 0 && (samples < ROLL_MIN_CHUNK_SAMPLES || samples > ROLL_MAX_CHUNK_SAMPLES)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    atomic_store(&roll_chunk, samples);
+    return ESP_OK;
+}
+
+int roll_chunk_samples(void)
+{
+    return atomic_load(&roll_chunk);
+}
+
+bool data_session_get(data_session_t *session)
+{
+    if (!atomic_load(&session_active)) {
+        return false;
+    }
+
+    // Latched before session_active is set and left alone until it is cleared
+    session->format = session_format;
+    session->roll_chunk_samples = session_roll;
+    session->frame_samples = session_frame_samples;
+    return true;
+}
+
+esp_err_t set_continuous_mode(void)
+{
+    ESP_LOGI(TAG, "Entering continuous mode");
+
+    mode = 0; // Set to continuous mode
+
+    esp_err_t ret = set_trigger_level(0); // Reset trigger level
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set trigger level");
+    }
+
+#ifdef USE_EXTERNAL_ADC
+    ESP_ERROR_CHECK(pcnt_unit_stop(pcnt_unit));
+#endif
+
+    return ESP_OK;
+}
+
+#ifdef USE_EXTERNAL_ADC
+void request_socket_reset(void)
+{
+    ESP_LOGI(TAG, "---------------------------------------------");
+    ESP_LOGI(TAG, "SOCKET RESET: Setting socket_reset_requested flag");
+    ESP_LOGI(TAG, "Previous flag value: %d", atomic_load(&socket_reset_requested));
+    atomic_store(&socket_reset_requested, 1);
+    ESP_LOGI(TAG, "Flag set to: %d", atomic_load(&socket_reset_requested));
+
+    // Use a longer delay to ensure the task has time to process the request
+    vTaskDelay(pdMS_TO_TICKS(350)); // Increased to 350ms
+
+    // After delay, verify if flag is still set
+    if (atomic_load(&socket_reset_requested)) {
+        ESP_LOGW(TAG, "SOCKET RESET: Flag still set after delay - forcing cleanup");
+        // Force cleanup in case socket_task is stuck
+        atomic_store(&socket_reset_requested, 0);
+    } else {
+        ESP_LOGI(TAG, "SOCKET RESET: Flag was processed successfully");
+    }
+    ESP_LOGI(TAG, "---------------------------------------------");
+}
+
+void force_socket_cleanup(void)
+{
+    ESP_LOGI(TAG, "*** FORCE SOCKET CLEANUP: Closing all connections ***");
+
+    // Close the client sockets first (from socket_task)
+    atomic_store(&socket_reset_requested, 1);
+
+    // Wait for socket_task to process the reset request
+    vTaskDelay(pdMS_TO_TICKS(150));
+
+    // Force close of the listening socket to ensure clean state
+    if (new_sock != -1) {
+        ESP_LOGI(TAG, "Forcing close of listening socket %d", new_sock);
+        safe_close(new_sock);
+        new_sock = -1;
+    }
+
+    // Make sure the reset flag is cleared
+    atomic_store(&socket_reset_requested, 0);
+    ESP_LOGI(TAG, "*** Force socket cleanup completed ***");
+}
+#endif
+
+/**
+ * @brief Check whether handing the frame just captured to the sender would leave nothing to capture into
+ */
+static bool capture_would_stall(void)
+{
+#ifdef USE_EXTERNAL_ADC
+    return capture_pipeline.in_flight == 0 && frame_pool_in_use() >= frame_pool_count();
+#else
+    return frame_pool_in_use() >= frame_pool_count();
+#endif
+}
+
+void acquisition_task(void *pvParameters)
+{
+    frame_desc_t desc;
+    trigger_config_t trigger;
+    bool stalled = false; // Whether the current overrun has already been counted
+    int64_t stall_start_us = 0;
+    uint32_t sequence = 0;
+    bool carved = false; // Whether the frame pool has been carved for the current session
+    size_t frame_len = 0; // Bytes captured per frame in the current session
+#ifdef USE_EXTERNAL_ADC
+    int frame_index;
+#else
+    uint32_t len;
+    uint32_t overflows_seen = 0; // adc_pool_overflows when the last frame was read
+#endif
+
+    while (1) {
+        if (!atomic_load(&acquisition_enabled)) {
+            if (atomic_load(&acquisition_running)) {
+#ifdef USE_EXTERNAL_ADC
+                // Captures still owned by the SPI driver must complete before the buffers are reused
+                spi_pipeline_drain(&capture_pipeline);
+#else
+                overflows_seen = atomic_load(&acquisition_stats.adc_pool_overflows);
+#endif
+                stalled = false;
+                sequence = 0;
+                carved = false;
+                segments_discard();
+                averaging_release();
+                atomic_store(&acquisition_running, false);
+            }
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        // Take back the buffers the sender is done with
+        while (frame_ring_pop(&free_ring, &desc)) {
+            release_frame(desc.index);
+        }
+
+        if (!carved) {
+            // The pool can only be cut to this session's frames once no consumer references the last session's
+            frame_len = get_frame_capture_len(session_roll > 0 ? session_roll : session_frame_samples);
+#ifdef USE_EXTERNAL_ADC
+            carved = spi_pipeline_carve(&capture_pipeline, frame_len) == ESP_OK;
+#else
+            carved = frame_pool_carve(frame_len) > 0;
+#endif
+            if (!carved) {
+                ulTaskNotifyTake(pdTRUE, 1);
+                continue;
+            }
+        }
+
+#ifdef USE_EXTERNAL_ADC
+        // Keep every free buffer capturing while earlier frames are being sent
+        if (spi_pipeline_fill(&capture_pipeline) != ESP_OK) {
+            report_read_miss();
+        }
+
+        if (capture_pipeline.in_flight == 0) {
+            // Every buffer is waiting on the sender
+            if (!stalled) {
+                atomic_fetch_add(&frame_overruns, 1);
+                sequence++; // Leave a gap so the client sees the lost capture
+                stalled = true;
+                stall_start_us = esp_timer_get_time();
+            }
+            ulTaskNotifyTake(pdTRUE, 1);
+            continue;
+        }
+        if (stalled) {
+            STATS_ADD(pool_exhausted_us, esp_timer_get_time() - stall_start_us);
+            stalled = false;
+        }
+
+        if (spi_pipeline_wait(&capture_pipeline, &frame_index) != ESP_OK) {
+            report_read_miss();
+            continue;
+        }
+        desc.header.timestamp_us = esp_timer_get_time();
+        STATS_ADD(frames_captured, 1);
+
+        desc.data = capture_pipeline.buffers[frame_index];
+        desc.index = frame_index;
+        desc.len = frame_len; // Captures are rounded up to whole 32-bit words for the DMA, the padding is not sent
+#else
+        if (adc_modify_freq) {
+            config_adc_sampling();
+            adc_modify_freq = 0;
+        }
+
+        int index = frame_pool_acquire();
+        if (index < 0) {
+            // Every buffer is still referenced by the sender or another consumer
+            if (!stalled) {
+                atomic_fetch_add(&frame_overruns, 1);
+                sequence++; // Leave a gap so the client sees the lost capture
+                stalled = true;
+                stall_start_us = esp_timer_get_time();
+            }
+            ulTaskNotifyTake(pdTRUE, 1);
+            continue;
+        }
+        if (stalled) {
+            STATS_ADD(pool_exhausted_us, esp_timer_get_time() - stall_start_us);
+            stalled = false;
+        }
+
+        // Returns as soon as the conversion-done callbacks have filled the pool with a whole frame
+        esp_err_t ret = adc_read_frame(frame_pool_slot(index), frame_len, &len, pdMS_TO_TICKS(ADC_READ_TIMEOUT_MS));
+        if (ret != ESP_OK || len == 0) {
+            frame_pool_release(index);
+            report_read_miss();
+            continue;
+        }
+        uint32_t overflows = atomic_load(&acquisition_stats.adc_pool_overflows);
+        if (overflows != overflows_seen) {
+            overflows_seen = overflows;
+            sequence++; // The pool dropped conversions since the last frame, leave a gap so the client sees it
+        }
+
+        desc.header.timestamp_us = esp_timer_get_time();
+        STATS_ADD(frames_captured, 1);
+        desc.data = frame_pool_slot(index);
+        desc.index = index;
+        desc.len = frame_len;
+#endif
+
+        desc.data += get_discard_head();
+        desc.len -= get_discard_head() + get_discard_trailer();
+        record_frame(desc.data, desc.len, desc.header.timestamp_us);
+
+        // Capturing for the record alone: nothing is sent and the buffer is captured into again right away
+        if (!atomic_load(&session_active)) {
+            release_frame(desc.index);
+            continue;
+        }
+        // While a record fills, a frame that would leave no buffer to capture into only goes to the record,
+        // so a slow client cannot open gaps in it. The clients see it as a lost capture.
+        if (record_filling() && capture_would_stall()) {
+            atomic_fetch_add(&frame_overruns, 1);
+            sequence++;
+            release_frame(desc.index);
+            continue;
+        }
+
+        size_t trigger_index = 0;
+        bool triggered = mode == 1 && session_roll == 0;
+        bool segmented = false;
+        if (triggered) {
+            trigger_get_config(&trigger);
+            segmented = segments_update(desc.len / 2);
+        }
+
+        if (segmented || !triggered) {
+            averaging_release();
+        }
+        if (segmented) {
+            // Segments are copied into the store, so the capture buffer can be reused right away
+            segments_capture(desc.data, desc.len, desc.header.timestamp_us, &trigger);
+            release_frame(desc.index);
+            desc.len = segments_take_batch(session_format, &desc.data);
+            if (desc.len == 0) {
+                continue;
+            }
+            desc.index = SEGMENT_STORE_INDEX;
+        } else if (triggered) {
+            // Single mode only streams frames that hold a trigger, cut to the window around it
+            desc.len = trigger_align_frame(desc.data, desc.len, &trigger, &trigger_index);
+            if (desc.len == 0) {
+                release_frame(desc.index);
+                continue;
+            }
+
+            // Averaging keeps the frame in its accumulator until N windows have been added
+            if (!average_frame(desc.data, desc.len)) {
+                release_frame(desc.index);
+                continue;
+            }
+        }
+        int averages = triggered && !segmented ? averaging_get_frames() : 1;
+
+        // Decimate and re-encode the samples here so the sender only has to hand the payload to lwIP.
+        // A segment batch is already encoded and is sent at the hardware rate.
+        size_t captured_samples;
+        size_t samples;
+        int factor = 1;
+        decimation_mode_t decimation = DECIMATION_FILTER;
+        if (segmented) {
+            captured_samples = samples = segments_get_count() * segments_get_samples();
+            trigger_index = ((const segment_batch_t *)desc.data)->trigger_index;
+        } else {
+            captured_samples = desc.len / 2;
+            factor = decimation_get_factor();
+            decimation = decimation_get_mode();
+            uint16_t data_mask = get_data_mask();
+            if (decimation == DECIMATION_PEAK) {
+                desc.len = peak_detect_frame(desc.data, desc.len, factor);
+            } else if (decimation == DECIMATION_HIRES) {
+                desc.len = hires_frame(desc.data, desc.len, factor);
+                data_mask = hires_data_mask(factor);
+            } else {
+                desc.len = decimate_frame(desc.data, desc.len, factor);
+            }
+            samples = desc.len / 2;
+            desc.len = sample_format_encode(session_format, data_mask, desc.data, desc.len);
+        }
+
+        // The header is filled even when the session does not send it, it costs a few stores
+        desc.header.magic = FRAME_HEADER_MAGIC;
+        desc.header.version = FRAME_HEADER_VERSION;
+        desc.header.header_len = sizeof(frame_header_t);
+        desc.header.sequence = sequence++;
+#ifdef USE_EXTERNAL_ADC
+        // Captures queued before a rate change complete at the old rate
+        desc.header.sample_rate_hz = lround(spi_timing_rate(spi_active_divider()));
+        desc.header.rate_index = spi_timing_row(spi_active_divider());
+#else
+        desc.header.sample_rate_hz = get_current_sample_rate();
+        desc.header.rate_index = get_rate_index();
+#endif
+        desc.header.decimation = factor;
+        desc.header.format = session_format;
+        desc.header.decimation_mode = decimation;
+        desc.header.flags = (triggered ? FRAME_FLAG_TRIGGERED : 0) | (averages > 1 ? FRAME_FLAG_AVERAGED : 0) |
+                            (segmented ? FRAME_FLAG_SEGMENTED : 0);
+        desc.header.averages = averages;
+        desc.header.trigger_offset = -1;
+        if (triggered && captured_samples > 0) {
+            desc.header.trigger_offset = trigger_index * samples / captured_samples;
+        }
+        desc.header.sample_count = samples;
+        desc.header.payload_len = desc.len;
+
+        // Cannot fail: the ring holds more descriptors than there are buffers
+        frame_ring_push(&ready_ring, &desc);
+        wake_socket_task();
+    }
+}
+
+/**
+ * @brief Start the ADC and acquisition_task with the latched session settings
+ */
+static void start_capture(void)
+{
+#ifndef USE_EXTERNAL_ADC
+    if (!atomic_load(&adc_is_running) && !atomic_load(&adc_initializing)) {
+        ESP_LOGI(TAG, "Starting ADC sampling from socket task");
+        start_adc_sampling();
+    } else {
+        ESP_LOGW(TAG, "ADC already running or initializing, not starting again");
+    }
+#endif
+
+    start_acquisition();
+}
+
+/**
+ * @brief Stop acquisition_task and the ADC
+ */
+static void stop_capture(void)
+{
+    stop_acquisition();
+#ifndef USE_EXTERNAL_ADC
+    stop_adc_sampling();
+#endif
+}
+
+/**
+ * @brief Latch the session settings and start streaming for the first client
+ */
+static void start_session(void)
+{
+    // Capture for the record alone used its own frame length, the record goes on filling with the clients' frames
+    if (record_capture) {
+        stop_capture();
+        record_capture = false;
+    }
+
+    // Format, roll chunk and frame length are shared by every client that joins the session
+    session_format = sample_format_selected();
+    session_roll = roll_chunk_samples();
+    session_frame_samples = get_frame_samples();
+    ESP_LOGI(TAG, "Streaming %s samples (%d bits each), %d per frame", sample_format_name(session_format),
+             sample_format_bits(session_format), session_roll > 0 ? session_roll : session_frame_samples);
+    atomic_store(&session_active, true);
+
+    start_capture();
+}
+
+/**
+ * @brief Keep acquisition running for a filling record while no client is connected
+ *
+ * Frames then only go to the record, captured at the longest frame length
+ * so the record has the fewest gaps, and none waits on a sender.
+ */
+static void update_record_capture(void)
+{
+    bool wanted = client_count == 0 && record_filling();
+    if (wanted == record_capture) {
+        return;
+    }
+
+    record_capture = wanted;
+    if (wanted) {
+        ESP_LOGI(TAG, "Capturing for the deep record, no client connected");
+        session_roll = 0;
+        session_frame_samples = get_max_frame_samples();
+        start_capture();
+    } else {
+        stop_capture();
+        ESP_LOGI(TAG, "Deep record capture stopped");
+    }
+}
+
+/**
+ * @brief Find the ws_sessions entry of a WebSocket client
+ *
+ * @param client WebSocket client
+ * @return Index into ws_sessions, -1 if the session is gone
+ */
+static int ws_session_index(const data_client_t *client)
+{
+    for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+        int value = atomic_load(&ws_sessions[i]);
+        if (value >= 0 && (value & WS_ADOPTED) && (value & WS_FD_MASK) == client->sock) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Check whether the server is closing a WebSocket client's session
+ *
+ * @param client WebSocket client
+ * @return true if the client must be dropped now
+ */
+static bool ws_session_closing(const data_client_t *client)
+{
+    int i = ws_session_index(client);
+    return i < 0 || (atomic_load(&ws_sessions[i]) & WS_CLOSING);
+}
+
+/**
+ * @brief Reset a connection, dropping whatever lwIP still holds for it
+ *
+ * A graceful close keeps unacknowledged segments queued until the peer ACKs
+ * them, and with NOCOPY writes those segments point into the frame buffers.
+ * With a zero linger time the shutdown aborts the pcb instead, which frees
+ * the segments before the call returns, so the frames can be reused.
+ *
+ * @param sock Connected TCP socket, stays open
+ */
+static void abort_connection(int sock)
+{
+    struct linger so_linger = {.l_onoff = 1, .l_linger = 0};
+    if (setsockopt(sock, SOL_SOCKET, SO_LINGER, &so_linger, sizeof(so_linger)) < 0) {
+        ESP_LOGE(TAG, "Failed to set immediate close on socket %d: errno %d", sock, errno);
+    }
+    shutdown(sock, SHUT_RDWR);
+}
+
+/**
+ * @brief Queue the PONG owed to a WebSocket client behind its control replies
+ *
+ * client_write() sends it at the next frame boundary, so it never lands
+ * inside a binary message.
+ *
+ * @param client WebSocket client
+ */
+static void queue_ws_pong(data_client_t *client)
+{
+    int i = ws_session_index(client);
+    if (i < 0 || !atomic_load_explicit(&ws_pongs[i].pending, memory_order_acquire) ||
+        client->replies_len + 2 + ws_pongs[i].len > sizeof(client->replies)) {
+        return;
+    }
+
+    uint8_t *pong = client->replies + client->replies_len;
+    pong[0] = 0x8A; // FIN, PONG
+    pong[1] = ws_pongs[i].len; // Unmasked
+    memcpy(pong + 2, ws_pongs[i].payload, ws_pongs[i].len);
+    client->replies_len += 2 + ws_pongs[i].len;
+    atomic_store_explicit(&ws_pongs[i].pending, false, memory_order_release);
+}
+
+/**
+ * @brief Hand a WebSocket session back to its server
+ *
+ * A session the server is not already closing is closed through the
+ * server, while its entry still holds the socket so httpd cannot reuse the
+ * descriptor in between.
+ *
+ * @param client WebSocket client
+ */
+static void release_ws_session(data_client_t *client)
+{
+    int i = ws_session_index(client);
+    if (i < 0) {
+        return;
+    }
+
+    if (!(atomic_load(&ws_sessions[i]) & WS_CLOSING)) {
+        httpd_sess_trigger_close(client->server, client->sock);
+    }
+    atomic_store(&ws_sessions[i], -1);
+}
+
+/**
+ * @brief Disconnect a client and give back every frame it still holds
+ *
+ * Stops acquisition once the last client is gone.
+ *
+ * @param client Client to close
+ */
+static void close_client(data_client_t *client)
+{
+    // UDP clients share the UDP socket, WebSocket sessions are closed by their server
+    if (client->transport == TRANSPORT_TCP) {
+        abort_connection(client->sock);
+        close(client->sock);
+    } else if (client->transport == TRANSPORT_WS) {
+        abort_connection(client->sock);
+        release_ws_session(client);
+    }
+    client->sock = -1;
+    ESP_LOGI(TAG, "Client %s:%u disconnected after %u frames, %u dropped", client->addr, client->port,
+             client->frames_sent, client->frames_dropped);
+
+    // The connection was aborted, so lwIP no longer references any frame buffer. UDP sends keep none.
+    for (int i = 0; i < client->count; i++) {
+        unref_shared_frame(client->queue[i]);
+    }
+    client->count = 0;
+    client->written = 0;
+
+    if (--client_count == 0) {
+        atomic_store(&session_active, false);
+        stop_capture();
+    }
+}
+
+/**
+ * @brief Disconnect every client
+ */
+static void close_all_clients(void)
+{
+    for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+        if (clients[i].sock >= 0) {
+            close_client(&clients[i]);
+        }
+    }
+}
+
+/**
+ * @brief Find an unused client slot
+ *
+ * @return Slot, NULL if MAX_DATA_CLIENTS are connected
+ */
+static data_client_t *free_client_slot(void)
+{
+    for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+        if (clients[i].sock < 0) {
+            return &clients[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fill in a new client and start streaming if it is the first one
+ *
+ * @param client Unused slot
+ * @param sock Connected TCP socket or the UDP socket
+ * @param transport How frames are sent to the client
+ * @param peer Peer address
+ */
+static void open_client(data_client_t *client, int sock, data_transport_t transport, const struct sockaddr_in *peer)
+{
+    memset(client, 0, sizeof(*client));
+    client->sock = sock;
+    client->transport = transport;
+    client->peer = *peer;
+    inet_ntoa_r(peer->sin_addr, client->addr, sizeof(client->addr));
+    client->port = ntohs(peer->sin_port);
+    client->policy = (drop_policy_t)atomic_load(&drop_policy);
+    client->last_heard_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "Client connected: %s, Port: %d, %s (%d of %d)", client->addr, client->port,
+             data_transport_name(transport), client_count + 1, MAX_DATA_CLIENTS);
+
+    if (client_count++ == 0) {
+        start_session();
+    }
+
+    // Roll chunks always carry their sequence number, and UDP needs it to reassemble frames
+    client->header = frame_header_enabled() || session_roll > 0 || transport == TRANSPORT_UDP;
+}
+
+/**
+ * @brief Accept a pending connection on the non-blocking listening socket
+ *
+ * @param listen_sock Listening socket
+ * @return ESP_OK if a client was accepted or none is waiting, ESP_FAIL if the listening socket failed
+ */
+static esp_err_t accept_client(int listen_sock)
+{
+    data_client_t *client = free_client_slot();
+    if (client == NULL) {
+        return ESP_OK;
+    }
+
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int sock = accept(listen_sock, (struct sockaddr *)&client_addr, &client_addr_len);
+    if (sock < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return ESP_OK;
+        }
+        ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+        return ESP_FAIL;
+    }
+
+    open_client(client, sock, TRANSPORT_TCP, &client_addr);
+    return ESP_OK;
+}
+
+/**
+ * @brief Open the UDP socket on the port number of the TCP listening socket
+ *
+ * @param listen_sock TCP listening socket
+ */
+static void open_udp_socket(int listen_sock)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(listen_sock, (struct sockaddr *)&addr, &addr_len) != 0) {
+        ESP_LOGE(TAG, "Unable to get the data socket address: errno %d", errno);
+        return;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Unable to create UDP socket: errno %d", errno);
+        return;
+    }
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ESP_LOGE(TAG, "UDP socket unable to bind: errno %d", errno);
+        close(sock);
+        return;
     }
-#endif
 
-    return ret;
+    int sock_flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, sock_flags | O_NONBLOCK);
+    udp_sock = sock;
+    ESP_LOGI(TAG, "UDP streaming available on port %d", ntohs(addr.sin_port));
 }
 
-bool is_triggered(int current, int last)
+/**
+ * @brief Close the UDP socket, its clients must already be closed
+ */
+static void close_udp_socket(void)
 {
-    // Check for the specific edge type set in trigger_edge
-    if (trigger_edge == 1) {
-        // Positive edge detection
-        return (current > last);
-    } else {
-        // Negative edge detection
-        return (current < last);
+    if (udp_sock >= 0) {
+        close(udp_sock);
+        udp_sock = -1;
     }
 }
 
-esp_err_t set_single_trigger_mode(void)
+/**
+ * @brief Find the UDP client a datagram came from
+ *
+ * @param peer Sender of the datagram
+ * @return Client, NULL if the sender is not subscribed
+ */
+static data_client_t *find_udp_client(const struct sockaddr_in *peer)
 {
-    ESP_LOGI(TAG, "Entering single trigger mode");
-
-    mode = 1; // Set to single trigger mode
-
-#ifdef USE_EXTERNAL_ADC
-    ESP_ERROR_CHECK(pcnt_unit_start(pcnt_unit));
-
-    if (trigger_edge == 1) {
-        // Configure for positive edge detection
-        ESP_ERROR_CHECK(
-            pcnt_channel_set_edge_action(pcnt_chan, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_HOLD));
-    } else {
-        // Configure for negative edge detection
-        ESP_ERROR_CHECK(
-            pcnt_channel_set_edge_action(pcnt_chan, PCNT_CHANNEL_EDGE_ACTION_HOLD, PCNT_CHANNEL_EDGE_ACTION_INCREASE));
+    for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+        data_client_t *client = &clients[i];
+        if (client->sock >= 0 && client->transport == TRANSPORT_UDP &&
+            client->peer.sin_addr.s_addr == peer->sin_addr.s_addr && client->peer.sin_port == peer->sin_port) {
+            return client;
+        }
     }
-
-    // Get initial state
-    int temp_last_state;
-    pcnt_unit_get_count(pcnt_unit, &temp_last_state);
-    last_state = temp_last_state;
-#else
-    // Sample the current GPIO state
-    last_state = gpio_get_level(SINGLE_INPUT_PIN);
-#endif
-
-    return ESP_OK;
+    return NULL;
 }
 
-esp_err_t set_continuous_mode(void)
+/**
+ * @brief Start streaming to the WebSocket sessions handed over since the last call
+ */
+static void adopt_ws_sessions(void)
 {
-    ESP_LOGI(TAG, "Entering continuous mode");
+    for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+        int fd = atomic_load(&ws_sessions[i]);
+        if (fd < 0 || (fd & (WS_ADOPTED | WS_CLOSING | WS_RESERVED))) {
+            continue;
+        }
+        if (!atomic_compare_exchange_strong(&ws_sessions[i], &fd, fd | WS_ADOPTED)) {
+            continue; // Closed meanwhile
+        }
 
-    mode = 0; // Set to continuous mode
+        data_client_t *client = free_client_slot();
+        if (client == NULL) {
+            ESP_LOGW(TAG, "WebSocket session refused, %d clients connected", client_count);
+            httpd_sess_trigger_close(ws_servers[i], fd);
+            atomic_store(&ws_sessions[i], -1);
+            continue;
+        }
 
-    esp_err_t ret = set_trigger_level(0); // Reset trigger level
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to set trigger level");
+        struct sockaddr_in peer = {0};
+        socklen_t peer_len = sizeof(peer);
+        getpeername(fd, (struct sockaddr *)&peer, &peer_len);
+        open_client(client, fd, TRANSPORT_WS, &peer);
+        client->server = ws_servers[i];
     }
-
-#ifdef USE_EXTERNAL_ADC
-    ESP_ERROR_CHECK(pcnt_unit_stop(pcnt_unit));
-#endif
-
-    return ESP_OK;
 }
 
-esp_err_t send_data_packet(int client_sock, uint8_t *buffer, size_t sample_size, int discard_head,
-                           int samples_per_packet)
+/**
+ * @brief Send the fragments a UDP client reported missing
+ *
+ * Only frames still inside the retransmit window are resent, and of the
+ * frame being written only the fragments already sent.
+ *
+ * @param client Client that sent the NACK
+ * @param nack The NACK
+ */
+static void retransmit_fragments(data_client_t *client, const udp_control_t *nack)
 {
-    // Calculate actual data to send
-    void *send_buffer = buffer + (discard_head * sample_size);
-    size_t send_len = samples_per_packet * sample_size;
+    int64_t now_us = esp_timer_get_time();
+    int held = client->written + (client->offset > 0 ? 1 : 0);
 
-    // Use MSG_MORE to optimize TCP packet usage
-    int flags = MSG_MORE;
-
-    // Send the data
-    ssize_t sent = send(client_sock, send_buffer, send_len, flags);
+    for (int i = 0; i < held; i++) {
+        const frame_desc_t *frame = &shared_frames[client->queue[i]].frame;
+        if (frame->header.sequence != nack->frame_seq) {
+            continue;
+        }
 
-    if (sent < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            // Socket buffer is full, need to wait
-            ESP_LOGW(TAG, "Socket buffer full, waiting to send");
-            vTaskDelay(pdMS_TO_TICKS(10));
-            return ESP_ERR_TIMEOUT;
+        size_t sent_len = i < client->written ? sizeof(frame_header_t) + frame->len : client->offset;
+        int64_t sent_us = i < client->written ? client->sent_us[i] : now_us;
+        uint64_t resend;
+        if (!udp_nack_select(nack, frame->len, sent_len, sent_us, now_us, &resend)) {
+            break;
         }
-        ESP_LOGE(TAG, "Send error: errno %d", errno);
-        return ESP_FAIL;
+        for (; resend != 0; resend &= resend - 1) {
+            int fragment = nack->first_fragment + __builtin_ctzll(resend);
+            // Out of buffers: the client NACKs again if the frame is still worth having
+            if (udp_send_fragment(client, frame, fragment, UDP_FRAGMENT_RETRANSMIT) != ESP_OK) {
+                return;
+            }
+            client->retransmits++;
+            STATS_ADD(udp_retransmits, 1);
+        }
+        return;
     }
 
-    return ESP_OK;
+    // Too late: the frame is dropped rather than delivered late
+    STATS_ADD(udp_nacks_expired, 1);
 }
 
-#ifdef USE_EXTERNAL_ADC
-void request_socket_reset(void)
+/**
+ * @brief Handle every datagram waiting on the UDP socket
+ */
+static void poll_udp_socket(void)
 {
-    ESP_LOGI(TAG, "---------------------------------------------");
-    ESP_LOGI(TAG, "SOCKET RESET: Setting socket_reset_requested flag");
-    ESP_LOGI(TAG, "Previous flag value: %d", atomic_load(&socket_reset_requested));
-    atomic_store(&socket_reset_requested, 1);
-    ESP_LOGI(TAG, "Flag set to: %d", atomic_load(&socket_reset_requested));
+    udp_control_t msg;
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+
+    while (udp_sock >= 0 &&
+           recvfrom(udp_sock, &msg, sizeof(msg), 0, (struct sockaddr *)&peer, &peer_len) == sizeof(msg)) {
+        peer_len = sizeof(peer);
+        if (msg.magic != UDP_STREAM_MAGIC) {
+            continue;
+        }
 
-    // Use a longer delay to ensure the task has time to process the request
-    vTaskDelay(pdMS_TO_TICKS(350)); // Increased to 350ms
+        data_client_t *client = find_udp_client(&peer);
+        if (client == NULL) {
+            if (msg.type != UDP_MSG_SUBSCRIBE) {
+                continue;
+            }
+            client = free_client_slot();
+            if (client == NULL) {
+                ESP_LOGW(TAG, "UDP subscription refused, %d clients connected", client_count);
+                continue;
+            }
+            open_client(client, udp_sock, TRANSPORT_UDP, &peer);
+            continue;
+        }
 
-    // After delay, verify if flag is still set
-    if (atomic_load(&socket_reset_requested)) {
-        ESP_LOGW(TAG, "SOCKET RESET: Flag still set after delay - forcing cleanup");
-        // Force cleanup in case socket_task is stuck
-        atomic_store(&socket_reset_requested, 0);
-    } else {
-        ESP_LOGI(TAG, "SOCKET RESET: Flag was processed successfully");
+        client->last_heard_us = esp_timer_get_time();
+        if (msg.type == UDP_MSG_NACK) {
+            retransmit_fragments(client, &msg);
+        } else if (msg.type == UDP_MSG_BYE) {
+            close_client(client);
+        }
     }
-    ESP_LOGI(TAG, "---------------------------------------------");
 }
 
-void force_socket_cleanup(void)
+esp_err_t drop_policy_select(drop_policy_t policy)
 {
-    ESP_LOGI(TAG, "*** FORCE SOCKET CLEANUP: Closing all connections ***");
+    if (policy < 0 || policy >= DROP_POLICY_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
 
-    // Close the client sockets first (from socket_task)
-    atomic_store(&socket_reset_requested, 1);
+    atomic_store(&drop_policy, policy);
+    return ESP_OK;
+}
 
-    // Wait for socket_task to process the reset request
-    vTaskDelay(pdMS_TO_TICKS(150));
+drop_policy_t drop_policy_selected(void)
+{
+    return (drop_policy_t)atomic_load(&drop_policy);
+}
 
-    // Force close of the listening socket to ensure clean state
-    if (new_sock != -1) {
-        ESP_LOGI(TAG, "Forcing close of listening socket %d", new_sock);
-        safe_close(new_sock);
-        new_sock = -1;
+const char *drop_policy_name(drop_policy_t policy)
+{
+    if (policy < 0 || policy >= DROP_POLICY_COUNT) {
+        return "unknown";
     }
+    return drop_policy_names[policy];
+}
 
-    // Make sure the reset flag is cleared
-    atomic_store(&socket_reset_requested, 0);
-    ESP_LOGI(TAG, "*** Force socket cleanup completed ***");
+esp_err_t drop_policy_from_name(const char *name, drop_policy_t *policy)
+{
+    for (int i = 0; i < DROP_POLICY_COUNT; i++) {
+        if (strcmp(name, drop_policy_names[i]) == 0) {
+            *policy = (drop_policy_t)i;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
 }
-#endif
 
-esp_err_t non_blocking_send(int client_sock, void *buffer, size_t len, int flags)
+const char *data_transport_name(data_transport_t transport)
 {
-#ifdef USE_EXTERNAL_ADC
-    static int socket_at_start = -1; // To track changes in new_sock during sending
-#endif
-    // If first send or previous send completed
-    if (!send_in_progress) {
-        // Store the buffer info for potential retries
-        pending_send_buffer = buffer;
-        pending_send_size = len;
-        pending_send_offset = 0;
-        send_in_progress = true;
-#ifdef USE_EXTERNAL_ADC
-        socket_at_start = new_sock; // Store the current value of new_sock
-#endif
-        // Make socket non-blocking for this operation
-        int sock_flags = fcntl(client_sock, F_GETFL, 0);
-        fcntl(client_sock, F_SETFL, sock_flags | O_NONBLOCK);
+    if (transport < 0 || transport > TRANSPORT_WS) {
+        return "unknown";
     }
+    return transport_names[transport];
+}
 
-    // Try to send remaining data
-    while (pending_send_offset < pending_send_size) {
-#ifndef USE_EXTERNAL_ADC
-        // Only check wifi_operation_requested in internal ADC mode
-        if (atomic_load(&wifi_operation_requested)) {
-            // Reset socket to blocking mode before returning
-            int sock_flags = fcntl(client_sock, F_GETFL, 0);
-            fcntl(client_sock, F_SETFL, sock_flags & ~O_NONBLOCK);
-            send_in_progress = false;
-            return ESP_ERR_TIMEOUT; // Signal caller to handle the WiFi operation
-        }
-#else
-        // In external ADC mode, check if the socket has changed
-        if (new_sock != socket_at_start) {
-            ESP_LOGI(TAG, "Socket changed during send operation (was %d, now %d), aborting", socket_at_start, new_sock);
-            // Reset socket to blocking mode before returning
-            int sock_flags = fcntl(client_sock, F_GETFL, 0);
-            fcntl(client_sock, F_SETFL, sock_flags & ~O_NONBLOCK);
-            send_in_progress = false;
-            return ESP_FAIL; // Abort sending if the socket changed
+int data_clients_get(data_client_info_t *info, int max)
+{
+    // Read without locking, so a client connecting meanwhile may show up half filled in
+    int n = 0;
+    for (int i = 0; i < MAX_DATA_CLIENTS && n < max; i++) {
+        const data_client_t *client = &clients[i];
+        if (client->sock < 0) {
+            continue;
         }
+        memcpy(info[n].addr, client->addr, sizeof(info[n].addr));
+        info[n].port = client->port;
+        info[n].transport = client->transport;
+        info[n].policy = client->policy;
+        info[n].header = client->header;
+        info[n].format = session_format;
+        info[n].frame_samples = session_roll > 0 ? session_roll : session_frame_samples;
+        info[n].queued = client->count;
+        info[n].frames_sent = client->frames_sent;
+        info[n].frames_dropped = client->frames_dropped;
+        info[n].retransmits = client->retransmits;
+        n++;
+    }
+    return n;
+}
 
-        // Also check for explicit socket reset requests
-        if (atomic_load(&socket_reset_requested)) {
-            ESP_LOGI(TAG, "Socket reset requested during send operation, aborting");
-            // Reset socket to blocking mode before returning
-            int sock_flags = fcntl(client_sock, F_GETFL, 0);
-            fcntl(client_sock, F_SETFL, sock_flags & ~O_NONBLOCK);
-            send_in_progress = false;
-            return ESP_FAIL;
+esp_err_t ws_client_open(httpd_handle_t server, int fd)
+{
+    for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+        int expected = -1;
+        if (atomic_compare_exchange_strong(&ws_sessions[i], &expected, WS_RESERVED)) {
+            ws_servers[i] = server;
+            atomic_store(&ws_pongs[i].pending, false);
+            atomic_store(&ws_sessions[i], fd);
+            wake_socket_task();
+            return ESP_OK;
         }
-#endif
-
-        ssize_t sent = send(client_sock, pending_send_buffer + pending_send_offset,
-                            pending_send_size - pending_send_offset, flags);
+    }
+    return ESP_ERR_NO_MEM;
+}
 
-        if (sent > 0) {
-            pending_send_offset += sent;
-        } else if (sent < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // Socket buffer is full, wait a bit
-                vTaskDelay(pdMS_TO_TICKS(10));
+void ws_client_closed(int fd)
+{
+    for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+        int value = atomic_load(&ws_sessions[i]);
+        while (value >= 0 && !(value & WS_RESERVED) && (value & WS_FD_MASK) == fd) {
+            // Not streamed to yet, nothing to wait for
+            if (!(value & WS_ADOPTED)) {
+                if (atomic_compare_exchange_strong(&ws_sessions[i], &value, -1)) {
+                    return;
+                }
+                continue;
+            }
+            if (!(value & WS_CLOSING) && !atomic_compare_exchange_strong(&ws_sessions[i], &value, value | WS_CLOSING)) {
                 continue;
             }
 
-            // Actual error
-            ESP_LOGE(TAG, "Send error: errno %d", errno);
+            // socket_task drops the client on its next pass, no frame is written to the socket after that
+            wake_socket_task();
+            TickType_t start = xTaskGetTickCount();
+            while (atomic_load(&ws_sessions[i]) == (value | WS_CLOSING) &&
+                   xTaskGetTickCount() - start < pdMS_TO_TICKS(WS_CLOSE_TIMEOUT_MS)) {
+                vTaskDelay(1);
+            }
+            return;
+        }
+    }
+}
+
+esp_err_t ws_client_pong(int fd, const uint8_t *payload, size_t len)
+{
+    if (len > WS_MAX_CONTROL_PAYLOAD) {
+        return ESP_ERR_INVALID_SIZE;
+    }
 
-            // Reset socket to blocking mode
-            int sock_flags = fcntl(client_sock, F_GETFL, 0);
-            fcntl(client_sock, F_SETFL, sock_flags & ~O_NONBLOCK);
-            send_in_progress = false;
-            return ESP_FAIL;
+    for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+        int value = atomic_load(&ws_sessions[i]);
+        if (value < 0 || (value & (WS_CLOSING | WS_RESERVED)) || (value & WS_FD_MASK) != fd) {
+            continue;
+        }
+        if (!atomic_load_explicit(&ws_pongs[i].pending, memory_order_acquire)) {
+            ws_pongs[i].len = (uint8_t)len;
+            memcpy(ws_pongs[i].payload, payload, len);
+            atomic_store_explicit(&ws_pongs[i].pending, true, memory_order_release);
+            wake_socket_task();
         }
+        return ESP_OK;
     }
+    return ESP_ERR_NOT_FOUND;
+}
 
-    // Reset socket to blocking mode
-    int sock_flags = fcntl(client_sock, F_GETFL, 0);
-    fcntl(client_sock, F_SETFL, sock_flags & ~O_NONBLOCK);
-    send_in_progress = false;
-    return ESP_OK;
+/**
+ * @brief Wait until socket_task has something to do
+ *
+ * Returns early when a connection is waiting, a datagram or control request
+ * arrived, a blocked client's send buffer has room again, or another task
+ * called wake_socket_task().
+ *
+ * @param listen_sock Listening socket
+ * @param timeout_ms Longest wait
+ */
+static void wait_for_events(int listen_sock, int timeout_ms)
+{
+    fd_set readfds;
+    fd_set writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    int max_fd = wake_fd;
+    FD_SET(wake_fd, &readfds);
+
+    if (client_count < MAX_DATA_CLIENTS) {
+        FD_SET(listen_sock, &readfds);
+        max_fd = listen_sock > max_fd ? listen_sock : max_fd;
+    }
+    if (udp_sock >= 0) {
+        FD_SET(udp_sock, &readfds);
+        max_fd = udp_sock > max_fd ? udp_sock : max_fd;
+    }
+    for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+        const data_client_t *client = &clients[i];
+        if (client->sock < 0) {
+            continue;
+        }
+        // WebSocket sessions are read by the HTTP server
+        if (client->transport == TRANSPORT_TCP) {
+            FD_SET(client->sock, &readfds);
+        }
+        // Only sockets whose buffer was full, the others are writable all along
+        if (client->blocked) {
+            FD_SET(client->sock, &writefds);
+        }
+        max_fd = client->sock > max_fd ? client->sock : max_fd;
+    }
+
+    struct timeval timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    if (select(max_fd + 1, &readfds, &writefds, NULL, &timeout) > 0 && FD_ISSET(wake_fd, &readfds)) {
+        uint64_t count;
+        read(wake_fd, &count, sizeof(count));
+    }
 }
 
 void socket_task(void *pvParameters)
 {
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    char addr_str[128];
-    uint32_t len;
     int current_sock = -1; // To track changes in new_sock
-    int client_sock = -1; // Declare client_sock at the beginning and set it to -1
-    TickType_t last_heartbeat = 0;
-    uint32_t loop_counter = 0;
-
-#ifdef USE_EXTERNAL_ADC
-    uint8_t buffer[BUF_SIZE];
-    spi_transaction_t t;
-    memset(&t, 0, sizeof(t));
-    t.length = 0;
-    t.rxlength = BUF_SIZE * 8;
-    t.rx_buffer = buffer;
-    t.flags = 0;
-    len = BUF_SIZE;
-    esp_err_t ret = ESP_OK; // Initialize ret to avoid the error
-#else
-    uint8_t buffer[BUF_SIZE];
-#endif
-
-    // Calculate actual data to send
-#ifdef USE_EXTERNAL_ADC
-    size_t sample_size = sizeof(uint8_t);
-#else
-    size_t sample_size = sizeof(uint8_t);
-#endif
-
-    void *send_buffer = buffer + (get_discard_head() * sample_size);
-    size_t send_len = get_samples_per_packet() * sample_size;
+    TickType_t last_heartbeat = xTaskGetTickCount();
+    frame_desc_t frame;
+    bool starved = false; // Whether the current underrun has already been counted
 
-    int flags = MSG_MORE;
+    for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+        clients[i].sock = -1;
+    }
 
     while (1) {
 #ifndef USE_EXTERNAL_ADC
         // Only for internal ADC: WiFi operations check
         if (atomic_load(&wifi_operation_requested)) {
             ESP_LOGI(TAG, "WiFi operation requested, pausing ADC operations");
+            close_all_clients();
 
             if (atomic_load(&adc_is_running)) {
                 stop_adc_sampling();
             }
 
+            if (record_capture) {
+                stop_capture();
+                record_capture = false;
+            }
             atomic_store(&wifi_operation_acknowledged, 1);
 
             while (atomic_load(&wifi_operation_requested)) {
@@ -369,22 +1889,18 @@ void socket_task(void *pvParameters)
 
             ESP_LOGI(TAG, "Resuming ADC operations after WiFi change");
         }
-#endif
-
-#ifdef USE_EXTERNAL_ADC
-        ESP_LOGD(TAG, "Socket task main loop - reset_flag:%d, new_sock:%d, current_sock:%d, client_sock:%d",
-                 atomic_load(&socket_reset_requested), new_sock, current_sock, client_sock);
-        // Check for socket reset more frequently
+#else
+        ESP_LOGD(TAG, "Socket task main loop - reset_flag:%d, new_sock:%d, current_sock:%d, clients:%d",
+                 atomic_load(&socket_reset_requested), new_sock, current_sock, client_count);
         if (atomic_load(&socket_reset_requested)) {
             ESP_LOGI(TAG, "---------------------------------------------");
             ESP_LOGI(TAG, "SOCKET RESET: Detected in main loop");
-            ESP_LOGI(TAG, "Socket values - new:%d, current:%d, client:%d", new_sock, current_sock, client_sock);
+            ESP_LOGI(TAG, "Socket values - new:%d, current:%d, clients:%d", new_sock, current_sock, client_count);
 
-            if (client_sock >= 0) {
-                ESP_LOGI(TAG, "SOCKET RESET: Closing client socket %d due to reset request", client_sock);
-                safe_close(client_sock);
-                client_sock = -1;
-                ESP_LOGI(TAG, "SOCKET RESET: Client socket closed successfully");
+            if (client_count > 0) {
+                ESP_LOGI(TAG, "SOCKET RESET: Closing %d client sockets due to reset request", client_count);
+                close_all_clients();
+                ESP_LOGI(TAG, "SOCKET RESET: Client sockets closed successfully");
             } else {
                 ESP_LOGI(TAG, "SOCKET RESET: No client socket to close");
             }
@@ -395,21 +1911,29 @@ void socket_task(void *pvParameters)
             // Add delay to ensure clean state transition
             vTaskDelay(pdMS_TO_TICKS(100));
             ESP_LOGI(TAG, "---------------------------------------------");
-
-            // Continue to restart from the beginning of the loop
             continue;
         }
 #endif
 
+        update_record_capture();
+
         // Detect if the socket has changed
         if (new_sock != current_sock) {
             ESP_LOGI(TAG, "Detected socket change: previous=%d, new=%d", current_sock, new_sock);
             current_sock = new_sock;
-            // If we were connected with a client, close that connection
-            if (client_sock >= 0) {
-                safe_close(client_sock);
-                client_sock = -1;
-                ESP_LOGI(TAG, "Closed previous client connection due to socket change");
+            // Clients of the previous socket belong to the old configuration
+            if (client_count > 0) {
+                close_all_clients();
+                ESP_LOGI(TAG, "Closed previous client connections due to socket change");
+            }
+
+            close_udp_socket();
+            if (new_sock >= 0) {
+                // Non-blocking, so waiting for clients never holds up the ones already streaming
+                int sock_flags = fcntl(new_sock, F_GETFL, 0);
+                fcntl(new_sock, F_SETFL, sock_flags | O_NONBLOCK);
+                open_udp_socket(new_sock);
+                ESP_LOGI(TAG, "Waiting for client connections on socket %d...", new_sock);
             }
         }
 
@@ -418,254 +1942,87 @@ void socket_task(void *pvParameters)
             continue;
         }
 
-        // Make the listening socket non-blocking to be able to periodically
-        // check if it has changed
-        int sock_flags = fcntl(new_sock, F_GETFL, 0);
-        fcntl(new_sock, F_SETFL, sock_flags | O_NONBLOCK);
-
-        ESP_LOGI(TAG, "Waiting for client connection on socket %d...", new_sock);
-
-        bool accept_completed = false;
-        // Connection acceptance loop with timeouts to be able to detect changes
-        while (!accept_completed) {
-#ifdef USE_EXTERNAL_ADC
-            // Check for socket reset request
-            if (atomic_load(&socket_reset_requested)) {
-                ESP_LOGI(TAG, "SOCKET RESET: Requested while waiting for connection");
-                atomic_store(&socket_reset_requested, 0);
-                accept_completed = true; // Exit the accept loop
-                break;
-            }
-#endif
-
-            // Check if the socket has changed
-            if (new_sock != current_sock) {
-                ESP_LOGI(TAG, "Socket changed while waiting for connection: old=%d, new=%d", current_sock, new_sock);
-                accept_completed = true; // Exit the accept loop
-                break;
-            }
-
-            client_sock = accept(new_sock, (struct sockaddr *)&client_addr, &client_addr_len);
-
-            if (client_sock >= 0) {
-                // Success, we have a connection
-                inet_ntoa_r(client_addr.sin_addr, addr_str, sizeof(addr_str) - 1);
-                ESP_LOGI(TAG, "Client connected: %s, Port: %d", addr_str, ntohs(client_addr.sin_port));
-                accept_completed = true;
-                break;
-            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                // Real error in accept
-                ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+        // The listening socket is non-blocking, so this only accepts a connection that is already waiting
+        if (client_count < MAX_DATA_CLIENTS) {
+            if (accept_client(new_sock) != ESP_OK) {
                 close(new_sock);
                 new_sock = -1;
                 current_sock = -1; // Reset socket tracking
-                accept_completed = true;
-                break;
+                close_all_clients();
+                close_udp_socket();
+                continue;
             }
-
-            // No connection yet, wait a bit and keep checking
-            vTaskDelay(pdMS_TO_TICKS(200));
         }
 
-        // If the socket changed or there was an error, go back to the beginning of the main loop
-        if (new_sock != current_sock || client_sock < 0) {
+        // Subscriptions and NACKs, handled every pass so retransmits go out within the window
+        poll_udp_socket();
+        adopt_ws_sessions();
+
+        if (client_count == 0) {
+            wait_for_events(new_sock, ACCEPT_POLL_MS);
             continue;
         }
 
-        // Return to blocking mode for the listening socket
-        sock_flags = fcntl(new_sock, F_GETFL, 0);
-        fcntl(new_sock, F_SETFL, sock_flags & ~O_NONBLOCK);
-
-#ifdef USE_EXTERNAL_ADC
-        // We don't need to declare ret here since it's already declared and initialized above
-#else
-        if (!atomic_load(&adc_is_running) && !atomic_load(&adc_initializing)) {
-            ESP_LOGI(TAG, "Starting ADC sampling from socket task");
-            start_adc_sampling();
-        } else {
-            ESP_LOGW(TAG, "ADC already running or initializing, not starting again");
+        // Periodic heartbeat to check if task is still running
+        if (xTaskGetTickCount() - last_heartbeat > pdMS_TO_TICKS(2000)) {
+            ESP_LOGI(TAG, "Data transfer heartbeat - still active, clients:%d, overruns:%u, underruns:%u", client_count,
+                     atomic_load(&frame_overruns), atomic_load(&frame_underruns));
+            ESP_LOGI(TAG, "Acquisition task stack: %u bytes never used",
+                     (unsigned)uxTaskGetStackHighWaterMark(acquisition_task_handle));
+            last_heartbeat = xTaskGetTickCount();
         }
-#endif
-
-        bool data_transfer_complete = false;
-        loop_counter = 0;
-        last_heartbeat = xTaskGetTickCount();
-
-        while (!data_transfer_complete) {
-            // Periodic heartbeat to check if task is still running
-            if (++loop_counter % 5000 == 0) {
-                TickType_t current_time = xTaskGetTickCount();
-                if ((current_time - last_heartbeat) > pdMS_TO_TICKS(2000)) {
-                    ESP_LOGI(TAG, "Data transfer heartbeat - still active, client:%d", client_sock);
-                    last_heartbeat = current_time;
-                }
-            }
-
-#ifndef USE_EXTERNAL_ADC
-            // Only for internal ADC: WiFi operations check
-            if (atomic_load(&wifi_operation_requested)) {
-                data_transfer_complete = true;
-                break; // Break the inner loop to handle this at the outer loop level
-            }
-
-            if (adc_modify_freq) {
-                config_adc_sampling();
-                adc_modify_freq = 0;
-            }
-#else
-            // In external ADC mode, check if the socket has changed or reset is requested
-            if (new_sock != current_sock || atomic_load(&socket_reset_requested)) {
-                if (atomic_load(&socket_reset_requested)) {
-                    ESP_LOGI(TAG, "---------------------------------------------");
-                    ESP_LOGI(TAG, "SOCKET RESET: Requested during data transfer");
-                    ESP_LOGI(TAG, "Socket values - new:%d, current:%d, client:%d", new_sock, current_sock, client_sock);
-                    atomic_store(&socket_reset_requested, 0);
-                    ESP_LOGI(TAG, "SOCKET RESET: Reset flag cleared");
-                    ESP_LOGI(TAG, "---------------------------------------------");
-                } else {
-                    ESP_LOGI(TAG, "Socket changed during data transfer");
-                }
-                data_transfer_complete = true;
-                break; // Exit the inner loop and go back to accept()
-            }
-#endif
-            if (mode == 1) {
-#ifdef USE_EXTERNAL_ADC
-                if (xSemaphoreTake(spi_mutex, portMAX_DELAY) == pdTRUE) {
-                    ret = spi_device_polling_transmit(spi, &t);
-                    if (ret != ESP_OK) {
-                        ESP_LOGE(TAG, "SPI transaction failed");
-                    }
-                    xSemaphoreGive(spi_mutex);
-                }
 
-                // Use temporary variable to resolve compilation warning
-                int temp_current_state;
-                pcnt_unit_get_count(pcnt_unit, &temp_current_state);
-                current_state = temp_current_state;
+        // Every captured frame is fanned out to all clients by reference
+        bool captured = false;
+        while (frame_ring_pop(&ready_ring, &frame)) {
+            share_frame(&frame);
+            captured = true;
+        }
 
-                if (last_state == current_state) {
-                    continue;
-                }
-                last_state = current_state;
-
-                if (ret == ESP_OK && len > 0) {
-                    // Use pseudo-non-blocking send
-                    esp_err_t send_result = non_blocking_send(client_sock, send_buffer, send_len, flags);
-                    if (send_result != ESP_OK) {
-                        ESP_LOGE(TAG, "Send error");
-                        data_transfer_complete = true;
-                        break;
-                    }
-                } else {
-                    read_miss_count++;
-                    ESP_LOGW(TAG, "Missed ADC readings! Count: %d", read_miss_count);
-                    if (read_miss_count >= 10) {
-                        ESP_LOGE(TAG, "Critical ADC or SPI data loss detected.");
-                        read_miss_count = 0;
-                    }
-                }
+        // Buffers go back to acquisition only once every client has ACKed them
+        bool pending = false; // Frames waiting to be written or acknowledged
+        bool writing = false; // Frames waiting to be written
+        for (int i = 0; i < MAX_DATA_CLIENTS; i++) {
+            data_client_t *client = &clients[i];
+            if (client->sock < 0) {
                 continue;
-#else
-                TickType_t xLastWakeTime = xTaskGetTickCount();
-                current_state = gpio_get_level(SINGLE_INPUT_PIN);
-
-                // Check for specific edge type
-                bool edge_detected = (trigger_edge == 1) ? (current_state > last_state) : // Positive edge
-                    (current_state < last_state); // Negative edge
-
-                last_state = current_state;
+            }
 
-                if (!edge_detected) {
+            if (client->transport == TRANSPORT_WS) {
+                if (ws_session_closing(client)) {
+                    close_client(client);
                     continue;
                 }
-
-                // If we get here, edge was detected
-                TickType_t xCurrentTime = xTaskGetTickCount();
-                vTaskDelay(pdMS_TO_TICKS(wait_convertion_time / 2) - (xCurrentTime - xLastWakeTime));
-                int ret = adc_continuous_read(adc_handle, buffer, BUF_SIZE, &len, 1000 / portTICK_PERIOD_MS);
-                if (ret == ESP_OK && len > 0) {
-                    // Use non-blocking send
-                    esp_err_t send_result = non_blocking_send(client_sock, send_buffer, send_len, flags);
-                    if (send_result == ESP_ERR_TIMEOUT) {
-                        data_transfer_complete = true;
-                        break; // Break the inner loop to handle WiFi operation
-                    } else if (send_result != ESP_OK) {
-                        ESP_LOGE(TAG, "Send error");
-                        data_transfer_complete = true;
-                        break;
-                    }
-                } else {
-                    read_miss_count++;
-                    ESP_LOGW(TAG, "Missed ADC readings! Count: %d", read_miss_count);
-                    if (read_miss_count >= 10) {
-                        ESP_LOGE(TAG, "Critical ADC or SPI data loss detected.");
-                        read_miss_count = 0;
-                    }
-                }
+                queue_ws_pong(client);
+            }
+            if (client->transport == TRANSPORT_UDP &&
+                esp_timer_get_time() - client->last_heard_us > UDP_CLIENT_TIMEOUT_MS * 1000) {
+                ESP_LOGW(TAG, "UDP client %s:%u timed out", client->addr, client->port);
+                close_client(client);
                 continue;
-#endif
             }
 
-#ifdef USE_EXTERNAL_ADC
-            if (xSemaphoreTake(spi_mutex, portMAX_DELAY) == pdTRUE) {
-                ret = spi_device_polling_transmit(spi, &t);
-                if (ret != ESP_OK) {
-                    ESP_LOGE(TAG, "SPI transaction failed");
-                }
-                xSemaphoreGive(spi_mutex);
+            release_acked_frames(client);
+            if ((client->transport == TRANSPORT_TCP && poll_control(client) != ESP_OK) ||
+                client_write(client) != ESP_OK) {
+                close_client(client);
+                continue;
             }
+            pending |= client->count > 0 || client->replies_len > 0;
+            writing |= client->count > client->written;
+        }
 
-            if (ret == ESP_OK && len > 0) {
-                // Use pseudo-non-blocking send
-                esp_err_t send_result = non_blocking_send(client_sock, send_buffer, send_len, flags);
-                if (send_result != ESP_OK) {
-                    ESP_LOGE(TAG, "Send error");
-                    data_transfer_complete = true;
-                    break;
-                }
-            } else {
-                read_miss_count++;
-                ESP_LOGW(TAG, "Missed ADC readings! Count: %d", read_miss_count);
-                if (read_miss_count >= 10) {
-                    ESP_LOGE(TAG, "Critical ADC or SPI data loss detected.");
-                    read_miss_count = 0;
-                }
-            }
-#else
-            vTaskDelay(pdMS_TO_TICKS(wait_convertion_time));
-            int ret = adc_continuous_read(adc_handle, buffer, BUF_SIZE, &len, 1000 / portTICK_PERIOD_MS);
-
-            if (ret == ESP_OK && len > 0) {
-                // Use non-blocking send for continuous mode
-                esp_err_t send_result = non_blocking_send(client_sock, send_buffer, send_len, flags);
-                if (send_result == ESP_ERR_TIMEOUT) {
-                    data_transfer_complete = true;
-                    break; // Break the inner loop to handle WiFi operation
-                } else if (send_result != ESP_OK) {
-                    ESP_LOGE(TAG, "Send error");
-                    data_transfer_complete = true;
-                    break;
-                }
-            } else {
-                read_miss_count++;
-                ESP_LOGW(TAG, "Missed ADC readings! Count: %d", read_miss_count);
-                if (read_miss_count >= 10) {
-                    ESP_LOGE(TAG, "Critical ADC or SPI data loss detected.");
-                    read_miss_count = 0;
-                }
+        if (!captured && !writing) {
+            if (!starved) {
+                atomic_fetch_add(&frame_underruns, 1);
+                starved = true;
             }
-#endif
+        } else {
+            starved = false;
         }
 
-#ifndef USE_EXTERNAL_ADC
-        stop_adc_sampling();
-#endif
-
-        if (client_sock >= 0) {
-            safe_close(client_sock);
-            client_sock = -1;
-            ESP_LOGI(TAG, "Client disconnected");
-        }
+        // A blocked client wakes the task as soon as its buffer drains. Frames only waiting for their ACK
+        // are checked every tick so buffers are not held longer than needed.
+        wait_for_events(new_sock, pending ? portTICK_PERIOD_MS : ACCEPT_POLL_MS);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,22 @@
+/**
+ * @file frame_header.c
+ * @brief Frame header selection
+ */
+
+#include "frame_header.h"
+#include <stdatomic.h>
+
+/**
+ * @brief Whether the next data connection sends frame headers
+ */
+static atomic_bool header_enabled = ATOMIC_VAR_INIT(false);
+
+void frame_header_set_enabled(bool enabled)
+{
+    atomic_store(&header_enabled, enabled);
+}
+
+bool frame_header_enabled(void)
+{
+    return atomic_load(&header_enabled);
+}
@@ -0,0 +1,192 @@
+/**
+ * @file frame_pool.c
+ * @brief Implementation of the preallocated frame buffer pool
+ */
+
+#include "frame_pool.h"
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <stdatomic.h>
+#include <string.h>
+
+static const char *TAG = "FRAME_POOL";
+
+/**
+ * @brief Chunks allocated so far, the first chunk_count are set
+ */
+static uint8_t *chunks[FRAME_BUFFERS];
+static int chunk_count = 0;
+static const char *pool_memory = "none";
+static size_t slot_len = 0;
+static int slots_per_chunk = 0;
+
+/**
+ * @brief Buffers of the current carving, read by the HTTP API
+ */
+static atomic_int slot_count = ATOMIC_VAR_INIT(0);
+
+/**
+ * @brief Whether each buffer is owned, by acquisition_task or by the frame it was passed on with
+ */
+static atomic_bool owned[FRAME_POOL_MAX_SLOTS];
+
+static atomic_int in_use = ATOMIC_VAR_INIT(0);
+static atomic_int peak_in_use = ATOMIC_VAR_INIT(0);
+
+static inline size_t aligned_len(size_t frame_len)
+{
+    return (frame_len + FRAME_POOL_ALIGN - 1) & ~(size_t)(FRAME_POOL_ALIGN - 1);
+}
+
+/**
+ * @brief Name the memory a set of heap_caps flags allocates from
+ */
+static const char *memory_name(uint32_t caps)
+{
+    if (caps & MALLOC_CAP_SPIRAM) {
+        return "psram";
+    }
+    return caps & MALLOC_CAP_DMA ? "dma" : "internal";
+}
+
+/**
+ * @brief Allocate one chunk, falling back to fallback_caps
+ *
+ * @return The chunk, NULL if neither placement has a large enough block
+ */
+static uint8_t *allocate_chunk(uint32_t caps, uint32_t fallback_caps, const char **memory)
+{
+    uint8_t *chunk = heap_caps_malloc(FRAME_POOL_CHUNK_SIZE, caps);
+    if (chunk == NULL && fallback_caps != 0) {
+        ESP_LOGW(TAG, "No %s block of %d bytes (largest %zu), trying %s", memory_name(caps), FRAME_POOL_CHUNK_SIZE,
+                 heap_caps_get_largest_free_block(caps), memory_name(fallback_caps));
+        caps = fallback_caps;
+        chunk = heap_caps_malloc(FRAME_POOL_CHUNK_SIZE, caps);
+    }
+    if (chunk == NULL) {
+        ESP_LOGE(TAG, "No %s block of %d bytes for a frame chunk, largest free block is %zu bytes",
+                 memory_name(caps), FRAME_POOL_CHUNK_SIZE, heap_caps_get_largest_free_block(caps));
+        return NULL;
+    }
+    *memory = memory_name(caps);
+    return chunk;
+}
+
+esp_err_t frame_pool_init(uint32_t caps, uint32_t fallback_caps)
+{
+    if (chunk_count == FRAME_BUFFERS) {
+        return ESP_OK;
+    }
+
+    while (chunk_count < FRAME_BUFFERS) {
+        const char *memory;
+        uint8_t *chunk = allocate_chunk(caps, fallback_caps, &memory);
+        if (chunk == NULL) {
+            break;
+        }
+        pool_memory = chunk_count == 0 || strcmp(pool_memory, memory) == 0 ? memory : "mixed";
+        chunks[chunk_count++] = chunk;
+    }
+
+    if (chunk_count == 0) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (chunk_count < FRAME_BUFFERS) {
+        ESP_LOGW(TAG, "Only %d of %d frame chunks allocated, capture and send overlap less", chunk_count,
+                 FRAME_BUFFERS);
+    }
+    ESP_LOGI(TAG, "%d frame chunks of %d bytes allocated in %s memory", chunk_count, FRAME_POOL_CHUNK_SIZE,
+             pool_memory);
+    return ESP_OK;
+}
+
+const char *frame_pool_memory(void)
+{
+    return pool_memory;
+}
+
+int frame_pool_chunks(void)
+{
+    return chunk_count;
+}
+
+int frame_pool_slots_for(size_t frame_len)
+{
+    if (frame_len == 0) {
+        return 0;
+    }
+
+    size_t slots = (FRAME_POOL_CHUNK_SIZE / aligned_len(frame_len)) * (chunk_count > 0 ? chunk_count : FRAME_BUFFERS);
+    return slots > FRAME_POOL_MAX_SLOTS ? FRAME_POOL_MAX_SLOTS : (int)slots;
+}
+
+int frame_pool_carve(size_t frame_len)
+{
+    if (atomic_load(&in_use) > 0) {
+        return 0;
+    }
+
+    int slots = chunk_count > 0 ? frame_pool_slots_for(frame_len) : 0;
+    if (slots == 0) {
+        return 0;
+    }
+
+    slot_len = aligned_len(frame_len);
+    slots_per_chunk = (int)(FRAME_POOL_CHUNK_SIZE / slot_len);
+    atomic_store(&slot_count, slots);
+    atomic_store(&peak_in_use, 0);
+    ESP_LOGI(TAG, "Frame chunks carved into %d buffers of %zu bytes", slots, slot_len);
+    return slots;
+}
+
+int frame_pool_acquire(void)
+{
+    int count = atomic_load(&slot_count);
+    for (int i = 0; i < count; i++) {
+        bool expected = false;
+        if (!atomic_load_explicit(&owned[i], memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&owned[i], &expected, true)) {
+            int used = atomic_fetch_add(&in_use, 1) + 1;
+            if (used > atomic_load_explicit(&peak_in_use, memory_order_relaxed)) {
+                atomic_store_explicit(&peak_in_use, used, memory_order_relaxed); // Only acquire raises it
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool frame_pool_release(int index)
+{
+    if (!atomic_exchange(&owned[index], false)) {
+        return false; // Already free, the pool counts stay right
+    }
+
+    atomic_fetch_sub(&in_use, 1);
+    return true;
+}
+
+uint8_t *frame_pool_slot(int index)
+{
+    return chunks[index / slots_per_chunk] + (size_t)(index % slots_per_chunk) * slot_len;
+}
+
+int frame_pool_count(void)
+{
+    return atomic_load(&slot_count);
+}
+
+size_t frame_pool_slot_len(void)
+{
+    return slot_len;
+}
+
+int frame_pool_in_use(void)
+{
+    return atomic_load(&in_use);
+}
+
+int frame_pool_peak_in_use(void)
+{
+    return atomic_load(&peak_in_use);
+}
@@ -0,0 +1,50 @@
+/**
+ * @file frame_ring.c
+ * @brief Implementation of the lock-free frame descriptor ring
+ */
+
+#include "frame_ring.h"
+
+void frame_ring_init(frame_ring_t *ring)
+{
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+}
+
+bool frame_ring_push(frame_ring_t *ring, const frame_desc_t *desc)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail >= FRAME_RING_CAPACITY) {
+        return false;
+    }
+
+    ring->slots[head & (FRAME_RING_CAPACITY - 1)] = *desc;
+
+    // Publish the slot only after its contents are written
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool frame_ring_pop(frame_ring_t *ring, frame_desc_t *desc)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        return false;
+    }
+
+    *desc = ring->slots[tail & (FRAME_RING_CAPACITY - 1)];
+
+    // Release the slot only after its contents are read
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+unsigned frame_ring_count(frame_ring_t *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+        atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
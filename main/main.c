@@ -14,6 +14,28 @@
 static const char *TAG = "MAIN";
 
 TaskHandle_t socket_task_handle; /**< Handle to the socket communication task */
+TaskHandle_t acquisition_task_handle; /**< Handle to the frame acquisition task */
+
+/**
+ * @brief Log the internal RAM left once every buffer and task is allocated
+ *
+ * The frame arena and the segment and averaging buffers are sized against
+ * BUF_SIZE, so this shows how much room a build leaves for WiFi and lwIP.
+ */
+static void report_free_heap(void)
+{
+    size_t internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    size_t internal_block = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    size_t dma = heap_caps_get_free_size(MALLOC_CAP_DMA);
+    size_t dma_block = heap_caps_get_largest_free_block(MALLOC_CAP_DMA);
+
+    ESP_LOGI(TAG, "Free internal heap: %zu bytes (largest block %zu), DMA-capable: %zu bytes (largest block %zu)",
+             internal, internal_block, dma, dma_block);
+    if (internal < MIN_FREE_INTERNAL_HEAP) {
+        ESP_LOGW(TAG, "Less than %d bytes of internal heap left, reduce FRAME_BUFFERS or BUF_SIZE",
+                 MIN_FREE_INTERNAL_HEAP);
+    }
+}
 
 void app_main(void)
 {
@@ -63,6 +85,9 @@ void app_main(void)
     init_mcpwm_trigger(); // Configure precise trigger with MCPWM
     init_pulse_counter(); // Initialize pulse counter for edge detection
     ESP_LOGI(TAG, "External ADC via SPI initialized");
+#else
+    // Reserve the internal ADC driver before WiFi and the frame pool take the heap
+    ESP_ERROR_CHECK(adc_sampling_init());
 #endif
 
     // Initialize timer for precise synchronization
@@ -89,23 +114,31 @@ void app_main(void)
     }
     ESP_LOGI(TAG, "Primary HTTP server started on port 81");
 
-    // Initialize data transmission subsystem
-    data_transmission_init();
+    // Initialize data transmission subsystem (allocates the capture buffers)
+    ret = data_transmission_init();
+    if (ret != ESP_OK) {
+        // Keep the HTTP server up so the failure can be read from the log instead of boot looping
+        ESP_LOGE(TAG, "Data transmission init failed: %s, acquisition not started", esp_err_to_name(ret));
+        report_free_heap();
+        return;
+    }
     ESP_LOGI(TAG, "Data transmission subsystem initialized");
 
-    // Create the main task for socket handling on core 1
-#ifdef USE_EXTERNAL_ADC
-    xTaskCreatePinnedToCore(socket_task, "socket_task", 72000, NULL, 5, &socket_task_handle, 1);
-#else
-    xTaskCreatePinnedToCore(socket_task, "socket_task", 53000, NULL, 5, &socket_task_handle, 1);
-#endif
+    // Create the acquisition task on core 1, above the sender so a slow client cannot stall the ADC.
+    // Its deepest path is a rate switch log (printf with a double) below the segment, hires and averaging
+    // processing, about 3 KB; the rest is margin. socket_task logs the measured high water mark.
+    xTaskCreatePinnedToCore(acquisition_task, "acquisition_task", 6144, NULL, 10, &acquisition_task_handle, 1);
+
+    // Create the sender task for socket handling on core 0, next to the network stack
+    xTaskCreatePinnedToCore(socket_task, "socket_task", 8192, NULL, 5, &socket_task_handle, 0);
 
     // Activate LED to indicate socket is ready for connections
     gpio_set_level(LED_GPIO, 1);
-    ESP_LOGI(TAG, "Socket task created on core 1");
+    ESP_LOGI(TAG, "Acquisition task created on core 1, socket task on core 0");
 
     // Start memory monitoring task (optional, commented out by default)
     // xTaskCreate(memory_monitor_task, "memory_monitor", 2048, NULL, 1, NULL);
 
+    report_free_heap();
     ESP_LOGI(TAG, "ESP32 Oscilloscope initialization complete");
 }
\ No newline at end of file
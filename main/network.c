@@ -164,7 +164,7 @@ esp_err_t create_socket_and_bind(esp_netif_ip_info_t *ip_info)
     }
 
     // Start listening
-    if (listen(sock, 1) != 0) {
+    if (listen(sock, MAX_DATA_CLIENTS) != 0) {
         ESP_LOGE(TAG, "Error during listen: errno %d", errno);
         safe_close(sock);
         return ESP_FAIL;
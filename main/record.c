@@ -0,0 +1,284 @@
+/**
+ * @file record.c
+ * @brief Implementation of the PSRAM deep record
+ */
+
+#include "record.h"
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "acquisition.h"
+#include "sdkconfig.h"
+#include "signal_processing.h"
+
+static const char *TAG = "RECORD";
+
+static const char *state_names[] = {
+    [RECORD_IDLE] = "idle", [RECORD_ARMED] = "armed", [RECORD_BUSY] = "busy",
+    [RECORD_DONE] = "done", [RECORD_READING] = "reading",
+};
+
+/**
+ * @brief Owner of the record
+ *
+ * Whoever moves the state to RECORD_BUSY or RECORD_READING with a
+ * compare-and-swap may touch the fields below until it stores the next
+ * state, so the record needs no mutex shared with acquisition_task.
+ */
+static atomic_int record_state = ATOMIC_VAR_INIT(RECORD_IDLE);
+
+/**
+ * @brief Set from record_arm() until the record is full or freed, read by socket_task
+ */
+static atomic_bool filling = ATOMIC_VAR_INIT(false);
+
+static struct {
+    uint8_t *data; /**< Record in PSRAM, samples * 2 bytes */
+    record_frame_entry_t *frame_table; /**< Entry of every frame appended, in PSRAM */
+    size_t table_len; /**< Entries frame_table holds */
+    size_t samples; /**< Length in samples */
+    size_t filled; /**< Samples captured so far */
+    uint32_t frames; /**< Frames appended */
+    int64_t first_us; /**< Completion time of the first frame */
+    int64_t last_us; /**< Completion time of the last frame */
+    uint32_t sample_rate_hz; /**< Hardware sample rate when armed */
+} record;
+
+/**
+ * @brief Take the record away from acquisition_task and readers
+ */
+static void claim_record(void)
+{
+    while (1) {
+        int state = atomic_load(&record_state);
+        if (state == RECORD_BUSY || state == RECORD_READING) {
+            vTaskDelay(1);
+            continue;
+        }
+        if (atomic_compare_exchange_weak(&record_state, &state, RECORD_BUSY)) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Free the record's memory, the caller has claimed it
+ */
+static void free_record(void)
+{
+    atomic_store(&filling, false);
+    heap_caps_free(record.data);
+    heap_caps_free(record.frame_table);
+    memset(&record, 0, sizeof(record));
+}
+
+esp_err_t record_arm(size_t samples)
+{
+#ifdef CONFIG_SPIRAM
+    if (samples < RECORD_MIN_SAMPLES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    claim_record();
+    free_record();
+
+    // Every frame but the last holds at least RECORD_FRAME_MIN_SAMPLES, so the table cannot run out
+    const size_t table_len = samples / RECORD_FRAME_MIN_SAMPLES + 1;
+    record.data = heap_caps_malloc(samples * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    record.frame_table =
+        heap_caps_malloc(table_len * sizeof(record_frame_entry_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (record.data == NULL || record.frame_table == NULL) {
+        ESP_LOGE(TAG, "No PSRAM for a %zu-sample record", samples);
+        free_record();
+        atomic_store(&record_state, RECORD_IDLE);
+        return ESP_ERR_NO_MEM;
+    }
+
+    record.samples = samples;
+    record.table_len = table_len;
+    record.sample_rate_hz = get_current_sample_rate();
+    atomic_store(&filling, true);
+    atomic_store(&record_state, RECORD_ARMED);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void record_free(void)
+{
+    claim_record();
+    free_record();
+    atomic_store(&record_state, RECORD_IDLE);
+}
+
+bool record_filling(void)
+{
+    return atomic_load(&filling);
+}
+
+void record_get_status(record_status_t *status)
+{
+    // The fields are read without claiming the record, so they may be a frame apart
+    status->state = (record_state_t)atomic_load(&record_state);
+    status->samples = record.samples;
+    status->filled = record.filled;
+    status->frames = record.frames;
+    status->first_us = record.first_us;
+    status->last_us = record.last_us;
+    status->sample_rate_hz = record.sample_rate_hz;
+}
+
+size_t record_max_samples(void)
+{
+#ifdef CONFIG_SPIRAM
+    return heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) / 2;
+#else
+    return 0;
+#endif
+}
+
+void record_frame(const uint8_t *data, size_t len, int64_t timestamp_us)
+{
+    int state = RECORD_ARMED;
+    if (!atomic_compare_exchange_strong(&record_state, &state, RECORD_BUSY)) {
+        return;
+    }
+
+    size_t samples = len / 2;
+    if (samples > record.samples - record.filled) {
+        samples = record.samples - record.filled;
+    }
+
+    // The frame buffers stay in internal RAM for the SPI DMA, PSRAM only ever sees this copy
+    memcpy(&record.data[record.filled * 2], data, samples * 2);
+    if (record.frames == 0) {
+        record.first_us = timestamp_us;
+    }
+    record.last_us = timestamp_us;
+    if (record.frames < record.table_len) {
+        record.frame_table[record.frames] = (record_frame_entry_t){
+            .first_sample = record.filled,
+            .samples = samples,
+            .end_us = timestamp_us,
+        };
+    }
+    record.frames++;
+    record.filled += samples;
+
+    if (record.filled == record.samples) {
+        atomic_store(&filling, false);
+        atomic_store(&record_state, RECORD_DONE);
+    } else {
+        atomic_store(&record_state, RECORD_ARMED);
+    }
+}
+
+/**
+ * @brief Take a finished record for reading
+ *
+ * @return ESP_OK once the state is RECORD_READING, ESP_ERR_INVALID_STATE if no finished record exists
+ */
+static esp_err_t claim_for_reading(void)
+{
+    while (1) {
+        int state = atomic_load(&record_state);
+        if (state == RECORD_BUSY || state == RECORD_READING) {
+            vTaskDelay(1);
+            continue;
+        }
+        if (state != RECORD_DONE) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        if (atomic_compare_exchange_weak(&record_state, &state, RECORD_READING)) {
+            return ESP_OK;
+        }
+    }
+}
+
+esp_err_t record_read(size_t start, size_t count, int step, record_sink_t sink, void *ctx)
+{
+    if (claim_for_reading() != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (start >= record.samples || step < 1) {
+        atomic_store(&record_state, RECORD_DONE);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (count > record.samples - start) {
+        count = record.samples - start;
+    }
+
+    esp_err_t ret = ESP_OK;
+    const uint8_t *in = &record.data[start * 2];
+
+    if (step == 1) {
+        // lwIP copies the data anyway, so PSRAM is handed over directly
+        for (size_t done = 0; done < count && ret == ESP_OK; done += RECORD_READ_CHUNK_SAMPLES) {
+            size_t chunk = count - done < RECORD_READ_CHUNK_SAMPLES ? count - done : RECORD_READ_CHUNK_SAMPLES;
+            ret = sink(ctx, &in[done * 2], chunk * 2);
+        }
+    } else {
+        // Min/max pairs are staged in internal RAM, a trailing partial bucket is dropped
+        uint8_t staging[RECORD_READ_CHUNK_SAMPLES * 2];
+        const uint16_t mask = get_data_mask();
+        const size_t buckets = count / step;
+        size_t staged = 0;
+
+        for (size_t b = 0; b < buckets && ret == ESP_OK; b++) {
+            uint16_t lo = mask;
+            uint16_t hi = 0;
+            for (int i = 0; i < step; i++) {
+                uint16_t value = adc_word_read(in) & mask;
+                lo = value < lo ? value : lo;
+                hi = value > hi ? value : hi;
+                in += 2;
+            }
+
+            adc_word_write(&staging[staged * 2], lo);
+            adc_word_write(&staging[staged * 2 + 2], hi);
+            staged += 2;
+            if (staged == RECORD_READ_CHUNK_SAMPLES) {
+                ret = sink(ctx, staging, staged * 2);
+                staged = 0;
+            }
+        }
+        if (staged > 0 && ret == ESP_OK) {
+            ret = sink(ctx, staging, staged * 2);
+        }
+    }
+
+    atomic_store(&record_state, RECORD_DONE);
+    return ret;
+}
+
+esp_err_t record_read_frames(record_sink_t sink, void *ctx)
+{
+    if (claim_for_reading() != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Same chunk size as the samples, PSRAM is handed over directly
+    const size_t per_chunk = RECORD_READ_CHUNK_SAMPLES * 2 / sizeof(record_frame_entry_t);
+    const size_t frames = record.frames < record.table_len ? record.frames : record.table_len;
+    esp_err_t ret = ESP_OK;
+    for (size_t done = 0; done < frames && ret == ESP_OK; done += per_chunk) {
+        size_t chunk = frames - done < per_chunk ? frames - done : per_chunk;
+        ret = sink(ctx, (const uint8_t *)&record.frame_table[done], chunk * sizeof(record_frame_entry_t));
+    }
+
+    atomic_store(&record_state, RECORD_DONE);
+    return ret;
+}
+
+const char *record_state_name(record_state_t state)
+{
+    if (state < 0 || state > RECORD_READING) {
+        return "unknown";
+    }
+    return state_names[state];
+}
@@ -0,0 +1,190 @@
+/**
+ * @file sample_format.c
+ * @brief Implementation of the wire sample formats
+ */
+
+#include "sample_format.h"
+#include <stdatomic.h>
+#include <string.h>
+#include "acquisition.h"
+#include "globals.h"
+#include "signal_processing.h"
+
+static const char *format_names[SAMPLE_FORMAT_COUNT] = {
+    [SAMPLE_FORMAT_RAW16] = "raw16",
+    [SAMPLE_FORMAT_PACKED] = "packed",
+    [SAMPLE_FORMAT_DISPLAY8] = "display8",
+    [SAMPLE_FORMAT_DELTA] = "delta",
+};
+
+/**
+ * @brief Format applied to the next data connection
+ */
+static atomic_int selected_format = ATOMIC_VAR_INIT(SAMPLE_FORMAT_RAW16);
+
+const char *sample_format_name(sample_format_t format)
+{
+    if (format < 0 || format >= SAMPLE_FORMAT_COUNT) {
+        return "unknown";
+    }
+    return format_names[format];
+}
+
+esp_err_t sample_format_from_name(const char *name, sample_format_t *format)
+{
+    for (int i = 0; i < SAMPLE_FORMAT_COUNT; i++) {
+        if (strcmp(name, format_names[i]) == 0) {
+            *format = (sample_format_t)i;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+int sample_format_bits(sample_format_t format)
+{
+    switch (format) {
+    case SAMPLE_FORMAT_PACKED:
+        return __builtin_popcount(get_data_mask());
+    case SAMPLE_FORMAT_DISPLAY8:
+        return 8;
+    case SAMPLE_FORMAT_DELTA:
+        return 0;
+    default:
+        return 16;
+    }
+}
+
+/**
+ * @brief MSB-first bit stream writer
+ */
+typedef struct {
+    uint8_t *out; /**< Next byte to write */
+    uint32_t acc; /**< Bits not yet written, right-aligned */
+    int acc_bits; /**< Number of valid bits in acc */
+} bit_writer_t;
+
+static inline void put_bits(bit_writer_t *w, uint32_t value, int bits)
+{
+    // bits never exceeds 17, so acc holds at most 24 pending bits
+    w->acc = (w->acc << bits) | value;
+    w->acc_bits += bits;
+    while (w->acc_bits >= 8) {
+        w->acc_bits -= 8;
+        *w->out++ = (uint8_t)(w->acc >> w->acc_bits);
+    }
+}
+
+static inline void align_bits(bit_writer_t *w)
+{
+    if (w->acc_bits > 0) {
+        *w->out++ = (uint8_t)(w->acc << (8 - w->acc_bits));
+        w->acc_bits = 0;
+    }
+}
+
+/**
+ * @brief Number of bits needed to hold value
+ */
+static inline int bit_length(uint32_t value)
+{
+    return value == 0 ? 0 : 32 - __builtin_clz(value);
+}
+
+/**
+ * @brief Encode one block with zigzag delta and frame-of-reference packing
+ *
+ * Falls back to the plain packed samples if the deltas would not be smaller.
+ */
+static void encode_delta_block(bit_writer_t *w, const uint16_t *values, int count, int width)
+{
+    uint32_t zigzag[DELTA_BLOCK_SAMPLES];
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+
+    for (int i = 1; i < count; i++) {
+        int32_t delta = (int32_t)values[i] - (int32_t)values[i - 1];
+        zigzag[i] = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+        if (zigzag[i] < min) {
+            min = zigzag[i];
+        }
+        if (zigzag[i] > max) {
+            max = zigzag[i];
+        }
+    }
+    if (count < 2) {
+        min = max = 0;
+    }
+
+    int delta_bits = bit_length(max - min);
+    int delta_size = width + (width + 1) + (count - 1) * delta_bits;
+
+    if (delta_size >= count * width) {
+        put_bits(w, DELTA_BLOCK_RAW, 8);
+        for (int i = 0; i < count; i++) {
+            put_bits(w, values[i], width);
+        }
+    } else {
+        put_bits(w, delta_bits, 8);
+        put_bits(w, values[0], width);
+        put_bits(w, min, width + 1);
+        for (int i = 1; i < count; i++) {
+            put_bits(w, zigzag[i] - min, delta_bits);
+        }
+    }
+
+    align_bits(w);
+}
+
+size_t sample_format_encode(sample_format_t format, uint16_t mask, uint8_t *data, size_t len)
+{
+    if (format == SAMPLE_FORMAT_RAW16) {
+        return len;
+    }
+
+    const int shift = __builtin_ctz(mask);
+    const int width = __builtin_popcount(mask);
+    const size_t samples = len / 2;
+    bit_writer_t writer = {.out = data, .acc = 0, .acc_bits = 0};
+
+    if (format == SAMPLE_FORMAT_DISPLAY8) {
+        const int display_shift = shift + width - 8;
+        for (size_t i = 0; i < samples; i++) {
+            data[i] = (uint8_t)((adc_word_read(&data[2 * i]) & mask) >> display_shift);
+        }
+        return samples;
+    }
+
+    if (format == SAMPLE_FORMAT_DELTA) {
+        // A block is read completely before it is written, and even a raw block
+        // (1 + DELTA_BLOCK_SAMPLES * width / 8 bytes) is smaller than its input,
+        // so the output stays behind the input for any frame of two or more samples
+        uint16_t values[DELTA_BLOCK_SAMPLES];
+        for (size_t start = 0; start < samples; start += DELTA_BLOCK_SAMPLES) {
+            int count = samples - start < DELTA_BLOCK_SAMPLES ? samples - start : DELTA_BLOCK_SAMPLES;
+            for (int i = 0; i < count; i++) {
+                values[i] = (adc_word_read(&data[2 * (start + i)]) & mask) >> shift;
+            }
+            encode_delta_block(&writer, values, count, width);
+        }
+        return writer.out - data;
+    }
+
+    // Output bits of sample i end at or before byte 2 * i + 1, which has already been read
+    for (size_t i = 0; i < samples; i++) {
+        put_bits(&writer, (adc_word_read(&data[2 * i]) & mask) >> shift, width);
+    }
+    align_bits(&writer);
+
+    return writer.out - data;
+}
+
+void sample_format_select(sample_format_t format)
+{
+    atomic_store(&selected_format, format);
+}
+
+sample_format_t sample_format_selected(void)
+{
+    return (sample_format_t)atomic_load(&selected_format);
+}
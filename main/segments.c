@@ -0,0 +1,237 @@
+/**
+ * @file segments.c
+ * @brief Implementation of the segmented capture store
+ */
+
+#include "segments.h"
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "acquisition.h"
+#include "stats.h"
+
+static const char *TAG = "SEGMENTS";
+
+/**
+ * @brief Setting requested by the HTTP API, packed as count << 16 | samples
+ */
+static atomic_int segments_request = ATOMIC_VAR_INIT(0);
+
+/**
+ * @brief Setting currently in effect, read by other tasks
+ */
+static atomic_int segments_active = ATOMIC_VAR_INIT(0);
+
+/**
+ * @brief Store state, only touched by acquisition_task except for busy
+ */
+static struct {
+    int request; /**< Request the store was set up for */
+    size_t frame_samples; /**< Frame length the request was checked against */
+    uint8_t *store; /**< segment_batch_t, entries and samples, in wire order */
+    int count; /**< Segments per batch */
+    size_t samples; /**< Samples per segment */
+    int filled; /**< Segments stored in the current batch */
+    size_t trigger_index; /**< Pre-trigger samples of the segments in the current batch */
+    atomic_bool busy; /**< Set while the store is sent, cleared once the transport holds no reference to it */
+    int64_t last_end_us; /**< Completion time of the last scanned frame, -1 if none */
+    int64_t dead_time_us; /**< Blind time accumulated since the last segment */
+} segments = {.last_end_us = -1};
+
+/**
+ * @brief Whether a batch handed out by segments_take_batch() is still referenced
+ *
+ * Acquire pairs with the release in segments_release(), so the sender's last
+ * access to the store happens before the store is refilled or freed.
+ */
+static inline bool store_busy(void)
+{
+    return atomic_load_explicit(&segments.busy, memory_order_acquire);
+}
+
+static inline segment_batch_t *batch_header(void)
+{
+    return (segment_batch_t *)segments.store;
+}
+
+static inline segment_entry_t *batch_entries(void)
+{
+    return (segment_entry_t *)(segments.store + sizeof(segment_batch_t));
+}
+
+static inline uint8_t *batch_samples(void)
+{
+    return segments.store + sizeof(segment_batch_t) + segments.count * sizeof(segment_entry_t);
+}
+
+esp_err_t segments_configure(int count, int samples)
+{
+    if (count == 0) {
+        atomic_store(&segments_request, 0);
+        return ESP_OK;
+    }
+
+    if (count < 1 || count > SEGMENT_MAX_COUNT || samples < SEGMENT_MIN_SAMPLES ||
+        samples > get_samples_per_packet() / 2 || count * samples > SEGMENT_MAX_STORE_SAMPLES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    atomic_store(&segments_request, count << 16 | samples);
+    return ESP_OK;
+}
+
+int segments_get_count(void)
+{
+    return atomic_load(&segments_active) >> 16;
+}
+
+int segments_get_samples(void)
+{
+    return atomic_load(&segments_active) & 0xFFFF;
+}
+
+bool segments_update(size_t frame_samples)
+{
+    int request = atomic_load(&segments_request);
+    if ((request == segments.request && frame_samples == segments.frame_samples) || store_busy()) {
+        return segments.count > 0;
+    }
+    segments.request = request;
+    segments.frame_samples = frame_samples;
+
+    // A window longer than the frame never fits, e.g. once /frame_length shortened the frames after /segments.
+    // The request is kept and applies again with frames long enough.
+    int applied = request;
+    if ((size_t)(request & 0xFFFF) > frame_samples) {
+        ESP_LOGE(TAG, "Segments of %d samples do not fit frames of %zu samples, segmented capture off",
+                 request & 0xFFFF, frame_samples);
+        applied = 0;
+    }
+    if (applied == (segments.count << 16 | (int)segments.samples)) {
+        return segments.count > 0;
+    }
+
+    // Not busy, so no client queue and no lwIP segment points into the store any more
+    heap_caps_free(segments.store);
+    segments.store = NULL;
+    segments.count = applied >> 16;
+    segments.samples = applied & 0xFFFF;
+    segments_discard();
+
+    if (segments.count > 0) {
+        size_t size = sizeof(segment_batch_t) + segments.count * (sizeof(segment_entry_t) + segments.samples * 2);
+        segments.store = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+        if (segments.store == NULL) {
+            ESP_LOGE(TAG, "No memory for a %zu-byte segment store, segmented capture disabled", size);
+            segments.count = 0;
+            segments.samples = 0;
+            atomic_store(&segments_request, 0);
+            segments.request = 0;
+        }
+    }
+
+    atomic_store(&segments_active, segments.count << 16 | segments.samples);
+    return segments.count > 0;
+}
+
+int segments_capture(const uint8_t *data, size_t len, int64_t end_us, const trigger_config_t *config)
+{
+    const size_t frame_samples = len / 2;
+    const size_t window = segments.samples;
+    const size_t pre = window * config->position / 100;
+    const uint32_t rate = get_current_sample_rate();
+    const int64_t frame_us = (int64_t)frame_samples * 1000000 / rate;
+
+    // A frame is not scanned at all while the last batch is still being sent
+    const bool skipped = store_busy() || window == 0 || window > frame_samples || segments.filled >= segments.count;
+
+    // A window cannot straddle two captures, so besides the gap between them the
+    // last and first window's worth of samples of a boundary cannot hold a trigger
+    if (skipped) {
+        segments.dead_time_us += frame_us;
+    }
+    if (segments.last_end_us >= 0) {
+        int64_t gap_us = end_us - segments.last_end_us - frame_us;
+        if (gap_us < 0) {
+            gap_us = 0;
+        }
+        segments.dead_time_us += gap_us + (skipped ? 0 : (int64_t)window * 1000000 / rate);
+        atomic_store_explicit(&acquisition_stats.rearm_dead_time_us, (uint32_t)gap_us, memory_order_relaxed);
+    }
+    segments.last_end_us = end_us;
+
+    if (skipped) {
+        return 0;
+    }
+
+    // Re-arm right after each segment: the next window starts where the last one ended,
+    // and edge arming only looks at samples after the last trigger
+    size_t next_start = 0;
+    size_t base = 0;
+    int stored = 0;
+    while (segments.filled < segments.count && next_start + window <= frame_samples) {
+        ssize_t trigger =
+            trigger_scan(&data[2 * base], next_start + pre - base, frame_samples - window + pre + 1 - base, config);
+        if (trigger < 0) {
+            break;
+        }
+        trigger += base;
+
+        size_t start = trigger - pre;
+        segments.trigger_index = pre;
+        memcpy(&batch_samples()[segments.filled * window * 2], &data[2 * start], window * 2);
+
+        segment_entry_t *entry = &batch_entries()[segments.filled];
+        entry->timestamp_us = end_us - (int64_t)(frame_samples - trigger) * 1000000 / rate;
+        entry->dead_time_us = (uint32_t)segments.dead_time_us;
+        segments.dead_time_us = 0;
+
+        segments.filled++;
+        stored++;
+        next_start = start + window;
+        base = trigger + 1;
+    }
+
+    // The batch filled up mid-frame: the trigger positions left in the frame were never scanned
+    if (segments.filled == segments.count && frame_samples >= next_start + window) {
+        segments.dead_time_us += (int64_t)(frame_samples - window - next_start + 1) * 1000000 / rate;
+    }
+
+    if (stored > 0) {
+        STATS_ADD(segments_captured, stored);
+    }
+    return stored;
+}
+
+size_t segments_take_batch(sample_format_t format, uint8_t **payload)
+{
+    if (segments.count == 0 || segments.filled < segments.count || store_busy()) {
+        return 0;
+    }
+
+    segment_batch_t *batch = batch_header();
+    batch->count = segments.count;
+    batch->trigger_index = segments.trigger_index;
+    batch->samples = segments.samples;
+
+    size_t encoded =
+        sample_format_encode(format, get_data_mask(), batch_samples(), segments.count * segments.samples * 2);
+
+    segments.filled = 0;
+    atomic_store_explicit(&segments.busy, true, memory_order_release);
+    *payload = segments.store;
+    return batch_samples() - segments.store + encoded;
+}
+
+void segments_release(void)
+{
+    atomic_store_explicit(&segments.busy, false, memory_order_release);
+}
+
+void segments_discard(void)
+{
+    segments.filled = 0;
+    segments.last_end_us = -1;
+    segments.dead_time_us = 0;
+}
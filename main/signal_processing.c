@@ -0,0 +1,420 @@
+/**
+ * @file signal_processing.c
+ * @brief Implementation of the on-device frame processing
+ */
+
+#include "signal_processing.h"
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "acquisition.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "SIGNAL_PROCESSING";
+
+/**
+ * @brief Decimation factor applied to the next frame
+ */
+static atomic_int decimation_factor = ATOMIC_VAR_INIT(1);
+
+/**
+ * @brief Decimation mode applied to the next frame
+ */
+static atomic_int decimation_mode = ATOMIC_VAR_INIT(DECIMATION_FILTER);
+
+static const char *mode_names[DECIMATION_MODE_COUNT] = {
+    [DECIMATION_FILTER] = "filter",
+    [DECIMATION_PEAK] = "peak",
+    [DECIMATION_HIRES] = "hires",
+};
+
+static const char *averaging_names[AVERAGING_MODE_COUNT] = {
+    [AVERAGING_OFF] = "off",
+    [AVERAGING_BLOCK] = "block",
+    [AVERAGING_EXPONENTIAL] = "exponential",
+};
+
+/**
+ * @brief Averaging setting requested by the HTTP API, packed as mode << 16 | frames
+ */
+static atomic_int averaging_request = ATOMIC_VAR_INIT(AVERAGING_OFF << 16 | 1);
+
+/**
+ * @brief Averaging state, only touched by acquisition_task
+ */
+static struct {
+    int request; /**< Request the state was set up for */
+    uint32_t *accumulator; /**< Block sums, or exponential averages in fixed point */
+    size_t capacity; /**< Samples the accumulator can hold */
+    size_t samples; /**< Samples in the running average */
+    int count; /**< Frames added since the last output */
+    bool primed; /**< Whether the exponential average holds a first frame */
+} averaging = {.request = AVERAGING_OFF << 16 | 1};
+
+#ifdef CONFIG_SPIRAM
+#define AVERAGING_PSRAM_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) /* Keeps internal RAM for DMA and lwIP */
+#else
+#define AVERAGING_PSRAM_CAPS 0
+#endif
+
+/**
+ * @brief Setting currently in effect, read by other tasks
+ */
+static atomic_int averaging_active = ATOMIC_VAR_INIT(AVERAGING_OFF << 16 | 1);
+
+esp_err_t decimation_set_factor(int factor)
+{
+    if (factor < 1 || factor > DECIMATION_MAX_FACTOR) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    atomic_store(&decimation_factor, factor);
+    return ESP_OK;
+}
+
+int decimation_get_factor(void)
+{
+    return atomic_load(&decimation_factor);
+}
+
+esp_err_t decimation_set_mode(decimation_mode_t mode)
+{
+    if (mode < 0 || mode >= DECIMATION_MODE_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    atomic_store(&decimation_mode, mode);
+    return ESP_OK;
+}
+
+decimation_mode_t decimation_get_mode(void)
+{
+    return (decimation_mode_t)atomic_load(&decimation_mode);
+}
+
+const char *decimation_mode_name(decimation_mode_t mode)
+{
+    if (mode < 0 || mode >= DECIMATION_MODE_COUNT) {
+        return "unknown";
+    }
+    return mode_names[mode];
+}
+
+esp_err_t decimation_mode_from_name(const char *name, decimation_mode_t *mode)
+{
+    for (int i = 0; i < DECIMATION_MODE_COUNT; i++) {
+        if (strcmp(name, mode_names[i]) == 0) {
+            *mode = (decimation_mode_t)i;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+size_t decimated_samples(size_t samples, int factor, decimation_mode_t mode)
+{
+    if (factor <= 1) {
+        return samples;
+    }
+
+    if (mode == DECIMATION_PEAK) {
+        return 2 * (samples / factor);
+    }
+    if (mode == DECIMATION_HIRES) {
+        return samples / factor;
+    }
+
+    size_t outputs = samples / factor;
+    return outputs > DECIMATION_WARMUP ? outputs - DECIMATION_WARMUP : 0;
+}
+
+size_t decimate_frame(uint8_t *data, size_t len, int factor)
+{
+    if (factor <= 1) {
+        return len;
+    }
+
+    const uint16_t mask = get_data_mask();
+    const int shift = __builtin_ctz(mask);
+    const int32_t max_value = mask >> shift;
+    const size_t samples = len / 2;
+
+    // CIC gain is factor^order; fold the normalization into a 32.32 fixed-point multiplier
+    const int64_t gain = (int64_t)factor * factor * factor;
+    const int64_t scale = ((1LL << 32) + gain / 2) / gain;
+
+    // Integrator and comb registers wrap modulo 2^32, which CIC arithmetic tolerates
+    uint32_t integrator[DECIMATION_CIC_ORDER] = {0};
+    uint32_t comb_delay[DECIMATION_CIC_ORDER] = {0};
+    int32_t history[2] = {0}; // Previous two CIC outputs for the compensation FIR
+    int phase = 0;
+    size_t produced = 0;
+    size_t written = 0;
+
+    for (size_t n = 0; n < samples; n++) {
+        uint32_t value = (adc_word_read(&data[2 * n]) & mask) >> shift;
+        for (int s = 0; s < DECIMATION_CIC_ORDER; s++) {
+            value = integrator[s] += value;
+        }
+
+        if (++phase < factor) {
+            continue;
+        }
+        phase = 0;
+
+        for (int s = 0; s < DECIMATION_CIC_ORDER; s++) {
+            uint32_t delayed = comb_delay[s];
+            comb_delay[s] = value;
+            value -= delayed;
+        }
+
+        int32_t cic = (int32_t)(((int64_t)(int32_t)value * scale) >> 32);
+        int32_t out = (10 * history[1] - history[0] - cic) / 8;
+        history[0] = history[1];
+        history[1] = cic;
+
+        if (++produced <= DECIMATION_WARMUP) {
+            continue;
+        }
+
+        if (out < 0) {
+            out = 0;
+        } else if (out > max_value) {
+            out = max_value;
+        }
+
+        // written < n / factor, so this never overwrites a word still to be read
+        adc_word_write(&data[2 * written], (uint16_t)(out << shift));
+        written++;
+    }
+
+    return written * 2;
+}
+
+size_t peak_detect_frame(uint8_t *data, size_t len, int factor)
+{
+    if (factor <= 1) {
+        return len;
+    }
+
+    const uint16_t mask = get_data_mask();
+    const size_t buckets = len / 2 / factor;
+    const uint8_t *in = data;
+
+    for (size_t b = 0; b < buckets; b++) {
+        // Compare masked words directly, the data bits keep their order without shifting
+        uint16_t lo = mask;
+        uint16_t hi = 0;
+        for (int i = 0; i < factor; i++) {
+            uint16_t value = adc_word_read(in) & mask;
+            lo = value < lo ? value : lo;
+            hi = value > hi ? value : hi;
+            in += 2;
+        }
+
+        // Bucket b is written to bytes 4 * b .. 4 * b + 3, all read already for factor >= 2
+        adc_word_write(&data[4 * b], lo);
+        adc_word_write(&data[4 * b + 2], hi);
+    }
+
+    return buckets * 4;
+}
+
+int hires_extra_bits(int factor)
+{
+    return factor > 1 ? (31 - __builtin_clz(factor)) / 2 : 0;
+}
+
+uint16_t hires_data_mask(int factor)
+{
+    const uint16_t mask = get_data_mask();
+    const int shift = __builtin_ctz(mask);
+    const int extra = hires_extra_bits(factor);
+    const int width = __builtin_popcount(mask) + extra;
+
+    return (uint16_t)(((1U << width) - 1) << (shift >= extra ? shift - extra : 0));
+}
+
+size_t hires_frame(uint8_t *data, size_t len, int factor)
+{
+    if (factor <= 1) {
+        return len;
+    }
+
+    const uint16_t mask = get_data_mask();
+    const int shift = __builtin_ctz(mask);
+    const int extra = hires_extra_bits(factor);
+    const int out_shift = __builtin_ctz(hires_data_mask(factor));
+    const size_t buckets = len / 2 / factor;
+
+    // mean << extra == sum * 2^extra / factor, with the division done by a 16.16 reciprocal;
+    // the product stays near max_value << (16 + extra), below 2^31 for 12-bit samples
+    const uint32_t scale = ((1U << (16 + extra)) + factor / 2) / factor;
+    const uint8_t *in = data;
+
+    for (size_t b = 0; b < buckets; b++) {
+        // Sum the masked words unshifted and drop the shift once per bucket
+        uint32_t sum = 0;
+        for (int i = 0; i < factor; i++) {
+            sum += adc_word_read(in) & mask;
+            in += 2;
+        }
+
+        uint32_t value = ((sum >> shift) * scale + (1U << 15)) >> 16;
+        // Bucket b is written to bytes 2 * b and 2 * b + 1, both read already for factor >= 2
+        adc_word_write(&data[2 * b], (uint16_t)(value << out_shift));
+    }
+
+    return buckets * 2;
+}
+
+esp_err_t averaging_configure(averaging_mode_t mode, int frames)
+{
+    if (mode < 0 || mode >= AVERAGING_MODE_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (mode == AVERAGING_OFF) {
+        frames = 1;
+    } else if (frames < 2 || frames > AVERAGING_MAX_FRAMES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    atomic_store(&averaging_request, mode << 16 | frames);
+    return ESP_OK;
+}
+
+averaging_mode_t averaging_get_mode(void)
+{
+    return (averaging_mode_t)(atomic_load(&averaging_active) >> 16);
+}
+
+int averaging_get_frames(void)
+{
+    return atomic_load(&averaging_active) & 0xFFFF;
+}
+
+const char *averaging_mode_name(averaging_mode_t mode)
+{
+    if (mode < 0 || mode >= AVERAGING_MODE_COUNT) {
+        return "unknown";
+    }
+    return averaging_names[mode];
+}
+
+esp_err_t averaging_mode_from_name(const char *name, averaging_mode_t *mode)
+{
+    for (int i = 0; i < AVERAGING_MODE_COUNT; i++) {
+        if (strcmp(name, averaging_names[i]) == 0) {
+            *mode = (averaging_mode_t)i;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+void averaging_release(void)
+{
+    if (averaging.accumulator == NULL) {
+        return;
+    }
+
+    heap_caps_free(averaging.accumulator);
+    averaging.accumulator = NULL;
+    averaging.capacity = 0;
+    averaging.samples = 0; // The next averaged frame restarts the average and allocates again
+}
+
+bool average_frame(uint8_t *data, size_t len)
+{
+    const size_t samples = len / 2;
+
+    // Apply a new setting, or restart when the window length changed
+    int request = atomic_load(&averaging_request);
+    if (request != averaging.request || samples != averaging.samples) {
+        averaging.request = request;
+        averaging.samples = samples;
+        averaging.count = 0;
+        averaging.primed = false;
+
+        if ((request >> 16) == AVERAGING_OFF) {
+            heap_caps_free(averaging.accumulator);
+            averaging.accumulator = NULL;
+            averaging.capacity = 0;
+        } else if (samples > averaging.capacity) {
+            heap_caps_free(averaging.accumulator);
+            averaging.accumulator = NULL;
+            if (AVERAGING_PSRAM_CAPS != 0) {
+                averaging.accumulator = heap_caps_malloc(samples * sizeof(uint32_t), AVERAGING_PSRAM_CAPS);
+            }
+            if (averaging.accumulator == NULL) {
+                averaging.accumulator = heap_caps_malloc(samples * sizeof(uint32_t), MALLOC_CAP_8BIT);
+            }
+            averaging.capacity = averaging.accumulator != NULL ? samples : 0;
+            if (averaging.accumulator == NULL) {
+                ESP_LOGE(TAG, "No memory for a %zu-sample averaging buffer, averaging disabled", samples);
+                request = AVERAGING_OFF << 16 | 1;
+                averaging.request = request;
+                atomic_store(&averaging_request, request);
+            }
+        }
+        atomic_store(&averaging_active, request);
+    }
+
+    const averaging_mode_t mode = (averaging_mode_t)(request >> 16);
+    const int frames = request & 0xFFFF;
+    if (mode == AVERAGING_OFF) {
+        return true;
+    }
+
+    const uint16_t mask = get_data_mask();
+    const int shift = __builtin_ctz(mask);
+    uint32_t *acc = averaging.accumulator;
+
+    if (mode == AVERAGING_BLOCK) {
+        if (averaging.count == 0) {
+            for (size_t i = 0; i < samples; i++) {
+                acc[i] = (adc_word_read(&data[2 * i]) & mask) >> shift;
+            }
+        } else {
+            for (size_t i = 0; i < samples; i++) {
+                acc[i] += (adc_word_read(&data[2 * i]) & mask) >> shift;
+            }
+        }
+
+        if (++averaging.count < frames) {
+            return false;
+        }
+        averaging.count = 0;
+
+        // Rounded mean of the block
+        for (size_t i = 0; i < samples; i++) {
+            adc_word_write(&data[2 * i], (uint16_t)(((acc[i] + frames / 2) / frames) << shift));
+        }
+        return true;
+    }
+
+    // Exponential: acc += (sample - acc) / frames, kept with AVERAGING_FRACTION_BITS of fraction
+    if (!averaging.primed) {
+        for (size_t i = 0; i < samples; i++) {
+            acc[i] = ((adc_word_read(&data[2 * i]) & mask) >> shift) << AVERAGING_FRACTION_BITS;
+        }
+        averaging.primed = true;
+    } else {
+        for (size_t i = 0; i < samples; i++) {
+            int32_t sample = ((adc_word_read(&data[2 * i]) & mask) >> shift) << AVERAGING_FRACTION_BITS;
+            acc[i] += (sample - (int32_t)acc[i]) / frames;
+        }
+    }
+
+    if (++averaging.count < frames) {
+        return false;
+    }
+    averaging.count = 0;
+
+    for (size_t i = 0; i < samples; i++) {
+        uint32_t value = (acc[i] + (1 << (AVERAGING_FRACTION_BITS - 1))) >> AVERAGING_FRACTION_BITS;
+        adc_word_write(&data[2 * i], (uint16_t)(value << shift));
+    }
+    return true;
+}
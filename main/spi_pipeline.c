@@ -0,0 +1,145 @@
+/**
+ * @file spi_pipeline.c
+ * @brief Queued-transaction capture pipeline for the external ADC
+ */
+
+#include "spi_pipeline.h"
+#include "acquisition.h"
+#include "globals.h"
+
+#ifdef USE_EXTERNAL_ADC
+static const char *TAG = "SPI_PIPELINE";
+
+esp_err_t spi_pipeline_init(spi_pipeline_t *pipeline)
+{
+    memset(pipeline, 0, sizeof(*pipeline));
+
+    esp_err_t ret = frame_pool_init(MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL, 0);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = spi_pipeline_carve(pipeline, BUF_SIZE);
+    if (ret == ESP_OK) {
+        ESP_LOGI(TAG, "SPI capture pipeline initialized with %d buffers", pipeline->count);
+    }
+    return ret;
+}
+
+esp_err_t spi_pipeline_carve(spi_pipeline_t *pipeline, size_t frame_len)
+{
+    if (pipeline->in_flight > 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    pipeline->count = frame_pool_carve(frame_len);
+    if (pipeline->count == 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pipeline->capture_len = frame_pool_slot_len();
+
+    for (int i = 0; i < pipeline->count; i++) {
+        pipeline->buffers[i] = frame_pool_slot(i);
+        pipeline->trans[i].length = 0;
+        pipeline->trans[i].rxlength = pipeline->capture_len * 8; // in bits
+        pipeline->trans[i].rx_buffer = pipeline->buffers[i];
+        pipeline->trans[i].user = (void *)(intptr_t)i;
+        pipeline->state[i] = SPI_FRAME_FREE;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t spi_pipeline_fill(spi_pipeline_t *pipeline)
+{
+    // A rate change is pending: let the queue run empty, then switch at this frame boundary
+    if (atomic_load(&spi_reconfig_requested)) {
+        if (pipeline->in_flight > 0) {
+            return ESP_OK;
+        }
+        if (!pipeline->holds_mutex) {
+            if (xSemaphoreTake(spi_mutex, portMAX_DELAY) != pdTRUE) {
+                ESP_LOGE(TAG, "Failed to take SPI mutex");
+                return ESP_FAIL;
+            }
+            pipeline->holds_mutex = true;
+        }
+        spi_switch_timing();
+    }
+
+    while (pipeline->in_flight < pipeline->count) {
+        // Buffers still owned by the sender or another consumer are skipped
+        int i = frame_pool_acquire();
+        if (i < 0) {
+            break;
+        }
+
+        if (!pipeline->holds_mutex) {
+            if (xSemaphoreTake(spi_mutex, portMAX_DELAY) != pdTRUE) {
+                ESP_LOGE(TAG, "Failed to take SPI mutex");
+                frame_pool_release(i);
+                return ESP_FAIL;
+            }
+            pipeline->holds_mutex = true;
+        }
+
+        esp_err_t ret = spi_device_queue_trans(spi, &pipeline->trans[i], portMAX_DELAY);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to queue SPI transaction: %s", esp_err_to_name(ret));
+            frame_pool_release(i);
+            return ret;
+        }
+
+        pipeline->state[i] = SPI_FRAME_QUEUED;
+        pipeline->order[pipeline->in_flight++] = i;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t spi_pipeline_wait(spi_pipeline_t *pipeline, int *index)
+{
+    if (pipeline->in_flight == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    spi_transaction_t *done = NULL;
+    esp_err_t ret = spi_device_get_trans_result(spi, &done, portMAX_DELAY);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "SPI transaction failed: %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    // Transactions complete in the order they were queued
+    *index = (int)(intptr_t)done->user;
+    pipeline->in_flight--;
+    memmove(&pipeline->order[0], &pipeline->order[1], pipeline->in_flight * sizeof(pipeline->order[0]));
+    pipeline->state[*index] = SPI_FRAME_HELD;
+
+    return ESP_OK;
+}
+
+void spi_pipeline_release(spi_pipeline_t *pipeline, int index)
+{
+    if (pipeline->state[index] == SPI_FRAME_HELD) {
+        pipeline->state[index] = SPI_FRAME_FREE;
+        frame_pool_release(index);
+    }
+}
+
+void spi_pipeline_drain(spi_pipeline_t *pipeline)
+{
+    int index;
+    while (pipeline->in_flight > 0) {
+        if (spi_pipeline_wait(pipeline, &index) != ESP_OK) {
+            break;
+        }
+        spi_pipeline_release(pipeline, index);
+    }
+
+    if (pipeline->holds_mutex) {
+        xSemaphoreGive(spi_mutex);
+        pipeline->holds_mutex = false;
+    }
+}
+#endif
@@ -0,0 +1,84 @@
+/**
+ * @file spi_timing.c
+ * @brief Implementation of the external ADC timing solver
+ */
+
+#include "spi_timing.h"
+#include <math.h>
+#include "globals.h"
+
+_Static_assert(MCPWM_FREQ_HZ * 32 == SPI_TIMING_BASE_HZ, "The MCPWM must count at the SPI clock source rate");
+
+bool spi_timing_divider_valid(uint32_t divider)
+{
+    if (divider < SPI_TIMING_MIN_DIVIDER || divider > SPI_TIMING_MAX_DIVIDER) {
+        return false;
+    }
+
+    // The prescaler takes the rest, it is never the limit below SPI_TIMING_MAX_DIVIDER
+    for (uint32_t n = 2; n <= SPI_TIMING_MAX_CLOCK_N; n++) {
+        if (divider % n == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+double spi_timing_rate(uint32_t divider)
+{
+    return (double)SPI_TIMING_BASE_HZ / ((double)SPI_TIMING_CLOCKS_PER_SAMPLE * divider);
+}
+
+uint32_t spi_timing_divider_for_rate(double rate_hz)
+{
+    double ideal = rate_hz > 0 ? SPI_TIMING_BASE_HZ / (SPI_TIMING_CLOCKS_PER_SAMPLE * rate_hz) : INFINITY;
+    if (ideal <= SPI_TIMING_MIN_DIVIDER) {
+        return SPI_TIMING_MIN_DIVIDER;
+    }
+    if (ideal >= SPI_TIMING_MAX_DIVIDER) {
+        ideal = SPI_TIMING_MAX_DIVIDER;
+    }
+
+    // Only primes above SPI_TIMING_MAX_CLOCK_N are invalid, so a valid divider is a few steps away at most
+    uint32_t below = (uint32_t)ideal;
+    uint32_t above = below + 1;
+    while (!spi_timing_divider_valid(below)) {
+        below--;
+    }
+    while (above <= SPI_TIMING_MAX_DIVIDER && !spi_timing_divider_valid(above)) {
+        above++;
+    }
+
+    if (above > SPI_TIMING_MAX_DIVIDER ||
+        fabs(spi_timing_rate(below) - rate_hz) <= fabs(spi_timing_rate(above) - rate_hz)) {
+        return below;
+    }
+    return above;
+}
+
+uint32_t spi_timing_row_divider(int row)
+{
+    return SPI_TIMING_BASE_HZ / spi_matrix[row][0];
+}
+
+int spi_timing_row(uint32_t divider)
+{
+    // Rows get slower with the index, move on while the divider is past the geometric mean of two rows
+    int row = 0;
+    while (row + 1 < MATRIX_SPI_ROWS &&
+           (uint64_t)divider * divider > (uint64_t)spi_timing_row_divider(row) * spi_timing_row_divider(row + 1)) {
+        row++;
+    }
+    return row;
+}
+
+void spi_timing_for_divider(uint32_t divider, spi_timing_t *timing)
+{
+    timing->divider = divider;
+    timing->spi_clock_hz = SPI_TIMING_BASE_HZ / divider;
+    timing->row = spi_timing_row(divider);
+    timing->cs_ena_pretrans = spi_matrix[timing->row][1];
+    timing->input_delay_ns = spi_matrix[timing->row][2];
+    timing->period_ticks = SPI_TIMING_CLOCKS_PER_SAMPLE * divider;
+    timing->compare_ticks = timing->period_ticks * COMPARE_VALUE / PERIOD_TICKS;
+}
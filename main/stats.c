@@ -0,0 +1,99 @@
+/**
+ * @file stats.c
+ * @brief Implementation of the runtime statistics
+ */
+
+#include "stats.h"
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+
+acquisition_stats_t acquisition_stats;
+
+/**
+ * @brief Totals folded by the rate timer, and the counter values they include
+ *
+ * Guarded by totals_lock, so a reader never sees half of a 64-bit total.
+ * The lock is only taken once per second and per /stats request.
+ */
+static stats_totals_t totals;
+static stats_totals_t folded;
+static portMUX_TYPE totals_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Add what a wrapping counter gained since it was last folded
+ *
+ * Correct as long as the counter gains less than 2^32 between two folds,
+ * which holds for bytes and microseconds in one second.
+ *
+ * @param counter Wrapping counter
+ * @param total Total up to *last
+ * @param last Counter value already included in total
+ * @return Total up to the current counter value
+ */
+static uint64_t fold(atomic_uint *counter, uint64_t total, uint64_t *last)
+{
+    uint32_t value = atomic_load_explicit(counter, memory_order_relaxed);
+    total += (uint32_t)(value - (uint32_t)*last);
+    *last = value;
+    return total;
+}
+
+/**
+ * @brief Fold all wrapping counters into totals, totals_lock must be held
+ */
+static void fold_totals(void)
+{
+    totals.bytes_sent = fold(&acquisition_stats.bytes_sent, totals.bytes_sent, &folded.bytes_sent);
+    totals.send_stall_us = fold(&acquisition_stats.send_stall_us, totals.send_stall_us, &folded.send_stall_us);
+    totals.pool_exhausted_us =
+        fold(&acquisition_stats.pool_exhausted_us, totals.pool_exhausted_us, &folded.pool_exhausted_us);
+}
+
+/**
+ * @brief Turn the totals of the last second into rates
+ */
+static void rate_timer_callback(void *arg)
+{
+    static uint32_t last_frames = 0;
+    static uint64_t last_bytes = 0;
+
+    uint32_t frames = atomic_load_explicit(&acquisition_stats.frames_sent, memory_order_relaxed);
+    portENTER_CRITICAL(&totals_lock);
+    fold_totals();
+    uint64_t bytes = totals.bytes_sent;
+    portEXIT_CRITICAL(&totals_lock);
+
+    atomic_store_explicit(&acquisition_stats.frames_per_second, frames - last_frames, memory_order_relaxed);
+    atomic_store_explicit(&acquisition_stats.bytes_per_second, (uint32_t)(bytes - last_bytes), memory_order_relaxed);
+
+    last_frames = frames;
+    last_bytes = bytes;
+}
+
+esp_err_t stats_init(void)
+{
+    static esp_timer_handle_t rate_timer = NULL;
+    if (rate_timer != NULL) {
+        return ESP_OK;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = rate_timer_callback,
+        .name = "stats_rate",
+    };
+
+    esp_err_t ret = esp_timer_create(&timer_args, &rate_timer);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    return esp_timer_start_periodic(rate_timer, 1000000);
+}
+
+void stats_get_totals(stats_totals_t *result)
+{
+    portENTER_CRITICAL(&totals_lock);
+    fold_totals();
+    *result = totals;
+    portEXIT_CRITICAL(&totals_lock);
+}
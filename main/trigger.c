@@ -0,0 +1,163 @@
+/**
+ * @file trigger.c
+ * @brief Implementation of the sample-domain trigger engine
+ */
+
+#include "trigger.h"
+#include <stdatomic.h>
+#include <string.h>
+#include "acquisition.h"
+#include "globals.h"
+#include "signal_processing.h"
+
+static const char *type_names[TRIGGER_TYPE_COUNT] = {
+    [TRIGGER_TYPE_EDGE] = "edge",
+    [TRIGGER_TYPE_LEVEL] = "level",
+};
+
+// Settings are written by the HTTP handlers and read once per frame by acquisition_task
+static atomic_int trigger_type = ATOMIC_VAR_INIT(TRIGGER_TYPE_EDGE);
+static atomic_int trigger_level_percent = ATOMIC_VAR_INIT(50);
+static atomic_int trigger_hysteresis_percent = ATOMIC_VAR_INIT(2);
+static atomic_int trigger_position = ATOMIC_VAR_INIT(50);
+
+void trigger_get_config(trigger_config_t *config)
+{
+    config->type = (trigger_type_t)atomic_load(&trigger_type);
+    config->rising = atomic_load(&trigger_edge) == 1;
+    config->level = atomic_load(&trigger_level_percent) * get_max_bits() / 100;
+    config->hysteresis = atomic_load(&trigger_hysteresis_percent) * get_max_bits() / 100;
+    config->position = atomic_load(&trigger_position);
+}
+
+esp_err_t trigger_set_type(trigger_type_t type)
+{
+    if (type < 0 || type >= TRIGGER_TYPE_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    atomic_store(&trigger_type, type);
+    return ESP_OK;
+}
+
+esp_err_t trigger_set_level(int percentage)
+{
+    if (percentage < 0 || percentage > 100) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    atomic_store(&trigger_level_percent, percentage);
+    return ESP_OK;
+}
+
+esp_err_t trigger_set_hysteresis(int percentage)
+{
+    if (percentage < 0 || percentage > 100) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    atomic_store(&trigger_hysteresis_percent, percentage);
+    return ESP_OK;
+}
+
+esp_err_t trigger_set_position(int percentage)
+{
+    if (percentage < 0 || percentage > 100) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    atomic_store(&trigger_position, percentage);
+    return ESP_OK;
+}
+
+const char *trigger_type_name(trigger_type_t type)
+{
+    if (type < 0 || type >= TRIGGER_TYPE_COUNT) {
+        return "unknown";
+    }
+    return type_names[type];
+}
+
+esp_err_t trigger_type_from_name(const char *name, trigger_type_t *type)
+{
+    for (int i = 0; i < TRIGGER_TYPE_COUNT; i++) {
+        if (strcmp(name, type_names[i]) == 0) {
+            *type = (trigger_type_t)i;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+size_t trigger_window_samples(size_t samples)
+{
+    return samples / TRIGGER_WINDOW_DIVISOR;
+}
+
+ssize_t trigger_scan(const uint8_t *data, size_t from, size_t to, const trigger_config_t *config)
+{
+    // Compare masked words against thresholds moved into the same bit position,
+    // so the loop needs no shift per sample
+    const uint16_t mask = get_data_mask();
+    const int shift = __builtin_ctz(mask);
+    const int32_t fire = config->level << shift;
+
+    if (config->type == TRIGGER_TYPE_LEVEL) {
+        for (size_t i = from; i < to; i++) {
+            int32_t value = adc_word_read(&data[2 * i]) & mask;
+            if (config->rising ? value >= fire : value <= fire) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Separate loops keep the edge direction out of the per-sample work
+    bool armed = false;
+    if (config->rising) {
+        const int32_t arm = (config->level - config->hysteresis) << shift;
+        for (size_t i = 0; i < to; i++) {
+            int32_t value = adc_word_read(&data[2 * i]) & mask;
+            if (value < arm) {
+                armed = true;
+            } else if (armed && value >= fire) {
+                if (i >= from) {
+                    return i;
+                }
+                armed = false;
+            }
+        }
+    } else {
+        const int32_t arm = (config->level + config->hysteresis) << shift;
+        for (size_t i = 0; i < to; i++) {
+            int32_t value = adc_word_read(&data[2 * i]) & mask;
+            if (value > arm) {
+                armed = true;
+            } else if (armed && value <= fire) {
+                if (i >= from) {
+                    return i;
+                }
+                armed = false;
+            }
+        }
+    }
+
+    return -1;
+}
+
+size_t trigger_align_frame(uint8_t *data, size_t len, const trigger_config_t *config, size_t *trigger_index)
+{
+    const size_t samples = len / 2;
+    const size_t window = trigger_window_samples(samples);
+    const size_t pre = window * config->position / 100;
+
+    // The whole window must lie inside the frame
+    ssize_t trigger = trigger_scan(data, pre, samples - window + pre + 1, config);
+    if (trigger < 0) {
+        return 0;
+    }
+
+    memmove(data, &data[2 * (trigger - pre)], window * 2);
+    *trigger_index = pre;
+    return window * 2;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file udp_stream.c
+ * @brief Fragmentation of frames for the UDP transport, and the fragments a NACK gets back
+ */
+
+#include "udp_stream.h"
+
+int udp_fragment_count(size_t payload_len)
+{
+    size_t frame_len = sizeof(frame_header_t) + payload_len;
+    return (frame_len + UDP_FRAGMENT_PAYLOAD - 1) / UDP_FRAGMENT_PAYLOAD;
+}
+
+int udp_fragment_iov(const frame_header_t *header, const uint8_t *payload, size_t payload_len, int fragment,
+                     uint8_t flags, udp_fragment_header_t *frag, struct iovec iov[3])
+{
+    const size_t frame_len = sizeof(frame_header_t) + payload_len;
+    const int count = udp_fragment_count(payload_len);
+    if (fragment < 0 || fragment >= count) {
+        return 0;
+    }
+
+    frag->magic = UDP_STREAM_MAGIC;
+    frag->type = UDP_MSG_FRAGMENT;
+    frag->flags = flags;
+    frag->frame_seq = header->sequence;
+    frag->fragment = fragment;
+    frag->fragment_count = count;
+    frag->frame_len = frame_len;
+
+    iov[0].iov_base = frag;
+    iov[0].iov_len = sizeof(*frag);
+    int n = 1;
+
+    // The frame is the header followed by the payload, a fragment may straddle both
+    size_t start = (size_t)fragment * UDP_FRAGMENT_PAYLOAD;
+    size_t end = start + UDP_FRAGMENT_PAYLOAD < frame_len ? start + UDP_FRAGMENT_PAYLOAD : frame_len;
+    if (start < sizeof(frame_header_t)) {
+        size_t header_end = end < sizeof(frame_header_t) ? end : sizeof(frame_header_t);
+        iov[n].iov_base = (uint8_t *)header + start;
+        iov[n].iov_len = header_end - start;
+        n++;
+        start = header_end;
+    }
+    if (start < end) {
+        iov[n].iov_base = (uint8_t *)payload + (start - sizeof(frame_header_t));
+        iov[n].iov_len = end - start;
+        n++;
+    }
+    return n;
+}
+
+bool udp_nack_select(const udp_control_t *nack, size_t payload_len, size_t sent_len, int64_t sent_us, int64_t now_us,
+                     uint64_t *resend)
+{
+    const size_t frame_len = sizeof(frame_header_t) + payload_len;
+    *resend = 0;
+
+    int sent_fragments;
+    if (sent_len >= frame_len) {
+        if (sent_us < now_us - UDP_RETRANSMIT_WINDOW_MS * 1000) {
+            return false;
+        }
+        sent_fragments = udp_fragment_count(payload_len);
+    } else {
+        sent_fragments = (int)(sent_len / UDP_FRAGMENT_PAYLOAD); // The fragment being sent is not complete
+    }
+
+    if (nack->first_fragment < sent_fragments) {
+        int fragments = sent_fragments - nack->first_fragment;
+        *resend = nack->mask & (fragments >= 64 ? ~0ULL : (1ULL << fragments) - 1);
+    }
+    return true;
+}
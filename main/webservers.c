@@ -7,8 +7,18 @@
 #include "acquisition.h"
 #include "crypto.h"
 #include "data_transmission.h"
+#include "frame_header.h"
+#include "frame_pool.h"
 #include "globals.h"
 #include "network.h"
+#include "record.h"
+#include "sample_format.h"
+#include "segments.h"
+#include "signal_processing.h"
+#include "stats.h"
+#include "trigger.h"
+
+#define HTTPD_MAX_OPEN_SOCKETS (7 + MAX_DATA_CLIENTS) /* httpd's default 7 sessions plus one per /stream session */
 
 static const char *TAG = "WEBSERVER";
 
@@ -32,11 +42,63 @@ esp_err_t config_handler(httpd_req_t *req)
     cJSON_AddNumberToObject(config, "channel_mask", get_channel_mask());
     cJSON_AddNumberToObject(config, "useful_bits", get_useful_bits());
     cJSON_AddNumberToObject(config, "samples_per_packet", get_samples_per_packet());
+    cJSON_AddNumberToObject(config, "frame_samples", get_frame_samples());
+    cJSON_AddNumberToObject(config, "frame_min_samples", FRAME_MIN_SAMPLES);
+    cJSON_AddNumberToObject(config, "frame_max_samples", get_max_frame_samples());
+    cJSON_AddNumberToObject(config, "frames_in_pool", frame_pool_count());
+    cJSON_AddStringToObject(config, "frame_pool_memory", frame_pool_memory());
+    cJSON_AddNumberToObject(config, "frame_pool_chunks", frame_pool_chunks());
     cJSON_AddNumberToObject(config, "dividing_factor", dividing_factor());
     cJSON_AddNumberToObject(config, "discard_head", get_discard_head());
     cJSON_AddNumberToObject(config, "discard_trailer", get_discard_trailer());
     cJSON_AddNumberToObject(config, "max_bits", get_max_bits());
     cJSON_AddNumberToObject(config, "mid_bits", get_mid_bits());
+    cJSON_AddStringToObject(config, "sample_format", sample_format_name(sample_format_selected()));
+
+    // Advertise the wire formats a client can select through /format
+    cJSON *formats_array = cJSON_CreateArray();
+    if (formats_array != NULL) {
+        for (int i = 0; i < SAMPLE_FORMAT_COUNT; i++) {
+            cJSON *format = cJSON_CreateObject();
+            if (format != NULL) {
+                cJSON_AddStringToObject(format, "name", sample_format_name((sample_format_t)i));
+                cJSON_AddNumberToObject(format, "bits_per_sample", sample_format_bits((sample_format_t)i));
+                cJSON_AddItemToArray(formats_array, format);
+            }
+        }
+
+        cJSON_AddItemToObject(config, "sample_formats", formats_array);
+    }
+    cJSON_AddNumberToObject(config, "delta_block_samples", DELTA_BLOCK_SAMPLES);
+    cJSON_AddBoolToObject(config, "frame_header", frame_header_enabled());
+    cJSON_AddNumberToObject(config, "frame_header_size", sizeof(frame_header_t));
+    cJSON_AddNumberToObject(config, "decimation", decimation_get_factor());
+    cJSON_AddNumberToObject(config, "decimation_max", DECIMATION_MAX_FACTOR);
+    cJSON_AddNumberToObject(config, "trigger_window_samples", trigger_window_samples(get_samples_per_packet() / 2));
+    cJSON_AddStringToObject(config, "decimation_mode", decimation_mode_name(decimation_get_mode()));
+
+    cJSON *modes_array = cJSON_CreateArray();
+    if (modes_array != NULL) {
+        for (int i = 0; i < DECIMATION_MODE_COUNT; i++) {
+            cJSON_AddItemToArray(modes_array, cJSON_CreateString(decimation_mode_name((decimation_mode_t)i)));
+        }
+
+        cJSON_AddItemToObject(config, "decimation_modes", modes_array);
+    }
+
+    // Resolution of the samples as sent, wider than useful_bits in hi-res mode
+    uint16_t effective_mask = decimation_get_mode() == DECIMATION_HIRES ? hires_data_mask(decimation_get_factor())
+                                                                        : get_data_mask();
+    cJSON_AddNumberToObject(config, "effective_bits", __builtin_popcount(effective_mask));
+    cJSON_AddNumberToObject(config, "effective_mask", effective_mask);
+    cJSON_AddStringToObject(config, "averaging", averaging_mode_name(averaging_get_mode()));
+    cJSON_AddNumberToObject(config, "averaging_frames", averaging_get_frames());
+    cJSON_AddNumberToObject(config, "averaging_max_frames", AVERAGING_MAX_FRAMES);
+    cJSON_AddNumberToObject(config, "roll_chunk_samples", roll_chunk_samples());
+    cJSON_AddNumberToObject(config, "segment_count", segments_get_count());
+    cJSON_AddNumberToObject(config, "segment_samples", segments_get_samples());
+    cJSON_AddNumberToObject(config, "segment_max_count", SEGMENT_MAX_COUNT);
+    cJSON_AddNumberToObject(config, "segment_max_store_samples", SEGMENT_MAX_STORE_SAMPLES);
 
     // Create the voltage scales array
     cJSON *voltage_scales_array = cJSON_CreateArray();
@@ -66,6 +128,51 @@ esp_err_t config_handler(httpd_req_t *req)
     return ret;
 }
 
+esp_err_t stats_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "application/json");
+
+    cJSON *stats = cJSON_CreateObject();
+    if (stats == NULL) {
+        return httpd_resp_send_500(req);
+    }
+
+    // Counters are read one by one, so they may be a frame apart from each other
+    stats_totals_t totals;
+    stats_get_totals(&totals);
+    cJSON_AddNumberToObject(stats, "uptime_us", esp_timer_get_time());
+    cJSON_AddNumberToObject(stats, "frames_captured", atomic_load(&acquisition_stats.frames_captured));
+    cJSON_AddNumberToObject(stats, "frames_sent", atomic_load(&acquisition_stats.frames_sent));
+    cJSON_AddNumberToObject(stats, "bytes_sent", totals.bytes_sent);
+    cJSON_AddNumberToObject(stats, "capture_failures", atomic_load(&acquisition_stats.capture_failures));
+    cJSON_AddNumberToObject(stats, "client_drops", atomic_load(&acquisition_stats.client_drops));
+    cJSON_AddNumberToObject(stats, "send_retries", atomic_load(&acquisition_stats.send_retries));
+    cJSON_AddNumberToObject(stats, "send_stall_us", totals.send_stall_us);
+    cJSON_AddNumberToObject(stats, "udp_retransmits", atomic_load(&acquisition_stats.udp_retransmits));
+    cJSON_AddNumberToObject(stats, "udp_nacks_expired", atomic_load(&acquisition_stats.udp_nacks_expired));
+    cJSON_AddNumberToObject(stats, "frame_overruns", atomic_load(&frame_overruns));
+    cJSON_AddNumberToObject(stats, "frame_underruns", atomic_load(&frame_underruns));
+    cJSON_AddNumberToObject(stats, "segments_captured", atomic_load(&acquisition_stats.segments_captured));
+    cJSON_AddNumberToObject(stats, "rearm_dead_time_us", atomic_load(&acquisition_stats.rearm_dead_time_us));
+    cJSON_AddNumberToObject(stats, "pool_exhausted_us", totals.pool_exhausted_us);
+    cJSON_AddNumberToObject(stats, "rate_switches", atomic_load(&acquisition_stats.rate_switches));
+    cJSON_AddNumberToObject(stats, "rate_switch_us", atomic_load(&acquisition_stats.rate_switch_us));
+    cJSON_AddNumberToObject(stats, "adc_pool_overflows", atomic_load(&acquisition_stats.adc_pool_overflows));
+    cJSON_AddNumberToObject(stats, "pool_in_use", frame_pool_in_use());
+    cJSON_AddNumberToObject(stats, "pool_peak_in_use", frame_pool_peak_in_use());
+    cJSON_AddNumberToObject(stats, "acquisition_stack_free", uxTaskGetStackHighWaterMark(acquisition_task_handle));
+    cJSON_AddNumberToObject(stats, "frames_per_second", atomic_load(&acquisition_stats.frames_per_second));
+    cJSON_AddNumberToObject(stats, "mb_per_second", atomic_load(&acquisition_stats.bytes_per_second) / 1e6);
+
+    const char *response = cJSON_Print(stats);
+    esp_err_t ret = httpd_resp_send(req, response, strlen(response));
+
+    free((void *)response);
+    cJSON_Delete(stats);
+
+    return ret;
+}
+
 esp_err_t scan_wifi_handler(httpd_req_t *req)
 {
     uint16_t num_networks = 0;
@@ -198,23 +305,10 @@ esp_err_t trigger_handler(httpd_req_t *req)
     cJSON *edge = cJSON_GetObjectItem(root, "trigger_edge");
     if (cJSON_IsString(edge)) {
         if (strcmp(edge->valuestring, "positive") == 0) {
-            trigger_edge = 1;
+            set_trigger_edge(true);
         } else if (strcmp(edge->valuestring, "negative") == 0) {
-            trigger_edge = 0;
-        }
-#ifdef USE_EXTERNAL_ADC
-        if (mode == 1) {
-            if (trigger_edge == 1) {
-                // Configure for positive edge detection
-                ESP_ERROR_CHECK(pcnt_channel_set_edge_action(pcnt_chan, PCNT_CHANNEL_EDGE_ACTION_INCREASE,
-                                                             PCNT_CHANNEL_EDGE_ACTION_HOLD));
-            } else {
-                // Configure for negative edge detection
-                ESP_ERROR_CHECK(pcnt_channel_set_edge_action(pcnt_chan, PCNT_CHANNEL_EDGE_ACTION_HOLD,
-                                                             PCNT_CHANNEL_EDGE_ACTION_INCREASE));
-            }
+            set_trigger_edge(false);
         }
-#endif
     }
 
     // Get trigger percentage
@@ -226,6 +320,26 @@ esp_err_t trigger_handler(httpd_req_t *req)
     }
 
     int percentage = (int)trigger->valuedouble;
+
+    // Software trigger settings, all optional
+    trigger_type_t type;
+    cJSON *type_name = cJSON_GetObjectItem(root, "trigger_type");
+    if (cJSON_IsString(type_name) && trigger_type_from_name(type_name->valuestring, &type) == ESP_OK) {
+        trigger_set_type(type);
+    }
+
+    cJSON *hysteresis = cJSON_GetObjectItem(root, "hysteresis_percentage");
+    if (cJSON_IsNumber(hysteresis)) {
+        trigger_set_hysteresis((int)hysteresis->valuedouble);
+    }
+
+    cJSON *position = cJSON_GetObjectItem(root, "trigger_position");
+    if (cJSON_IsNumber(position)) {
+        trigger_set_position((int)position->valuedouble);
+    }
+
+    trigger_set_level(percentage);
+
     esp_err_t ret = ESP_OK;
     if (mode == 1) {
         ret = set_trigger_level(percentage);
@@ -240,6 +354,13 @@ esp_err_t trigger_handler(httpd_req_t *req)
     cJSON *response = cJSON_CreateObject();
     cJSON_AddNumberToObject(response, "set_percentage", percentage);
     cJSON_AddStringToObject(response, "edge", trigger_edge ? "positive" : "negative");
+
+    trigger_config_t config;
+    trigger_get_config(&config);
+    cJSON_AddStringToObject(response, "trigger_type", trigger_type_name(config.type));
+    cJSON_AddNumberToObject(response, "trigger_level", config.level);
+    cJSON_AddNumberToObject(response, "hysteresis", config.hysteresis);
+    cJSON_AddNumberToObject(response, "trigger_position", config.position);
     const char *json_response = cJSON_Print(response);
 
     httpd_resp_set_type(req, "application/json");
@@ -269,11 +390,27 @@ esp_err_t single_handler(httpd_req_t *req)
     return httpd_resp_send(req, response, strlen(response));
 }
 
+/**
+ * @brief Answer a rate change with the rate now selected
+ */
+static esp_err_t send_rate_response(httpd_req_t *req)
+{
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddNumberToObject(response, "sampling_frequency", get_exact_sample_rate());
+
+    const char *json_response = cJSON_Print(response);
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = httpd_resp_send(req, json_response, strlen(json_response));
+
+    // Cleanup
+    free((void *)json_response);
+    cJSON_Delete(response);
+
+    return ret;
+}
+
 esp_err_t freq_handler(httpd_req_t *req)
 {
-#ifdef USE_EXTERNAL_ADC
-    int final_freq;
-#endif
     char content[100];
     int received = httpd_req_recv(req, content, sizeof(content) - 1);
     if (received <= 0) {
@@ -286,84 +423,448 @@ esp_err_t freq_handler(httpd_req_t *req)
         return httpd_resp_send_500(req);
     }
 
-    // Get action (more/less)
+    // Either a step (more/less) or a rate in Hz
     cJSON *action = cJSON_GetObjectItem(root, "action");
-    if (!cJSON_IsString(action)) {
+    cJSON *sample_rate = cJSON_GetObjectItem(root, "sample_rate");
+    if (!cJSON_IsString(action) && !cJSON_IsNumber(sample_rate)) {
         cJSON_Delete(root);
         return httpd_resp_send_500(req);
     }
 
-    vTaskDelay(pdMS_TO_TICKS(1000)); // Pause to reduce potential crashes
-
-#ifdef USE_EXTERNAL_ADC
-    // Determine index based on action
-    if (strcmp(action->valuestring, "less") == 0 && spi_index != 6) {
-        spi_index++;
+    if (cJSON_IsNumber(sample_rate)) {
+        esp_err_t err = sample_rate_set(sample_rate->valuedouble, NULL);
+        cJSON_Delete(root);
+        if (err == ESP_ERR_NOT_SUPPORTED) {
+            return httpd_resp_send_err(req, HTTPD_501_METHOD_NOT_IMPLEMENTED, "Sample rate must be stepped");
+        }
+        if (err != ESP_OK) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid sample rate");
+        }
+        return send_rate_response(req);
     }
-    if (strcmp(action->valuestring, "more") == 0 && spi_index != 0) {
-        spi_index--;
+
+    // Either ADC switches at the next frame boundary, the response already reports the new rate
+    if (strcmp(action->valuestring, "less") == 0) {
+        sample_rate_step(-1);
+    } else if (strcmp(action->valuestring, "more") == 0) {
+        sample_rate_step(1);
     }
 
-    ESP_LOGI(TAG, "spi index: %d", spi_index);
+    cJSON_Delete(root);
+    return send_rate_response(req);
+}
 
-    if (xSemaphoreTake(spi_mutex, portMAX_DELAY) == pdTRUE) {
-        // Reinitialize SPI with new frequency
-        ESP_LOGI(TAG, "Reinitializing SPI with new frequency: %lu", spi_matrix[spi_index][0]);
-        ESP_ERROR_CHECK(spi_bus_remove_device(spi));
+/**
+ * @brief Refuse a setting that differs from the running session's with 409 and the settings in effect
+ *
+ * Every client of a session receives the same frames, so the setting would
+ * only apply once the last client has disconnected.
+ */
+static esp_err_t send_session_conflict(httpd_req_t *req, const data_session_t *session)
+{
+    ESP_LOGW(TAG, "%s refused, a streaming session with other settings is running", req->uri);
 
-        spi_device_interface_config_t devcfg = {.clock_speed_hz = spi_matrix[spi_index][0],
-                                                .mode = 0,
-                                                .spics_io_num = PIN_NUM_CS,
-                                                .queue_size = 7,
-                                                .pre_cb = NULL,
-                                                .post_cb = NULL,
-                                                .flags = SPI_DEVICE_HALFDUPLEX | SPI_DEVICE_NO_DUMMY,
-                                                .cs_ena_pretrans = spi_matrix[spi_index][1],
-                                                .input_delay_ns = spi_matrix[spi_index][2]};
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddStringToObject(response, "error", "Streaming session running, settings apply once every client is gone");
+    cJSON_AddStringToObject(response, "format", sample_format_name(session->format));
+    cJSON_AddNumberToObject(response, "bits_per_sample", sample_format_bits(session->format));
+    cJSON_AddNumberToObject(response, "chunk_samples", session->roll_chunk_samples);
+    cJSON_AddNumberToObject(response, "samples", session->frame_samples);
+    const char *json_response = cJSON_Print(response);
 
-        ESP_ERROR_CHECK(spi_bus_add_device(HSPI_HOST, &devcfg, &spi));
+    httpd_resp_set_status(req, "409 Conflict");
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = httpd_resp_send(req, json_response, strlen(json_response));
 
-        // Update MCPWM
-        ESP_ERROR_CHECK(mcpwm_timer_set_period(timer, spi_matrix[spi_index][3]));
+    free((void *)json_response);
+    cJSON_Delete(response);
 
-        // Update comparator value
-        ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(comparator, spi_matrix[spi_index][4]));
+    return ret;
+}
 
-        xSemaphoreGive(spi_mutex);
+esp_err_t format_handler(httpd_req_t *req)
+{
+    char content[100];
+    int received = httpd_req_recv(req, content, sizeof(content) - 1);
+    if (received <= 0) {
+        return httpd_resp_send_408(req);
     }
+    content[received] = '\0';
 
-    ESP_ERROR_CHECK(spi_device_get_actual_freq(spi, &final_freq));
+    cJSON *root = cJSON_Parse(content);
+    if (!root) {
+        return httpd_resp_send_500(req);
+    }
+
+    sample_format_t format;
+    cJSON *name = cJSON_GetObjectItem(root, "format");
+    if (!cJSON_IsString(name) || sample_format_from_name(name->valuestring, &format) != ESP_OK) {
+        cJSON_Delete(root);
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown sample format");
+    }
+
+    data_session_t session;
+    if (data_session_get(&session) && format != session.format) {
+        cJSON_Delete(root);
+        return send_session_conflict(req, &session);
+    }
+
+    // Frame headers are optional so clients reading bare frames keep working
+    cJSON *header = cJSON_GetObjectItem(root, "frame_header");
+    if (cJSON_IsBool(header)) {
+        frame_header_set_enabled(cJSON_IsTrue(header));
+    }
+    cJSON_Delete(root);
+
+    // Takes effect when the client opens its next data connection, the frame header is per client
+    sample_format_select(format);
+    ESP_LOGI(TAG, "Sample format set to %s, frame header %s", sample_format_name(format),
+             frame_header_enabled() ? "on" : "off");
 
-    // Build response
     cJSON *response = cJSON_CreateObject();
-    cJSON_AddNumberToObject(response, "sampling_frequency", final_freq * SPI_FREQ_SCALE_FACTOR);
-#else
-    // Adjust divider for internal ADC
-    if (strcmp(action->valuestring, "less") == 0 && adc_divider != 16) {
-        adc_divider *= 2;
+    cJSON_AddStringToObject(response, "format", sample_format_name(format));
+    cJSON_AddNumberToObject(response, "bits_per_sample", sample_format_bits(format));
+    cJSON_AddBoolToObject(response, "frame_header", frame_header_enabled());
+    const char *json_response = cJSON_Print(response);
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = httpd_resp_send(req, json_response, strlen(json_response));
+
+    free((void *)json_response);
+    cJSON_Delete(response);
+
+    return ret;
+}
+
+esp_err_t roll_handler(httpd_req_t *req)
+{
+    char content[100];
+    int received = httpd_req_recv(req, content, sizeof(content) - 1);
+    if (received <= 0) {
+        return httpd_resp_send_408(req);
+    }
+    content[received] = '\0';
+
+    cJSON *root = cJSON_Parse(content);
+    if (!root) {
+        return httpd_resp_send_500(req);
     }
-    if (strcmp(action->valuestring, "more") == 0 && adc_divider != 1) {
-        adc_divider /= 2;
+
+    cJSON *chunk = cJSON_GetObjectItem(root, "chunk_samples");
+    data_session_t session;
+    if (cJSON_IsNumber(chunk) && data_session_get(&session) && chunk->valueint != session.roll_chunk_samples) {
+        cJSON_Delete(root);
+        return send_session_conflict(req, &session);
     }
-    adc_modify_freq = 1;
+    if (!cJSON_IsNumber(chunk) || roll_set_chunk_samples(chunk->valueint) != ESP_OK) {
+        cJSON_Delete(root);
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid roll chunk size");
+    }
+    cJSON_Delete(root);
+
+    // Takes effect when the client opens its next data connection
+    ESP_LOGI(TAG, "Roll mode chunk set to %d samples", roll_chunk_samples());
 
-    // Build response
     cJSON *response = cJSON_CreateObject();
-    cJSON_AddNumberToObject(response, "sampling_frequency", get_sampling_frequency() / adc_divider);
+    cJSON_AddNumberToObject(response, "chunk_samples", roll_chunk_samples());
+    cJSON_AddNumberToObject(response, "chunk_us", roll_chunk_samples() * 1000000.0 / get_current_sample_rate());
+    const char *json_response = cJSON_Print(response);
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = httpd_resp_send(req, json_response, strlen(json_response));
+
+    free((void *)json_response);
+    cJSON_Delete(response);
+
+    return ret;
+}
+
+esp_err_t decimation_handler(httpd_req_t *req)
+{
+    char content[100];
+    int received = httpd_req_recv(req, content, sizeof(content) - 1);
+    if (received <= 0) {
+        return httpd_resp_send_408(req);
+    }
+    content[received] = '\0';
+
+    cJSON *root = cJSON_Parse(content);
+    if (!root) {
+        return httpd_resp_send_500(req);
+    }
+
+    // Both fields are optional, but an invalid one rejects the whole request
+    decimation_mode_t mode = decimation_get_mode();
+    cJSON *mode_name = cJSON_GetObjectItem(root, "mode");
+    if (mode_name != NULL &&
+        (!cJSON_IsString(mode_name) || decimation_mode_from_name(mode_name->valuestring, &mode) != ESP_OK)) {
+        cJSON_Delete(root);
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown decimation mode");
+    }
+
+    cJSON *factor = cJSON_GetObjectItem(root, "factor");
+    if (factor != NULL && (!cJSON_IsNumber(factor) || decimation_set_factor(factor->valueint) != ESP_OK)) {
+        cJSON_Delete(root);
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid decimation factor");
+    }
+    cJSON_Delete(root);
+
+    decimation_set_mode(mode);
+
+    // Hi-res trades rate for resolution, so it oversamples at the fastest rate
+    if (mode == DECIMATION_HIRES) {
+#ifdef USE_EXTERNAL_ADC
+        sample_rate_set(get_sampling_frequency(), NULL);
+#else
+        if (adc_divider != 1) {
+            adc_divider = 1;
+            adc_modify_freq = 1;
+        }
 #endif
+    }
 
+    // Otherwise the ADC keeps its rate, only the frames captured from now on are decimated
+    ESP_LOGI(TAG, "Decimation set to %s by %d", decimation_mode_name(mode), decimation_get_factor());
+
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddNumberToObject(response, "decimation", decimation_get_factor());
+    cJSON_AddStringToObject(response, "mode", decimation_mode_name(mode));
+    cJSON_AddNumberToObject(response, "samples_per_frame",
+                            decimated_samples(get_samples_per_packet() / 2, decimation_get_factor(), mode));
+    cJSON_AddNumberToObject(response, "effective_bits",
+                            mode == DECIMATION_HIRES ? __builtin_popcount(hires_data_mask(decimation_get_factor()))
+                                                     : get_useful_bits());
     const char *json_response = cJSON_Print(response);
+
     httpd_resp_set_type(req, "application/json");
     esp_err_t ret = httpd_resp_send(req, json_response, strlen(json_response));
 
-    // Cleanup
     free((void *)json_response);
     cJSON_Delete(response);
+
+    return ret;
+}
+
+esp_err_t averaging_handler(httpd_req_t *req)
+{
+    char content[100];
+    int received = httpd_req_recv(req, content, sizeof(content) - 1);
+    if (received <= 0) {
+        return httpd_resp_send_408(req);
+    }
+    content[received] = '\0';
+
+    cJSON *root = cJSON_Parse(content);
+    if (!root) {
+        return httpd_resp_send_500(req);
+    }
+
+    averaging_mode_t mode = AVERAGING_OFF;
+    cJSON *mode_name = cJSON_GetObjectItem(root, "mode");
+    if (!cJSON_IsString(mode_name) || averaging_mode_from_name(mode_name->valuestring, &mode) != ESP_OK) {
+        cJSON_Delete(root);
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown averaging mode");
+    }
+
+    cJSON *frames = cJSON_GetObjectItem(root, "frames");
+    int count = cJSON_IsNumber(frames) ? frames->valueint : 0;
     cJSON_Delete(root);
 
+    if (averaging_configure(mode, count) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid number of frames to average");
+    }
+
+    // Takes effect at the next frame boundary and restarts the running average
+    ESP_LOGI(TAG, "Averaging set to %s over %d frames", averaging_mode_name(mode), mode == AVERAGING_OFF ? 1 : count);
+
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddStringToObject(response, "mode", averaging_mode_name(mode));
+    cJSON_AddNumberToObject(response, "frames", mode == AVERAGING_OFF ? 1 : count);
+    const char *json_response = cJSON_Print(response);
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = httpd_resp_send(req, json_response, strlen(json_response));
+
+    free((void *)json_response);
+    cJSON_Delete(response);
+
     return ret;
 }
 
+esp_err_t segments_handler(httpd_req_t *req)
+{
+    char content[100];
+    int received = httpd_req_recv(req, content, sizeof(content) - 1);
+    if (received <= 0) {
+        return httpd_resp_send_408(req);
+    }
+    content[received] = '\0';
+
+    cJSON *root = cJSON_Parse(content);
+    if (!root) {
+        return httpd_resp_send_500(req);
+    }
+
+    cJSON *count = cJSON_GetObjectItem(root, "count");
+    cJSON *samples = cJSON_GetObjectItem(root, "samples");
+    if (!cJSON_IsNumber(count) || (count->valueint != 0 && !cJSON_IsNumber(samples))) {
+        cJSON_Delete(root);
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing segment count or samples");
+    }
+
+    int segment_count = count->valueint;
+    int segment_samples = segment_count != 0 ? samples->valueint : 0;
+    cJSON_Delete(root);
+
+    if (segments_configure(segment_count, segment_samples) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid segment count or samples");
+    }
+
+    // The store is allocated by the acquisition task at the next frame boundary
+    ESP_LOGI(TAG, "Segmented capture set to %d segments of %d samples", segment_count, segment_samples);
+
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddNumberToObject(response, "count", segment_count);
+    cJSON_AddNumberToObject(response, "samples", segment_samples);
+    const char *json_response = cJSON_Print(response);
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = httpd_resp_send(req, json_response, strlen(json_response));
+
+    free((void *)json_response);
+    cJSON_Delete(response);
+
+    return ret;
+}
+
+/**
+ * @brief Build the JSON description of the deep record
+ */
+static cJSON *record_status_json(void)
+{
+    record_status_t status;
+    record_get_status(&status);
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "state", record_state_name(status.state));
+    cJSON_AddNumberToObject(root, "samples", status.samples);
+    cJSON_AddNumberToObject(root, "filled", status.filled);
+    cJSON_AddNumberToObject(root, "frames", status.frames);
+    cJSON_AddNumberToObject(root, "first_us", status.first_us);
+    cJSON_AddNumberToObject(root, "last_us", status.last_us);
+    cJSON_AddNumberToObject(root, "sample_rate_hz", status.sample_rate_hz);
+    cJSON_AddNumberToObject(root, "max_samples", record_max_samples());
+    return root;
+}
+
+esp_err_t record_status_handler(httpd_req_t *req)
+{
+    cJSON *response = record_status_json();
+    const char *json_response = cJSON_Print(response);
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = httpd_resp_send(req, json_response, strlen(json_response));
+
+    free((void *)json_response);
+    cJSON_Delete(response);
+
+    return ret;
+}
+
+esp_err_t record_handler(httpd_req_t *req)
+{
+    char content[100];
+    int received = httpd_req_recv(req, content, sizeof(content) - 1);
+    if (received <= 0) {
+        return httpd_resp_send_408(req);
+    }
+    content[received] = '\0';
+
+    cJSON *root = cJSON_Parse(content);
+    if (!root) {
+        return httpd_resp_send_500(req);
+    }
+
+    cJSON *samples = cJSON_GetObjectItem(root, "samples");
+    if (!cJSON_IsNumber(samples) || samples->valuedouble < 0) {
+        cJSON_Delete(root);
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing record length");
+    }
+    size_t length = (size_t)samples->valuedouble;
+    cJSON_Delete(root);
+
+    if (length == 0) {
+        record_free();
+    } else {
+        esp_err_t err = record_arm(length);
+        if (err == ESP_ERR_NOT_SUPPORTED) {
+            return httpd_resp_send_err(req, HTTPD_501_METHOD_NOT_IMPLEMENTED, "Deep record needs PSRAM");
+        } else if (err != ESP_OK) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Record length does not fit PSRAM");
+        }
+        ESP_LOGI(TAG, "Deep record armed for %u samples", (unsigned)length);
+    }
+
+    return record_status_handler(req);
+}
+
+/**
+ * @brief Pass record samples on as one HTTP chunk
+ */
+static esp_err_t record_chunk_sink(void *ctx, const uint8_t *data, size_t len)
+{
+    return httpd_resp_send_chunk((httpd_req_t *)ctx, (const char *)data, len);
+}
+
+esp_err_t record_data_handler(httpd_req_t *req)
+{
+    char content[100];
+    int received = httpd_req_recv(req, content, sizeof(content) - 1);
+    if (received <= 0) {
+        return httpd_resp_send_408(req);
+    }
+    content[received] = '\0';
+
+    cJSON *root = cJSON_Parse(content);
+    if (!root) {
+        return httpd_resp_send_500(req);
+    }
+
+    // The frame table instead of the samples
+    if (cJSON_IsTrue(cJSON_GetObjectItem(root, "frames"))) {
+        cJSON_Delete(root);
+        httpd_resp_set_type(req, "application/octet-stream");
+        esp_err_t ret = record_read_frames(record_chunk_sink, req);
+        if (ret == ESP_ERR_INVALID_STATE) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "No finished record");
+        } else if (ret != ESP_OK) {
+            return ret;
+        }
+        return httpd_resp_send_chunk(req, NULL, 0);
+    }
+
+    // Defaults read the whole record at full resolution
+    cJSON *start = cJSON_GetObjectItem(root, "start");
+    cJSON *count = cJSON_GetObjectItem(root, "count");
+    cJSON *step = cJSON_GetObjectItem(root, "step");
+    size_t first = cJSON_IsNumber(start) && start->valuedouble > 0 ? (size_t)start->valuedouble : 0;
+    size_t samples = cJSON_IsNumber(count) && count->valuedouble > 0 ? (size_t)count->valuedouble : SIZE_MAX;
+    int bucket = cJSON_IsNumber(step) ? step->valueint : 1;
+    cJSON_Delete(root);
+
+    httpd_resp_set_type(req, "application/octet-stream");
+    esp_err_t ret = record_read(first, samples, bucket, record_chunk_sink, req);
+    if (ret == ESP_ERR_INVALID_STATE) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "No finished record");
+    } else if (ret == ESP_ERR_INVALID_ARG) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid start or step");
+    } else if (ret != ESP_OK) {
+        return ret;
+    }
+
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
 esp_err_t reset_socket_handler(httpd_req_t *req)
 {
     ESP_LOGI(TAG, "Reset socket handler called");
@@ -566,9 +1067,6 @@ esp_err_t connect_wifi_handler(httpd_req_t *req)
         ESP_LOGI(TAG, "Stopping ADC for WiFi connection");
         stop_adc_sampling();
 
-        // Extra delay to ensure ADC resources are fully released
-        vTaskDelay(pdMS_TO_TICKS(500));
-
         // Ensure flags are cleared
         atomic_store(&adc_is_running, false);
         atomic_store(&adc_initializing, false);
@@ -657,9 +1155,6 @@ esp_err_t internal_mode_handler(httpd_req_t *req)
         ESP_LOGI(TAG, "Stopping ADC for internal mode transition");
         stop_adc_sampling();
 
-        // Extra delay to ensure ADC resources are fully released
-        vTaskDelay(pdMS_TO_TICKS(500));
-
         // Ensure flags are cleared
         atomic_store(&adc_is_running, false);
         atomic_store(&adc_initializing, false);
@@ -717,7 +1212,7 @@ esp_err_t internal_mode_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
-    if (listen(new_sock, 1) != 0) {
+    if (listen(new_sock, MAX_DATA_CLIENTS) != 0) {
         ESP_LOGE(TAG, "Error during listen: errno %d", errno);
         safe_close(new_sock);
         new_sock = -1;
@@ -832,6 +1327,183 @@ esp_err_t send_wifi_response(httpd_req_t *req, const char *ip, int port, bool su
     return ret;
 }
 
+esp_err_t frame_length_handler(httpd_req_t *req)
+{
+    char content[100];
+    int received = httpd_req_recv(req, content, sizeof(content) - 1);
+    if (received <= 0) {
+        return httpd_resp_send_408(req);
+    }
+    content[received] = '\0';
+
+    cJSON *root = cJSON_Parse(content);
+    if (!root) {
+        return httpd_resp_send_500(req);
+    }
+
+    cJSON *samples = cJSON_GetObjectItem(root, "samples");
+    data_session_t session;
+    if (cJSON_IsNumber(samples) && data_session_get(&session) &&
+        (samples->valueint > 0 ? samples->valueint : get_max_frame_samples()) != session.frame_samples) {
+        cJSON_Delete(root);
+        return send_session_conflict(req, &session);
+    }
+    if (!cJSON_IsNumber(samples) || set_frame_samples(samples->valueint) != ESP_OK) {
+        cJSON_Delete(root);
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid frame length");
+    }
+    cJSON_Delete(root);
+
+    // The pool is re-carved when the client opens its next data connection
+    int frame_samples = get_frame_samples();
+    ESP_LOGI(TAG, "Frame length set to %d samples", frame_samples);
+
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddNumberToObject(response, "samples", frame_samples);
+    cJSON_AddNumberToObject(response, "frame_us", frame_samples * 1000000.0 / get_current_sample_rate());
+    cJSON_AddNumberToObject(response, "frames_in_pool", frame_pool_slots_for(get_frame_capture_len(frame_samples)));
+    const char *json_response = cJSON_Print(response);
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = httpd_resp_send(req, json_response, strlen(json_response));
+
+    free((void *)json_response);
+    cJSON_Delete(response);
+
+    return ret;
+}
+
+/**
+ * @brief Build the JSON description of the data clients shared by both /clients handlers
+ */
+static cJSON *clients_json(void)
+{
+    data_client_info_t info[MAX_DATA_CLIENTS];
+    int count = data_clients_get(info, MAX_DATA_CLIENTS);
+
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddNumberToObject(response, "max_clients", MAX_DATA_CLIENTS);
+    cJSON_AddStringToObject(response, "drop_policy", drop_policy_name(drop_policy_selected()));
+
+    cJSON *clients_array = cJSON_CreateArray();
+    if (clients_array != NULL) {
+        for (int i = 0; i < count; i++) {
+            cJSON *client = cJSON_CreateObject();
+            if (client != NULL) {
+                cJSON_AddStringToObject(client, "address", info[i].addr);
+                cJSON_AddNumberToObject(client, "port", info[i].port);
+                cJSON_AddStringToObject(client, "transport", data_transport_name(info[i].transport));
+                cJSON_AddStringToObject(client, "drop_policy", drop_policy_name(info[i].policy));
+                cJSON_AddBoolToObject(client, "frame_header", info[i].header);
+                cJSON_AddStringToObject(client, "format", sample_format_name(info[i].format));
+                cJSON_AddNumberToObject(client, "samples", info[i].frame_samples);
+                cJSON_AddNumberToObject(client, "queued", info[i].queued);
+                cJSON_AddNumberToObject(client, "frames_sent", info[i].frames_sent);
+                cJSON_AddNumberToObject(client, "frames_dropped", info[i].frames_dropped);
+                cJSON_AddNumberToObject(client, "retransmits", info[i].retransmits);
+                cJSON_AddItemToArray(clients_array, client);
+            }
+        }
+
+        cJSON_AddItemToObject(response, "clients", clients_array);
+    }
+
+    return response;
+}
+
+esp_err_t clients_handler(httpd_req_t *req)
+{
+    cJSON *response = clients_json();
+    const char *json_response = cJSON_Print(response);
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = httpd_resp_send(req, json_response, strlen(json_response));
+
+    free((void *)json_response);
+    cJSON_Delete(response);
+
+    return ret;
+}
+
+esp_err_t drop_policy_handler(httpd_req_t *req)
+{
+    char content[100];
+    int received = httpd_req_recv(req, content, sizeof(content) - 1);
+    if (received <= 0) {
+        return httpd_resp_send_408(req);
+    }
+    content[received] = '\0';
+
+    cJSON *root = cJSON_Parse(content);
+    if (!root) {
+        return httpd_resp_send_500(req);
+    }
+
+    drop_policy_t policy;
+    cJSON *name = cJSON_GetObjectItem(root, "drop_policy");
+    if (!cJSON_IsString(name) || drop_policy_from_name(name->valuestring, &policy) != ESP_OK) {
+        cJSON_Delete(root);
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid drop policy");
+    }
+    cJSON_Delete(root);
+
+    // Clients already connected keep the policy they connected with
+    drop_policy_select(policy);
+    ESP_LOGI(TAG, "Drop policy for new clients set to %s", drop_policy_name(policy));
+
+    cJSON *response = clients_json();
+    const char *json_response = cJSON_Print(response);
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t ret = httpd_resp_send(req, json_response, strlen(json_response));
+
+    free((void *)json_response);
+    cJSON_Delete(response);
+
+    return ret;
+}
+
+esp_err_t stream_ws_handler(httpd_req_t *req)
+{
+    // httpd has already answered the handshake, the stream itself is written by socket_task
+    if (req->method == HTTP_GET) {
+        esp_err_t ret = ws_client_open(req->handle, httpd_req_to_sockfd(req));
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "WebSocket stream refused, too many data clients");
+        }
+        return ret;
+    }
+
+    httpd_ws_frame_t frame = {0};
+    esp_err_t ret = httpd_ws_recv_frame(req, &frame, 0);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // Only small control frames are expected. A close or anything else ends the session:
+    // a reply from this task could interleave with a frame socket_task is writing.
+    uint8_t payload[WS_MAX_CONTROL_PAYLOAD];
+    if (frame.type == HTTPD_WS_TYPE_CLOSE || frame.len > sizeof(payload)) {
+        return ESP_FAIL;
+    }
+    frame.payload = payload;
+    ret = httpd_ws_recv_frame(req, &frame, sizeof(payload));
+    if (ret != ESP_OK || frame.type != HTTPD_WS_TYPE_PING) {
+        return ret;
+    }
+
+    // socket_task sends the PONG between two frames of the stream
+    ret = ws_client_pong(httpd_req_to_sockfd(req), payload, frame.len);
+    return ret == ESP_ERR_NOT_FOUND ? ESP_OK : ret;
+}
+
+void session_close_handler(httpd_handle_t hd, int sockfd)
+{
+    // A session streaming over WebSocket must be let go of before its socket can be reused
+    ws_client_closed(sockfd);
+    close(sockfd);
+}
+
 httpd_handle_t start_webserver(void)
 {
     httpd_handle_t server = NULL;
@@ -840,9 +1512,11 @@ httpd_handle_t start_webserver(void)
     config.server_port = 81;
     config.ctrl_port = 32767;
     config.stack_size = 4096 * 4;
-    config.max_uri_handlers = 11;
+    config.max_uri_handlers = 24;
     config.max_resp_headers = 8;
-    config.lru_purge_enable = true;
+    config.max_open_sockets = HTTPD_MAX_OPEN_SOCKETS;
+    config.lru_purge_enable = false; // Browsers send nothing on a /stream session, LRU would evict it first
+    config.close_fn = session_close_handler;
 
     if (httpd_start(&server, &config) == ESP_OK) {
         // Register handlers for different endpoints
@@ -869,6 +1543,9 @@ httpd_handle_t start_webserver(void)
         httpd_uri_t config_uri = {.uri = "/config", .method = HTTP_GET, .handler = config_handler, .user_ctx = NULL};
         httpd_register_uri_handler(server, &config_uri);
 
+        httpd_uri_t stats_uri = {.uri = "/stats", .method = HTTP_GET, .handler = stats_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &stats_uri);
+
         httpd_uri_t connect_wifi_uri = {
             .uri = "/connect_wifi", .method = HTTP_POST, .handler = connect_wifi_handler, .user_ctx = NULL};
         httpd_register_uri_handler(server, &connect_wifi_uri);
@@ -885,6 +1562,54 @@ httpd_handle_t start_webserver(void)
 
         httpd_uri_t freq_uri = {.uri = "/freq", .method = HTTP_POST, .handler = freq_handler, .user_ctx = NULL};
         httpd_register_uri_handler(server, &freq_uri);
+
+        httpd_uri_t format_uri = {.uri = "/format", .method = HTTP_POST, .handler = format_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &format_uri);
+
+        httpd_uri_t roll_uri = {.uri = "/roll", .method = HTTP_POST, .handler = roll_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &roll_uri);
+
+        httpd_uri_t frame_length_uri = {
+            .uri = "/frame_length", .method = HTTP_POST, .handler = frame_length_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &frame_length_uri);
+
+        httpd_uri_t clients_uri = {.uri = "/clients", .method = HTTP_GET, .handler = clients_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &clients_uri);
+
+        httpd_uri_t drop_policy_uri = {
+            .uri = "/clients", .method = HTTP_POST, .handler = drop_policy_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &drop_policy_uri);
+
+        httpd_uri_t decimation_uri = {
+            .uri = "/decimation", .method = HTTP_POST, .handler = decimation_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &decimation_uri);
+
+        httpd_uri_t averaging_uri = {
+            .uri = "/averaging", .method = HTTP_POST, .handler = averaging_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &averaging_uri);
+
+        httpd_uri_t segments_uri = {
+            .uri = "/segments", .method = HTTP_POST, .handler = segments_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &segments_uri);
+
+        httpd_uri_t record_uri = {.uri = "/record", .method = HTTP_POST, .handler = record_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &record_uri);
+
+        httpd_uri_t record_status_uri = {
+            .uri = "/record", .method = HTTP_GET, .handler = record_status_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &record_status_uri);
+
+        httpd_uri_t record_data_uri = {
+            .uri = "/record_data", .method = HTTP_POST, .handler = record_data_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(server, &record_data_uri);
+
+        httpd_uri_t stream_uri = {.uri = "/stream",
+                                  .method = HTTP_GET,
+                                  .handler = stream_ws_handler,
+                                  .user_ctx = NULL,
+                                  .is_websocket = true,
+                                  .handle_ws_control_frames = true};
+        httpd_register_uri_handler(server, &stream_uri);
     }
 
     return server;
@@ -901,9 +1626,11 @@ httpd_handle_t start_second_webserver(void)
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.core_id = 0; // Run on core 0
     config.server_port = 80;
-    config.max_uri_handlers = 10; // Increase from default 8
+    config.max_uri_handlers = 20; // Increase from default 8
     config.max_resp_headers = 8; // Increase if needed
-    config.lru_purge_enable = true; // Enable LRU mechanism
+    config.max_open_sockets = HTTPD_MAX_OPEN_SOCKETS;
+    config.lru_purge_enable = false; // Browsers send nothing on a /stream session, LRU would evict it first
+    config.close_fn = session_close_handler;
     config.stack_size = 4096 * 1.5;
 
     if (httpd_start(&second_server, &config) == ESP_OK) {
@@ -917,6 +1644,9 @@ httpd_handle_t start_second_webserver(void)
         httpd_uri_t config_uri = {.uri = "/config", .method = HTTP_GET, .handler = config_handler, .user_ctx = NULL};
         httpd_register_uri_handler(second_server, &config_uri);
 
+        httpd_uri_t stats_uri = {.uri = "/stats", .method = HTTP_GET, .handler = stats_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &stats_uri);
+
         httpd_uri_t trigger_uri = {
             .uri = "/trigger", .method = HTTP_POST, .handler = trigger_handler, .user_ctx = NULL};
         httpd_register_uri_handler(second_server, &trigger_uri);
@@ -929,6 +1659,54 @@ httpd_handle_t start_second_webserver(void)
 
         httpd_uri_t freq_uri = {.uri = "/freq", .method = HTTP_POST, .handler = freq_handler, .user_ctx = NULL};
         httpd_register_uri_handler(second_server, &freq_uri);
+
+        httpd_uri_t format_uri = {.uri = "/format", .method = HTTP_POST, .handler = format_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &format_uri);
+
+        httpd_uri_t roll_uri = {.uri = "/roll", .method = HTTP_POST, .handler = roll_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &roll_uri);
+
+        httpd_uri_t frame_length_uri = {
+            .uri = "/frame_length", .method = HTTP_POST, .handler = frame_length_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &frame_length_uri);
+
+        httpd_uri_t clients_uri = {.uri = "/clients", .method = HTTP_GET, .handler = clients_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &clients_uri);
+
+        httpd_uri_t drop_policy_uri = {
+            .uri = "/clients", .method = HTTP_POST, .handler = drop_policy_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &drop_policy_uri);
+
+        httpd_uri_t decimation_uri = {
+            .uri = "/decimation", .method = HTTP_POST, .handler = decimation_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &decimation_uri);
+
+        httpd_uri_t averaging_uri = {
+            .uri = "/averaging", .method = HTTP_POST, .handler = averaging_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &averaging_uri);
+
+        httpd_uri_t segments_uri = {
+            .uri = "/segments", .method = HTTP_POST, .handler = segments_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &segments_uri);
+
+        httpd_uri_t record_uri = {.uri = "/record", .method = HTTP_POST, .handler = record_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &record_uri);
+
+        httpd_uri_t record_status_uri = {
+            .uri = "/record", .method = HTTP_GET, .handler = record_status_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &record_status_uri);
+
+        httpd_uri_t record_data_uri = {
+            .uri = "/record_data", .method = HTTP_POST, .handler = record_data_handler, .user_ctx = NULL};
+        httpd_register_uri_handler(second_server, &record_data_uri);
+
+        httpd_uri_t stream_uri = {.uri = "/stream",
+                                  .method = HTTP_GET,
+                                  .handler = stream_ws_handler,
+                                  .user_ctx = NULL,
+                                  .is_websocket = true,
+                                  .handle_ws_control_frames = true};
+        httpd_register_uri_handler(second_server, &stream_uri);
     }
 
     return second_server;
@@ -0,0 +1,209 @@
+/**
+ * @file fakes.c
+ * @brief Host implementations of the IDF and acquisition functions the tests link against
+ */
+
+#include "fakes.h"
+#include <stdarg.h>
+#include <time.h>
+#include "acquisition.h"
+#include "signal_processing.h"
+#include "stats.h"
+
+int fake_data_mask = 0x1FF8;
+uint32_t fake_sample_rate = 2500000;
+int fake_samples_per_packet = BUF_SIZE / 2;
+int fake_max_bits = 1023;
+uint32_t fake_failing_caps = 0;
+int fake_malloc_budget = -1;
+int fake_spi_queued = 0;
+int fake_spi_max_queued = 0;
+uint32_t fake_spi_captures = 0;
+esp_err_t fake_spi_queue_error = ESP_OK;
+int fake_spi_switches = 0;
+
+#define FAKE_SPI_QUEUE_SIZE 7 /* queue_size of the SPI devices registered in acquisition.c */
+
+static spi_transaction_t *spi_queue[FAKE_SPI_QUEUE_SIZE];
+static int spi_queue_head = 0;
+
+acquisition_stats_t acquisition_stats;
+atomic_int trigger_edge = ATOMIC_VAR_INIT(1);
+const uint32_t spi_matrix[MATRIX_SPI_ROWS][MATRIX_SPI_COLS] = MATRIX_SPI_FREQ;
+spi_device_handle_t spi;
+SemaphoreHandle_t spi_mutex;
+atomic_int spi_reconfig_requested = ATOMIC_VAR_INIT(0);
+
+void fake_fill_words(uint8_t *data, const uint16_t *samples, int count, uint16_t mask)
+{
+    int shift = __builtin_ctz(mask);
+    for (int i = 0; i < count; i++) {
+        adc_word_write(&data[2 * i], (uint16_t)(samples[i] << shift) & mask);
+    }
+}
+
+int get_data_mask(void)
+{
+    return fake_data_mask;
+}
+
+uint32_t get_current_sample_rate(void)
+{
+    return fake_sample_rate;
+}
+
+int get_samples_per_packet(void)
+{
+    return fake_samples_per_packet;
+}
+
+int get_max_bits(void)
+{
+    return fake_max_bits;
+}
+
+void host_log(const char *level, const char *tag, const char *format, ...)
+{
+    if (getenv("HOST_LOG") == NULL) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%s (%s) ", level, tag);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    if (caps & fake_failing_caps || fake_malloc_budget == 0) {
+        return NULL;
+    }
+    fake_malloc_budget -= fake_malloc_budget > 0 ? 1 : 0;
+    return malloc(size);
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps)
+{
+    (void)caps;
+    return calloc(n, size);
+}
+
+void *heap_caps_aligned_alloc(size_t alignment, size_t size, uint32_t caps)
+{
+    (void)caps;
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void heap_caps_free(void *ptr)
+{
+    free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+    (void)caps;
+    return SIZE_MAX;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    (void)caps;
+    return SIZE_MAX;
+}
+
+bool esp_ptr_external_ram(const void *ptr)
+{
+    (void)ptr;
+    return false;
+}
+
+bool esp_ptr_dma_capable(const void *ptr)
+{
+    (void)ptr;
+    return true;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    return code == ESP_OK ? "ESP_OK" : "ERROR";
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return calloc(1, sizeof(bool));
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+    // Nothing else runs on the host, a taken mutex would never be given back
+    (void)ticks;
+    bool *taken = semaphore;
+    if (*taken) {
+        return pdFALSE;
+    }
+    *taken = true;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    bool *taken = semaphore;
+    if (!*taken) {
+        return pdFALSE;
+    }
+    *taken = false;
+    return pdTRUE;
+}
+
+bool fake_semaphore_taken(SemaphoreHandle_t semaphore)
+{
+    return *(bool *)semaphore;
+}
+
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t *trans, TickType_t ticks)
+{
+    (void)handle;
+    (void)ticks;
+    if (fake_spi_queue_error != ESP_OK) {
+        return fake_spi_queue_error;
+    }
+    if (fake_spi_queued == FAKE_SPI_QUEUE_SIZE) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    spi_queue[(spi_queue_head + fake_spi_queued) % FAKE_SPI_QUEUE_SIZE] = trans;
+    fake_spi_queued++;
+    fake_spi_max_queued = fake_spi_queued > fake_spi_max_queued ? fake_spi_queued : fake_spi_max_queued;
+    return ESP_OK;
+}
+
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t **trans, TickType_t ticks)
+{
+    (void)handle;
+    (void)ticks;
+    if (fake_spi_queued == 0) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    *trans = spi_queue[spi_queue_head];
+    spi_queue_head = (spi_queue_head + 1) % FAKE_SPI_QUEUE_SIZE;
+    fake_spi_queued--;
+    memcpy((*trans)->rx_buffer, &fake_spi_captures, sizeof(fake_spi_captures));
+    fake_spi_captures++;
+    return ESP_OK;
+}
+
+void spi_switch_timing(void)
+{
+    atomic_store(&spi_reconfig_requested, 0);
+    fake_spi_switches++;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file fakes.h
+ * @brief Host stand-ins for the hardware-facing acquisition functions
+ *
+ * The modules under test only ask acquisition.c for the data mask, the
+ * sample rate and the frame length. Tests set these variables instead.
+ *
+ * The SPI driver is a FIFO of queued transactions. A transaction completes
+ * when spi_device_get_trans_result() takes it, in the order it was queued,
+ * and writes its capture number into the first word of its buffer.
+ */
+
+#ifndef FAKES_H
+#define FAKES_H
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <stdint.h>
+
+extern int fake_data_mask; /**< Returned by get_data_mask(), the external ADC mask unless changed */
+extern uint32_t fake_sample_rate; /**< Returned by get_current_sample_rate() */
+extern int fake_samples_per_packet; /**< Returned by get_samples_per_packet() */
+extern int fake_max_bits; /**< Returned by get_max_bits() */
+extern uint32_t fake_failing_caps; /**< heap_caps_malloc() fails for caps with any of these bits */
+extern int fake_malloc_budget; /**< heap_caps_malloc() calls left to succeed, -1 for no limit */
+extern int fake_spi_queued; /**< Transactions queued in the SPI driver and not taken back yet */
+extern int fake_spi_max_queued; /**< Most transactions ever queued at once */
+extern uint32_t fake_spi_captures; /**< Transactions completed so far, the capture number of the next one */
+extern esp_err_t fake_spi_queue_error; /**< Returned by spi_device_queue_trans() instead of queueing unless ESP_OK */
+extern int fake_spi_switches; /**< spi_switch_timing() calls */
+
+/**
+ * @brief Check whether a semaphore from xSemaphoreCreateMutex() is taken
+ */
+bool fake_semaphore_taken(SemaphoreHandle_t semaphore);
+
+/**
+ * @brief Store ADC words in the byte order of the configured ADC
+ *
+ * @param data Receives 2 * count bytes
+ * @param samples Sample values, shifted up into the data mask
+ * @param count Number of samples
+ * @param mask Data mask the samples are shifted into
+ */
+void fake_fill_words(uint8_t *data, const uint16_t *samples, int count, uint16_t mask);
+
+#endif /* FAKES_H */
@@ -0,0 +1,5 @@
+/* Host build: see host_idf.h */
+#ifndef STUB_DRIVER_GPIO_H
+#define STUB_DRIVER_GPIO_H
+#include "host_idf.h"
+#endif
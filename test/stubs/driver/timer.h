@@ -0,0 +1,5 @@
+/* Host build: see host_idf.h */
+#ifndef STUB_DRIVER_TIMER_H
+#define STUB_DRIVER_TIMER_H
+#include "host_idf.h"
+#endif
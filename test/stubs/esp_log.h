@@ -0,0 +1,5 @@
+/* Host build: see host_idf.h */
+#ifndef STUB_ESP_LOG_H
+#define STUB_ESP_LOG_H
+#include "host_idf.h"
+#endif
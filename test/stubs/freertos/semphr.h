@@ -0,0 +1,5 @@
+/* Host build: see host_idf.h */
+#ifndef STUB_FREERTOS_SEMPHR_H
+#define STUB_FREERTOS_SEMPHR_H
+#include "host_idf.h"
+#endif
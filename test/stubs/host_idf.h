@@ -0,0 +1,116 @@
+/**
+ * @file host_idf.h
+ * @brief Minimal ESP-IDF declarations for building firmware modules on the host
+ *
+ * Only what the modules under test and the headers they include need. Every
+ * stub header in this directory includes this file, so the firmware sources
+ * compile unchanged. Functions the tests actually call are implemented in
+ * fakes.c.
+ */
+
+#ifndef HOST_IDF_H
+#define HOST_IDF_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* esp_err.h */
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_NOT_SUPPORTED 0x106
+#define ESP_ERR_TIMEOUT 0x107
+#define ESP_ERROR_CHECK(x) (void)(x)
+const char *esp_err_to_name(esp_err_t code);
+
+/* esp_log.h, quiet unless HOST_LOG is set */
+void host_log(const char *level, const char *tag, const char *format, ...) __attribute__((format(printf, 3, 4)));
+#define ESP_LOGE(tag, ...) host_log("E", tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) host_log("W", tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) host_log("I", tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) host_log("D", tag, __VA_ARGS__)
+#define ESP_LOGV(tag, ...) host_log("V", tag, __VA_ARGS__)
+
+/* esp_attr.h */
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+/* esp_heap_caps.h, backed by malloc */
+#define MALLOC_CAP_32BIT (1 << 1)
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+void *heap_caps_malloc(size_t size, uint32_t caps);
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps);
+void *heap_caps_aligned_alloc(size_t alignment, size_t size, uint32_t caps);
+void heap_caps_free(void *ptr);
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+
+/* esp_memory_utils.h */
+bool esp_ptr_external_ram(const void *ptr);
+bool esp_ptr_dma_capable(const void *ptr);
+
+/* esp_timer.h */
+int64_t esp_timer_get_time(void);
+
+/* FreeRTOS */
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void *TaskHandle_t;
+typedef void *SemaphoreHandle_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define portTICK_PERIOD_MS 10
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms) / portTICK_PERIOD_MS)
+#define portMAX_DELAY 0xFFFFFFFFu
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+
+/* Drivers, only the types the firmware headers refer to */
+typedef int gpio_num_t;
+#define GPIO_NUM_NC -1
+typedef struct adc_continuous_ctx_t *adc_continuous_handle_t;
+typedef struct spi_device_t *spi_device_handle_t;
+typedef struct {
+    uint32_t flags;
+    size_t length;
+    size_t rxlength;
+    void *user;
+    const void *tx_buffer;
+    void *rx_buffer;
+} spi_transaction_t;
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t *trans, TickType_t ticks);
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t **trans, TickType_t ticks);
+typedef void *mcpwm_timer_handle_t;
+typedef void *mcpwm_oper_handle_t;
+typedef void *mcpwm_cmpr_handle_t;
+typedef void *mcpwm_gen_handle_t;
+typedef void *pcnt_unit_handle_t;
+typedef void *pcnt_channel_handle_t;
+typedef struct {
+    int gpio_num;
+    int speed_mode;
+    int channel;
+    int timer_sel;
+    uint32_t duty;
+    int hpoint;
+} ledc_channel_config_t;
+typedef void *httpd_handle_t;
+
+#endif /* HOST_IDF_H */
@@ -0,0 +1,11 @@
+/* Host build: the BSD socket API of the host stands in for lwIP's */
+#ifndef STUB_LWIP_SOCKETS_H
+#define STUB_LWIP_SOCKETS_H
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "host_idf.h"
+#endif
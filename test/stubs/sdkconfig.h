@@ -0,0 +1,5 @@
+/* Host build: no PSRAM, lwIP options the firmware requires */
+#ifndef STUB_SDKCONFIG_H
+#define STUB_SDKCONFIG_H
+#define CONFIG_LWIP_SO_LINGER 1
+#endif
@@ -0,0 +1,234 @@
+/**
+ * @file test_frame_pool.c
+ * @brief Frame descriptor ring and frame buffer pool, and the frame rate they sustain between two threads
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include "fakes.h"
+#include "frame_pool.h"
+#include "frame_ring.h"
+#include "test_util.h"
+
+static frame_ring_t ring;
+
+static frame_desc_t desc_for(int index)
+{
+    return (frame_desc_t){.index = index, .len = (size_t)index * 3};
+}
+
+static void test_ring(void)
+{
+    frame_desc_t desc;
+
+    frame_ring_init(&ring);
+    CHECK_EQ(frame_ring_count(&ring), 0);
+    CHECK(!frame_ring_pop(&ring, &desc));
+
+    for (int i = 0; i < FRAME_RING_CAPACITY; i++) {
+        frame_desc_t in = desc_for(i);
+        CHECK(frame_ring_push(&ring, &in));
+    }
+    CHECK_EQ(frame_ring_count(&ring), FRAME_RING_CAPACITY);
+    frame_desc_t extra = desc_for(99);
+    CHECK(!frame_ring_push(&ring, &extra));
+
+    for (int i = 0; i < FRAME_RING_CAPACITY; i++) {
+        CHECK(frame_ring_pop(&ring, &desc));
+        CHECK_EQ(desc.index, i);
+        CHECK_EQ(desc.len, (size_t)i * 3);
+    }
+    CHECK(!frame_ring_pop(&ring, &desc));
+
+    // The free-running indices wrap around without losing the count or the order
+    atomic_store(&ring.head, UINT32_MAX - 2);
+    atomic_store(&ring.tail, UINT32_MAX - 2);
+    for (int i = 0; i < 6; i++) {
+        frame_desc_t in = desc_for(i);
+        CHECK(frame_ring_push(&ring, &in));
+    }
+    CHECK_EQ(frame_ring_count(&ring), 6);
+    for (int i = 0; i < 6; i++) {
+        CHECK(frame_ring_pop(&ring, &desc));
+        CHECK_EQ(desc.index, i);
+    }
+    CHECK_EQ(frame_ring_count(&ring), 0);
+}
+
+static void test_pool(void)
+{
+    CHECK_EQ(strcmp(frame_pool_memory(), "none"), 0);
+    CHECK_EQ(frame_pool_carve(BUF_SIZE), 0);
+    CHECK_EQ(frame_pool_acquire(), -1);
+
+    CHECK_EQ(frame_pool_slots_for(0), 0);
+    CHECK_EQ(frame_pool_slots_for(FRAME_POOL_CHUNK_SIZE + 1), 0);
+    CHECK_EQ(frame_pool_slots_for(FRAME_POOL_CHUNK_SIZE), FRAME_BUFFERS);
+    CHECK_EQ(frame_pool_slots_for(BUF_SIZE), FRAME_BUFFERS);
+    CHECK_EQ(frame_pool_slots_for(1), FRAME_POOL_MAX_SLOTS);
+
+    // Without any memory the pool stays unusable; the fallback placement is taken when the preferred one fails
+    fake_failing_caps = MALLOC_CAP_DMA | MALLOC_CAP_8BIT;
+    CHECK_EQ(frame_pool_init(MALLOC_CAP_DMA, MALLOC_CAP_8BIT), ESP_ERR_NO_MEM);
+    CHECK_EQ(strcmp(frame_pool_memory(), "none"), 0);
+    CHECK_EQ(frame_pool_chunks(), 0);
+
+    // Memory for one chunk only: the pool runs with the buffers of that chunk
+    fake_failing_caps = MALLOC_CAP_DMA;
+    fake_malloc_budget = 1;
+    CHECK_EQ(frame_pool_init(MALLOC_CAP_DMA, MALLOC_CAP_8BIT), ESP_OK);
+    CHECK_EQ(strcmp(frame_pool_memory(), "internal"), 0);
+    CHECK_EQ(frame_pool_chunks(), 1);
+    CHECK_EQ(frame_pool_slots_for(BUF_SIZE), 1);
+    CHECK_EQ(frame_pool_carve(BUF_SIZE), 1);
+
+    // The missing chunk is allocated by the next call, in whichever memory is free by then
+    fake_failing_caps = 0;
+    fake_malloc_budget = -1;
+    CHECK_EQ(frame_pool_init(MALLOC_CAP_DMA, 0), ESP_OK);
+    CHECK_EQ(frame_pool_chunks(), FRAME_BUFFERS);
+    CHECK_EQ(strcmp(frame_pool_memory(), FRAME_BUFFERS > 1 ? "mixed" : "internal"), 0);
+    CHECK_EQ(frame_pool_slots_for(BUF_SIZE), FRAME_BUFFERS);
+
+    const size_t lens[] = {BUF_SIZE, 4321, 1000, 2, FRAME_POOL_CHUNK_SIZE / 2 + 1};
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        const int slots = frame_pool_carve(lens[l]);
+        CHECK_EQ(slots, frame_pool_slots_for(lens[l]));
+        CHECK_EQ(frame_pool_count(), slots);
+        CHECK(frame_pool_slot_len() >= lens[l]);
+        CHECK_EQ(frame_pool_slot_len() % FRAME_POOL_ALIGN, 0);
+        CHECK_EQ(frame_pool_peak_in_use(), 0);
+
+        // Every buffer is handed out once, aligned and without overlapping the next one
+        int taken[FRAME_POOL_MAX_SLOTS];
+        for (int i = 0; i < slots; i++) {
+            taken[i] = frame_pool_acquire();
+            CHECK(taken[i] >= 0 && taken[i] < slots);
+            CHECK_EQ((uintptr_t)frame_pool_slot(taken[i]) % FRAME_POOL_ALIGN, 0);
+            memset(frame_pool_slot(taken[i]), i, lens[l]);
+            CHECK_EQ(frame_pool_in_use(), i + 1);
+        }
+        CHECK_EQ(frame_pool_acquire(), -1);
+        CHECK_EQ(frame_pool_peak_in_use(), slots);
+        for (int i = 0; i < slots; i++) {
+            CHECK_EQ(frame_pool_slot(taken[i])[0], i);
+            CHECK_EQ(frame_pool_slot(taken[i])[lens[l] - 1], i);
+        }
+        // A buffer never straddles two chunks, so each one lies within a chunk starting at a chunk's first buffer
+        const int per_chunk = (int)(FRAME_POOL_CHUNK_SIZE / frame_pool_slot_len());
+        for (int i = 0; i < slots; i++) {
+            const uint8_t *chunk = frame_pool_slot(i - i % per_chunk);
+            CHECK(frame_pool_slot(i) + frame_pool_slot_len() <= chunk + FRAME_POOL_CHUNK_SIZE);
+        }
+
+        // Re-carving would invalidate the buffers still owned
+        CHECK_EQ(frame_pool_carve(1000), 0);
+        CHECK(frame_pool_release(taken[0]));
+        CHECK_EQ(frame_pool_in_use(), slots - 1);
+        CHECK(!frame_pool_release(taken[0])); // A second release leaves the count alone
+        CHECK_EQ(frame_pool_in_use(), slots - 1);
+        CHECK_EQ(frame_pool_acquire(), taken[0]);
+        for (int i = 0; i < slots; i++) {
+            CHECK(frame_pool_release(taken[i]));
+        }
+        CHECK_EQ(frame_pool_in_use(), 0);
+        CHECK_EQ(frame_pool_peak_in_use(), slots);
+    }
+
+    CHECK_EQ(frame_pool_carve(0), 0);
+    CHECK_EQ(frame_pool_carve(FRAME_POOL_CHUNK_SIZE + 1), 0);
+}
+
+/**
+ * @brief Frames the consumer received, checked against the order they were produced in
+ */
+static struct {
+    int frames;
+    int received;
+    int out_of_order;
+} bench;
+
+/**
+ * @brief Sender side: take frames from the ring, copy them out as a socket write would, then free the buffer
+ */
+static void *consume(void *arg)
+{
+    static uint8_t sink[BUF_SIZE];
+    (void)arg;
+
+    frame_desc_t desc;
+    while (bench.received < bench.frames) {
+        if (!frame_ring_pop(&ring, &desc)) {
+            sched_yield();
+            continue;
+        }
+        memcpy(sink, desc.data, desc.len);
+        if (desc.header.sequence != (uint32_t)bench.received || sink[0] != (uint8_t)bench.received) {
+            bench.out_of_order++;
+        }
+        bench.received++;
+        frame_pool_release(desc.index);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Report frames and bytes per second through pool and ring at several frame lengths
+ *
+ * The producer fills every buffer like the capture would; the consumer copies
+ * it out. This is the bookkeeping ceiling of the pipeline on this host, the
+ * device is bounded by the ADC and the network well below it.
+ */
+static void bench_pipeline(void)
+{
+    const size_t lens[] = {1024, 8192, BUF_SIZE};
+
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        frame_ring_init(&ring);
+        CHECK(frame_pool_carve(lens[l]) > 0);
+        bench.frames = (int)(400 * 1024 * 1024 / lens[l]);
+        bench.received = 0;
+        bench.out_of_order = 0;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_t consumer;
+        pthread_create(&consumer, NULL, consume, NULL);
+
+        for (int n = 0; n < bench.frames;) {
+            int index = frame_pool_acquire();
+            if (index < 0) {
+                sched_yield();
+                continue;
+            }
+            uint8_t *data = frame_pool_slot(index);
+            memset(data, (uint8_t)n, lens[l]);
+            frame_desc_t desc = {.data = data, .len = lens[l], .index = index, .header.sequence = (uint32_t)n};
+            while (!frame_ring_push(&ring, &desc)) {
+                sched_yield();
+            }
+            n++;
+        }
+
+        pthread_join(consumer, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        CHECK_EQ(bench.received, bench.frames);
+        CHECK_EQ(bench.out_of_order, 0);
+        CHECK_EQ(frame_pool_in_use(), 0);
+        printf("%zu-byte frames: %.0f frames/s, %.0f MB/s on this host, %d of %d buffers used at once\n", lens[l],
+               bench.frames / seconds, bench.frames * (double)lens[l] / seconds / 1e6, frame_pool_peak_in_use(),
+               frame_pool_count());
+    }
+}
+
+int main(void)
+{
+    test_ring();
+    test_pool();
+    bench_pipeline();
+    return TEST_EXIT_CODE();
+}
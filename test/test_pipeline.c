@@ -0,0 +1,178 @@
+/**
+ * @file test_pipeline.c
+ * @brief External ADC capture pipeline against the fake SPI driver
+ *
+ * spi_pipeline.c runs unchanged on top of the frame pool. The fake driver in
+ * fakes.c completes transactions in the order they were queued and numbers
+ * the captures, so the tests check without any timing that the next frames
+ * stay queued for capture while earlier ones are consumed, that they come
+ * back in order and without gaps, and that a rate change waits for the queue
+ * to run empty.
+ */
+
+#include <string.h>
+#include "fakes.h"
+#include "globals.h"
+#include "spi_pipeline.h"
+#include "test_util.h"
+
+#define FRAMES 200
+#define MAX_HELD 3 /* Frames the consumer holds at most, as the sender does for a slow client */
+
+static spi_pipeline_t pipeline;
+static uint32_t next_capture;
+
+/**
+ * @brief Wait for the oldest capture and check it is the one queued first
+ *
+ * @return Index of the completed buffer
+ */
+static int take_frame(void)
+{
+    int oldest = pipeline.order[0];
+    int index = -1;
+    CHECK_EQ(spi_pipeline_wait(&pipeline, &index), ESP_OK);
+    CHECK_EQ(index, oldest);
+    if (index < 0) {
+        return 0;
+    }
+    CHECK_EQ(pipeline.state[index], SPI_FRAME_HELD);
+
+    uint32_t capture;
+    memcpy(&capture, pipeline.buffers[index], sizeof(capture));
+    CHECK_EQ(capture, next_capture);
+    next_capture = capture + 1;
+    return index;
+}
+
+static void test_overlap(size_t frame_len)
+{
+    CHECK_EQ(spi_pipeline_carve(&pipeline, frame_len), ESP_OK);
+    CHECK(pipeline.count >= 2);
+    CHECK(pipeline.capture_len >= frame_len && pipeline.capture_len % 4 == 0);
+
+    // Every buffer starts capturing at once
+    CHECK_EQ(spi_pipeline_fill(&pipeline), ESP_OK);
+    CHECK_EQ(pipeline.in_flight, pipeline.count);
+    CHECK_EQ(fake_spi_queued, pipeline.count);
+    CHECK(fake_semaphore_taken(spi_mutex));
+
+    // A consumer holding up to MAX_HELD frames: each buffer it holds is the only one not capturing
+    int held[MAX_HELD];
+    int held_count = 0;
+    for (int n = 0; n < FRAMES; n++) {
+        held[held_count++] = take_frame();
+        CHECK_EQ(pipeline.in_flight, pipeline.count - held_count);
+        CHECK_EQ(fake_spi_queued, pipeline.in_flight);
+        CHECK(pipeline.in_flight > 0 || pipeline.count <= MAX_HELD);
+
+        // Held buffers are not queued again
+        CHECK_EQ(spi_pipeline_fill(&pipeline), ESP_OK);
+        CHECK_EQ(pipeline.in_flight, pipeline.count - held_count);
+        for (int i = 0; i < held_count; i++) {
+            CHECK_EQ(pipeline.state[held[i]], SPI_FRAME_HELD);
+        }
+
+        // Held frames are released oldest first, at an uneven pace, and are captured into again at once
+        int release = held_count == MAX_HELD || held_count == pipeline.count ? held_count : (int)(test_random() % 2);
+        for (int i = 0; i < release; i++) {
+            spi_pipeline_release(&pipeline, held[i]);
+            CHECK_EQ(pipeline.state[held[i]], SPI_FRAME_FREE);
+        }
+        memmove(held, held + release, (held_count - release) * sizeof(held[0]));
+        held_count -= release;
+        CHECK_EQ(spi_pipeline_fill(&pipeline), ESP_OK);
+        CHECK_EQ(pipeline.in_flight, pipeline.count - held_count);
+        CHECK_EQ(frame_pool_in_use(), pipeline.in_flight + held_count);
+    }
+
+    // Re-carving needs an idle pipeline
+    CHECK_EQ(spi_pipeline_carve(&pipeline, frame_len), ESP_ERR_INVALID_STATE);
+    for (int i = 0; i < held_count; i++) {
+        spi_pipeline_release(&pipeline, held[i]);
+    }
+    spi_pipeline_drain(&pipeline);
+    next_capture = fake_spi_captures;
+    CHECK_EQ(pipeline.in_flight, 0);
+    CHECK_EQ(fake_spi_queued, 0);
+    CHECK_EQ(frame_pool_in_use(), 0);
+    CHECK(!fake_semaphore_taken(spi_mutex));
+    CHECK(fake_spi_max_queued <= FRAME_POOL_MAX_SLOTS);
+}
+
+static void test_rate_switch(void)
+{
+    CHECK_EQ(spi_pipeline_carve(&pipeline, 2 * 4096), ESP_OK);
+    CHECK_EQ(spi_pipeline_fill(&pipeline), ESP_OK);
+    const int queued = pipeline.in_flight;
+
+    // The captures already queued complete at the old rate, nothing new is queued meanwhile
+    atomic_store(&spi_reconfig_requested, 1);
+    for (int n = 0; n < queued; n++) {
+        spi_pipeline_release(&pipeline, take_frame());
+        CHECK_EQ(pipeline.in_flight, queued - n - 1);
+        if (n < queued - 1) {
+            CHECK_EQ(spi_pipeline_fill(&pipeline), ESP_OK);
+            CHECK_EQ(pipeline.in_flight, queued - n - 1);
+        }
+        CHECK_EQ(fake_spi_switches, 0);
+    }
+
+    // The switch happens at the frame boundary with the mutex still held, then capture resumes
+    CHECK_EQ(spi_pipeline_fill(&pipeline), ESP_OK);
+    CHECK_EQ(fake_spi_switches, 1);
+    CHECK_EQ(atomic_load(&spi_reconfig_requested), 0);
+    CHECK_EQ(pipeline.in_flight, pipeline.count);
+    CHECK(fake_semaphore_taken(spi_mutex));
+    spi_pipeline_release(&pipeline, take_frame());
+
+    spi_pipeline_drain(&pipeline);
+    next_capture = fake_spi_captures;
+
+    // Without captures in flight the pipeline switches on its next fill
+    atomic_store(&spi_reconfig_requested, 1);
+    CHECK_EQ(spi_pipeline_fill(&pipeline), ESP_OK);
+    CHECK_EQ(fake_spi_switches, 2);
+    CHECK_EQ(pipeline.in_flight, pipeline.count);
+    spi_pipeline_drain(&pipeline);
+    next_capture = fake_spi_captures;
+    CHECK_EQ(frame_pool_in_use(), 0);
+}
+
+static void test_queue_failure(void)
+{
+    CHECK_EQ(spi_pipeline_carve(&pipeline, 2 * 4096), ESP_OK);
+
+    // A buffer the driver refused goes back to the pool
+    fake_spi_queue_error = ESP_ERR_NO_MEM;
+    CHECK_EQ(spi_pipeline_fill(&pipeline), ESP_ERR_NO_MEM);
+    CHECK_EQ(pipeline.in_flight, 0);
+    CHECK_EQ(frame_pool_in_use(), 0);
+    fake_spi_queue_error = ESP_OK;
+
+    int index;
+    CHECK_EQ(spi_pipeline_wait(&pipeline, &index), ESP_ERR_INVALID_STATE);
+    CHECK_EQ(spi_pipeline_fill(&pipeline), ESP_OK);
+    CHECK_EQ(pipeline.in_flight, pipeline.count);
+    spi_pipeline_drain(&pipeline);
+    CHECK(!fake_semaphore_taken(spi_mutex));
+    CHECK_EQ(frame_pool_in_use(), 0);
+}
+
+int main(void)
+{
+    spi_mutex = xSemaphoreCreateMutex();
+    CHECK_EQ(spi_pipeline_init(&pipeline), ESP_OK);
+    CHECK_EQ(pipeline.capture_len, BUF_SIZE);
+
+    const int frame_samples[] = {1000, 4096, 16384, BUF_SIZE / 2};
+    for (size_t i = 0; i < sizeof(frame_samples) / sizeof(frame_samples[0]); i++) {
+        test_overlap(2 * (size_t)frame_samples[i]);
+        printf("%6d samples: %d buffers, %d captures queued at most while frames are consumed\n",
+               frame_samples[i], pipeline.count, fake_spi_max_queued);
+        fake_spi_max_queued = 0;
+    }
+    test_rate_switch();
+    test_queue_failure();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,282 @@
+/**
+ * @file test_sample_format.c
+ * @brief Round trips of every wire format through a reference decoder, and codec throughput
+ *
+ * Run as test_sample_format [capture] to also benchmark a recorded capture:
+ * raw16 frames as received from the data socket without frame headers.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include "fakes.h"
+#include "globals.h"
+#include "sample_format.h"
+#include "test_util.h"
+
+#define MAX_SAMPLES 1000
+
+/**
+ * @brief MSB-first bit stream reader, the counterpart of the encoder's writer
+ */
+typedef struct {
+    const uint8_t *data;
+    size_t bit;
+} bit_reader_t;
+
+static uint32_t get_bits(bit_reader_t *r, int bits)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < bits; i++, r->bit++) {
+        value = value << 1 | ((r->data[r->bit / 8] >> (7 - r->bit % 8)) & 1);
+    }
+    return value;
+}
+
+static void align(bit_reader_t *r)
+{
+    r->bit = (r->bit + 7) / 8 * 8;
+}
+
+/**
+ * @brief Decode a SAMPLE_FORMAT_DELTA frame as documented in sample_format.h
+ *
+ * @return Bytes consumed
+ */
+static size_t decode_delta(const uint8_t *data, int samples, int width, uint16_t *out)
+{
+    bit_reader_t r = {.data = data};
+    for (int start = 0; start < samples; start += DELTA_BLOCK_SAMPLES) {
+        int count = samples - start < DELTA_BLOCK_SAMPLES ? samples - start : DELTA_BLOCK_SAMPLES;
+        int header = get_bits(&r, 8);
+        if (header == DELTA_BLOCK_RAW) {
+            for (int i = 0; i < count; i++) {
+                out[start + i] = get_bits(&r, width);
+            }
+        } else {
+            out[start] = get_bits(&r, width);
+            uint32_t reference = get_bits(&r, width + 1);
+            for (int i = 1; i < count; i++) {
+                uint32_t zigzag = get_bits(&r, header) + reference;
+                int32_t delta = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+                out[start + i] = out[start + i - 1] + delta;
+            }
+        }
+        align(&r);
+    }
+    return r.bit / 8;
+}
+
+static int width_of(uint16_t mask)
+{
+    return __builtin_popcount(mask);
+}
+
+/**
+ * @brief Encode samples in every format and check that they decode back
+ *
+ * @return Encoded length of the delta format
+ */
+static size_t check_round_trip(const char *signal, const uint16_t *samples, int count, uint16_t mask)
+{
+    static uint8_t frame[2 * MAX_SAMPLES];
+    static uint16_t decoded[MAX_SAMPLES];
+    const int width = width_of(mask);
+    size_t len;
+
+    // raw16 leaves the words untouched
+    fake_fill_words(frame, samples, count, mask);
+    uint8_t copy[2 * MAX_SAMPLES];
+    memcpy(copy, frame, 2 * count);
+    CHECK_EQ(sample_format_encode(SAMPLE_FORMAT_RAW16, mask, frame, 2 * count), 2 * count);
+    CHECK(memcmp(copy, frame, 2 * count) == 0);
+
+    // packed: exactly width bits per sample
+    fake_fill_words(frame, samples, count, mask);
+    len = sample_format_encode(SAMPLE_FORMAT_PACKED, mask, frame, 2 * count);
+    CHECK_EQ(len, ((size_t)count * width + 7) / 8);
+    bit_reader_t r = {.data = frame};
+    int mismatches = 0;
+    for (int i = 0; i < count; i++) {
+        mismatches += get_bits(&r, width) != samples[i];
+    }
+    if (mismatches > 0) {
+        fprintf(stderr, "packed %s (mask 0x%04x): %d samples differ\n", signal, mask, mismatches);
+    }
+    CHECK_EQ(mismatches, 0);
+
+    // display8: the eight most significant data bits
+    fake_fill_words(frame, samples, count, mask);
+    len = sample_format_encode(SAMPLE_FORMAT_DISPLAY8, mask, frame, 2 * count);
+    CHECK_EQ(len, count);
+    mismatches = 0;
+    for (int i = 0; i < count; i++) {
+        mismatches += frame[i] != samples[i] >> (width - 8);
+    }
+    CHECK_EQ(mismatches, 0);
+
+    // delta: lossless
+    fake_fill_words(frame, samples, count, mask);
+    len = sample_format_encode(SAMPLE_FORMAT_DELTA, mask, frame, 2 * count);
+    // Encoding in place relies on this, frames are never shorter than two samples
+    CHECK(count < 2 || len <= 2 * (size_t)count);
+    CHECK_EQ(decode_delta(frame, count, width, decoded), len);
+    mismatches = 0;
+    for (int i = 0; i < count; i++) {
+        mismatches += decoded[i] != samples[i];
+    }
+    if (mismatches > 0) {
+        fprintf(stderr, "delta %s (mask 0x%04x): %d samples differ\n", signal, mask, mismatches);
+    }
+    CHECK_EQ(mismatches, 0);
+    return len;
+}
+
+static void test_names(void)
+{
+    for (int f = 0; f < SAMPLE_FORMAT_COUNT; f++) {
+        sample_format_t parsed;
+        CHECK_EQ(sample_format_from_name(sample_format_name(f), &parsed), ESP_OK);
+        CHECK_EQ(parsed, f);
+    }
+    sample_format_t parsed = SAMPLE_FORMAT_RAW16;
+    CHECK_EQ(sample_format_from_name("bogus", &parsed), ESP_ERR_NOT_FOUND);
+}
+
+static void test_bits(void)
+{
+    fake_data_mask = 0x1FF8;
+    CHECK_EQ(sample_format_bits(SAMPLE_FORMAT_RAW16), 16);
+    CHECK_EQ(sample_format_bits(SAMPLE_FORMAT_PACKED), 10);
+    CHECK_EQ(sample_format_bits(SAMPLE_FORMAT_DISPLAY8), 8);
+    CHECK_EQ(sample_format_bits(SAMPLE_FORMAT_DELTA), 0);
+    fake_data_mask = 0x0FFF;
+    CHECK_EQ(sample_format_bits(SAMPLE_FORMAT_PACKED), 12);
+    fake_data_mask = 0x1FF8;
+}
+
+static void test_round_trips(uint16_t mask)
+{
+    const int width = width_of(mask);
+    const uint16_t full = (1u << width) - 1;
+    uint16_t samples[MAX_SAMPLES];
+
+    // Noise, delta falls back to raw blocks and must not grow past packed plus a header per block
+    for (int i = 0; i < MAX_SAMPLES; i++) {
+        samples[i] = test_random() & full;
+    }
+    size_t noise_len = check_round_trip("noise", samples, MAX_SAMPLES, mask);
+    size_t blocks = (MAX_SAMPLES + DELTA_BLOCK_SAMPLES - 1) / DELTA_BLOCK_SAMPLES;
+    CHECK(noise_len <= ((size_t)MAX_SAMPLES * width + 7) / 8 + 2 * blocks);
+
+    // Slow sine, delta is far smaller than packed
+    for (int i = 0; i < MAX_SAMPLES; i++) {
+        samples[i] = (uint16_t)(full / 2 + (full / 2) * sin(i * 0.01));
+    }
+    size_t sine_len = check_round_trip("sine", samples, MAX_SAMPLES, mask);
+    CHECK(sine_len < ((size_t)MAX_SAMPLES * width + 7) / 8 / 2);
+
+    // Full-scale square wave, the largest deltas there are
+    for (int i = 0; i < MAX_SAMPLES; i++) {
+        samples[i] = (i / 7) % 2 ? full : 0;
+    }
+    check_round_trip("square", samples, MAX_SAMPLES, mask);
+
+    // Constant, and lengths that leave a short last block or a single sample
+    for (int i = 0; i < MAX_SAMPLES; i++) {
+        samples[i] = full / 3;
+    }
+    check_round_trip("constant", samples, MAX_SAMPLES, mask);
+    check_round_trip("constant", samples, DELTA_BLOCK_SAMPLES + 1, mask);
+    check_round_trip("constant", samples, 1, mask);
+    check_round_trip("constant", samples, 0, mask);
+}
+
+/**
+ * @brief Report the compression ratio and encode rate of packed and delta on ADC words
+ *
+ * Every round encodes a fresh copy of the frame, as the firmware encodes in
+ * place; the copy is included in the time and is small next to the encoder.
+ *
+ * @param signal Name printed with the results
+ * @param words ADC words in the byte order of the configured ADC
+ * @param len Length of words in bytes
+ */
+static void bench_signal(const char *signal, const uint8_t *words, size_t len)
+{
+    static uint8_t frame[BUF_SIZE];
+    const sample_format_t formats[] = {SAMPLE_FORMAT_PACKED, SAMPLE_FORMAT_DELTA};
+    const uint16_t mask = fake_data_mask;
+    const int rounds = (int)(64 * 1024 * 1024 / len) + 1;
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        size_t encoded = 0;
+        clock_t start = clock();
+        for (int i = 0; i < rounds; i++) {
+            memcpy(frame, words, len);
+            encoded = sample_format_encode(formats[f], mask, frame, len);
+        }
+        double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        CHECK(encoded > 0 && encoded <= len);
+        printf("%-8s %-11s %.2fx smaller than raw16, encodes %.0f MB/s on this host\n", sample_format_name(formats[f]),
+               signal, encoded > 0 ? (double)len / encoded : 0, seconds > 0 ? rounds * (double)len / seconds / 1e6 : 0);
+    }
+}
+
+/**
+ * @brief Benchmark the codecs on synthetic frames of the external ADC, then on a recorded capture if given
+ */
+static void bench_codecs(const char *capture)
+{
+    static uint16_t samples[BUF_SIZE / 2];
+    static uint8_t words[BUF_SIZE];
+    const int count = BUF_SIZE / 2;
+    const uint16_t full = (1u << width_of(fake_data_mask)) - 1;
+
+    // A 10 kHz sine at 2.5 MS/s with a couple of LSB of noise, the typical probe signal
+    for (int i = 0; i < count; i++) {
+        double noise = (int)(test_random() % 5) - 2;
+        samples[i] = (uint16_t)lround(full / 2.0 + 0.4 * full * sin(2 * M_PI * i / 250.0) + noise);
+    }
+    fake_fill_words(words, samples, count, fake_data_mask);
+    bench_signal("noisy sine", words, BUF_SIZE);
+
+    for (int i = 0; i < count; i++) {
+        samples[i] = (i / 125) % 2 ? full * 9 / 10 : full / 10;
+    }
+    fake_fill_words(words, samples, count, fake_data_mask);
+    bench_signal("square", words, BUF_SIZE);
+
+    for (int i = 0; i < count; i++) {
+        samples[i] = test_random() & full;
+    }
+    fake_fill_words(words, samples, count, fake_data_mask);
+    bench_signal("noise", words, BUF_SIZE);
+
+    if (capture == NULL) {
+        return;
+    }
+    FILE *file = fopen(capture, "rb");
+    CHECK(file != NULL);
+    if (file == NULL) {
+        return;
+    }
+    size_t len;
+    int frames = 0;
+    while ((len = fread(words, 1, sizeof(words), file)) >= 2 * DELTA_BLOCK_SAMPLES && frames++ < 16) {
+        bench_signal(capture, words, len & ~(size_t)1);
+    }
+    fclose(file);
+}
+
+int main(int argc, char **argv)
+{
+    test_names();
+    test_bits();
+    test_round_trips(0x1FF8); // External ADC
+    test_round_trips(0x0FFF); // Internal ADC
+    test_round_trips(0x1FFF); // Hi-res frame of the external ADC, 13 bits
+    fake_data_mask = 0x1FF8;
+    bench_codecs(argc > 1 ? argv[1] : NULL);
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,139 @@
+/**
+ * @file test_segments.c
+ * @brief Segmented capture: segments per frame, their timestamps and the dead time reported with them
+ *
+ * The fake ADC runs at 1 MHz, so one sample is one microsecond and every
+ * expected dead time can be counted in samples.
+ */
+
+#include "fakes.h"
+#include "globals.h"
+#include "segments.h"
+#include "test_util.h"
+
+#define FRAME_SAMPLES 1000
+#define WINDOW 100
+#define LOW 100
+#define HIGH 900
+
+static uint8_t frame[2 * FRAME_SAMPLES];
+
+static const trigger_config_t edge = {
+    .type = TRIGGER_TYPE_EDGE,
+    .rising = true,
+    .level = (LOW + HIGH) / 2,
+    .hysteresis = 10,
+    .position = 0,
+};
+
+/**
+ * @brief Frame that is low except for a 50-sample pulse starting at each of the given indices
+ */
+static void make_pulses(const int *starts, int count)
+{
+    uint16_t samples[FRAME_SAMPLES];
+    for (int i = 0; i < FRAME_SAMPLES; i++) {
+        samples[i] = LOW;
+    }
+    for (int p = 0; p < count; p++) {
+        for (int i = starts[p]; i < starts[p] + 50 && i < FRAME_SAMPLES; i++) {
+            samples[i] = HIGH;
+        }
+    }
+    fake_fill_words(frame, samples, FRAME_SAMPLES, fake_data_mask);
+}
+
+/**
+ * @brief Take the full batch and return its entries
+ */
+static const segment_entry_t *take_entries(int count)
+{
+    uint8_t *payload = NULL;
+    size_t len = segments_take_batch(SAMPLE_FORMAT_RAW16, &payload);
+    CHECK_EQ(len, sizeof(segment_batch_t) + count * (sizeof(segment_entry_t) + WINDOW * 2));
+    if (len == 0) {
+        static const segment_entry_t none[SEGMENT_MAX_COUNT];
+        return none;
+    }
+
+    const segment_batch_t *batch = (const segment_batch_t *)payload;
+    CHECK_EQ(batch->count, count);
+    CHECK_EQ(batch->samples, WINDOW);
+    CHECK_EQ(batch->trigger_index, 0);
+    return (const segment_entry_t *)(payload + sizeof(segment_batch_t));
+}
+
+static void test_window_fits_frame(void)
+{
+    CHECK_EQ(segments_configure(2, WINDOW), ESP_OK);
+
+    // Frames shorter than the segments leave segmented capture off, and the request waits for longer ones
+    CHECK(!segments_update(WINDOW - 1));
+    CHECK_EQ(segments_get_count(), 0);
+    CHECK(segments_update(FRAME_SAMPLES));
+    CHECK_EQ(segments_get_count(), 2);
+    CHECK_EQ(segments_get_samples(), WINDOW);
+    CHECK(!segments_update(WINDOW - 1));
+    CHECK(segments_update(FRAME_SAMPLES));
+}
+
+static void test_dead_time(void)
+{
+    const int pulses[] = {100, 400, 700};
+    make_pulses(pulses, 3);
+    segments_discard();
+    CHECK(segments_update(FRAME_SAMPLES));
+
+    // The batch fills at the second pulse; trigger positions 500 to 900 of the frame were never scanned
+    CHECK_EQ(segments_capture(frame, sizeof(frame), 1000, &edge), 2);
+    const segment_entry_t *entries = take_entries(2);
+    CHECK_EQ(entries[0].timestamp_us, 100);
+    CHECK_EQ(entries[0].dead_time_us, 0);
+    CHECK_EQ(entries[1].timestamp_us, 400);
+    CHECK_EQ(entries[1].dead_time_us, 0);
+
+    // A whole frame arrives while the batch is sent and is not scanned
+    uint8_t *payload;
+    CHECK_EQ(segments_capture(frame, sizeof(frame), 2000, &edge), 0);
+    CHECK_EQ(segments_take_batch(SAMPLE_FORMAT_RAW16, &payload), 0);
+    segments_release();
+
+    // Next frame right after: tail, skipped frame and the boundary window before it
+    CHECK_EQ(segments_capture(frame, sizeof(frame), 3000, &edge), 2);
+    entries = take_entries(2);
+    CHECK_EQ(entries[0].timestamp_us, 2100);
+    CHECK_EQ(entries[0].dead_time_us, 401 + FRAME_SAMPLES + WINDOW);
+    CHECK_EQ(entries[1].dead_time_us, 0);
+    segments_release();
+
+    // A 1.5 ms gap between captures adds to the tail and the boundary window
+    CHECK_EQ(segments_capture(frame, sizeof(frame), 5500, &edge), 2);
+    entries = take_entries(2);
+    CHECK_EQ(entries[0].timestamp_us, 4600);
+    CHECK_EQ(entries[0].dead_time_us, 401 + 1500 + WINDOW);
+    segments_release();
+
+    // Without a trigger the frame is scanned, only the boundary counts; the pulse of the next frame gets it all
+    make_pulses(NULL, 0);
+    CHECK_EQ(segments_capture(frame, sizeof(frame), 6500, &edge), 0);
+    const int one[] = {300};
+    make_pulses(one, 1);
+    CHECK_EQ(segments_capture(frame, sizeof(frame), 7500, &edge), 1);
+    CHECK_EQ(segments_capture(frame, sizeof(frame), 8500, &edge), 1);
+    entries = take_entries(2);
+    CHECK_EQ(entries[0].timestamp_us, 6800);
+    CHECK_EQ(entries[0].dead_time_us, 401 + WINDOW + WINDOW);
+    CHECK_EQ(entries[1].timestamp_us, 7800);
+    CHECK_EQ(entries[1].dead_time_us, WINDOW);
+    segments_release();
+}
+
+int main(void)
+{
+    fake_sample_rate = 1000000;
+    test_window_fits_frame();
+    test_dead_time();
+    CHECK_EQ(segments_configure(0, 0), ESP_OK);
+    CHECK(!segments_update(FRAME_SAMPLES));
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,341 @@
+/**
+ * @file test_signal_processing.c
+ * @brief Decimation, peak detect, hi-res and frame averaging on synthetic frames
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include "fakes.h"
+#include "signal_processing.h"
+#include "test_util.h"
+
+#define SAMPLES 4096
+#define FULL_SCALE 1023
+
+static uint8_t frame[2 * SAMPLES];
+static uint16_t samples[SAMPLES];
+
+static void load(void)
+{
+    fake_fill_words(frame, samples, SAMPLES, fake_data_mask);
+}
+
+/**
+ * @brief Sample value of the word at index, as the decoder on the client sees it
+ */
+static int sample_at(int index, uint16_t mask)
+{
+    return (adc_word_read(&frame[2 * index]) & mask) >> __builtin_ctz(mask);
+}
+
+static void make_constant(uint16_t value)
+{
+    for (int i = 0; i < SAMPLES; i++) {
+        samples[i] = value;
+    }
+    load();
+}
+
+static void make_noise(void)
+{
+    for (int i = 0; i < SAMPLES; i++) {
+        samples[i] = test_random() % (FULL_SCALE + 1);
+    }
+    load();
+}
+
+static void test_settings(void)
+{
+    CHECK_EQ(decimation_set_factor(0), ESP_ERR_INVALID_ARG);
+    CHECK_EQ(decimation_set_factor(DECIMATION_MAX_FACTOR + 1), ESP_ERR_INVALID_ARG);
+    CHECK_EQ(decimation_set_factor(8), ESP_OK);
+    CHECK_EQ(decimation_get_factor(), 8);
+    CHECK_EQ(decimation_set_factor(1), ESP_OK);
+
+    decimation_mode_t mode;
+    for (int i = 0; i < DECIMATION_MODE_COUNT; i++) {
+        CHECK_EQ(decimation_mode_from_name(decimation_mode_name(i), &mode), ESP_OK);
+        CHECK_EQ(mode, i);
+    }
+    CHECK_EQ(decimation_mode_from_name("boxcar", &mode), ESP_ERR_NOT_FOUND);
+    CHECK_EQ(decimation_set_mode(DECIMATION_MODE_COUNT), ESP_ERR_INVALID_ARG);
+
+    CHECK_EQ(decimated_samples(SAMPLES, 1, DECIMATION_FILTER), SAMPLES);
+    CHECK_EQ(decimated_samples(SAMPLES, 16, DECIMATION_FILTER), SAMPLES / 16 - DECIMATION_WARMUP);
+    CHECK_EQ(decimated_samples(SAMPLES, 16, DECIMATION_PEAK), 2 * SAMPLES / 16);
+    CHECK_EQ(decimated_samples(SAMPLES, 16, DECIMATION_HIRES), SAMPLES / 16);
+    CHECK_EQ(decimated_samples(3 * 16, 16, DECIMATION_FILTER), 0);
+}
+
+static void test_decimate(void)
+{
+    const uint16_t mask = fake_data_mask;
+    const int factors[] = {2, 3, 8, 16, DECIMATION_MAX_FACTOR};
+
+    for (size_t f = 0; f < sizeof(factors) / sizeof(factors[0]); f++) {
+        const int factor = factors[f];
+
+        // DC passes with unity gain, up to the rounding of the fixed-point normalization
+        const uint16_t levels[] = {0, 1, 517, FULL_SCALE};
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+            make_constant(levels[l]);
+            size_t len = decimate_frame(frame, sizeof(frame), factor);
+            CHECK_EQ(len, 2 * decimated_samples(SAMPLES, factor, DECIMATION_FILTER));
+            for (size_t i = 0; i < len / 2; i++) {
+                int value = sample_at(i, mask);
+                if (abs(value - levels[l]) > 1) {
+                    CHECK_EQ(value, levels[l]);
+                    break;
+                }
+            }
+        }
+
+        // A tone at the input Nyquist frequency falls into a CIC null for even factors, only its mean is left
+        if (factor % 2) {
+            continue;
+        }
+        for (int i = 0; i < SAMPLES; i++) {
+            samples[i] = i % 2 ? 700 : 300;
+        }
+        load();
+        size_t len = decimate_frame(frame, sizeof(frame), factor);
+        for (size_t i = 0; i < len / 2; i++) {
+            if (abs(sample_at(i, mask) - 500) > 2) {
+                CHECK_EQ(sample_at(i, mask), 500);
+                break;
+            }
+        }
+    }
+
+    // A slow sine survives with its amplitude, after the group delay of the filter
+    const int factor = 8;
+    const double period = 64.0 * factor;
+    for (int i = 0; i < SAMPLES; i++) {
+        samples[i] = (uint16_t)lround(FULL_SCALE / 2.0 + 400 * sin(2 * M_PI * i / period));
+    }
+    load();
+    size_t len = decimate_frame(frame, sizeof(frame), factor);
+    int lo = FULL_SCALE;
+    int hi = 0;
+    for (size_t i = 0; i < len / 2; i++) {
+        int value = sample_at(i, mask);
+        lo = value < lo ? value : lo;
+        hi = value > hi ? value : hi;
+    }
+    CHECK(hi - lo > 2 * 400 * 0.97);
+    CHECK(hi - lo < 2 * 400 * 1.03);
+
+    // Factor 1 leaves the frame untouched
+    make_noise();
+    CHECK_EQ(decimate_frame(frame, sizeof(frame), 1), sizeof(frame));
+    CHECK_EQ(sample_at(SAMPLES - 1, mask), samples[SAMPLES - 1]);
+}
+
+static void test_peak(void)
+{
+    const uint16_t mask = fake_data_mask;
+    const int factors[] = {2, 5, 16, DECIMATION_MAX_FACTOR};
+
+    for (size_t f = 0; f < sizeof(factors) / sizeof(factors[0]); f++) {
+        const int factor = factors[f];
+        make_noise();
+        size_t len = peak_detect_frame(frame, sizeof(frame), factor);
+        CHECK_EQ(len, 2 * decimated_samples(SAMPLES, factor, DECIMATION_PEAK));
+
+        for (size_t b = 0; b < len / 4; b++) {
+            int lo = FULL_SCALE;
+            int hi = 0;
+            for (int i = 0; i < factor; i++) {
+                int value = samples[b * factor + i];
+                lo = value < lo ? value : lo;
+                hi = value > hi ? value : hi;
+            }
+            if (sample_at(2 * b, mask) != lo || sample_at(2 * b + 1, mask) != hi) {
+                CHECK_EQ(sample_at(2 * b, mask), lo);
+                CHECK_EQ(sample_at(2 * b + 1, mask), hi);
+                break;
+            }
+        }
+    }
+
+    // A one-sample glitch stays visible, where filtering would average it away
+    make_constant(500);
+    samples[1000] = FULL_SCALE;
+    samples[3000] = 0;
+    load();
+    size_t len = peak_detect_frame(frame, sizeof(frame), 64);
+    CHECK_EQ(len, 4 * (SAMPLES / 64));
+    CHECK_EQ(sample_at(2 * (1000 / 64) + 1, mask), FULL_SCALE);
+    CHECK_EQ(sample_at(2 * (3000 / 64), mask), 0);
+    CHECK_EQ(sample_at(0, mask), 500);
+    CHECK_EQ(sample_at(1, mask), 500);
+}
+
+static void test_hires(void)
+{
+    CHECK_EQ(hires_extra_bits(1), 0);
+    CHECK_EQ(hires_extra_bits(2), 0);
+    CHECK_EQ(hires_extra_bits(4), 1);
+    CHECK_EQ(hires_extra_bits(15), 1);
+    CHECK_EQ(hires_extra_bits(16), 2);
+    CHECK_EQ(hires_extra_bits(64), 3);
+
+    const uint16_t mask = fake_data_mask;
+    CHECK_EQ(hires_data_mask(1), mask);
+    CHECK_EQ(hires_data_mask(2), mask);
+
+    const int factors[] = {2, 4, 7, 16, DECIMATION_MAX_FACTOR};
+    for (size_t f = 0; f < sizeof(factors) / sizeof(factors[0]); f++) {
+        const int factor = factors[f];
+        const int extra = hires_extra_bits(factor);
+        const uint16_t out_mask = hires_data_mask(factor);
+        CHECK_EQ(__builtin_popcount(out_mask), __builtin_popcount(mask) + extra);
+        CHECK_EQ(out_mask >> 15, 0);
+
+        make_noise();
+        size_t len = hires_frame(frame, sizeof(frame), factor);
+        CHECK_EQ(len, 2 * decimated_samples(SAMPLES, factor, DECIMATION_HIRES));
+
+        for (size_t b = 0; b < len / 2; b++) {
+            double mean = 0;
+            for (int i = 0; i < factor; i++) {
+                mean += samples[b * factor + i];
+            }
+            mean /= factor;
+
+            // The mean carries extra fraction bits, off by at most the rounding of the reciprocal
+            int value = sample_at(b, out_mask);
+            if (fabs(value - mean * (1 << extra)) > 1) {
+                CHECK_EQ(value, lround(mean * (1 << extra)));
+                break;
+            }
+        }
+    }
+
+    // With room below the sample bits, the plain mask still reads a plain-resolution sample
+    if (__builtin_ctz(mask) >= hires_extra_bits(16)) {
+        make_constant(517);
+        hires_frame(frame, sizeof(frame), 16);
+        CHECK_EQ(sample_at(0, mask), 517);
+    }
+}
+
+static void test_averaging(void)
+{
+    const uint16_t mask = fake_data_mask;
+
+    CHECK_EQ(averaging_configure(AVERAGING_MODE_COUNT, 4), ESP_ERR_INVALID_ARG);
+    CHECK_EQ(averaging_configure(AVERAGING_BLOCK, 1), ESP_ERR_INVALID_ARG);
+    CHECK_EQ(averaging_configure(AVERAGING_BLOCK, AVERAGING_MAX_FRAMES + 1), ESP_ERR_INVALID_ARG);
+
+    averaging_mode_t mode;
+    for (int i = 0; i < AVERAGING_MODE_COUNT; i++) {
+        CHECK_EQ(averaging_mode_from_name(averaging_mode_name(i), &mode), ESP_OK);
+        CHECK_EQ(mode, i);
+    }
+
+    // Off: every frame passes through unchanged
+    make_noise();
+    CHECK(average_frame(frame, sizeof(frame)));
+    CHECK_EQ(averaging_get_mode(), AVERAGING_OFF);
+    CHECK_EQ(averaging_get_frames(), 1);
+    CHECK_EQ(sample_at(123, mask), samples[123]);
+
+    // Block: one rounded mean every 4 frames
+    CHECK_EQ(averaging_configure(AVERAGING_BLOCK, 4), ESP_OK);
+    const uint16_t block[4] = {100, 200, 300, 401};
+    for (int n = 0; n < 4; n++) {
+        make_constant(block[n]);
+        samples[7] = FULL_SCALE * (n % 2);
+        load();
+        CHECK_EQ(average_frame(frame, sizeof(frame)), n == 3);
+    }
+    CHECK_EQ(averaging_get_mode(), AVERAGING_BLOCK);
+    CHECK_EQ(averaging_get_frames(), 4);
+    CHECK_EQ(sample_at(0, mask), (100 + 200 + 300 + 401 + 2) / 4);
+    CHECK_EQ(sample_at(7, mask), (2 * FULL_SCALE + 2) / 4);
+
+    // A frame of another length restarts the average
+    make_constant(600);
+    CHECK(!average_frame(frame, sizeof(frame) / 2));
+    for (int n = 1; n < 4; n++) {
+        CHECK_EQ(average_frame(frame, sizeof(frame) / 2), n == 3);
+    }
+    CHECK_EQ(sample_at(SAMPLES / 2 - 1, mask), 600);
+
+    // Exponential: a step settles towards the new level and is sent every N frames
+    CHECK_EQ(averaging_configure(AVERAGING_EXPONENTIAL, 8), ESP_OK);
+    make_constant(0);
+    CHECK(!average_frame(frame, sizeof(frame)));
+    int sent = 0;
+    int previous = 0;
+    for (int n = 0; n < 8 * 10; n++) {
+        make_constant(800);
+        if (average_frame(frame, sizeof(frame))) {
+            int value = sample_at(SAMPLES / 2, mask);
+            CHECK(value >= previous); // Rises until it settles on the new level
+            CHECK(value <= 800);
+            previous = value;
+            sent++;
+        }
+    }
+    CHECK_EQ(sent, 10);
+    CHECK_EQ(previous, 800);
+
+    // Releasing the accumulator restarts the average, which allocates again
+    averaging_release();
+    make_constant(100);
+    CHECK(!average_frame(frame, sizeof(frame)));
+    for (int n = 1; n < 8; n++) {
+        CHECK_EQ(average_frame(frame, sizeof(frame)), n == 7);
+    }
+    CHECK_EQ(sample_at(0, mask), 100);
+
+    CHECK_EQ(averaging_configure(AVERAGING_OFF, 0), ESP_OK);
+    make_noise();
+    CHECK(average_frame(frame, sizeof(frame)));
+    CHECK_EQ(averaging_get_mode(), AVERAGING_OFF);
+    CHECK_EQ(sample_at(SAMPLES - 1, mask), samples[SAMPLES - 1]);
+}
+
+/**
+ * @brief Report the input rate of each kernel at factor 16, which has to stay well above the ADC rate
+ */
+static void bench_kernels(void)
+{
+    static const struct {
+        const char *name;
+        size_t (*kernel)(uint8_t *, size_t, int);
+    } kernels[] = {
+        {"decimate_frame", decimate_frame},
+        {"peak_detect_frame", peak_detect_frame},
+        {"hires_frame", hires_frame},
+    };
+
+    make_noise();
+    const int rounds = 2000;
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        size_t sink = 0;
+        clock_t start = clock();
+        for (int i = 0; i < rounds; i++) {
+            // The kernels work in place; the output is noise again, which is all the benchmark needs
+            sink += kernels[k].kernel(frame, sizeof(frame), 16);
+        }
+        double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        CHECK(sink > 0);
+        printf("%s: %.1f MS/s on this host\n", kernels[k].name,
+               seconds > 0 ? rounds * (double)SAMPLES / seconds / 1e6 : 0);
+    }
+}
+
+int main(void)
+{
+    test_settings();
+    test_decimate();
+    test_peak();
+    test_hires();
+    test_averaging();
+    bench_kernels();
+    return TEST_EXIT_CODE();
+}
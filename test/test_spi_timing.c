@@ -0,0 +1,129 @@
+/**
+ * @file test_spi_timing.c
+ * @brief External ADC timing solver against spi_matrix and an exhaustive divider search
+ */
+
+#include <math.h>
+#include "globals.h"
+#include "spi_timing.h"
+#include "test_util.h"
+
+static void test_rows(void)
+{
+    for (int row = 0; row < MATRIX_SPI_ROWS; row++) {
+        const uint32_t divider = spi_timing_row_divider(row);
+        CHECK(spi_timing_divider_valid(divider));
+        CHECK_EQ(spi_timing_row(divider), row);
+        CHECK_EQ(spi_timing_divider_for_rate(spi_timing_rate(divider)), divider);
+
+        // The divider of a calibration row reproduces the row exactly
+        spi_timing_t timing;
+        spi_timing_for_divider(divider, &timing);
+        CHECK_EQ(timing.divider, divider);
+        CHECK_EQ(timing.row, row);
+        CHECK_EQ(timing.spi_clock_hz, spi_matrix[row][0]);
+        CHECK_EQ(timing.cs_ena_pretrans, spi_matrix[row][1]);
+        CHECK_EQ(timing.input_delay_ns, spi_matrix[row][2]);
+        CHECK_EQ(timing.period_ticks, spi_matrix[row][3]);
+        CHECK_EQ(timing.compare_ticks, spi_matrix[row][4]);
+    }
+    CHECK_EQ(spi_timing_rate(SPI_TIMING_MIN_DIVIDER), 2500000);
+}
+
+static void test_divider_valid(void)
+{
+    CHECK(!spi_timing_divider_valid(0));
+    CHECK(!spi_timing_divider_valid(1));
+    CHECK(spi_timing_divider_valid(2));
+    CHECK(spi_timing_divider_valid(3));
+    CHECK(spi_timing_divider_valid(61));
+    CHECK(!spi_timing_divider_valid(67)); // Prime above SPI_TIMING_MAX_CLOCK_N
+    CHECK(spi_timing_divider_valid(2 * 67));
+    CHECK(!spi_timing_divider_valid(4093));
+    CHECK(spi_timing_divider_valid(SPI_TIMING_MAX_DIVIDER));
+    CHECK(!spi_timing_divider_valid(SPI_TIMING_MAX_DIVIDER + 1));
+}
+
+static void test_every_divider(void)
+{
+    int previous_row = 0;
+    for (uint32_t divider = SPI_TIMING_MIN_DIVIDER; divider <= SPI_TIMING_MAX_DIVIDER; divider++) {
+        if (!spi_timing_divider_valid(divider)) {
+            continue;
+        }
+
+        spi_timing_t timing;
+        spi_timing_for_divider(divider, &timing);
+        CHECK(timing.period_ticks <= UINT16_MAX);
+        CHECK_EQ(timing.spi_clock_hz * divider, SPI_TIMING_BASE_HZ - SPI_TIMING_BASE_HZ % divider);
+        CHECK_EQ(timing.period_ticks, SPI_TIMING_CLOCKS_PER_SAMPLE * divider);
+        CHECK(fabs((double)timing.compare_ticks / timing.period_ticks - (double)COMPARE_VALUE / PERIOD_TICKS) <
+              1.0 / timing.period_ticks);
+
+        // The calibration row is the nearest on a log scale, and never goes back to a faster row
+        int nearest = 0;
+        for (int row = 1; row < MATRIX_SPI_ROWS; row++) {
+            if (fabs(log((double)divider / spi_timing_row_divider(row))) <
+                fabs(log((double)divider / spi_timing_row_divider(nearest)))) {
+                nearest = row;
+            }
+        }
+        if (timing.row != nearest) {
+            fprintf(stderr, "divider %u\n", divider);
+            CHECK_EQ(timing.row, nearest);
+        }
+        CHECK(timing.row >= previous_row);
+        previous_row = timing.row;
+    }
+}
+
+/**
+ * @brief Distance of the nearest achievable rate, by trying every divider
+ */
+static double nearest_distance(double rate_hz)
+{
+    double best = INFINITY;
+    for (uint32_t divider = SPI_TIMING_MIN_DIVIDER; divider <= SPI_TIMING_MAX_DIVIDER; divider++) {
+        if (spi_timing_divider_valid(divider) && fabs(spi_timing_rate(divider) - rate_hz) < best) {
+            best = fabs(spi_timing_rate(divider) - rate_hz);
+        }
+    }
+    return best;
+}
+
+static void test_divider_for_rate(void)
+{
+    const double slowest = spi_timing_rate(SPI_TIMING_MAX_DIVIDER);
+
+    // Arbitrary rates over the whole range, evenly spread on a log scale
+    for (int i = 0; i < 5000; i++) {
+        double rate_hz = slowest * pow(2500000 / slowest, (test_random() % 1000000) / 1e6);
+        uint32_t divider = spi_timing_divider_for_rate(rate_hz);
+        CHECK(spi_timing_divider_valid(divider));
+        if (fabs(spi_timing_rate(divider) - rate_hz) != nearest_distance(rate_hz)) {
+            fprintf(stderr, "%.3f Hz gives divider %u\n", rate_hz, divider);
+            CHECK(fabs(spi_timing_rate(divider) - rate_hz) == nearest_distance(rate_hz));
+        }
+    }
+
+    // Rates next to the invalid prime dividers 67 and 4093 get a neighbour
+    CHECK_EQ(spi_timing_divider_for_rate(spi_timing_rate(67)), 68); // Nearer in rate than 66
+    CHECK(spi_timing_divider_valid(spi_timing_divider_for_rate(spi_timing_rate(4093))));
+
+    // Beyond the limits the fastest or slowest divider is used
+    CHECK_EQ(spi_timing_divider_for_rate(1e9), SPI_TIMING_MIN_DIVIDER);
+    CHECK_EQ(spi_timing_divider_for_rate(2500001), SPI_TIMING_MIN_DIVIDER);
+    CHECK_EQ(spi_timing_divider_for_rate(slowest), SPI_TIMING_MAX_DIVIDER);
+    CHECK_EQ(spi_timing_divider_for_rate(1), SPI_TIMING_MAX_DIVIDER);
+    CHECK_EQ(spi_timing_divider_for_rate(0), SPI_TIMING_MAX_DIVIDER);
+    CHECK_EQ(spi_timing_divider_for_rate(-100), SPI_TIMING_MAX_DIVIDER);
+}
+
+int main(void)
+{
+    test_rows();
+    test_divider_valid();
+    test_every_divider();
+    test_divider_for_rate();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,197 @@
+/**
+ * @file test_trigger.c
+ * @brief Trigger engine on synthetic waveforms
+ */
+
+#include <math.h>
+#include <time.h>
+#include "fakes.h"
+#include "globals.h"
+#include "signal_processing.h"
+#include "test_util.h"
+#include "trigger.h"
+
+#define SAMPLES 4096
+#define FULL_SCALE 1023
+
+static uint8_t frame[2 * SAMPLES];
+static uint16_t samples[SAMPLES];
+
+static trigger_config_t config(trigger_type_t type, bool rising, int32_t level, int32_t hysteresis, int position)
+{
+    return (trigger_config_t){
+        .type = type,
+        .rising = rising,
+        .level = level,
+        .hysteresis = hysteresis,
+        .position = position,
+    };
+}
+
+static void load(void)
+{
+    fake_fill_words(frame, samples, SAMPLES, fake_data_mask);
+}
+
+/**
+ * @brief Sine of the given period, starting at its minimum
+ */
+static void make_sine(double period)
+{
+    for (int i = 0; i < SAMPLES; i++) {
+        samples[i] = (uint16_t)lround(FULL_SCALE / 2.0 - FULL_SCALE / 2.0 * cos(2 * M_PI * i / period));
+    }
+    load();
+}
+
+/**
+ * @brief Index of the first rising (or falling) crossing of level at or after from, computed naively
+ */
+static ssize_t first_crossing(int32_t level, bool rising, size_t from)
+{
+    for (size_t i = from > 0 ? from : 1; i < SAMPLES; i++) {
+        if (rising ? samples[i - 1] < level && samples[i] >= level : samples[i - 1] > level && samples[i] <= level) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void test_settings(void)
+{
+    fake_max_bits = FULL_SCALE;
+    CHECK_EQ(trigger_set_type(TRIGGER_TYPE_LEVEL), ESP_OK);
+    CHECK_EQ(trigger_set_level(40), ESP_OK);
+    CHECK_EQ(trigger_set_hysteresis(5), ESP_OK);
+    CHECK_EQ(trigger_set_position(25), ESP_OK);
+    CHECK_EQ(trigger_set_level(101), ESP_ERR_INVALID_ARG);
+    CHECK_EQ(trigger_set_type(TRIGGER_TYPE_COUNT), ESP_ERR_INVALID_ARG);
+
+    trigger_config_t current;
+    trigger_get_config(&current);
+    CHECK_EQ(current.type, TRIGGER_TYPE_LEVEL);
+    CHECK_EQ(current.level, 40 * FULL_SCALE / 100);
+    CHECK_EQ(current.hysteresis, 5 * FULL_SCALE / 100);
+    CHECK_EQ(current.position, 25);
+
+    trigger_type_t type;
+    CHECK_EQ(trigger_type_from_name(trigger_type_name(TRIGGER_TYPE_EDGE), &type), ESP_OK);
+    CHECK_EQ(type, TRIGGER_TYPE_EDGE);
+    CHECK_EQ(trigger_type_from_name("bogus", &type), ESP_ERR_NOT_FOUND);
+}
+
+static void test_level(void)
+{
+    make_sine(1000);
+    trigger_config_t rising = config(TRIGGER_TYPE_LEVEL, true, 700, 0, 50);
+    ssize_t found = trigger_scan(frame, 0, SAMPLES, &rising);
+    CHECK(found > 0);
+    CHECK(samples[found] >= 700 && samples[found - 1] < 700);
+
+    // The sine starts at its minimum, which is already below a falling level
+    trigger_config_t falling = config(TRIGGER_TYPE_LEVEL, false, 300, 0, 50);
+    CHECK_EQ(trigger_scan(frame, 0, SAMPLES, &falling), 0);
+
+    trigger_config_t never = config(TRIGGER_TYPE_LEVEL, true, FULL_SCALE + 1, 0, 50);
+    CHECK_EQ(trigger_scan(frame, 0, SAMPLES, &never), -1);
+}
+
+static void test_edge(void)
+{
+    make_sine(1000);
+    for (int rising = 0; rising <= 1; rising++) {
+        for (int32_t level = 100; level <= 900; level += 200) {
+            trigger_config_t edge = config(TRIGGER_TYPE_EDGE, rising, level, 10, 50);
+            CHECK_EQ(trigger_scan(frame, 0, SAMPLES, &edge), first_crossing(level, rising, 0));
+
+            // Samples before from arm the trigger but cannot fire it
+            CHECK_EQ(trigger_scan(frame, 1500, SAMPLES, &edge), first_crossing(level, rising, 1500));
+        }
+    }
+
+    // A signal that starts above the level has to drop below level - hysteresis before a rising edge counts
+    for (int i = 0; i < SAMPLES; i++) {
+        samples[i] = i < 100 ? 600 : i < 200 ? 480 : i < 300 ? 600 : i < 400 ? 440 : 600;
+    }
+    load();
+    trigger_config_t edge = config(TRIGGER_TYPE_EDGE, true, 500, 50, 50);
+    CHECK_EQ(trigger_scan(frame, 0, SAMPLES, &edge), 400);
+
+    // Noise inside the hysteresis band never fires
+    for (int i = 0; i < SAMPLES; i++) {
+        samples[i] = 500 + (int)(test_random() % 41) - 20;
+    }
+    load();
+    edge = config(TRIGGER_TYPE_EDGE, true, 500, 30, 50);
+    CHECK_EQ(trigger_scan(frame, 0, SAMPLES, &edge), -1);
+    edge.hysteresis = 0;
+    CHECK(trigger_scan(frame, 0, SAMPLES, &edge) >= 0);
+}
+
+static void test_align(void)
+{
+    static uint16_t original[SAMPLES];
+    const size_t window = trigger_window_samples(SAMPLES);
+
+    for (int position = 0; position <= 100; position += 25) {
+        make_sine(700);
+        memcpy(original, samples, sizeof(samples));
+        trigger_config_t edge = config(TRIGGER_TYPE_EDGE, true, 512, 10, position);
+        size_t pre = window * position / 100;
+        ssize_t expected = first_crossing(512, true, pre);
+
+        size_t trigger_index = 0;
+        size_t len = trigger_align_frame(frame, sizeof(frame), &edge, &trigger_index);
+        CHECK_EQ(len, 2 * window);
+        CHECK_EQ(trigger_index, pre);
+
+        // The window is the original samples around the trigger point
+        int mismatches = 0;
+        for (size_t i = 0; i < window; i++) {
+            uint16_t word = adc_word_read(&frame[2 * i]);
+            mismatches += (word & fake_data_mask) >> __builtin_ctz(fake_data_mask) != original[expected - pre + i];
+        }
+        CHECK_EQ(mismatches, 0);
+    }
+
+    // No trigger, nothing to send
+    for (int i = 0; i < SAMPLES; i++) {
+        samples[i] = 100;
+    }
+    load();
+    trigger_config_t edge = config(TRIGGER_TYPE_EDGE, true, 512, 10, 50);
+    size_t trigger_index;
+    CHECK_EQ(trigger_align_frame(frame, sizeof(frame), &edge, &trigger_index), 0);
+}
+
+/**
+ * @brief Report the scan rate, which has to stay well above the 2.5 MS/s of the external ADC
+ */
+static void bench_scan(void)
+{
+    for (int i = 0; i < SAMPLES; i++) {
+        samples[i] = 100; // Never fires, so every sample is scanned
+    }
+    load();
+    trigger_config_t edge = config(TRIGGER_TYPE_EDGE, true, 512, 10, 50);
+
+    const int rounds = 2000;
+    ssize_t sink = 0;
+    clock_t start = clock();
+    for (int i = 0; i < rounds; i++) {
+        sink += trigger_scan(frame, 0, SAMPLES, &edge);
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    CHECK_EQ(sink, -rounds);
+    printf("trigger_scan: %.1f MS/s on this host\n", seconds > 0 ? rounds * (double)SAMPLES / seconds / 1e6 : 0);
+}
+
+int main(void)
+{
+    test_settings();
+    test_level();
+    test_edge();
+    test_align();
+    bench_scan();
+    return TEST_EXIT_CODE();
+}
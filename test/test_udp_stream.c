@@ -0,0 +1,407 @@
+/**
+ * @file test_udp_stream.c
+ * @brief UDP fragmentation, and NACK recovery of lost and reordered fragments over host loopback sockets
+ *
+ * The device side below serves NACKs with the firmware's udp_nack_select(),
+ * which retransmit_fragments() in data_transmission.c also uses, and builds
+ * datagrams with udp_fragment_iov(); they travel through real sockets.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "fakes.h"
+#include "globals.h"
+#include "test_util.h"
+#include "udp_stream.h"
+
+#define FRAMES 24
+#define PAYLOAD_LEN BUF_SIZE
+#define MAX_FRAGMENTS 64
+
+static uint8_t payloads[FRAMES][PAYLOAD_LEN];
+static frame_header_t headers[FRAMES];
+
+/**
+ * @brief Frame bytes as they are on the wire, header then payload
+ */
+static void frame_bytes(int frame, size_t payload_len, uint8_t *out)
+{
+    memcpy(out, &headers[frame], sizeof(frame_header_t));
+    memcpy(out + sizeof(frame_header_t), payloads[frame], payload_len);
+}
+
+static void make_frames(void)
+{
+    for (int f = 0; f < FRAMES; f++) {
+        headers[f] = (frame_header_t){
+            .magic = FRAME_HEADER_MAGIC,
+            .version = FRAME_HEADER_VERSION,
+            .header_len = sizeof(frame_header_t),
+            .sequence = 1000 + f,
+            .payload_len = PAYLOAD_LEN,
+        };
+        for (int i = 0; i < PAYLOAD_LEN; i++) {
+            payloads[f][i] = (uint8_t)test_random();
+        }
+    }
+}
+
+static void test_fragmentation(void)
+{
+    static uint8_t expected[sizeof(frame_header_t) + PAYLOAD_LEN];
+    static uint8_t joined[sizeof(frame_header_t) + PAYLOAD_LEN];
+    const size_t lens[] = {
+        0, 1, UDP_FRAGMENT_PAYLOAD - sizeof(frame_header_t), UDP_FRAGMENT_PAYLOAD - sizeof(frame_header_t) + 1,
+        UDP_FRAGMENT_PAYLOAD, 10000, PAYLOAD_LEN,
+    };
+
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        const size_t frame_len = sizeof(frame_header_t) + lens[l];
+        const int count = udp_fragment_count(lens[l]);
+        CHECK_EQ(count, (frame_len + UDP_FRAGMENT_PAYLOAD - 1) / UDP_FRAGMENT_PAYLOAD);
+        frame_bytes(0, lens[l], expected);
+
+        udp_fragment_header_t frag;
+        struct iovec iov[3];
+        size_t joined_len = 0;
+        for (int i = 0; i < count; i++) {
+            int n = udp_fragment_iov(&headers[0], payloads[0], lens[l], i, 0, &frag, iov);
+            CHECK(n >= 2 && n <= 3);
+            CHECK(iov[0].iov_base == &frag);
+            CHECK_EQ(frag.magic, UDP_STREAM_MAGIC);
+            CHECK_EQ(frag.type, UDP_MSG_FRAGMENT);
+            CHECK_EQ(frag.frame_seq, headers[0].sequence);
+            CHECK_EQ(frag.fragment, i);
+            CHECK_EQ(frag.fragment_count, count);
+            CHECK_EQ(frag.frame_len, frame_len);
+
+            size_t datagram = 0;
+            for (int k = 0; k < n; k++) {
+                datagram += iov[k].iov_len;
+            }
+            CHECK(datagram <= UDP_MAX_DATAGRAM);
+            CHECK(i == count - 1 || datagram == UDP_MAX_DATAGRAM); // Only the last fragment is short
+            for (int k = 1; k < n; k++) {
+                memcpy(joined + joined_len, iov[k].iov_base, iov[k].iov_len);
+                joined_len += iov[k].iov_len;
+            }
+        }
+        CHECK_EQ(joined_len, frame_len);
+        CHECK_EQ(memcmp(joined, expected, frame_len), 0);
+
+        CHECK_EQ(udp_fragment_iov(&headers[0], payloads[0], lens[l], count, 0, &frag, iov), 0);
+        CHECK_EQ(udp_fragment_iov(&headers[0], payloads[0], lens[l], -1, 0, &frag, iov), 0);
+    }
+
+    // A frame that fits one datagram straddles header and payload in its only fragment
+    udp_fragment_header_t frag;
+    struct iovec iov[3];
+    CHECK_EQ(udp_fragment_iov(&headers[0], payloads[0], 100, 0, UDP_FRAGMENT_RETRANSMIT, &frag, iov), 3);
+    CHECK_EQ(frag.flags, UDP_FRAGMENT_RETRANSMIT);
+    CHECK_EQ(iov[1].iov_len, sizeof(frame_header_t));
+    CHECK_EQ(iov[2].iov_len, 100);
+}
+
+static void test_nack_select(void)
+{
+    const size_t frame_len = sizeof(frame_header_t) + PAYLOAD_LEN;
+    const int count = udp_fragment_count(PAYLOAD_LEN);
+    const int64_t window_us = UDP_RETRANSMIT_WINDOW_MS * 1000;
+    udp_control_t nack = {.magic = UDP_STREAM_MAGIC, .type = UDP_MSG_NACK, .first_fragment = 0, .mask = ~0ULL};
+    uint64_t resend;
+
+    // A sent frame gets back every fragment it has, up to the end of its window
+    CHECK(udp_nack_select(&nack, PAYLOAD_LEN, frame_len, 1000, 1000 + window_us, &resend));
+    CHECK_EQ(resend, (1ULL << count) - 1);
+    CHECK(!udp_nack_select(&nack, PAYLOAD_LEN, frame_len, 1000, 1000 + window_us + 1, &resend));
+    CHECK_EQ(resend, 0);
+
+    // A frame being written only resends complete fragments, however long ago it started
+    CHECK(udp_nack_select(&nack, PAYLOAD_LEN, 3 * UDP_FRAGMENT_PAYLOAD + 100, 0, 10 * window_us, &resend));
+    CHECK_EQ(resend, 0x7);
+    CHECK(udp_nack_select(&nack, PAYLOAD_LEN, UDP_FRAGMENT_PAYLOAD - 1, 0, 0, &resend));
+    CHECK_EQ(resend, 0);
+
+    // The mask is relative to first_fragment and only asked-for fragments are selected
+    nack.first_fragment = 2;
+    nack.mask = 0x5;
+    CHECK(udp_nack_select(&nack, PAYLOAD_LEN, 4 * UDP_FRAGMENT_PAYLOAD, 0, 0, &resend));
+    CHECK_EQ(resend, 0x1);
+    CHECK(udp_nack_select(&nack, PAYLOAD_LEN, frame_len, 0, 0, &resend));
+    CHECK_EQ(resend, 0x5);
+    nack.first_fragment = count;
+    CHECK(udp_nack_select(&nack, PAYLOAD_LEN, frame_len, 0, 0, &resend));
+    CHECK_EQ(resend, 0);
+
+    // A frame in one fragment
+    nack.first_fragment = 0;
+    nack.mask = ~0ULL;
+    CHECK(udp_nack_select(&nack, 0, sizeof(frame_header_t), 0, 0, &resend));
+    CHECK_EQ(resend, 1);
+}
+
+/**
+ * @brief Device side: frames held for retransmission, as in a UDP client's queue
+ */
+static struct {
+    int sock;
+    struct sockaddr_in client;
+    size_t sent_len[FRAMES]; /**< Bytes of each frame sent so far, header included */
+    int64_t sent_us[FRAMES]; /**< When the last fragment of each frame was sent */
+    int retransmits;
+    int nacks_expired;
+} device;
+
+/**
+ * @brief Client side: reassembly of every frame
+ */
+static struct {
+    int sock;
+    struct sockaddr_in device;
+    uint8_t frames[FRAMES][sizeof(frame_header_t) + PAYLOAD_LEN];
+    uint64_t received[FRAMES]; /**< Bit i set once fragment i arrived */
+    int count[FRAMES]; /**< Fragments of each frame, 0 until the first one arrived */
+    int64_t complete_us[FRAMES]; /**< When each frame was complete, 0 while it is not */
+    int retransmitted;
+    int duplicates;
+} client;
+
+static int open_socket(struct sockaddr_in *addr)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    CHECK(sock >= 0);
+    *addr = (struct sockaddr_in){.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    CHECK_EQ(bind(sock, (struct sockaddr *)addr, sizeof(*addr)), 0);
+    socklen_t len = sizeof(*addr);
+    CHECK_EQ(getsockname(sock, (struct sockaddr *)addr, &len), 0);
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    return sock;
+}
+
+static void device_send_fragment(int frame, int fragment, uint8_t flags)
+{
+    udp_fragment_header_t frag;
+    struct iovec iov[3];
+    int iovcnt = udp_fragment_iov(&headers[frame], payloads[frame], PAYLOAD_LEN, fragment, flags, &frag, iov);
+    struct msghdr msg = {
+        .msg_name = &device.client,
+        .msg_namelen = sizeof(device.client),
+        .msg_iov = iov,
+        .msg_iovlen = iovcnt,
+    };
+    CHECK(sendmsg(device.sock, &msg, 0) > 0);
+}
+
+/**
+ * @brief Send fragments 0 to sent - 1 of a frame in shuffled order, except those set in drop
+ */
+static void device_send_frame(int frame, int sent, uint64_t drop)
+{
+    int order[MAX_FRAGMENTS];
+    for (int i = 0; i < sent; i++) {
+        order[i] = i;
+    }
+    for (int i = sent - 1; i > 0; i--) {
+        int j = test_random() % (i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    for (int i = 0; i < sent; i++) {
+        if (!(drop >> order[i] & 1)) {
+            device_send_fragment(frame, order[i], 0);
+        }
+    }
+    device.sent_len[frame] = sent == udp_fragment_count(PAYLOAD_LEN) ? sizeof(frame_header_t) + PAYLOAD_LEN
+                                                                     : (size_t)sent * UDP_FRAGMENT_PAYLOAD;
+    device.sent_us[frame] = esp_timer_get_time();
+}
+
+/**
+ * @brief Answer the NACKs waiting on the device socket, as retransmit_fragments() does
+ */
+static void device_poll(void)
+{
+    udp_control_t nack;
+    while (recv(device.sock, &nack, sizeof(nack), 0) == sizeof(nack)) {
+        if (nack.magic != UDP_STREAM_MAGIC || nack.type != UDP_MSG_NACK) {
+            continue;
+        }
+
+        int frame = (int)(nack.frame_seq - headers[0].sequence);
+        uint64_t resend;
+        if (frame < 0 || frame >= FRAMES ||
+            !udp_nack_select(&nack, PAYLOAD_LEN, device.sent_len[frame], device.sent_us[frame], esp_timer_get_time(),
+                             &resend)) {
+            device.nacks_expired++;
+            continue;
+        }
+        for (int bit = 0; bit < 64; bit++) {
+            if (resend >> bit & 1) {
+                device_send_fragment(frame, nack.first_fragment + bit, UDP_FRAGMENT_RETRANSMIT);
+                device.retransmits++;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Receive every fragment waiting on the client socket into its frame
+ */
+static void client_poll(void)
+{
+    uint8_t datagram[UDP_MAX_DATAGRAM + 1];
+    ssize_t len;
+    while ((len = recv(client.sock, datagram, sizeof(datagram), 0)) > 0) {
+        udp_fragment_header_t frag;
+        CHECK(len > (ssize_t)sizeof(frag) && len <= UDP_MAX_DATAGRAM);
+        memcpy(&frag, datagram, sizeof(frag));
+        CHECK_EQ(frag.magic, UDP_STREAM_MAGIC);
+
+        int frame = (int)(frag.frame_seq - headers[0].sequence);
+        CHECK(frame >= 0 && frame < FRAMES && frag.fragment < frag.fragment_count);
+        if (frame < 0 || frame >= FRAMES || frag.fragment_count > MAX_FRAGMENTS) {
+            continue;
+        }
+        if (client.received[frame] >> frag.fragment & 1) {
+            client.duplicates++;
+            continue;
+        }
+
+        memcpy(&client.frames[frame][(size_t)frag.fragment * UDP_FRAGMENT_PAYLOAD], datagram + sizeof(frag),
+               len - sizeof(frag));
+        client.received[frame] |= 1ULL << frag.fragment;
+        client.count[frame] = frag.fragment_count;
+        client.retransmitted += frag.flags & UDP_FRAGMENT_RETRANSMIT ? 1 : 0;
+        if (client.received[frame] == (frag.fragment_count == 64 ? ~0ULL : (1ULL << frag.fragment_count) - 1)) {
+            client.complete_us[frame] = esp_timer_get_time();
+        }
+    }
+    CHECK(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/**
+ * @brief Report the fragments of a frame still missing
+ *
+ * @return Fragments in the NACK
+ */
+static int client_nack(int frame, int count)
+{
+    uint64_t missing = ~client.received[frame] & (count == 64 ? ~0ULL : (1ULL << count) - 1);
+    if (missing == 0) {
+        return 0;
+    }
+
+    udp_control_t nack = {
+        .magic = UDP_STREAM_MAGIC,
+        .type = UDP_MSG_NACK,
+        .frame_seq = headers[frame].sequence,
+        .first_fragment = 0,
+        .mask = missing,
+    };
+    CHECK_EQ(sendto(client.sock, &nack, sizeof(nack), 0, (struct sockaddr *)&client.device, sizeof(client.device)),
+             sizeof(nack));
+    return __builtin_popcountll(missing);
+}
+
+/**
+ * @brief Exchange datagrams until both sockets are quiet
+ */
+static void settle(void)
+{
+    for (int i = 0; i < 4; i++) {
+        usleep(1000);
+        device_poll();
+        client_poll();
+    }
+}
+
+static void test_loopback(void)
+{
+    static uint8_t expected[sizeof(frame_header_t) + PAYLOAD_LEN];
+    const int count = udp_fragment_count(PAYLOAD_LEN);
+    CHECK(count <= MAX_FRAGMENTS);
+
+    device.sock = open_socket(&client.device);
+    client.sock = open_socket(&device.client);
+
+    // Every frame arrives reordered with about one fragment in twelve lost, and is completed by one NACK
+    int dropped = 0;
+    int64_t recovery_us = 0;
+    int recovered = 0;
+    for (int f = 0; f < FRAMES - 2; f++) {
+        uint64_t drop = 0;
+        for (int i = 0; i < count; i++) {
+            drop |= (uint64_t)(test_random() % 12 == 0) << i;
+        }
+        drop |= f == 0 ? 1 : 0; // The header fragment can be lost like any other
+        dropped += __builtin_popcountll(drop);
+
+        device_send_frame(f, count, drop);
+        settle();
+        int64_t nack_us = esp_timer_get_time();
+        CHECK_EQ(client.count[f], count);
+        CHECK_EQ(client_nack(f, count), __builtin_popcountll(drop));
+        settle();
+        CHECK(client.complete_us[f] > 0);
+        if (drop != 0 && client.complete_us[f] > 0) {
+            recovery_us += client.complete_us[f] - nack_us;
+            recovered++;
+        }
+
+        frame_bytes(f, PAYLOAD_LEN, expected);
+        CHECK_EQ(memcmp(client.frames[f], expected, sizeof(expected)), 0);
+    }
+    CHECK_EQ(device.retransmits, dropped);
+    CHECK_EQ(client.retransmitted, dropped);
+    CHECK_EQ(client.duplicates, 0);
+    CHECK_EQ(device.nacks_expired, 0);
+
+    // A frame still being written only resends the fragments already sent
+    const int partial = FRAMES - 2;
+    device_send_frame(partial, count / 2, 1ULL << 3);
+    settle();
+    CHECK_EQ(client_nack(partial, count), count - count / 2 + 1);
+    settle();
+    CHECK_EQ(client.received[partial], (1ULL << (count / 2)) - 1);
+    CHECK_EQ(client.complete_us[partial], 0);
+
+    // Past the retransmit window the NACK is ignored and the frame is lost rather than late
+    const int late = FRAMES - 1;
+    device_send_frame(late, count, 1ULL << 7);
+    device.sent_us[late] -= (UDP_RETRANSMIT_WINDOW_MS + 1) * 1000;
+    settle();
+    int retransmits = device.retransmits;
+    CHECK_EQ(client_nack(late, count), 1);
+    settle();
+    CHECK_EQ(device.nacks_expired, 1);
+    CHECK_EQ(device.retransmits, retransmits);
+    CHECK_EQ(client.complete_us[late], 0);
+
+    // Datagrams that are not NACKs are ignored
+    udp_control_t stray = {.magic = 0x1234, .type = UDP_MSG_NACK, .frame_seq = headers[0].sequence, .mask = 1};
+    sendto(client.sock, &stray, sizeof(stray), 0, (struct sockaddr *)&client.device, sizeof(client.device));
+    settle();
+    CHECK_EQ(device.retransmits, retransmits);
+
+    printf("udp loopback: %d frames of %d fragments, %d fragments lost and resent, recovery %.0f us per NACK "
+           "on this host (device retransmit window %d ms)\n",
+           FRAMES - 2, count, dropped, recovered > 0 ? (double)recovery_us / recovered : 0,
+           UDP_RETRANSMIT_WINDOW_MS);
+
+    close(device.sock);
+    close(client.sock);
+}
+
+int main(void)
+{
+    make_frames();
+    test_fragmentation();
+    test_nack_select();
+    test_loopback();
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,50 @@
+/**
+ * @file test_util.h
+ * @brief Minimal assertions for the host tests
+ *
+ * A failed check is reported with its location and the test keeps going, so
+ * one run lists every failure. main() returns TEST_EXIT_CODE().
+ */
+
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond)                                                                 \
+    do {                                                                            \
+        if (!(cond)) {                                                              \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++;                                                        \
+        }                                                                           \
+    } while (0)
+
+#define CHECK_EQ(actual, expected)                                                                          \
+    do {                                                                                                    \
+        long long actual_value = (long long)(actual);                                                      \
+        long long expected_value = (long long)(expected);                                                  \
+        if (actual_value != expected_value) {                                                               \
+            fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, actual_value, \
+                    expected_value);                                                                        \
+            test_failures++;                                                                                \
+        }                                                                                                   \
+    } while (0)
+
+#define TEST_EXIT_CODE() (test_failures == 0 ? 0 : 1)
+
+/**
+ * @brief Deterministic pseudo-random numbers, so failures reproduce
+ */
+static inline uint32_t test_random(void)
+{
+    static uint32_t state = 0x12345678;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+#endif /* TEST_UTIL_H */
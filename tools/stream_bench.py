@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+"""
+Measure the frame rate and throughput of the data stream of a running device.
+
+For every frame length given, the script selects the length and the wire
+format over HTTP, connects to the TCP data socket, reads frames with frame
+headers for a while and reports frames per second, MB/s and captures lost
+(sequence numbers skipped), next to the device's own /stats counters.
+
+    python3 tools/stream_bench.py 192.168.4.1 --http-port 81 --samples 4096 16384 0
+
+Only the Python standard library is needed. --save writes the payloads of
+raw16 frames to a file that build-test/test_sample_format takes as a recorded
+capture for its codec benchmark.
+"""
+
+import argparse
+import json
+import socket
+import struct
+import sys
+import time
+import urllib.error
+import urllib.request
+
+# frame_header_t in include/frame_header.h, little-endian and packed
+FRAME_HEADER = struct.Struct("<HBBIqIHBBBBHiII")
+FRAME_HEADER_MAGIC = 0x4653
+
+# Counters of /stats reported as the difference over the run
+STATS_COUNTERS = ("frames_captured", "frames_sent", "frame_overruns", "frame_underruns", "send_stall_us",
+                  "client_drops", "capture_failures")
+
+
+def http(host, port, path, body=None):
+    """GET path, or POST body as JSON, and return the decoded JSON reply."""
+    data = json.dumps(body).encode() if body is not None else None
+    request = urllib.request.Request(f"http://{host}:{port}{path}", data=data,
+                                     headers={"Content-Type": "application/json"} if data else {})
+    try:
+        with urllib.request.urlopen(request, timeout=10) as reply:
+            return json.loads(reply.read() or b"{}")
+    except urllib.error.HTTPError as error:
+        if error.code != 409:
+            raise
+        # Another client's session is running with other settings, which would be applied instead
+        session = json.loads(error.read() or b"{}")
+        raise ValueError(f"{path} refused, another client streams {session.get('format')} with "
+                         f"{session.get('samples')} samples per frame") from None
+
+
+def read_exact(sock, length):
+    """Read exactly length bytes from sock."""
+    chunks = []
+    while length > 0:
+        chunk = sock.recv(min(length, 1 << 16))
+        if not chunk:
+            raise ConnectionError("data connection closed by the device")
+        chunks.append(chunk)
+        length -= len(chunk)
+    return b"".join(chunks)
+
+
+def run(args, samples, save):
+    """Stream at one frame length and return a dictionary of results."""
+    # /reset drops the clients of the previous run and reports the data socket; settings are refused while
+    # a session runs, so they are selected once it is gone
+    data = http(args.host, args.http_port, "/reset")
+    data_host = data.get("IP") or args.host
+    time.sleep(0.5)
+    http(args.host, args.http_port, "/format", {"format": args.format, "frame_header": True})
+    frame = http(args.host, args.http_port, "/frame_length", {"samples": samples})
+
+    with socket.create_connection((data_host, data["Port"]), timeout=10) as sock:
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 20)
+        before = http(args.host, args.http_port, "/stats")
+        start = time.monotonic()
+        frames = 0
+        wire_bytes = 0
+        lost = 0
+        sequence = None
+        while time.monotonic() - start < args.seconds:
+            header = FRAME_HEADER.unpack(read_exact(sock, FRAME_HEADER.size))
+            magic, header_len, seq, payload_len = header[0], header[2], header[3], header[14]
+            if magic != FRAME_HEADER_MAGIC:
+                raise ValueError(f"bad frame header magic 0x{magic:04x}")
+            read_exact(sock, header_len - FRAME_HEADER.size)
+            payload = read_exact(sock, payload_len)
+            if save is not None and args.format == "raw16":
+                save.write(payload)
+            if sequence is not None:
+                lost += (seq - sequence - 1) & 0xFFFFFFFF
+            sequence = seq
+            frames += 1
+            wire_bytes += header_len + payload_len
+        elapsed = time.monotonic() - start
+        after = http(args.host, args.http_port, "/stats")
+
+    result = {
+        "samples": frame.get("samples", samples),
+        "frames_in_pool": frame.get("frames_in_pool"),
+        "fps": frames / elapsed,
+        "mb_per_second": wire_bytes / elapsed / 1e6,
+        "captures_lost": lost,
+        "device_fps": after.get("frames_per_second"),
+        "device_mb_per_second": after.get("mb_per_second"),
+        "pool_peak_in_use": after.get("pool_peak_in_use"),
+    }
+    for name in STATS_COUNTERS:
+        if name in before and name in after:
+            result[name] = after[name] - before[name]
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("host", help="device address")
+    parser.add_argument("--http-port", type=int, default=80, help="80 in station mode, 81 in AP mode")
+    parser.add_argument("--samples", type=int, nargs="+", default=[0],
+                        help="frame lengths to measure, 0 for the longest frame")
+    parser.add_argument("--format", default="raw16", choices=("raw16", "packed", "display8", "delta"))
+    parser.add_argument("--seconds", type=float, default=10, help="measuring time per frame length")
+    parser.add_argument("--save", help="append the raw16 payloads to this file")
+    parser.add_argument("--json", action="store_true", help="print the results as JSON lines")
+    args = parser.parse_args()
+
+    save = open(args.save, "ab") if args.save else None
+    try:
+        for samples in args.samples:
+            result = run(args, samples, save)
+            if args.json:
+                print(json.dumps(result), flush=True)
+                continue
+            print(f"{result['samples']:6d} samples ({result['frames_in_pool']} buffers): "
+                  f"{result['fps']:.1f} FPS, {result['mb_per_second']:.2f} MB/s, "
+                  f"{result['captures_lost']} captures lost | device {result['device_fps']} FPS, "
+                  f"overruns {result.get('frame_overruns')}, underruns {result.get('frame_underruns')}, "
+                  f"send stall {result.get('send_stall_us', 0) / 1000:.0f} ms", flush=True)
+    except (OSError, ValueError, KeyError) as error:
+        print(f"stream_bench: {error}", file=sys.stderr)
+        return 1
+    finally:
+        if save is not None:
+            save.close()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())